@@ -0,0 +1,228 @@
+/*
+ * Copyright (c) 2016, Nareg Sinenian
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __ISCSI_HBA_NOTIFICATION_RING_H__
+#define __ISCSI_HBA_NOTIFICATION_RING_H__
+
+// This header is shared by the kernel extension and the user-space daemon,
+// which map the same ring.  It depends only on fixed-size C types and
+// compiler atomics so that it can be built (and exercised) on any platform.
+#include <stdint.h>
+
+/*! Number of entries in the notification ring (must be a power of two). */
+#define kiSCSIHBANotificationRingEntryCount 128
+
+/*! A single notification queued by the kernel.  The fields mirror those of
+ *  iSCSIHBANotificationMessage, without the mach message header. */
+typedef struct iSCSIHBANotificationRingEntry {
+
+    /*! Parameter associated with the notification (notification-specific). */
+    uint64_t parameter1;
+
+    /*! Parameter associated with the notification (notification-specific). */
+    uint64_t parameter2;
+
+    /*! Connection identifier. */
+    uint32_t connectionId;
+
+    /*! Session identifier. */
+    uint16_t sessionId;
+
+    /*! The notification type (see iSCSIHBANotificationTypes). */
+    uint8_t notificationType;
+
+    /*! Reserved (pads the entry to a multiple of eight bytes). */
+    uint8_t reserved;
+
+} iSCSIHBANotificationRingEntry;
+
+/*! Ring of notifications shared between the kernel (producer) and the
+ *  user-space daemon (consumer).  Indices increase monotonically and are
+ *  reduced modulo the ring size when accessing entries.  The producer side
+ *  must be serialized by the caller if there are multiple producers. */
+typedef struct iSCSIHBANotificationRing {
+
+    /*! Index of the next entry to be consumed (written by the consumer). */
+    volatile uint32_t head;
+
+    /*! Number of notifications the consumer has received as messages that
+     *  bypassed the ring (written by the consumer). */
+    volatile uint32_t bypassReceived;
+
+    /*! Keeps the head and tail indices on separate cache lines. */
+    uint32_t reserved0[14];
+
+    /*! Index of the next entry to be produced (written by the producer). */
+    volatile uint32_t tail;
+
+    /*! Keeps the tail index and the entries on separate cache lines. */
+    uint32_t reserved1[15];
+
+    /*! Notification entries. */
+    iSCSIHBANotificationRingEntry entries[kiSCSIHBANotificationRingEntryCount];
+
+} iSCSIHBANotificationRing;
+
+/*! State kept privately by the producer (it is not shared with the
+ *  consumer, which could otherwise corrupt it). */
+typedef struct iSCSIHBANotificationRingProducer {
+
+    /*! Number of notifications sent as messages that bypassed the ring. */
+    uint32_t bypassSent;
+
+    /*! Set if the consumer must be signaled but the signal could not be
+     *  delivered; the signal is retried until it is delivered. */
+    int signalPending;
+
+} iSCSIHBANotificationRingProducer;
+
+/*! Ways in which a notification is delivered (see
+ *  iSCSIHBANotificationRingProduce()). */
+enum iSCSIHBANotificationRingDelivery {
+
+    /*! The notification was queued and the consumer will see it. */
+    kiSCSIHBANotificationRingQueued,
+
+    /*! The notification was queued and the consumer must be signaled. */
+    kiSCSIHBANotificationRingSignal,
+
+    /*! The notification was not queued and must be sent as a message. */
+    kiSCSIHBANotificationRingBypass
+};
+
+/*! Initializes an empty notification ring.
+ *  @param ring the ring to initialize. */
+static inline void iSCSIHBANotificationRingInit(iSCSIHBANotificationRing * ring)
+{
+    __atomic_store_n(&ring->head,0,__ATOMIC_SEQ_CST);
+    __atomic_store_n(&ring->tail,0,__ATOMIC_SEQ_CST);
+    __atomic_store_n(&ring->bypassReceived,0,__ATOMIC_SEQ_CST);
+}
+
+/*! Appends an entry to the ring.  The consumer must be signaled if this
+ *  function indicates that it may have found the ring empty; otherwise it
+ *  is guaranteed to see the entry before it stops draining the ring.
+ *  @param ring the ring to append to.
+ *  @param entry the entry to append.
+ *  @param signal set to a non-zero value if the consumer must be signaled.
+ *  @return a non-zero value if the entry was appended, or zero if the ring
+ *  is full (or its indices are inconsistent). */
+static inline int iSCSIHBANotificationRingPush(iSCSIHBANotificationRing * ring,
+                                               const iSCSIHBANotificationRingEntry * entry,
+                                               int * signal)
+{
+    uint32_t tail = __atomic_load_n(&ring->tail,__ATOMIC_RELAXED);
+    uint32_t head = __atomic_load_n(&ring->head,__ATOMIC_ACQUIRE);
+
+    // The consumer may write anything into the head index; treat an
+    // impossible fill level the same as a full ring
+    if((uint32_t)(tail - head) >= kiSCSIHBANotificationRingEntryCount)
+        return 0;
+
+    ring->entries[tail & (kiSCSIHBANotificationRingEntryCount - 1)] = *entry;
+    __atomic_store_n(&ring->tail,tail + 1,__ATOMIC_SEQ_CST);
+
+    // If the consumer has caught up with this entry it may have stopped
+    // draining the ring before the entry was published
+    *signal = (__atomic_load_n(&ring->head,__ATOMIC_SEQ_CST) == tail);
+    return 1;
+}
+
+/*! Removes the oldest entry from the ring.
+ *  @param ring the ring to remove from.
+ *  @param entry the removed entry (returned).
+ *  @return a non-zero value if an entry was removed, or zero if the ring
+ *  is empty. */
+static inline int iSCSIHBANotificationRingPop(iSCSIHBANotificationRing * ring,
+                                              iSCSIHBANotificationRingEntry * entry)
+{
+    uint32_t head = __atomic_load_n(&ring->head,__ATOMIC_RELAXED);
+
+    if(__atomic_load_n(&ring->tail,__ATOMIC_SEQ_CST) == head)
+        return 0;
+
+    *entry = ring->entries[head & (kiSCSIHBANotificationRingEntryCount - 1)];
+    __atomic_store_n(&ring->head,head + 1,__ATOMIC_SEQ_CST);
+    return 1;
+}
+
+/*! Produces a notification, queuing it in the ring when that preserves the
+ *  order in which notifications are delivered.  Once the ring fills up,
+ *  notifications bypass it (and are sent as messages) until the consumer
+ *  has received every bypassing message; the consumer drains the ring
+ *  before acting on each message, so nothing queued after a bypassing
+ *  message can be seen before it.  The caller must serialize producers and
+ *  report the outcome of any message it sends using
+ *  iSCSIHBANotificationRingMessageSent().
+ *  @param ring the ring to append to.
+ *  @param producer the producer state.
+ *  @param entry the notification.
+ *  @return how the notification must be delivered (see
+ *  iSCSIHBANotificationRingDelivery). */
+static inline enum iSCSIHBANotificationRingDelivery
+    iSCSIHBANotificationRingProduce(iSCSIHBANotificationRing * ring,
+                                    iSCSIHBANotificationRingProducer * producer,
+                                    const iSCSIHBANotificationRingEntry * entry)
+{
+    int signal = 0;
+
+    if(__atomic_load_n(&ring->bypassReceived,__ATOMIC_ACQUIRE) != producer->bypassSent ||
+       !iSCSIHBANotificationRingPush(ring,entry,&signal))
+        return kiSCSIHBANotificationRingBypass;
+
+    if(signal || producer->signalPending)
+        return kiSCSIHBANotificationRingSignal;
+
+    return kiSCSIHBANotificationRingQueued;
+}
+
+/*! Records the outcome of a message sent by the producer.
+ *  @param producer the producer state.
+ *  @param delivery the kind of message that was sent (the signal or the
+ *  notification itself).
+ *  @param sent a non-zero value if the message was delivered. */
+static inline void iSCSIHBANotificationRingMessageSent(iSCSIHBANotificationRingProducer * producer,
+                                                       enum iSCSIHBANotificationRingDelivery delivery,
+                                                       int sent)
+{
+    if(delivery == kiSCSIHBANotificationRingSignal)
+        producer->signalPending = !sent;
+    else if(delivery == kiSCSIHBANotificationRingBypass && sent)
+        producer->bypassSent++;
+}
+
+/*! Acknowledges a notification received as a message that bypassed the
+ *  ring.  The consumer must drain the ring before acting on the message,
+ *  and acknowledge the message afterwards.
+ *  @param ring the ring. */
+static inline void iSCSIHBANotificationRingBypassReceived(iSCSIHBANotificationRing * ring)
+{
+    __atomic_add_fetch(&ring->bypassReceived,1,__ATOMIC_RELEASE);
+}
+
+#endif /* defined(__ISCSI_HBA_NOTIFICATION_RING_H__) */
@@ -59,11 +59,28 @@ enum iSCSIHBANotificationTypes {
      *  caused the specified connection and session to be dropped. */
     kiSCSIHBANotificationTimeout,
     
+    /*! Notifies clients that entries were added to the shared notification
+     *  ring.  This type is consumed by the user-space interface and is never
+     *  passed on to notification callbacks. */
+    kiSCSIHBANotificationRingUpdated,
+    
     /*! Invalid notification message. */
     kiSCSIHBANotificationInvalid
 };
 
 
+/*! Types of memory that may be mapped into user-space from the user client. */
+enum iSCSIHBAMemoryTypes {
+    
+    /*! Ring of notifications (see iSCSIHBANotificationRing). */
+    kiSCSIHBAMemoryNotificationRing = 0
+};
+
+/*! Message identifier of notifications that are sent as messages while the
+ *  notification ring is mapped, and must be acknowledged by the consumer
+ *  (see iSCSIHBANotificationRingBypassReceived()). */
+#define kiSCSIHBANotificationBypassMessageId 1
+
 /*! Used to pass notifications from the kernel to the user-space daemon.
  *  The notification type is one of the notification types listed in 
  *  the enumerated type iSCSINotificationTypes. */
@@ -115,6 +132,415 @@ typedef struct {
 } iSCSIHBANotificationAsyncMessage;
 
 
+/*! Events recorded in the per-connection PDU trace. */
+enum iSCSIHBAPDUTraceEvents {
+    
+    /*! A PDU was handed to the socket layer for transmission. */
+    kiSCSIHBAPDUTraceSend,
+    
+    /*! A PDU header was received (and its digest, if any, verified). */
+    kiSCSIHBAPDUTraceRecv,
+    
+    /*! A SCSI task was completed by the virtual HBA. */
+    kiSCSIHBAPDUTraceTaskComplete,
+    
+    /*! Invalid trace event. */
+    kiSCSIHBAPDUTraceInvalid
+};
+
+/*! Number of records retained by each connection's PDU trace. This must be
+ *  a power of two since the ring index is masked rather than wrapped. */
+#define kiSCSIHBAPDUTraceRecordCount 256
+
+/*! A single record of the per-connection PDU trace.  Records are fixed-size
+ *  so that they can be appended on the I/O path without allocation and
+ *  copied out to user-space as-is.  All fields are in host byte order. */
+typedef struct {
+    
+    /*! Time at which the event was recorded (mach absolute time). */
+    UInt64 timestamp;
+    
+    /*! Initiator task tag of the PDU or task. */
+    UInt32 initiatorTaskTag;
+    
+    /*! CmdSN for outgoing PDUs and StatSN for incoming PDUs. */
+    UInt32 sequenceNumber;
+    
+    /*! ExpStatSN for outgoing PDUs and ExpCmdSN for incoming PDUs. */
+    UInt32 expSequenceNumber;
+    
+    /*! DataSN (or R2TSN) for data and R2T PDUs, zero otherwise. */
+    UInt32 dataSN;
+    
+    /*! Buffer offset for data and R2T PDUs, zero otherwise. */
+    UInt32 bufferOffset;
+    
+    /*! Length of the data segment of the PDU, or the number of bytes
+     *  transferred for a completed task. */
+    UInt32 dataSegmentLength;
+    
+    /*! Task duration in microseconds (task completion events only). */
+    UInt32 latencyUSec;
+    
+    /*! The trace event, see iSCSIHBAPDUTraceEvents. */
+    UInt8 eventType;
+    
+    /*! The PDU opcode (without the immediate delivery flag). */
+    UInt8 opCode;
+    
+    /*! PDU flags (the first byte of the opcode-specific fields). */
+    UInt8 flags;
+    
+    /*! Reserved. */
+    UInt8 reserved;
+    
+} iSCSIHBAPDUTraceRecord;
+
+/*! Identifies a PDU trace file written by the daemon ("iPDT"). */
+#define kiSCSIHBAPDUTraceFileMagic 0x69504454
+
+/*! Version of the PDU trace file format. */
+#define kiSCSIHBAPDUTraceFileVersion 1
+
+/*! Header of a PDU trace file.  The header is followed by recordCount
+ *  records of recordSize bytes each (iSCSIHBAPDUTraceRecord), oldest first.
+ *  Timestamps are converted to nanoseconds by multiplying them by
+ *  timebaseNumer and dividing the result by timebaseDenom (see
+ *  mach_timebase_info()).  All fields are in host byte order. */
+typedef struct {
+    
+    /*! Set to kiSCSIHBAPDUTraceFileMagic. */
+    UInt32 magic;
+    
+    /*! Set to kiSCSIHBAPDUTraceFileVersion. */
+    UInt16 version;
+    
+    /*! Size of each record, in bytes. */
+    UInt16 recordSize;
+    
+    /*! Numerator of the timebase of the record timestamps. */
+    UInt32 timebaseNumer;
+    
+    /*! Denominator of the timebase of the record timestamps. */
+    UInt32 timebaseDenom;
+    
+    /*! Number of records in the file. */
+    UInt32 recordCount;
+    
+    /*! Total number of records appended to the trace of the connection
+     *  (older records were overwritten). */
+    UInt32 totalRecords;
+    
+    /*! Session identifier. */
+    UInt16 sessionId;
+    
+    /*! Connection identifier. */
+    UInt16 connectionId;
+    
+    /*! Reserved. */
+    UInt32 reserved;
+    
+} iSCSIHBAPDUTraceFileHeader;
+
+
+/*! Latencies tracked for each SCSI task. */
+enum iSCSIHBALatencyTypes {
+    
+    /*! Time spent queued in the HBA before the command PDU was sent. */
+    kiSCSIHBALatencyQueue,
+    
+    /*! Time from sending the command PDU until the task completed. */
+    kiSCSIHBALatencyWire,
+    
+    /*! Time from queuing the task until it completed. */
+    kiSCSIHBALatencyTotal,
+    
+    /*! Number of latency types. */
+    kiSCSIHBALatencyTypeCount
+};
+
+/*! Classes of SCSI commands for which latencies are tracked separately. */
+enum iSCSIHBACommandClasses {
+    
+    /*! Commands that transfer data from the target (e.g., READ). */
+    kiSCSIHBACommandClassRead,
+    
+    /*! Commands that transfer data to the target (e.g., WRITE). */
+    kiSCSIHBACommandClassWrite,
+    
+    /*! Commands that transfer no data. */
+    kiSCSIHBACommandClassOther,
+    
+    /*! Number of command classes. */
+    kiSCSIHBACommandClassCount
+};
+
+/*! Number of buckets in a latency histogram.  Latencies (in microseconds)
+ *  below 8 each have their own bucket; above that, every power of two is
+ *  split into four linear sub-buckets, covering latencies up to ~134s. */
+#define kiSCSIHBALatencyHistogramBucketCount 104
+
+/*! A log-linear histogram of latencies (in microseconds). */
+typedef struct {
+    
+    /*! Number of samples recorded. */
+    UInt64 count;
+    
+    /*! Sum of all samples (used to compute the mean). */
+    UInt64 sumUSec;
+    
+    /*! Largest sample recorded. */
+    UInt64 maxUSec;
+    
+    /*! Number of samples that fell into each bucket. */
+    UInt32 buckets[kiSCSIHBALatencyHistogramBucketCount];
+    
+} iSCSIHBALatencyHistogram;
+
+/*! Gets the histogram bucket for a latency.
+ *  @param usec the latency in microseconds.
+ *  @return the index of the bucket. */
+static inline UInt32 iSCSIHBALatencyHistogramGetBucket(UInt64 usec)
+{
+    if(usec < 8)
+        return (UInt32)usec;
+    
+    UInt32 exponent = 63 - __builtin_clzll(usec);
+    UInt32 bucket = (exponent - 1)*4 + (UInt32)((usec >> (exponent - 2)) & 3);
+    
+    return bucket < kiSCSIHBALatencyHistogramBucketCount ? bucket : kiSCSIHBALatencyHistogramBucketCount - 1;
+}
+
+/*! Gets the smallest latency that falls into a histogram bucket.
+ *  @param bucket the index of the bucket.
+ *  @return the lower bound of the bucket in microseconds. */
+static inline UInt64 iSCSIHBALatencyHistogramGetBucketLowerBound(UInt32 bucket)
+{
+    if(bucket < 8)
+        return bucket;
+    
+    return ((UInt64)(4 + (bucket & 3))) << (bucket/4 - 1);
+}
+
+/*! IORegistry property (of the target device) containing a dictionary of
+ *  performance counters for the session backing the target.  The values
+ *  are refreshed periodically by the kernel extension. */
+#define kiSCSIStatisticsKey                     "iSCSI Statistics"
+
+/*! IORegistry property (of the virtual HBA) containing a dictionary that
+ *  maps the name (IQN) of each target that has a session to the target
+ *  identifier used by the HBA.  Updated as sessions are created and released. */
+#define kiSCSITargetIdentifiersKey              "iSCSI Target Identifiers"
+
+/*! IORegistry property (of the target device) containing the name (IQN) of
+ *  the target.  Unlike the copy kept in the protocol characteristics, this
+ *  property can be used with kIOPropertyMatchKey to look up a target directly. */
+#define kiSCSITargetNameKey                     "iSCSI Target Name"
+
+/*! Interval at which statistics are published to the IORegistry (ms). */
+#define kiSCSIStatisticsPublishIntervalMs       1000
+
+/*! Session statistics keys (CFNumber values unless otherwise noted). */
+#define kiSCSIStatisticsCommandsIssuedKey       "Commands Issued"
+#define kiSCSIStatisticsCommandsCompletedKey    "Commands Completed"
+#define kiSCSIStatisticsOutstandingTasksKey     "Outstanding Tasks"
+#define kiSCSIStatisticsTaskTimeoutsKey         "Task Timeouts"
+#define kiSCSIStatisticsConnectionTimeoutsKey   "Connection Timeouts"
+
+/*! Array of per-connection statistics dictionaries. */
+#define kiSCSIStatisticsConnectionsKey          "Connections"
+
+/*! Connection statistics keys. */
+#define kiSCSIStatisticsConnectionIdKey         "Connection ID"
+#define kiSCSIStatisticsTxPDUsKey               "PDUs Sent"
+#define kiSCSIStatisticsRxPDUsKey               "PDUs Received"
+#define kiSCSIStatisticsTxBytesKey              "Bytes Sent"
+#define kiSCSIStatisticsRxBytesKey              "Bytes Received"
+#define kiSCSIStatisticsTxDataOutPDUsKey        "Data-Out PDUs Sent"
+#define kiSCSIStatisticsRxDataInPDUsKey         "Data-In PDUs Received"
+#define kiSCSIStatisticsRxR2TPDUsKey            "R2T PDUs Received"
+#define kiSCSIStatisticsHeaderDigestErrorsKey   "Header Digest Errors"
+#define kiSCSIStatisticsDataDigestErrorsKey     "Data Digest Errors"
+#define kiSCSIStatisticsBytesPerSecondKey       "Bytes Per Second"
+#define kiSCSIStatisticsLatencyKey              "Latency (ms)"
+
+/*! Array of per-LUN statistics dictionaries (only LUNs that were used). */
+#define kiSCSIStatisticsLUNsKey                 "Logical Units"
+
+/*! LUN statistics keys. */
+#define kiSCSIStatisticsLUNKey                  "LUN"
+#define kiSCSIStatisticsLUNCommandsKey          "Commands"
+#define kiSCSIStatisticsLUNBytesReadKey         "Bytes Read"
+#define kiSCSIStatisticsLUNBytesWrittenKey      "Bytes Written"
+#define kiSCSIStatisticsLUNErrorsKey            "Errors"
+
+/*! Latency histograms (CFData containing an iSCSIHBALatencyHistogram).  For
+ *  sessions and connections this is a dictionary keyed by latency type; for
+ *  sessions it is further keyed by command class.  For LUNs it is the
+ *  total latency histogram. */
+#define kiSCSIStatisticsLatencyHistogramsKey    "Latency Histograms"
+
+/*! Latency type keys. */
+#define kiSCSIStatisticsLatencyQueueKey         "Queue"
+#define kiSCSIStatisticsLatencyWireKey          "Wire"
+#define kiSCSIStatisticsLatencyTotalKey         "Total"
+
+/*! Command class keys. */
+#define kiSCSIStatisticsCommandClassReadKey     "Read"
+#define kiSCSIStatisticsCommandClassWriteKey    "Write"
+#define kiSCSIStatisticsCommandClassOtherKey    "Other"
+
+/*! Property that may be set on the virtual HBA (by a privileged user) to
+ *  reset statistics.  The value is either the name of a target (CFString)
+ *  or kCFBooleanTrue to reset the statistics of all targets. */
+#define kiSCSIResetStatisticsKey                "Reset Statistics"
+
+
+/*! Version of the snapshot layout returned by kiSCSIGetSessionSnapshots.
+ *  This must be incremented whenever the snapshot structures change. */
+#define kiSCSIHBASnapshotVersion                1
+
+/*! Snapshot of the parameters and counters of a single connection. */
+typedef struct {
+    
+    /*! Connection identifier. */
+    ConnectionIdentifier connectionId;
+    
+    /*! Maximum data segment length initiator can receive. */
+    UInt32 maxRecvDataSegmentLength;
+    
+    /*! Maximum data segment length allowed by the target. */
+    UInt32 maxSendDataSegmentLength;
+    
+    /*! Status sequence number expected by the initiator. */
+    UInt32 expStatSN;
+    
+    /*! Interval for IF marker. */
+    UInt16 IFMarkInt;
+    
+    /*! Interval for OF marker. */
+    UInt16 OFMarkInt;
+    
+    /*! Flag that indicates if this connection uses header digests. */
+    UInt8 useHeaderDigest;
+    
+    /*! Flag that indicates if this connection uses data digests. */
+    UInt8 useDataDigest;
+    
+    /*! Flag that indicates if this connection uses IF markers. */
+    UInt8 useIFMarker;
+    
+    /*! Flag that indicates if this connection uses OF markers. */
+    UInt8 useOFMarker;
+    
+    /*! Average data transfer rate of the connection (bytes per second). */
+    UInt32 bytesPerSecond;
+    
+    /*! Connection latency (ms). */
+    UInt32 latencyMs;
+    
+    /*! Number of PDUs sent. */
+    UInt64 txPDUs;
+    
+    /*! Number of PDUs received. */
+    UInt64 rxPDUs;
+    
+    /*! Number of bytes sent. */
+    UInt64 txBytes;
+    
+    /*! Number of bytes received. */
+    UInt64 rxBytes;
+    
+    /*! Number of PDUs that failed header digest verification. */
+    UInt64 headerDigestErrors;
+    
+    /*! Number of PDUs that failed data digest verification. */
+    UInt64 dataDigestErrors;
+    
+} iSCSIHBAConnectionSnapshot;
+
+/*! Snapshot of the parameters and counters of a session and its
+ *  connections, as returned by kiSCSIGetSessionSnapshots. */
+typedef struct {
+    
+    /*! Session identifier. */
+    SessionIdentifier sessionId;
+    
+    /*! Target session identifying handle. */
+    TargetSessionIdentifier targetSessionId;
+    
+    /*! Target portal group tag. */
+    TargetPortalGroupTag targetPortalGroupTag;
+    
+    /*! Time to retain. */
+    UInt16 defaultTime2Retain;
+    
+    /*! Time to wait. */
+    UInt16 defaultTime2Wait;
+    
+    /*! Number of outstanding R2Ts allowed. */
+    UInt16 maxOutStandingR2T;
+    
+    /*! Error recovery level. */
+    UInt8 errorRecoveryLevel;
+    
+    /*! Send data immediately. */
+    UInt8 immediateData;
+    
+    /*! Expect an initial R2T from target. */
+    UInt8 initialR2T;
+    
+    /*! Data PDUs in order. */
+    UInt8 dataPDUInOrder;
+    
+    /*! Data sequence in order. */
+    UInt8 dataSequenceInOrder;
+    
+    /*! Indicates whether the session is active. */
+    UInt8 active;
+    
+    /*! Max connections supported by target. */
+    UInt32 maxConnections;
+    
+    /*! Maximum data burst length (in bytes). */
+    UInt32 maxBurstLength;
+    
+    /*! First data burst length (in bytes). */
+    UInt32 firstBurstLength;
+    
+    /*! Number of SCSI tasks currently outstanding. */
+    UInt32 outstandingTasks;
+    
+    /*! Number of SCSI commands issued. */
+    UInt64 commandsIssued;
+    
+    /*! Number of SCSI commands completed. */
+    UInt64 commandsCompleted;
+    
+    /*! Number of SCSI tasks that timed out. */
+    UInt64 taskTimeouts;
+    
+    /*! Number of connections that were dropped due to a timeout. */
+    UInt64 connectionTimeouts;
+    
+    /*! Number of valid entries in connections. */
+    UInt32 connectionCount;
+    
+    /*! Reserved. */
+    UInt32 reserved;
+    
+    /*! Connections of the session, in order of connection identifier. */
+    iSCSIHBAConnectionSnapshot connections[kiSCSIMaxConnectionsPerSession];
+    
+} iSCSIHBASessionSnapshot;
+
+
+/*! Number of 64-bit scalars used to pass a basic header segment (48 bytes)
+ *  to and from kiSCSISendPDU, kiSCSIRecvPDU and kiSCSIExchangePDU.  The
+ *  header is passed in scalars so that the data segment can be passed as
+ *  the structure argument and a PDU costs a single call. */
+#define kiSCSIHBABHSScalarCount                 6
+
 /*! Function pointer indices.  These are the functions that can be called
  *	indirectly by calling IOCallScalarMethod(). */
 enum functionNames {
@@ -130,10 +556,9 @@ enum functionNames {
     kiSCSIActivateAllConnections,
     kiSCSIDeactivateConnection,
     kiSCSIDeactivateAllConnections,
-    kiSCSISendBHS,
-    kiSCSISendData,
-    kiSCSIRecvBHS,
-    kiSCSIRecvData,
+    kiSCSISendPDU,
+    kiSCSIRecvPDU,
+    kiSCSIExchangePDU,
     kiSCSISetConnectionParameter,
     kiSCSIGetConnectionParameter,
     kiSCSIGetConnection,
@@ -146,6 +571,8 @@ enum functionNames {
     kiSCSIGetPortalAddressForConnectionId,
     kiSCSIGetPortalPortForConnectionId,
     kiSCSIGetHostInterfaceForConnectionId,
+    kiSCSIGetPDUTrace,
+    kiSCSIGetSessionSnapshots,
 	kiSCSIInitiatorNumMethods
 };
 
@@ -30,6 +30,7 @@
 #include "iSCSIHBAUserClient.h"
 #include "iSCSITypesShared.h"
 #include "iSCSITypesKernel.h"
+#include "iSCSIPDUValidation.h"
 #include <IOKit/IOLib.h>
 
 /*! Required IOKit macro that defines the constructors, destructors, etc. */
@@ -125,32 +126,25 @@ const IOExternalMethodDispatch iSCSIHBAUserClient::methods[kiSCSIInitiatorNumMet
 		0
 	},
 	{
-		(IOExternalMethodAction) &iSCSIHBAUserClient::SendBHS,
-		0,                                  // Session ID, connection ID
-		sizeof(struct __iSCSIPDUCommonBHS), // Buffer to send
-		0,                                  // Return value
-		0
-	},
-	{
-		(IOExternalMethodAction) &iSCSIHBAUserClient::SendData,
-        2,                                  // Session ID, connection ID
-		kIOUCVariableStructureSize,         // Data is a variable size block
+		(IOExternalMethodAction) &iSCSIHBAUserClient::SendPDU,
+		2 + kiSCSIHBABHSScalarCount,        // Session ID, connection ID, BHS
+		kIOUCVariableStructureSize,         // Data segment
 		0,
 		0
 	},
     {
-		(IOExternalMethodAction) &iSCSIHBAUserClient::RecvBHS,
+		(IOExternalMethodAction) &iSCSIHBAUserClient::RecvPDU,
         2,                                  // Session ID, connection ID
 		0,
-		0,
-		sizeof(struct __iSCSIPDUCommonBHS), // Receive buffer
+		kiSCSIHBABHSScalarCount,            // Received BHS
+		kIOUCVariableStructureSize,         // Received data segment
 	},
     {
-		(IOExternalMethodAction) &iSCSIHBAUserClient::RecvData,
-        2,                                  // Session ID, connection ID
-		0,
-		0,
-		kIOUCVariableStructureSize,         // Receive buffer
+		(IOExternalMethodAction) &iSCSIHBAUserClient::ExchangePDU,
+        2 + kiSCSIHBABHSScalarCount,        // Session ID, connection ID, BHS
+		kIOUCVariableStructureSize,         // Data segment
+		kiSCSIHBABHSScalarCount,            // Received BHS
+		kIOUCVariableStructureSize,         // Received data segment
 	},
     {
 		(IOExternalMethodAction) &iSCSIHBAUserClient::SetConnectionParameter,
@@ -235,6 +229,20 @@ const IOExternalMethodDispatch iSCSIHBAUserClient::methods[kiSCSIInitiatorNumMet
         0,
         0,                                  // Returned connection count
         kIOUCVariableStructureSize // connection address structures
+    },
+    {
+        (IOExternalMethodAction) &iSCSIHBAUserClient::GetPDUTrace,
+        2,                                  // Session ID, connection ID
+        0,
+        2,                                  // Returned record count, total records
+        kIOUCVariableStructureSize          // Trace records
+    },
+    {
+        (IOExternalMethodAction) &iSCSIHBAUserClient::GetSessionSnapshots,
+        1,                                  // Session ID (or invalid ID for all)
+        0,
+        2,                                  // Returned snapshot version, count
+        kIOUCVariableStructureSize          // Session snapshots
     }
 };
 
@@ -272,11 +280,60 @@ bool iSCSIHBAUserClient::initWithTask(task_t owningTask,
 	this->type = type;
     this->accessLock = IOLockAlloc();
     this->notificationPort = MACH_PORT_NULL;
+    this->notificationLock = IOLockAlloc();
+    this->notificationRingMemory = NULL;
+    this->notificationRing = NULL;
+    
+    memset(this->releasingSessions,0,sizeof(this->releasingSessions));
+    memset(this->releasingConnections,0,sizeof(this->releasingConnections));
+    
+    // Locks are freed by free(), which also runs if initialization fails
+    if(!accessLock || !notificationLock)
+        return false;
+    
+    for(SessionIdentifier sessionId = 0; sessionId < kiSCSIMaxSessions; sessionId++) {
+        if(!(this->sessionLocks[sessionId] = IOLockAlloc()))
+            return false;
+        
+        for(ConnectionIdentifier connectionId = 0; connectionId < kiSCSIMaxConnectionsPerSession; connectionId++)
+            if(!(this->connectionLocks[sessionId][connectionId] = IOLockAlloc()))
+                return false;
+    }
         
 	// Perform any initialization tasks here
 	return super::initWithTask(owningTask,securityToken,type,properties);
 }
 
+// Called when the last reference to the user client is released
+void iSCSIHBAUserClient::free()
+{
+    if(accessLock) {
+        IOLockFree(accessLock);
+        accessLock = NULL;
+    }
+    
+    if(notificationLock) {
+        IOLockFree(notificationLock);
+        notificationLock = NULL;
+    }
+    
+    for(SessionIdentifier sessionId = 0; sessionId < kiSCSIMaxSessions; sessionId++) {
+        if(sessionLocks[sessionId]) {
+            IOLockFree(sessionLocks[sessionId]);
+            sessionLocks[sessionId] = NULL;
+        }
+        
+        for(ConnectionIdentifier connectionId = 0; connectionId < kiSCSIMaxConnectionsPerSession; connectionId++) {
+            if(connectionLocks[sessionId][connectionId]) {
+                IOLockFree(connectionLocks[sessionId][connectionId]);
+                connectionLocks[sessionId][connectionId] = NULL;
+            }
+        }
+    }
+    
+    super::free();
+}
+
 //Called after initWithTask as a result of call to IOServiceOpen()
 bool iSCSIHBAUserClient::start(IOService * provider)
 {
@@ -302,10 +359,15 @@ IOReturn iSCSIHBAUserClient::clientClose()
 	// IOServiceClose() before calling our close() method
 	close();
     
-    if(accessLock) {
-        IOLockFree(accessLock);
-        accessLock = NULL;
+    // Locks are kept until free(), as other threads may still be using them
+    IOLockLock(notificationLock);
+    notificationRing = NULL;
+    
+    if(notificationRingMemory) {
+        notificationRingMemory->release();
+        notificationRingMemory = NULL;
     }
+    IOLockUnlock(notificationLock);
 	
 	// Terminate ourselves
 	terminate();
@@ -337,7 +399,69 @@ IOReturn iSCSIHBAUserClient::registerNotificationPort(mach_port_t port,
     return kIOReturnSuccess;
 }
 
-/*! Send a notification message to the user-space application.
+/*! Invoked when a user-space application maps memory from this user
+ *  client (see iSCSIHBAMemoryTypes).
+ *  @param type the type of memory to map.
+ *  @param options mapping options (returned).
+ *  @param memory the memory descriptor to map (returned).
+ *  @return an error code indicating the result of the operation. */
+IOReturn iSCSIHBAUserClient::clientMemoryForType(UInt32 type,
+                                                 IOOptionBits * options,
+                                                 IOMemoryDescriptor * * memory)
+{
+    if(type != kiSCSIHBAMemoryNotificationRing)
+        return kIOReturnUnsupported;
+    
+    IOReturn result = kIOReturnNoMemory;
+    IOLockLock(notificationLock);
+    
+    // The ring is allocated once and shared by all mappings
+    if(!notificationRingMemory) {
+        notificationRingMemory = IOBufferMemoryDescriptor::withOptions(
+            kIODirectionInOut | kIOMemoryKernelUserShared,
+            sizeof(iSCSIHBANotificationRing),page_size);
+        
+        if(notificationRingMemory) {
+            notificationRing = (iSCSIHBANotificationRing *)notificationRingMemory->getBytesNoCopy();
+            bzero(notificationRing,sizeof(iSCSIHBANotificationRing));
+            iSCSIHBANotificationRingInit(notificationRing);
+            bzero(&notificationProducer,sizeof(notificationProducer));
+        }
+    }
+    
+    if(notificationRingMemory) {
+        // The caller releases the reference once the memory is mapped
+        notificationRingMemory->retain();
+        *options = 0;
+        *memory = notificationRingMemory;
+        result = kIOReturnSuccess;
+    }
+    
+    IOLockUnlock(notificationLock);
+    return result;
+}
+
+/*! Sends a message to the user-space application.  The notification lock
+ *  must be held, so that messages are sent in the order they are produced.
+ *  @param message the message to send.
+ *  @param messageId the mach message identifier.
+ *  @return true if the message was sent. */
+bool iSCSIHBAUserClient::sendNotificationMessage(iSCSIHBANotificationMessage * message,
+                                                 mach_msg_id_t messageId)
+{
+    message->header.msgh_bits = MACH_MSGH_BITS(MACH_MSG_TYPE_COPY_SEND,0);
+    message->header.msgh_size = sizeof(iSCSIHBANotificationMessage);
+    message->header.msgh_remote_port = notificationPort;
+    message->header.msgh_local_port = MACH_PORT_NULL;
+    message->header.msgh_reserved = 0;
+    message->header.msgh_id = messageId;
+    
+    return mach_msg_send_from_kernel_proper(&message->header,message->header.msgh_size) == MACH_MSG_SUCCESS;
+}
+
+/*! Send a notification message to the user-space application.  If the
+ *  application has mapped the notification ring the notification is
+ *  queued there, and a message is only sent if the ring was drained.
  *  @param message details regarding the notification message.
  *  @return an error code indicating the result of the operation. */
 IOReturn iSCSIHBAUserClient::sendNotification(iSCSIHBANotificationMessage * message)
@@ -348,17 +472,65 @@ IOReturn iSCSIHBAUserClient::sendNotification(iSCSIHBANotificationMessage * mess
     if(isInactive() || provider == NULL)
         return kIOReturnNotAttached;
     
-    message->header.msgh_bits = MACH_MSGH_BITS(MACH_MSG_TYPE_COPY_SEND,0);
-    message->header.msgh_size = sizeof(iSCSIHBANotificationMessage);
-    message->header.msgh_remote_port = notificationPort;
-    message->header.msgh_local_port = MACH_PORT_NULL;
-    message->header.msgh_reserved = 0;
-    message->header.msgh_id = 0;
+    IOLockLock(notificationLock);
     
-    mach_msg_send_from_kernel_proper(&message->header,message->header.msgh_size);
+    if(!notificationRing) {
+        sendNotificationMessage(message,0);
+        IOLockUnlock(notificationLock);
+        return kIOReturnSuccess;
+    }
+    
+    iSCSIHBANotificationRingEntry entry;
+    entry.notificationType = message->notificationType;
+    entry.reserved = 0;
+    entry.parameter1 = message->parameter1;
+    entry.parameter2 = message->parameter2;
+    entry.sessionId = message->sessionId;
+    entry.connectionId = message->connectionId;
+    
+    // If the ring is full (or still being bypassed) the notification itself
+    // is sent; the daemon drains the ring before handling it
+    enum iSCSIHBANotificationRingDelivery delivery =
+        iSCSIHBANotificationRingProduce(notificationRing,&notificationProducer,&entry);
+    
+    if(delivery == kiSCSIHBANotificationRingBypass) {
+        bool sent = sendNotificationMessage(message,kiSCSIHBANotificationBypassMessageId);
+        iSCSIHBANotificationRingMessageSent(&notificationProducer,delivery,sent);
+    }
+    else if(delivery == kiSCSIHBANotificationRingSignal) {
+        iSCSIHBANotificationMessage doorbell;
+        bzero(&doorbell,sizeof(doorbell));
+        doorbell.notificationType = kiSCSIHBANotificationRingUpdated;
+        
+        bool sent = sendNotificationMessage(&doorbell,0);
+        iSCSIHBANotificationRingMessageSent(&notificationProducer,delivery,sent);
+    }
+    
+    IOLockUnlock(notificationLock);
     return kIOReturnSuccess;
 }
 
+/*! Signals the user-space application if a previous signal indicating
+ *  that notifications were queued in the ring could not be delivered. */
+void iSCSIHBAUserClient::flushNotifications()
+{
+    if(notificationPort == MACH_PORT_NULL || isInactive())
+        return;
+    
+    IOLockLock(notificationLock);
+    
+    if(notificationRing && notificationProducer.signalPending) {
+        iSCSIHBANotificationMessage doorbell;
+        bzero(&doorbell,sizeof(doorbell));
+        doorbell.notificationType = kiSCSIHBANotificationRingUpdated;
+        
+        bool sent = sendNotificationMessage(&doorbell,0);
+        iSCSIHBANotificationRingMessageSent(&notificationProducer,kiSCSIHBANotificationRingSignal,sent);
+    }
+    
+    IOLockUnlock(notificationLock);
+}
+
 /*! Sends a notification message to the user indicating that an
  *  iSCSI asynchronous event has occured.
  *  @param sessionId the session identifier.
@@ -369,13 +541,17 @@ IOReturn iSCSIHBAUserClient::sendAsyncMessageNotification(SessionIdentifier sess
                                                           ConnectionIdentifier connectionId,
                                                           enum iSCSIPDUAsyncMsgEvent event)
 {
-    iSCSIHBANotificationAsyncMessage message;
+    // The asynchronous event is carried in the first parameter (and the LUN
+    // in the second) and unpacked into iSCSIHBANotificationAsyncMessage by
+    // the user-space interface
+    iSCSIHBANotificationMessage message;
+    bzero(&message,sizeof(message));
     message.notificationType = kiSCSIHBANotificationAsyncMessage;
-    message.asyncEvent = event;
+    message.parameter1 = event;
     message.sessionId = sessionId;
     message.connectionId = connectionId;
     
-    return sendNotification((iSCSIHBANotificationMessage*)&message);
+    return sendNotification(&message);
 }
 
 /*! Notifies clients that a network connnectivity issue has
@@ -387,11 +563,12 @@ IOReturn iSCSIHBAUserClient::sendTimeoutMessageNotification(SessionIdentifier se
                                                             ConnectionIdentifier connectionId)
 {
     iSCSIHBANotificationMessage message;
+    bzero(&message,sizeof(message));
     message.notificationType = kiSCSIHBANotificationTimeout;
     message.sessionId = sessionId;
     message.connectionId = connectionId;
     
-    return sendNotification((iSCSIHBANotificationMessage*)&message);
+    return sendNotification(&message);
 }
 
 /*! Sends a notification message to the user indicating that the kernel
@@ -400,6 +577,7 @@ IOReturn iSCSIHBAUserClient::sendTimeoutMessageNotification(SessionIdentifier se
 IOReturn iSCSIHBAUserClient::sendTerminateMessageNotification()
 {
     iSCSIHBANotificationMessage message;
+    bzero(&message,sizeof(message));
     message.notificationType = kiSCSIHBANotificationTerminate;
     
     return sendNotification(&message);
@@ -517,10 +695,13 @@ IOReturn iSCSIHBAUserClient::ReleaseSession(iSCSIHBAUserClient * target,
                                             void * reference,
                                             IOExternalMethodArguments * args)
 {
-    // Release the session with the specified ID
-    IOLockLock(target->accessLock);
-    target->provider->ReleaseSession(*args->scalarInput);
-    IOLockUnlock(target->accessLock);
+    SessionIdentifier sessionId = (SessionIdentifier)args->scalarInput[0];
+    
+    // Range-check input
+    if(sessionId >= kiSCSIMaxSessions)
+        return kIOReturnBadArgument;
+    
+    ReleaseSessionOrConnection(target,sessionId,kiSCSIInvalidConnectionId);
     
     return kIOReturnSuccess;
 }
@@ -593,6 +774,9 @@ IOReturn iSCSIHBAUserClient::SetSessionParameter(iSCSIHBAUserClient * target,
             case kiSCSIHBASOTargetSessionId:
                 session->targetSessionId = paramVal;
                 break;
+            case kiSCSIHBASORetainTarget:
+                session->retainTarget = paramVal;
+                break;
 
             default:
                 retVal = kIOReturnBadArgument;
@@ -673,6 +857,9 @@ IOReturn iSCSIHBAUserClient::GetSessionParameter(iSCSIHBAUserClient * target,
             case kiSCSIHBASOTargetSessionId:
                 *paramVal = session->targetSessionId;
                 break;
+            case kiSCSIHBASORetainTarget:
+                *paramVal = session->retainTarget;
+                break;
             default:
                 retVal = kIOReturnBadArgument;
         };
@@ -719,8 +906,11 @@ IOReturn iSCSIHBAUserClient::CreateConnection(iSCSIHBAUserClient * target,
     
     IOLockLock(target->accessLock);
     
-    // Create a connection
-    errno_t error = target->provider->CreateConnection(
+    // Create a connection (unless the session is being released)
+    errno_t error = EINVAL;
+    
+    if(sessionId < kiSCSIMaxSessions && !target->releasingSessions[sessionId])
+        error = target->provider->CreateConnection(
             sessionId,portalAddress,portalPort,hostInterface,remoteAddress,
             localAddress,&connectionId);
     
@@ -738,8 +928,6 @@ IOReturn iSCSIHBAUserClient::ReleaseConnection(iSCSIHBAUserClient * target,
                                                void * reference,
                                                IOExternalMethodArguments * args)
 {
-    iSCSIVirtualHBA * hba = OSDynamicCast(iSCSIVirtualHBA,target->provider);
-
     SessionIdentifier sessionId = (SessionIdentifier)args->scalarInput[0];
     ConnectionIdentifier connectionId = (ConnectionIdentifier)args->scalarInput[1];
     
@@ -747,28 +935,73 @@ IOReturn iSCSIHBAUserClient::ReleaseConnection(iSCSIHBAUserClient * target,
     if(sessionId >= kiSCSIMaxSessions || connectionId >= kiSCSIMaxConnectionsPerSession)
         return kIOReturnBadArgument;
     
+    ReleaseSessionOrConnection(target,sessionId,connectionId);
+    return kIOReturnSuccess;
+}
+
+/*! Helper function that releases a session, or one of its connections,
+ *  once PDU I/O in progress over the session has completed.  Sends and
+ *  receives hold the per-session and per-connection locks across socket
+ *  I/O, so the session or connection is first marked as being released
+ *  under the access lock, which is then dropped while waiting for those
+ *  locks; requests for other sessions are not held up in the meantime.
+ *  @param connectionId the connection to release, or
+ *  kiSCSIInvalidConnectionId to release the entire session.  Releasing the
+ *  only connection of a session releases the session as well. */
+void iSCSIHBAUserClient::ReleaseSessionOrConnection(iSCSIHBAUserClient * target,
+                                                    SessionIdentifier sessionId,
+                                                    ConnectionIdentifier connectionId)
+{
+    iSCSIVirtualHBA * hba = OSDynamicCast(iSCSIVirtualHBA,target->provider);
+    bool releaseSession = (connectionId == kiSCSIInvalidConnectionId);
+    
+    // Unpublish the session or connection so that no new PDU I/O starts;
+    // there is nothing to do if it is already being released
+    IOLockLock(target->accessLock);
+    
+    bool * releasing = releaseSession ? &target->releasingSessions[sessionId] :
+                                        &target->releasingConnections[sessionId][connectionId];
+    
+    if(*releasing || target->releasingSessions[sessionId]) {
+        IOLockUnlock(target->accessLock);
+        return;
+    }
+    
+    *releasing = true;
+    IOLockUnlock(target->accessLock);
+    
+    // Wait for PDU I/O in progress for this session to complete
+    IOLockLock(target->sessionLocks[sessionId]);
+    
+    for(ConnectionIdentifier lockId = 0; lockId < kiSCSIMaxConnectionsPerSession; lockId++)
+        IOLockLock(target->connectionLocks[sessionId][lockId]);
+    
     IOLockLock(target->accessLock);
     
-    iSCSISession * session = hba->sessionList[sessionId];
-
     // If this is the only connection, releasing the connection should
-    // release the session as well...
+    // release the session as well (connections are counted only now, as
+    // other connections may have been released in the meantime)
+    iSCSISession * session = hba->sessionList[sessionId];
     ConnectionIdentifier connectionCount = 0;
     
     if(session) {
-        // Iterate over list of connections to see how many are valid
-        for(ConnectionIdentifier connectionId = 0; connectionId < kiSCSIMaxConnectionsPerSession; connectionId++)
-            if(session->connections[connectionId])
+        for(ConnectionIdentifier index = 0; index < kiSCSIMaxConnectionsPerSession; index++)
+            if(session->connections[index])
                 connectionCount++;
     }
     
-    if(connectionCount == 1)
+    if(releaseSession || connectionCount == 1)
         target->provider->ReleaseSession(sessionId);
     else
         target->provider->ReleaseConnection(sessionId,connectionId);
     
+    *releasing = false;
     IOLockUnlock(target->accessLock);
-    return kIOReturnSuccess;
+    
+    for(ConnectionIdentifier lockId = 0; lockId < kiSCSIMaxConnectionsPerSession; lockId++)
+        IOLockUnlock(target->connectionLocks[sessionId][lockId]);
+    
+    IOLockUnlock(target->sessionLocks[sessionId]);
 }
 
 IOReturn iSCSIHBAUserClient::ActivateConnection(iSCSIHBAUserClient * target,
@@ -824,28 +1057,10 @@ IOReturn iSCSIHBAUserClient::DeactivateAllConnections(iSCSIHBAUserClient * targe
     return kIOReturnSuccess;
 }
 
-/*! Dispatched function invoked from user-space to send data
- *  over an existing, active connection. */
-IOReturn iSCSIHBAUserClient::SendBHS(iSCSIHBAUserClient * target,
-                                     void * reference,
-                                     IOExternalMethodArguments * args)
-{
-    // Validate input
-    if(args->structureInputSize != kiSCSIPDUBasicHeaderSegmentSize)
-        return kIOReturnNoSpace;
-    
-    IOLockLock(target->accessLock);
-    memcpy(&target->bhsBuffer,args->structureInput,kiSCSIPDUBasicHeaderSegmentSize);
-    IOLockUnlock(target->accessLock);
-    
-    return kIOReturnSuccess;
-}
-
-/*! Dispatched function invoked from user-space to send data
- *  over an existing, active connection. */
-IOReturn iSCSIHBAUserClient::SendData(iSCSIHBAUserClient * target,
-                                      void * reference,
-                                      IOExternalMethodArguments * args)
+/*! Helper function that sends the PDU described by the arguments of
+ *  SendPDU or ExchangePDU over an existing connection. */
+IOReturn iSCSIHBAUserClient::SendPDUWithArguments(iSCSIHBAUserClient * target,
+                                                  IOExternalMethodArguments * args)
 {
     iSCSIVirtualHBA * hba = OSDynamicCast(iSCSIVirtualHBA,target->provider);
     
@@ -856,44 +1071,67 @@ IOReturn iSCSIHBAUserClient::SendData(iSCSIHBAUserClient * target,
     if(sessionId >= kiSCSIMaxSessions || connectionId >= kiSCSIMaxConnectionsPerSession)
         return kIOReturnBadArgument;
     
-    IOLockLock(target->accessLock);
+    iSCSIPDUInitiatorBHS bhs;
+    memcpy(&bhs,&args->scalarInput[2],kiSCSIPDUBasicHeaderSegmentSize);
+    
+    const void * data = args->structureInput;
+    size_t length = args->structureInputSize;
+    void * buffer = NULL;
+    
+    // Large data segments are passed using a memory descriptor instead
+    IOMemoryDescriptor * descriptor = args->structureInputDescriptor;
+    
+    if(descriptor)
+        length = descriptor->getLength();
+    
+    IOLockLock(target->sessionLocks[sessionId]);
 
-    // Do nothing if session doesn't exist
+    // Do nothing if session doesn't exist (or is being released)
     iSCSISession * session = hba->sessionList[sessionId];
     iSCSIConnection * connection = NULL;
     
-    if(session)
+    if(session && !target->IsReleasing(sessionId,connectionId))
         connection = session->connections[connectionId];
     
-    const void * data = args->structureInput;
-    size_t length = args->structureInputSize;
+    IOReturn retVal = kIOReturnSuccess;
     
-    // Send data and return the result
-    IOReturn retVal = kIOReturnNotFound;
+    if(!connection)
+        retVal = kIOReturnNotFound;
     
-    if(connection) {
-        if(hba->SendPDU(session,connection,&(target->bhsBuffer),nullptr,data,length))
-            retVal = kIOReturnError;
-        else
-            retVal = kIOReturnSuccess;
+    // The data segment may not exceed the length the target accepts (the
+    // header is passed separately); this also bounds the copy below
+    else if(length > connection->maxSendDataSegmentLength)
+        retVal = kIOReturnBadArgument;
+    
+    else if(descriptor) {
+        if(!(buffer = IOMalloc(length)))
+            retVal = kIOReturnNoMemory;
+        else if(descriptor->prepare() != kIOReturnSuccess)
+            retVal = kIOReturnVMError;
+        else {
+            descriptor->readBytes(0,buffer,length);
+            descriptor->complete();
+            data = buffer;
+        }
     }
     
-    IOLockUnlock(target->accessLock);
+    // Send data and return the result
+    if(retVal == kIOReturnSuccess && hba->SendPDU(session,connection,&bhs,nullptr,data,length))
+        retVal = kIOReturnError;
+    
+    IOLockUnlock(target->sessionLocks[sessionId]);
+    
+    if(buffer)
+        IOFree(buffer,length);
     
     return retVal;
 }
 
-/*! Dispatched function invoked from user-space to receive data
- *  over an existing, active connection, and to retrieve the size of
- *  a user-space buffer that is required to hold the data. */
-IOReturn iSCSIHBAUserClient::RecvBHS(iSCSIHBAUserClient * target,
-                                     void * reference,
-                                     IOExternalMethodArguments * args)
+/*! Helper function that receives a PDU over an existing connection into
+ *  the outputs of RecvPDU or ExchangePDU. */
+IOReturn iSCSIHBAUserClient::RecvPDUWithArguments(iSCSIHBAUserClient * target,
+                                                  IOExternalMethodArguments * args)
 {
-    // Verify user-supplied buffer is large enough to hold BHS
-    if(args->structureOutputSize != kiSCSIPDUBasicHeaderSegmentSize)
-        return kIOReturnNoSpace;
-    
     iSCSIVirtualHBA * hba = OSDynamicCast(iSCSIVirtualHBA,target->provider);
     
     SessionIdentifier sessionId = (SessionIdentifier)args->scalarInput[0];
@@ -903,69 +1141,120 @@ IOReturn iSCSIHBAUserClient::RecvBHS(iSCSIHBAUserClient * target,
     if(sessionId >= kiSCSIMaxSessions || connectionId >= kiSCSIMaxConnectionsPerSession)
         return kIOReturnBadArgument;
     
-    IOLockLock(target->accessLock);
+    // Large receive buffers are passed using a memory descriptor instead
+    IOMemoryDescriptor * descriptor = args->structureOutputDescriptor;
+    size_t capacity = descriptor ? descriptor->getLength() : args->structureOutputSize;
     
-    // Do nothing if session doesn't exist
+    iSCSIPDUTargetBHS bhs;
+    iSCSIPDUFrame frame;
+    UInt32 length = 0;
+    void * buffer = NULL;
+    
+    IOLockLock(target->connectionLocks[sessionId][connectionId]);
+    
+    // Do nothing if session doesn't exist (or is being released)
     iSCSISession * session = hba->sessionList[sessionId];
     iSCSIConnection * connection = NULL;
     
-    if(session)
+    if(session && !target->IsReleasing(sessionId,connectionId))
         connection = session->connections[connectionId];
     
-    // Receive data and return the result
+    // Receive header and data and return the result
     IOReturn retVal = kIOReturnNotFound;
     
-    iSCSIPDUTargetBHS * bhs = (iSCSIPDUTargetBHS*)args->structureOutput;
+    if(!connection)
+        goto RECV_DONE;
     
-    if(connection) {
-        if(hba->RecvPDUHeader(session,connection,bhs,MSG_WAITALL))
-            retVal = kIOReturnIOError;
-        else
-            retVal = kIOReturnSuccess;
+    retVal = kIOReturnIOError;
+    
+    if(hba->RecvPDUHeader(session,connection,&bhs,MSG_WAITALL))
+        goto RECV_DONE;
+    
+    // The caller's buffer holds the largest data segment the initiator
+    // declared it can receive; anything larger violates the protocol.  The
+    // segment is left unread, so shut the socket down rather than let the
+    // next receive parse its payload as a header
+    if(!iSCSIPDUFrameDecode(&bhs,connection->maxRecvDataSegmentLength,&frame) ||
+       frame.dataSegmentLength > capacity) {
+        sock_shutdown(connection->socket,SHUT_RDWR);
+        retVal = kIOReturnNoSpace;
+        goto RECV_DONE;
     }
     
-    IOLockUnlock(target->accessLock);
+    length = frame.dataSegmentLength;
     
-    return retVal;
-}
-
-/*! Dispatched function invoked from user-space to receive data
- *  over an existing, active connection, and to retrieve the size of
- *  a user-space buffer that is required to hold the data. */
-IOReturn iSCSIHBAUserClient::RecvData(iSCSIHBAUserClient * target,
-                                      void * reference,
-                                      IOExternalMethodArguments * args)
-{
-    iSCSIVirtualHBA * hba = OSDynamicCast(iSCSIVirtualHBA,target->provider);
+    if(length > 0) {
+        void * data = args->structureOutput;
+        
+        if(descriptor && !(data = buffer = IOMalloc(length))) {
+            sock_shutdown(connection->socket,SHUT_RDWR);
+            retVal = kIOReturnNoMemory;
+            goto RECV_DONE;
+        }
+        
+        if(hba->RecvPDUData(session,connection,data,length,MSG_WAITALL))
+            goto RECV_DONE;
+    }
     
-    SessionIdentifier sessionId = (SessionIdentifier)args->scalarInput[0];
-    ConnectionIdentifier connectionId = (ConnectionIdentifier)args->scalarInput[1];
+    retVal = kIOReturnSuccess;
     
-    // Range-check input
-    if(sessionId >= kiSCSIMaxSessions || connectionId >= kiSCSIMaxConnectionsPerSession)
-        return kIOReturnBadArgument;
+RECV_DONE:
+    IOLockUnlock(target->connectionLocks[sessionId][connectionId]);
     
-    IOLockLock(target->accessLock);
+    if(buffer) {
+        if(retVal == kIOReturnSuccess) {
+            if(descriptor->prepare() == kIOReturnSuccess) {
+                descriptor->writeBytes(0,buffer,length);
+                descriptor->complete();
+            }
+            else
+                retVal = kIOReturnVMError;
+        }
+        IOFree(buffer,length);
+    }
     
-    // Do nothing if session doesn't exist
-    iSCSISession * session = hba->sessionList[sessionId];
-    iSCSIConnection * connection = NULL;
+    if(retVal != kIOReturnSuccess)
+        return retVal;
     
-    if(session)
-        connection = session->connections[connectionId];
+    memcpy(args->scalarOutput,&bhs,kiSCSIPDUBasicHeaderSegmentSize);
+    args->scalarOutputCount = kiSCSIHBABHSScalarCount;
     
-    // Receive data and return the result
-    IOReturn retVal = kIOReturnNotFound;
+    if(descriptor)
+        args->structureOutputDescriptorSize = length;
+    else
+        args->structureOutputSize = length;
     
-    void * data = (void *)args->structureOutput;
-    size_t length = args->structureOutputSize;
+    return kIOReturnSuccess;
+}
 
-    if(hba->RecvPDUData(session,connection,data,length,MSG_WAITALL))
-        retVal = kIOReturnIOError;
-    else
-        retVal = kIOReturnSuccess;
+/*! Dispatched function invoked from user-space to send a PDU
+ *  (header and data segment) over an existing connection. */
+IOReturn iSCSIHBAUserClient::SendPDU(iSCSIHBAUserClient * target,
+                                     void * reference,
+                                     IOExternalMethodArguments * args)
+{
+    return SendPDUWithArguments(target,args);
+}
+
+/*! Dispatched function invoked from user-space to receive a PDU
+ *  (header and data segment) over an existing connection. */
+IOReturn iSCSIHBAUserClient::RecvPDU(iSCSIHBAUserClient * target,
+                                     void * reference,
+                                     IOExternalMethodArguments * args)
+{
+    return RecvPDUWithArguments(target,args);
+}
+
+/*! Dispatched function invoked from user-space to send a PDU and
+ *  receive the response PDU over an existing connection. */
+IOReturn iSCSIHBAUserClient::ExchangePDU(iSCSIHBAUserClient * target,
+                                         void * reference,
+                                         IOExternalMethodArguments * args)
+{
+    IOReturn retVal = SendPDUWithArguments(target,args);
     
-    IOLockUnlock(target->accessLock);
+    if(retVal == kIOReturnSuccess)
+        retVal = RecvPDUWithArguments(target,args);
     
     return retVal;
 }
@@ -1514,5 +1803,190 @@ IOReturn iSCSIHBAUserClient::GetHostInterfaceForConnectionId(iSCSIHBAUserClient
     return retVal;
 }
 
+IOReturn iSCSIHBAUserClient::GetPDUTrace(iSCSIHBAUserClient * target,
+                                         void * reference,
+                                         IOExternalMethodArguments * args)
+{
+    iSCSIVirtualHBA * hba = OSDynamicCast(iSCSIVirtualHBA,target->provider);
+    
+    SessionIdentifier sessionId = (SessionIdentifier)args->scalarInput[0];
+    ConnectionIdentifier connectionId = (ConnectionIdentifier)args->scalarInput[1];
+    
+    // Range-check input
+    if(sessionId >= kiSCSIMaxSessions || connectionId >= kiSCSIMaxConnectionsPerSession)
+        return kIOReturnBadArgument;
+    
+    // Large buffers are passed in using a memory descriptor
+    UInt32 outputSize = args->structureOutputDescriptor ? args->structureOutputDescriptorSize :
+                                                          args->structureOutputSize;
+    
+    IOLockLock(target->accessLock);
+    
+    // Do nothing if session doesn't exist
+    iSCSISession * session = hba->sessionList[sessionId];
+    iSCSIConnection * connection = NULL;
+    
+    if(session)
+        connection = session->connections[connectionId];
+    
+    IOReturn retVal = kIOReturnNotFound;
+    
+    if(connection && !connection->traceRecords)
+        retVal = kIOReturnUnsupported;
+    else if(connection) {
+        retVal = kIOReturnSuccess;
+        
+        // Copy the newest records that fit, oldest first.  Records may be
+        // appended while copying; a record being overwritten may be torn
+        UInt32 head = (UInt32)connection->traceHead;
+        UInt32 count = min(head,kiSCSIHBAPDUTraceRecordCount);
+        count = min(count,outputSize/sizeof(iSCSIHBAPDUTraceRecord));
+        
+        for(UInt32 idx = 0; idx < count; idx++) {
+            UInt32 recordIdx = (head - count + idx) & (kiSCSIHBAPDUTraceRecordCount-1);
+            const iSCSIHBAPDUTraceRecord * record = &connection->traceRecords[recordIdx];
+            
+            if(args->structureOutputDescriptor)
+                args->structureOutputDescriptor->writeBytes(idx*sizeof(iSCSIHBAPDUTraceRecord),
+                                                            record,sizeof(iSCSIHBAPDUTraceRecord));
+            else
+                memcpy((UInt8*)args->structureOutput + idx*sizeof(iSCSIHBAPDUTraceRecord),
+                       record,sizeof(iSCSIHBAPDUTraceRecord));
+        }
+        
+        if(args->structureOutputDescriptor)
+            args->structureOutputDescriptorSize = count*sizeof(iSCSIHBAPDUTraceRecord);
+        else
+            args->structureOutputSize = count*sizeof(iSCSIHBAPDUTraceRecord);
+        
+        args->scalarOutputCount = 2;
+        args->scalarOutput[0] = count;
+        args->scalarOutput[1] = head;
+    }
+    
+    IOLockUnlock(target->accessLock);
+    return retVal;
+}
 
+/*! Fills in a snapshot of a session and its connections.  The caller must
+ *  hold the access lock.
+ *  @param session the session.
+ *  @param snapshot the snapshot to fill in. */
+static void iSCSIHBAUserClientFillSessionSnapshot(iSCSISession * session,
+                                                  iSCSIHBASessionSnapshot * snapshot)
+{
+    bzero(snapshot,sizeof(iSCSIHBASessionSnapshot));
+    
+    snapshot->sessionId = session->sessionId;
+    snapshot->targetSessionId = session->targetSessionId;
+    snapshot->targetPortalGroupTag = session->targetPortalGroupTag;
+    snapshot->defaultTime2Retain = session->defaultTime2Retain;
+    snapshot->defaultTime2Wait = session->defaultTime2Wait;
+    snapshot->maxOutStandingR2T = session->maxOutStandingR2T;
+    snapshot->errorRecoveryLevel = session->errorRecoveryLevel;
+    snapshot->immediateData = session->immediateData;
+    snapshot->initialR2T = session->initialR2T;
+    snapshot->dataPDUInOrder = session->dataPDUInOrder;
+    snapshot->dataSequenceInOrder = session->dataSequenceInOrder;
+    snapshot->active = session->active;
+    snapshot->maxConnections = session->maxConnections;
+    snapshot->maxBurstLength = session->maxBurstLength;
+    snapshot->firstBurstLength = session->firstBurstLength;
+    snapshot->outstandingTasks = (UInt32)session->statistics.outstandingTasks;
+    snapshot->commandsIssued = session->statistics.commandsIssued;
+    snapshot->commandsCompleted = session->statistics.commandsCompleted;
+    snapshot->taskTimeouts = session->statistics.taskTimeouts;
+    snapshot->connectionTimeouts = session->statistics.connectionTimeouts;
+    
+    for(ConnectionIdentifier connectionId = 0; connectionId < kiSCSIMaxConnectionsPerSession; connectionId++)
+    {
+        iSCSIConnection * connection = session->connections[connectionId];
+        
+        if(!connection)
+            continue;
+        
+        iSCSIHBAConnectionSnapshot * connSnapshot = &snapshot->connections[snapshot->connectionCount++];
+        
+        connSnapshot->connectionId = connectionId;
+        connSnapshot->maxRecvDataSegmentLength = connection->maxRecvDataSegmentLength;
+        connSnapshot->maxSendDataSegmentLength = connection->maxSendDataSegmentLength;
+        connSnapshot->expStatSN = connection->expStatSN;
+        connSnapshot->IFMarkInt = connection->IFMarkInt;
+        connSnapshot->OFMarkInt = connection->OFMarkInt;
+        connSnapshot->useHeaderDigest = connection->useHeaderDigest;
+        connSnapshot->useDataDigest = connection->useDataDigest;
+        connSnapshot->useIFMarker = connection->useIFMarker;
+        connSnapshot->useOFMarker = connection->useOFMarker;
+        connSnapshot->bytesPerSecond = connection->bytesPerSecond;
+        connSnapshot->latencyMs = connection->latency_ms;
+        connSnapshot->txPDUs = connection->statistics.txPDUs;
+        connSnapshot->rxPDUs = connection->statistics.rxPDUs;
+        connSnapshot->txBytes = connection->statistics.txBytes;
+        connSnapshot->rxBytes = connection->statistics.rxBytes;
+        connSnapshot->headerDigestErrors = connection->statistics.headerDigestErrors;
+        connSnapshot->dataDigestErrors = connection->statistics.dataDigestErrors;
+    }
+}
 
+IOReturn iSCSIHBAUserClient::GetSessionSnapshots(iSCSIHBAUserClient * target,
+                                                 void * reference,
+                                                 IOExternalMethodArguments * args)
+{
+    iSCSIVirtualHBA * hba = OSDynamicCast(iSCSIVirtualHBA,target->provider);
+    
+    SessionIdentifier sessionId = (SessionIdentifier)args->scalarInput[0];
+    
+    // Range-check input (the invalid session identifier selects all sessions)
+    if(sessionId >= kiSCSIMaxSessions && sessionId != kiSCSIInvalidSessionId)
+        return kIOReturnBadArgument;
+    
+    // Large buffers are passed in using a memory descriptor
+    UInt32 outputSize = args->structureOutputDescriptor ? args->structureOutputDescriptorSize :
+                                                          args->structureOutputSize;
+    UInt32 maxCount = outputSize/sizeof(iSCSIHBASessionSnapshot);
+    
+    SessionIdentifier firstId = 0, lastId = kiSCSIMaxSessions - 1;
+    
+    if(sessionId != kiSCSIInvalidSessionId)
+        firstId = lastId = sessionId;
+    
+    iSCSIHBASessionSnapshot snapshot;
+    UInt32 count = 0;
+    
+    IOLockLock(target->accessLock);
+    
+    for(SessionIdentifier id = firstId; id <= lastId && count < maxCount; id++)
+    {
+        iSCSISession * session = hba->sessionList[id];
+        
+        if(!session)
+            continue;
+        
+        iSCSIHBAUserClientFillSessionSnapshot(session,&snapshot);
+        
+        if(args->structureOutputDescriptor)
+            args->structureOutputDescriptor->writeBytes(count*sizeof(iSCSIHBASessionSnapshot),
+                                                        &snapshot,sizeof(iSCSIHBASessionSnapshot));
+        else
+            memcpy((UInt8*)args->structureOutput + count*sizeof(iSCSIHBASessionSnapshot),
+                   &snapshot,sizeof(iSCSIHBASessionSnapshot));
+        count++;
+    }
+    
+    IOLockUnlock(target->accessLock);
+    
+    // A specific session was requested but does not exist
+    if(sessionId != kiSCSIInvalidSessionId && count == 0 && maxCount > 0)
+        return kIOReturnNotFound;
+    
+    if(args->structureOutputDescriptor)
+        args->structureOutputDescriptorSize = count*sizeof(iSCSIHBASessionSnapshot);
+    else
+        args->structureOutputSize = count*sizeof(iSCSIHBASessionSnapshot);
+    
+    args->scalarOutputCount = 2;
+    args->scalarOutput[0] = kiSCSIHBASnapshotVersion;
+    args->scalarOutput[1] = count;
+    
+    return kIOReturnSuccess;
+}
@@ -30,9 +30,11 @@
 #define __ISCSI_USER_CLIENT_H__
 
 #include <IOKit/IOUserClient.h>
+#include <IOKit/IOBufferMemoryDescriptor.h>
 
 #include "iSCSIKernelClasses.h"
 #include "iSCSIHBATypes.h"
+#include "iSCSIHBANotificationRing.h"
 #include "iSCSIPDUShared.h"
 #include "iSCSIVirtualHBA.h"
 #include "iSCSITypesShared.h"
@@ -57,6 +59,10 @@ public:
 							  UInt32 type,
 							  OSDictionary * properties);
     
+    /*! Frees the locks allocated by initWithTask().  Invoked when the last
+     *  reference to the user client is released. */
+    virtual void free();
+    
 	/*! Dispatched function called from the device interface to this user
 	 *	client .*/
 	static IOReturn OpenInitiator(iSCSIHBAUserClient * target,
@@ -154,32 +160,38 @@ public:
     static IOReturn GetHostInterfaceForConnectionId(iSCSIHBAUserClient * target,
                                                     void * reference,
                                                     IOExternalMethodArguments * args);
+    
+    /*! Dispatched function invoked from user-space to copy the PDU trace
+     *  ring buffer of a connection, oldest record first. */
+    static IOReturn GetPDUTrace(iSCSIHBAUserClient * target,
+                                void * reference,
+                                IOExternalMethodArguments * args);
+    
+    /*! Dispatched function invoked from user-space to get a snapshot of the
+     *  parameters and counters of one session (and its connections), or of
+     *  all sessions if the invalid session identifier is passed in. */
+    static IOReturn GetSessionSnapshots(iSCSIHBAUserClient * target,
+                                        void * reference,
+                                        IOExternalMethodArguments * args);
 
-    /*! Dispatched function invoked from user-space to send data
-     *  over an existing, active connection. */
-    static IOReturn SendBHS(iSCSIHBAUserClient * target,
+    /*! Dispatched function invoked from user-space to send a PDU
+     *  (header and data segment) over an existing connection. */
+    static IOReturn SendPDU(iSCSIHBAUserClient * target,
                             void * reference,
                             IOExternalMethodArguments * args);
-
-    /*! Dispatched function invoked from user-space to send data
-     *  over an existing, active connection. */
-    static IOReturn SendData(iSCSIHBAUserClient * target,
-                             void * reference,
-                             IOExternalMethodArguments * args);
-    
-    /*! Dispatched function invoked from user-space to receive data
-     *  over an existing, active connection, and to retrieve the size of
-     *  a user-space buffer that is required to hold the data. */
-    static IOReturn RecvBHS(iSCSIHBAUserClient * target,
+    
+    /*! Dispatched function invoked from user-space to receive a PDU
+     *  (header and data segment) over an existing connection. */
+    static IOReturn RecvPDU(iSCSIHBAUserClient * target,
                             void * reference,
                             IOExternalMethodArguments * args);
     
-    /*! Dispatched function invoked from user-space to receive data
-     *  over an existing, active connection, and to retrieve the size of
-     *  a user-space buffer that is required to hold the data. */
-    static IOReturn RecvData(iSCSIHBAUserClient * target,
-                             void * reference,
-                             IOExternalMethodArguments * args);
+    /*! Dispatched function invoked from user-space to send a PDU and
+     *  receive the response PDU (e.g., a login or text request/response
+     *  round trip) over an existing connection. */
+    static IOReturn ExchangePDU(iSCSIHBAUserClient * target,
+                                void * reference,
+                                IOExternalMethodArguments * args);
     
     static IOReturn SetConnectionParameter(iSCSIHBAUserClient * target,
                                         void * reference,
@@ -228,10 +240,35 @@ public:
                                               UInt32 type,
                                               io_user_reference_t refCon);
     
-    /*! Send a notification message to the user-space application.
+    /*! Invoked when a user-space application maps memory from this user
+     *  client (see iSCSIHBAMemoryTypes).
+     *  @param type the type of memory to map.
+     *  @param options mapping options (returned).
+     *  @param memory the memory descriptor to map (returned).
+     *  @return an error code indicating the result of the operation. */
+    virtual IOReturn clientMemoryForType(UInt32 type,
+                                         IOOptionBits * options,
+                                         IOMemoryDescriptor * * memory);
+    
+    /*! Sends a message to the user-space application.  The notification lock
+     *  must be held, so that messages are sent in the order they are produced.
+     *  @param message the message to send.
+     *  @param messageId the mach message identifier.
+     *  @return true if the message was sent. */
+    bool sendNotificationMessage(iSCSIHBANotificationMessage * message,
+                                 mach_msg_id_t messageId);
+    
+    /*! Send a notification message to the user-space application.  If the
+     *  application has mapped the notification ring the notification is
+     *  queued there, and a message is only sent if the ring was drained.
      *  @param message details regarding the notification message.
      *  @return an error code indicating the result of the operation. */
     IOReturn sendNotification(iSCSIHBANotificationMessage * message);
+    
+    /*! Signals the user-space application if a previous signal indicating
+     *  that notifications were queued in the ring could not be delivered.
+     *  Invoked periodically by the virtual HBA. */
+    void flushNotifications();
 
     /*! Sends a notification message to the user indicating that an
      *  iSCSI asynchronous event has occured.
@@ -259,15 +296,36 @@ public:
 	static const IOExternalMethodDispatch methods[kiSCSIInitiatorNumMethods];
 	
 private:
+    
+    /*! Sends the PDU described by the arguments of SendPDU or ExchangePDU.
+     *  The header is passed in scalar inputs following the session and
+     *  connection identifiers, and the data segment as the structure input. */
+    static IOReturn SendPDUWithArguments(iSCSIHBAUserClient * target,
+                                         IOExternalMethodArguments * args);
+    
+    /*! Receives a PDU into the outputs of RecvPDU or ExchangePDU.  The
+     *  header is returned in the scalar outputs and the data segment in
+     *  the structure output. */
+    static IOReturn RecvPDUWithArguments(iSCSIHBAUserClient * target,
+                                         IOExternalMethodArguments * args);
+    
+    /*! Releases a session, or one of its connections, once PDU I/O in
+     *  progress has completed (see the lock order below).
+     *  @param connectionId the connection to release, or
+     *  kiSCSIInvalidConnectionId to release the session. */
+    static void ReleaseSessionOrConnection(iSCSIHBAUserClient * target,
+                                           SessionIdentifier sessionId,
+                                           ConnectionIdentifier connectionId);
+    
+    /*! Determines whether a session or connection is being released, in
+     *  which case no new PDU I/O may start over it. */
+    bool IsReleasing(SessionIdentifier sessionId,ConnectionIdentifier connectionId)
+    { return releasingSessions[sessionId] || releasingConnections[sessionId][connectionId]; };
 
 	/*! Points to the provider object (driver). The pointer is assigned
 	 *	when the start() function is called by the I/O Kit. */
 	iSCSIVirtualHBA * provider;
     
-    /*! Holds a basic header segment (buffer). Used when sending and
-     *  receiving PDUs to and from the target. */
-    iSCSIPDUInitiatorBHS bhsBuffer;
-	
 	/*! Identifies the Mach task (user-space) that opened a connection to this
 	 *	client. */
 	task_t owningTask;
@@ -281,8 +339,47 @@ private:
     /*! The notification port associated with a user-space connection. */
     mach_port_t notificationPort;
     
+    /*! Memory backing the notification ring, allocated when the ring is
+     *  first mapped by the user-space application. */
+    IOBufferMemoryDescriptor * notificationRingMemory;
+    
+    /*! Ring of notifications shared with the user-space application, or
+     *  NULL if the ring has not been mapped. */
+    iSCSIHBANotificationRing * notificationRing;
+    
+    /*! Producer state of the notification ring. */
+    iSCSIHBANotificationRingProducer notificationProducer;
+    
+    /*! Serializes notification producers (the ring has a single producer). */
+    IOLock * notificationLock;
+    
+    /*  Lock order: a session lock is taken before the connection locks of
+     *  that session, and both before the access lock.  The session and
+     *  connection locks are held across socket I/O, so the access lock is
+     *  never held while waiting for them.  The notification lock is only
+     *  taken on its own. */
+    
     /*! Access lock for kernel functions. */
     IOLock * accessLock;
+    
+    /*! Per-session locks held while sending PDUs, and while releasing the
+     *  session or its connections.  Socket I/O may block (up to the TCP
+     *  timeout) and must not hold up requests for other sessions, such as
+     *  concurrent logins and discovery. */
+    IOLock * sessionLocks[kiSCSIMaxSessions];
+    
+    /*! Per-connection locks held while receiving PDUs, and while releasing
+     *  the connection (or its session).  Receiving only touches connection
+     *  state, so logins over different connections of the same session
+     *  can wait for responses in parallel. */
+    IOLock * connectionLocks[kiSCSIMaxSessions][kiSCSIMaxConnectionsPerSession];
+    
+    /*! Sessions being released.  Set and cleared under the access lock;
+     *  read under the session or connection lock by sends and receives. */
+    bool releasingSessions[kiSCSIMaxSessions];
+    
+    /*! Connections being released, protected like releasingSessions. */
+    bool releasingConnections[kiSCSIMaxSessions][kiSCSIMaxConnectionsPerSession];
 };
 
 #endif /* defined(__ISCSI_USER_CLIENT_H__) */
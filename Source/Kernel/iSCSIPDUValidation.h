@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2016, Nareg Sinenian
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __ISCSI_PDU_VALIDATION_H__
+#define __ISCSI_PDU_VALIDATION_H__
+
+// This header is shared by the kernel extension, the user-space daemon and
+// the fuzzing harnesses, so that PDUs received from a target are checked
+// the same way everywhere.  It depends only on fixed-size C types so that
+// it can be built (and exercised) on any platform.
+#include <stddef.h>
+#include <stdint.h>
+
+/*! Size of the basic header segment of a PDU. */
+#define kiSCSIPDUValidationBHSSize 48
+
+/*! Lengths of the segments that follow the basic header segment of a PDU,
+ *  as declared by the sender. */
+typedef struct iSCSIPDUFrame {
+
+    /*! Length of the additional header segments (bytes). */
+    uint32_t ahsLength;
+
+    /*! Length of the data segment (bytes), excluding padding. */
+    uint32_t dataSegmentLength;
+
+    /*! Length of the data segment padded to a multiple of four bytes. */
+    uint32_t paddedDataSegmentLength;
+
+} iSCSIPDUFrame;
+
+/*! Decodes the framing of a PDU from its basic header segment and checks
+ *  that the data segment does not exceed the length the receiver declared
+ *  (MaxRecvDataSegmentLength).  A PDU that fails this check is a protocol
+ *  error, and the stream can no longer be trusted (RFC3720, section 12.12).
+ *  @param bhs the basic header segment (kiSCSIPDUValidationBHSSize bytes).
+ *  @param maxRecvDataSegmentLength the largest acceptable data segment.
+ *  @param frame the lengths declared by the header (returned).
+ *  @return a non-zero value if the PDU may be received, or zero if the
+ *  connection must be dropped. */
+static inline int iSCSIPDUFrameDecode(const void * bhs,
+                                      uint32_t maxRecvDataSegmentLength,
+                                      iSCSIPDUFrame * frame)
+{
+    const uint8_t * bytes = (const uint8_t *)bhs;
+
+    frame->ahsLength = (uint32_t)bytes[4] * 4;
+    frame->dataSegmentLength = ((uint32_t)bytes[5] << 16) | ((uint32_t)bytes[6] << 8) | bytes[7];
+    frame->paddedDataSegmentLength = (frame->dataSegmentLength + 3) & ~(uint32_t)3;
+
+    return frame->dataSegmentLength <= maxRecvDataSegmentLength;
+}
+
+/*! Checks that the data segment of a Data-In PDU lies within the buffer of
+ *  the task it belongs to.  The offset is supplied by the target; a PDU
+ *  that fails this check fails its task and drops the connection.
+ *  @param bufferOffset the buffer offset of the PDU.
+ *  @param length the length of the data segment.
+ *  @param transferLength the length of the data requested by the task.
+ *  @return a non-zero value if the data may be placed in the buffer. */
+static inline int iSCSIPDUDataInIsWithinTransfer(uint32_t bufferOffset,
+                                                 uint32_t length,
+                                                 uint64_t transferLength)
+{
+    return bufferOffset <= transferLength && length <= transferLength - bufferOffset;
+}
+
+#endif /* defined(__ISCSI_PDU_VALIDATION_H__) */
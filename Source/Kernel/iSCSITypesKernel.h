@@ -31,12 +31,123 @@
 
 
 #include <IOKit/IOLib.h>
+#include <IOKit/scsi/spi/IOSCSIParallelInterfaceController.h>
 #include <sys/socket.h>
 
 #include "iSCSITypesShared.h"
+#include "iSCSIHBATypes.h"
 
 class iSCSITaskQueue;
 class iSCSIIOEventSource;
+struct iSCSIPDUTransport;
+
+/*! Counters maintained for each connection.  These are updated on the I/O
+ *  path using atomic operations, since PDUs are sent from user client
+ *  threads as well as the work loop, and are periodically published to the
+ *  IORegistry by the virtual HBA. */
+typedef struct iSCSIConnectionStatistics {
+    
+    /*! Number of PDUs sent. */
+    UInt64 txPDUs;
+    
+    /*! Number of PDUs received. */
+    UInt64 rxPDUs;
+    
+    /*! Number of bytes sent (headers, data, padding and digests). */
+    UInt64 txBytes;
+    
+    /*! Number of bytes received (headers, data, padding and digests). */
+    UInt64 rxBytes;
+    
+    /*! Number of data-out PDUs sent. */
+    UInt64 txDataOutPDUs;
+    
+    /*! Number of data-in PDUs received. */
+    UInt64 rxDataInPDUs;
+    
+    /*! Number of R2T PDUs received. */
+    UInt64 rxR2TPDUs;
+    
+    /*! Number of PDUs that failed header digest verification. */
+    UInt64 headerDigestErrors;
+    
+    /*! Number of PDUs that failed data digest verification. */
+    UInt64 dataDigestErrors;
+    
+    /*! Latency histograms of tasks processed by this connection, indexed
+     *  by latency type (see iSCSIHBALatencyTypes). */
+    iSCSIHBALatencyHistogram latency[kiSCSIHBALatencyTypeCount];
+    
+} iSCSIConnectionStatistics;
+
+/*! Counters maintained for each logical unit of a session. */
+typedef struct iSCSILUNStatistics {
+    
+    /*! Number of SCSI commands issued to the logical unit. */
+    UInt64 commands;
+    
+    /*! Number of bytes read from the logical unit. */
+    UInt64 bytesRead;
+    
+    /*! Number of bytes written to the logical unit. */
+    UInt64 bytesWritten;
+    
+    /*! Number of commands that did not complete successfully. */
+    UInt64 errors;
+    
+    /*! Histogram of total task latency for the logical unit. */
+    iSCSIHBALatencyHistogram latency;
+    
+} iSCSILUNStatistics;
+
+/*! Counters maintained for each session. */
+typedef struct iSCSISessionStatistics {
+    
+    /*! Number of SCSI commands issued. */
+    UInt64 commandsIssued;
+    
+    /*! Number of SCSI commands completed (successfully or otherwise). */
+    UInt64 commandsCompleted;
+    
+    /*! Number of SCSI tasks that timed out. */
+    UInt64 taskTimeouts;
+    
+    /*! Number of connections that were dropped due to a timeout. */
+    UInt64 connectionTimeouts;
+    
+    /*! Number of SCSI tasks currently outstanding (queue depth). */
+    volatile SInt32 outstandingTasks;
+    
+    /*! Number of logical units for which statistics are kept. */
+    static const UInt8 kLUNStatisticsCount = 64;
+    
+    /*! Per-LUN counters, indexed by logical unit number. */
+    iSCSILUNStatistics LUNs[kLUNStatisticsCount];
+    
+    /*! Latency histograms, indexed by command class (see
+     *  iSCSIHBACommandClasses) and latency type (see iSCSIHBALatencyTypes). */
+    iSCSIHBALatencyHistogram latency[kiSCSIHBACommandClassCount][kiSCSIHBALatencyTypeCount];
+    
+} iSCSISessionStatistics;
+
+/*! HBA-specific data associated with each SCSI task. */
+typedef struct iSCSITaskData {
+    
+    /*! Connection the task was assigned to. */
+    ConnectionIdentifier connectionId;
+    
+    /*! Time at which the task was queued (mach absolute time). */
+    UInt64 queuedTime;
+    
+    /*! Time at which the command PDU was sent (mach absolute time), or zero
+     *  if the task has not been started. */
+    UInt64 startTime;
+    
+    /*! Next task held by the session while it has no connections (see
+     *  iSCSISession::heldTasks), or NULL if this is the last one. */
+    SCSIParallelTaskIdentifier nextHeldTask;
+    
+} iSCSITaskData;
 
 /*! Definition of a single connection that is associated with a particular
  *  iSCSI session. */
@@ -108,6 +219,21 @@ typedef struct iSCSIConnection {
     /*! Keeps track of the connection latency (ms). */
     UInt32 latency_ms;
     
+    /*! Ring buffer of recent PDU trace records (kiSCSIHBAPDUTraceRecordCount
+     *  entries), or NULL if tracing is unavailable for this connection. */
+    iSCSIHBAPDUTraceRecord * traceRecords;
+    
+    /*! Total number of trace records appended to the ring buffer. The next
+     *  record is written at this index modulo the ring size. */
+    volatile SInt32 traceHead;
+    
+    /*! Performance counters for this connection. */
+    iSCSIConnectionStatistics statistics;
+    
+    /*! Send and receive routines for the digest settings of this connection
+     *  (selected when the connection is created and activated). */
+    const iSCSIPDUTransport * transport;
+    
     //////////////////// Configured Connection Parameters /////////////////////
     
     /*! Flag that indicates if this connection uses header digests. */
@@ -167,6 +293,23 @@ typedef struct iSCSISession {
      *  exists and is backing the the iSCSI session. */
     bool active;
     
+    /*! Indicates whether the SCSI target is kept when the last connection
+     *  is deactivated (e.g., while the system sleeps), so that the logical
+     *  units and any mounted volumes survive until the session reconnects. */
+    bool retainTarget;
+    
+    /*! Tasks received while a retained target has no active connections.
+     *  The tasks are linked through their task data (nextHeldTask) in the
+     *  order they were received, and are resubmitted once a connection is
+     *  activated.  Protected by the work loop gate. */
+    SCSIParallelTaskIdentifier heldTasks;
+    
+    /*! Last task in the list of held tasks, or NULL if the list is empty. */
+    SCSIParallelTaskIdentifier lastHeldTask;
+    
+    /*! Performance counters for this session. */
+    iSCSISessionStatistics statistics;
+    
     //////////////////// Configured Session Parameters /////////////////////
     
     /*! Time to retain. */
@@ -32,6 +32,7 @@
 #include "iSCSITypesKernel.h"
 #include "iSCSIRFC3720Defaults.h"
 #include "iSCSIHBAUserClient.h"
+#include "iSCSIPDUValidation.h"
 #include "crc32c.h"
 
 #include <sys/ioctl.h>
@@ -156,6 +157,7 @@ bool iSCSIVirtualHBA::InitializeTargetForID(SCSITargetIdentifier targetId)
         
         if(targetIQN) {
             protocolDict->setObject("iSCSI Qualified Name",targetIQN);
+            device->setProperty(kiSCSITargetNameKey,targetIQN);
         }
         
         protocolDict->setObject(kIOPropertyPhysicalInterconnectTypeKey,OSString::withCString("iSCSI"));
@@ -317,9 +319,8 @@ UInt32 iSCSIVirtualHBA::ReportMaximumTaskCount()
 
 UInt32 iSCSIVirtualHBA::ReportHBASpecificTaskDataSize()
 {
-    // Due to a bug (feature?) in the SCSI family driver, this value cannot
-    // be zero, even if task data is not required.
-	return 1;
+    // Used to track the connection and timestamps of each task
+	return sizeof(iSCSITaskData);
 }
 
 UInt32 iSCSIVirtualHBA::ReportHBASpecificDeviceDataSize()
@@ -359,6 +360,16 @@ bool iSCSIVirtualHBA::InitializeController()
     // Generate an initiator id using a random number (per RFC3720)
     kInitiatorId = random();
     
+    // Periodically publish statistics to the IORegistry
+    statisticsTimer = IOTimerEventSource::timerEventSource(this,&PublishStatistics);
+    
+    if(statisticsTimer && GetWorkLoop()->addEventSource(statisticsTimer) == kIOReturnSuccess)
+        statisticsTimer->setTimeoutMS(kiSCSIStatisticsPublishIntervalMs);
+    else if(statisticsTimer) {
+        statisticsTimer->release();
+        statisticsTimer = NULL;
+    }
+    
     // Make ourselves discoverable to user clients (we do this last after
     // everything is initialized).
     registerService();
@@ -372,6 +383,13 @@ void iSCSIVirtualHBA::TerminateController()
 {
     DBLog("iscsi: Terminating virtual HBA\n");
     
+    if(statisticsTimer) {
+        statisticsTimer->cancelTimeout();
+        GetWorkLoop()->removeEventSource(statisticsTimer);
+        statisticsTimer->release();
+        statisticsTimer = NULL;
+    }
+    
     ReleaseAllSessions();
     
     // Free up our list of sessions and targets
@@ -401,15 +419,23 @@ void iSCSIVirtualHBA::HandleTimeout(SCSIParallelTaskIdentifier task)
     // Determine the target identifier (session identifier) and connection
     // associated with this task and remove the task from the task queue.
     SessionIdentifier sessionId = (UInt16)GetTargetIdentifier(task);
-    ConnectionIdentifier connectionId = *((UInt32*)GetHBADataPointer(task));
-    
-    if(connectionId >= kMaxConnectionsPerSession)
-        return;
+    ConnectionIdentifier connectionId = ((iSCSITaskData*)GetHBADataPointer(task))->connectionId;
     
     iSCSISession * session = sessionList[sessionId];
     if(!session)
         return;
     
+    // A held task was never assigned to a connection
+    if(RemoveHeldParallelTask(session,task)) {
+        super::CompleteParallelTask(task,
+                                    kSCSITaskStatus_DeliveryFailure,
+                                    kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE);
+        return;
+    }
+    
+    if(connectionId >= kMaxConnectionsPerSession)
+        return;
+    
     iSCSIConnection * connection = session->connections[connectionId];
     if(!connection)
         return;
@@ -417,6 +443,8 @@ void iSCSIVirtualHBA::HandleTimeout(SCSIParallelTaskIdentifier task)
     // Note: task tag is always 32-bits, even though the SCSI stack allows for 64-bit storage of the tag
     DBLog("iscsi: Task timeout for task %#x (sid: %d, cid: %d)\n",(UInt32)GetControllerTaskIdentifier(task),sessionId,connectionId);
 
+    OSIncrementAtomic64((SInt64*)&session->statistics.taskTimeouts);
+
     
     // If the task timeout is due to a broken connection, handle it.
     // Otherwise the target may be taking too long, just report it up the
@@ -451,6 +479,8 @@ void iSCSIVirtualHBA::HandleConnectionTimeout(SessionIdentifier sessionId,Connec
 
     DBLog("iscsi: Connection timeout (sid: %d, cid: %d)\n",sessionId,connectionId);
     
+    OSIncrementAtomic64((SInt64*)&session->statistics.connectionTimeouts);
+    
     ConnectionIdentifier connectionCount = 0;
     for(ConnectionIdentifier connectionId = 0; connectionId < kiSCSIMaxConnectionsPerSession; connectionId++)
         if(session->connections[connectionId])
@@ -490,6 +520,11 @@ SCSIServiceResponse iSCSIVirtualHBA::ProcessParallelTask(SCSIParallelTaskIdentif
     if(!session)
         return kSCSIServiceResponse_FUNCTION_REJECTED;
     
+    // A target kept across sleep has no connections until the session is
+    // reconnected; hold its tasks until then rather than rejecting them
+    if(HoldParallelTask(session,parallelTask))
+        return kSCSIServiceResponse_Request_In_Process;
+    
     // Determine which connection this task should be assigned to based on
     // bitrate and processing load; we do this by looking at the amount of
     // data each connection needs to transfer
@@ -524,10 +559,19 @@ SCSIServiceResponse iSCSIVirtualHBA::ProcessParallelTask(SCSIParallelTaskIdentif
     // Associate a connection identifier with this task; this is used to
     // maintain the connection associated with a task when only task information
     // is available (e.g., in the case of a task timeout).
-    *((UInt32*)GetHBADataPointer(parallelTask)) = 0;
+    iSCSITaskData * taskData = (iSCSITaskData*)GetHBADataPointer(parallelTask);
+    taskData->connectionId = 0;
+    taskData->queuedTime = mach_absolute_time();
+    taskData->startTime = 0;
     
     // Add the amount of data that we need to transfer to this connection
     OSAddAtomic64(GetRequestedDataTransferCount(parallelTask),&connection->dataToTransfer);
+    
+    OSIncrementAtomic64((SInt64*)&session->statistics.commandsIssued);
+    OSIncrementAtomic(&session->statistics.outstandingTasks);
+    
+    if(LUN < session->statistics.kLUNStatisticsCount)
+        OSIncrementAtomic64((SInt64*)&session->statistics.LUNs[LUN].commands);
 
     // Build and set iSCSI initiator task tag
     UInt32 initiatorTaskTag = BuildInitiatorTaskTag(kInitiatorTaskTypeSCSITask,LUN,taskId);
@@ -546,6 +590,92 @@ SCSIServiceResponse iSCSIVirtualHBA::ProcessParallelTask(SCSIParallelTaskIdentif
     return kSCSIServiceResponse_Request_In_Process;
 }
 
+bool iSCSIVirtualHBA::HoldParallelTask(iSCSISession * session,SCSIParallelTaskIdentifier parallelTask)
+{
+    bool held = false;
+    
+    GetWorkLoop()->closeGate();
+    
+    if(session->retainTarget && session->numActiveConnections == 0)
+    {
+        ((iSCSITaskData*)GetHBADataPointer(parallelTask))->nextHeldTask = NULL;
+        
+        if(session->lastHeldTask)
+            ((iSCSITaskData*)GetHBADataPointer(session->lastHeldTask))->nextHeldTask = parallelTask;
+        else
+            session->heldTasks = parallelTask;
+        
+        session->lastHeldTask = parallelTask;
+        held = true;
+    }
+    
+    GetWorkLoop()->openGate();
+    
+    if(held)
+        DBLog("iscsi: Holding task until session reconnects (sid: %d)\n",session->sessionId);
+    
+    return held;
+}
+
+bool iSCSIVirtualHBA::RemoveHeldParallelTask(iSCSISession * session,SCSIParallelTaskIdentifier parallelTask)
+{
+    bool removed = false;
+    
+    GetWorkLoop()->closeGate();
+    
+    SCSIParallelTaskIdentifier previous = NULL, task = session->heldTasks;
+    
+    while(task && task != parallelTask) {
+        previous = task;
+        task = ((iSCSITaskData*)GetHBADataPointer(task))->nextHeldTask;
+    }
+    
+    if(task)
+    {
+        SCSIParallelTaskIdentifier next = ((iSCSITaskData*)GetHBADataPointer(task))->nextHeldTask;
+        
+        if(previous)
+            ((iSCSITaskData*)GetHBADataPointer(previous))->nextHeldTask = next;
+        else
+            session->heldTasks = next;
+        
+        if(session->lastHeldTask == task)
+            session->lastHeldTask = previous;
+        
+        removed = true;
+    }
+    
+    GetWorkLoop()->openGate();
+    
+    return removed;
+}
+
+void iSCSIVirtualHBA::ReleaseHeldParallelTasks(iSCSISession * session,bool resubmit)
+{
+    // Detach the held tasks; once the session is being released no more
+    // tasks are held (they are rejected, since there are no connections)
+    GetWorkLoop()->closeGate();
+    
+    if(!resubmit)
+        session->retainTarget = false;
+    
+    SCSIParallelTaskIdentifier task = session->heldTasks;
+    session->heldTasks = session->lastHeldTask = NULL;
+    
+    GetWorkLoop()->openGate();
+    
+    while(task)
+    {
+        SCSIParallelTaskIdentifier next = ((iSCSITaskData*)GetHBADataPointer(task))->nextHeldTask;
+        
+        if(!resubmit || ProcessParallelTask(task) != kSCSIServiceResponse_Request_In_Process)
+            super::CompleteParallelTask(task,
+                                        kSCSITaskStatus_DeliveryFailure,
+                                        kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE);
+        task = next;
+    }
+}
+
 void iSCSIVirtualHBA::BeginTaskOnWorkloopThread(iSCSIVirtualHBA * owner,
                                                 iSCSISession * session,
                                                 iSCSIConnection * connection,
@@ -580,6 +710,8 @@ void iSCSIVirtualHBA::BeginTaskOnWorkloopThread(iSCSIVirtualHBA * owner,
     clock_get_system_microtime(&(connection->taskStartTimeSec),
                                &(connection->taskStartTimeUSec));
     
+    ((iSCSITaskData*)owner->GetHBADataPointer(parallelTask))->startTime = mach_absolute_time();
+    
     iSCSIPDUSCSICmdBHS bhs  = iSCSIPDUSCSICmdBHSInit;
     bhs.dataTransferLength  = OSSwapHostToBigInt32(transferSize);
     
@@ -703,6 +835,20 @@ bool iSCSIVirtualHBA::ProcessTaskOnWorkloopThread(iSCSIVirtualHBA * owner,
     else
         DBLog("iscsi: Received PDU type %#x (sid: %d, cid: %d)\n",
               bhs.opCode,session->sessionId,connection->cid);
+    
+    // The data segment length is supplied by the target; a PDU that exceeds
+    // the negotiated limit is a protocol error and the stream can no longer
+    // be trusted (RFC3720, section 12.12), so drop the connection
+    iSCSIPDUFrame frame;
+    
+    if(!iSCSIPDUFrameDecode(&bhs,connection->maxRecvDataSegmentLength,&frame))
+    {
+        DBLog("iscsi: Data segment length %u exceeds limit of %u (sid: %d, cid: %d)\n",
+              frame.dataSegmentLength,connection->maxRecvDataSegmentLength,
+              session->sessionId,connection->cid);
+        owner->HandleConnectionTimeout(session->sessionId,connection->cid);
+        return true;
+    }
 
     // Determine the kind of PDU that was received and process accordingly
     enum iSCSIPDUTargetOpCodes opCode = (iSCSIPDUTargetOpCodes)bhs.opCode;
@@ -743,6 +889,26 @@ bool iSCSIVirtualHBA::ProcessTaskOnWorkloopThread(iSCSIVirtualHBA * owner,
     return true;
 }
 
+/*! Records a latency sample in a histogram.  Tasks are usually completed on
+ *  the work loop, but a connection that fails while a user client thread
+ *  sends on it completes its tasks on that thread, so histograms are updated
+ *  using atomic operations.
+ *  @param histogram the histogram to update.
+ *  @param usec the latency in microseconds. */
+static void RecordLatency(iSCSIHBALatencyHistogram * histogram,UInt64 usec)
+{
+    OSIncrementAtomic64((SInt64*)&histogram->count);
+    OSAddAtomic64(usec,(SInt64*)&histogram->sumUSec);
+    
+    UInt64 maxUSec;
+    
+    do {
+        maxUSec = histogram->maxUSec;
+    } while(usec > maxUSec && !OSCompareAndSwap64(maxUSec,usec,&histogram->maxUSec));
+    
+    OSIncrementAtomic((SInt32*)&histogram->buckets[iSCSIHBALatencyHistogramGetBucket(usec)]);
+}
+
 /** This function has been overloaded to provide additional task-timing
  *  support for multiple connections.
  *  @param parallelRequest the request to complete.
@@ -754,11 +920,6 @@ void iSCSIVirtualHBA::CompleteParallelTask(iSCSISession * session,
                                            SCSITaskStatus completionStatus,
                                            SCSIServiceResponse serviceResponse)
 {
-    if(GetDataTransferDirection(parallelRequest) == kSCSIDataTransfer_NoDataTransfer) {
-        super::CompleteParallelTask(parallelRequest,completionStatus,serviceResponse);
-        return;
-    }
-
     // Compute the time it took to complete this task; first grab the timestamp
     // when task was first started
     clock_usec_t usecs;
@@ -768,8 +929,63 @@ void iSCSIVirtualHBA::CompleteParallelTask(iSCSISession * session,
     UInt64 duration_usecs = (secs  - connection->taskStartTimeSec)*1e6 +
                             (usecs - connection->taskStartTimeUSec);
     
-    // Calculate transfer speed over entire task...
     UInt64 bytesTransferred = GetRequestedDataTransferCount(parallelRequest);
+    
+    TraceTaskCompletion(connection,GetControllerTaskIdentifier(parallelRequest),
+                        (UInt32)bytesTransferred,(UInt32)duration_usecs);
+    
+    // Update session and LUN counters
+    iSCSISessionStatistics * stats = &session->statistics;
+    SCSILogicalUnitNumber LUN = GetLogicalUnitNumber(parallelRequest);
+    
+    OSIncrementAtomic64((SInt64*)&stats->commandsCompleted);
+    OSDecrementAtomic(&stats->outstandingTasks);
+    
+    // Split the task latency into the time spent queued in the HBA and the
+    // time spent on the wire (a task that was never started spent it all queued)
+    iSCSITaskData * taskData = (iSCSITaskData*)GetHBADataPointer(parallelRequest);
+    UInt64 now = mach_absolute_time(), latency[kiSCSIHBALatencyTypeCount];
+    UInt64 startTime = taskData->startTime ? taskData->startTime : now;
+    
+    absolutetime_to_nanoseconds(startTime - taskData->queuedTime,&latency[kiSCSIHBALatencyQueue]);
+    absolutetime_to_nanoseconds(now - startTime,&latency[kiSCSIHBALatencyWire]);
+    absolutetime_to_nanoseconds(now - taskData->queuedTime,&latency[kiSCSIHBALatencyTotal]);
+    
+    UInt8 transferDirection = GetDataTransferDirection(parallelRequest);
+    UInt8 commandClass = kiSCSIHBACommandClassOther;
+    
+    if(transferDirection == kSCSIDataTransfer_FromTargetToInitiator)
+        commandClass = kiSCSIHBACommandClassRead;
+    else if(transferDirection == kSCSIDataTransfer_FromInitiatorToTarget)
+        commandClass = kiSCSIHBACommandClassWrite;
+    
+    for(UInt8 type = 0; type < kiSCSIHBALatencyTypeCount; type++) {
+        latency[type] /= 1000;
+        RecordLatency(&stats->latency[commandClass][type],latency[type]);
+        RecordLatency(&connection->statistics.latency[type],latency[type]);
+    }
+    
+    if(LUN < stats->kLUNStatisticsCount)
+    {
+        RecordLatency(&stats->LUNs[LUN].latency,latency[kiSCSIHBALatencyTotal]);
+        
+        UInt64 bytesRealized = GetRealizedDataTransferCount(parallelRequest);
+        
+        if(commandClass == kiSCSIHBACommandClassRead)
+            OSAddAtomic64(bytesRealized,(SInt64*)&stats->LUNs[LUN].bytesRead);
+        else if(commandClass == kiSCSIHBACommandClassWrite)
+            OSAddAtomic64(bytesRealized,(SInt64*)&stats->LUNs[LUN].bytesWritten);
+        
+        if(completionStatus != kSCSITaskStatus_GOOD || serviceResponse != kSCSIServiceResponse_TASK_COMPLETE)
+            OSIncrementAtomic64((SInt64*)&stats->LUNs[LUN].errors);
+    }
+    
+    if(transferDirection == kSCSIDataTransfer_NoDataTransfer) {
+        super::CompleteParallelTask(parallelRequest,completionStatus,serviceResponse);
+        return;
+    }
+    
+    // Calculate transfer speed over entire task...
 
     // Add newest measurement to list (overwriting oldest one)
     connection->bytesPerSecondHistory[connection->bytesPerSecHistoryIdx]
@@ -851,15 +1067,23 @@ void iSCSIVirtualHBA::ProcessNOPIn(iSCSISession * session,
                                    iSCSIConnection * connection,
                                    iSCSIPDU::iSCSIPDUNOPInBHS * bhs)
 {
-    const size_t length = GetDataSegmentLength((iSCSIPDUTargetBHS*)bhs);
+    const UInt32 length = GetDataSegmentLength((iSCSIPDUTargetBHS*)bhs);
     
     // Grab data payload (could be ping data or other data, if it exists)
-    UInt8 data[length];
-
-    if(length > 0 && RecvPDUData(session,connection,data,length,MSG_WAITALL) != 0) {
-        DBLog("iscsi: Failed to retreive NOP in data (sid: %d, cid: %d)\n",
-              session->sessionId,connection->cid);
-        return;
+    UInt8 * data = NULL;
+    
+    if(length > 0) {
+        if(!(data = (UInt8*)IOMalloc(length))) {
+            DBLog("iscsi: couldn't allocate memory for PDU data (ProcessNOPIn)\n");
+            return;
+        }
+        
+        if(RecvPDUData(session,connection,data,length,MSG_WAITALL) != 0) {
+            DBLog("iscsi: Failed to retreive NOP in data (sid: %d, cid: %d)\n",
+                  session->sessionId,connection->cid);
+            IOFree(data,length);
+            return;
+        }
     }
     
     // Response to a previous ping from this initiator
@@ -867,8 +1091,11 @@ void iSCSIVirtualHBA::ProcessNOPIn(iSCSISession * session,
     {
         // Will use this to calculate latency; our initiated NOP contained
         // a timestamp that is sent back to us
-        if(length != (sizeof(clock_sec_t) + sizeof(clock_usec_t)))
+        if(length != (sizeof(clock_sec_t) + sizeof(clock_usec_t))) {
+            if(data)
+                IOFree(data,length);
             return;
+        }
         
         clock_sec_t secs_stamp, secs;
         clock_usec_t usecs_stamp, usecs;
@@ -901,6 +1128,9 @@ void iSCSIVirtualHBA::ProcessNOPIn(iSCSISession * session,
             DBLog("iscsi: Failed to send NOP response (sid: %d, cid: %d)\n",
                   session->sessionId,connection->cid);
     }
+    
+    if(data)
+        IOFree(data,length);
 }
 
 void iSCSIVirtualHBA::ProcessSCSIResponse(iSCSISession * session,
@@ -910,31 +1140,40 @@ void iSCSIVirtualHBA::ProcessSCSIResponse(iSCSISession * session,
     // Byte size of sense data (SAM)
     const UInt8 senseDataHeaderSize = 2;
     
+    // Sense data, if present (a data segment that could not be received in
+    // full is treated as though it were absent)
     const UInt32 length = GetDataSegmentLength((iSCSIPDUTargetBHS*)bhs);
-    UInt8 data[length];
-    memset(data, length, 0);
+    UInt32 senseLength = 0;
+    UInt8 * data = NULL;
+    
     if(length > 0) {
+        if(!(data = (UInt8*)IOMalloc(length))) {
+            DBLog("iscsi: couldn't allocate memory for PDU data (ProcessSCSIResponse)\n");
+            return;
+        }
+        
         if(RecvPDUData(session,connection,data,length,MSG_WAITALL))
             DBLog("iscsi: Error retrieving data segment (sid: %d, cid: %d)\n",
                   session->sessionId,connection->cid);
-        else
+        else {
+            senseLength = length;
             DBLog("iscsi: Received sense data (sid: %d, cid: %d)\n",
                   session->sessionId,connection->cid);
+        }
     }
 
-    // Grab parallel task associated with this PDU, indexed by task tag
+    // Grab parallel task associated with this PDU, indexed by task tag (the
+    // data segment has already been consumed, so there is nothing to flush)
     SCSIParallelTaskIdentifier parallelTask =
         FindTaskForControllerIdentifier(session->sessionId,bhs->initiatorTaskTag);
     
     if(!parallelTask)
     {
-        DBLog("iscsi: Task not found, flushing stream (ProcessSCSIResponse) (sid: %d, cid: %d)\n",
+        DBLog("iscsi: Task not found (ProcessSCSIResponse) (sid: %d, cid: %d)\n",
               session->sessionId,connection->cid);
         
-        // Flush stream
-        UInt8 buffer[length];
-        RecvPDUData(session,connection,buffer,length,MSG_WAITALL);
-        
+        if(data)
+            IOFree(data,length);
         return;
     }
     
@@ -942,13 +1181,14 @@ void iSCSIVirtualHBA::ProcessSCSIResponse(iSCSISession * session,
 
     // Process sense data if the PDU came with any...
     bool senseDataPresent = false;
-    if(length >= senseDataHeaderSize)
+    if(senseLength >= senseDataHeaderSize)
     {
         // First two bytes of the data segment are the size of the sense data
-        UInt16 senseDataLength = *((UInt16*)&data[0]);
+        UInt16 senseDataLength = 0;
+        memcpy(&senseDataLength,data,sizeof(senseDataLength));
         senseDataLength = OSSwapBigToHostInt16(senseDataLength);
         
-        if(length < senseDataLength + senseDataHeaderSize) {
+        if(senseDataLength == 0 || senseLength < (UInt32)senseDataLength + senseDataHeaderSize) {
             DBLog("iscsi: Received invalid sense data (sid: %d, cid: %d)\n",
                   session->sessionId,connection->cid);
         }
@@ -957,8 +1197,12 @@ void iSCSIVirtualHBA::ProcessSCSIResponse(iSCSISession * session,
             // Remaining data is sense data, advance pointer by two bytes to get this
             SCSI_Sense_Data * newSenseData = (SCSI_Sense_Data *)(data + senseDataHeaderSize);
         
-            // Incorporate sense data into the task
-            SetAutoSenseData(parallelTask,newSenseData,senseDataLength);
+            // Incorporate sense data into the task (the sense buffer size
+            // is expressed using a single byte)
+            if(senseDataLength > UINT8_MAX)
+                senseDataLength = UINT8_MAX;
+            
+            SetAutoSenseData(parallelTask,newSenseData,(UInt8)senseDataLength);
             
             senseDataPresent = true;
             
@@ -990,6 +1234,9 @@ void iSCSIVirtualHBA::ProcessSCSIResponse(iSCSISession * session,
     // Task is complete, remove it from the queue
     connection->taskQueue->completeCurrentTask();
     
+    if(data)
+        IOFree(data,length);
+    
     DBLog("iscsi: Processed SCSI response (sid: %d, cid: %d)\n",
           session->sessionId,connection->cid);
 
@@ -1012,7 +1259,12 @@ void iSCSIVirtualHBA::ProcessDataIn(iSCSISession * session,
         return;
     }
     
-    UInt8 buffer[length];
+    UInt8 * buffer = (UInt8*)IOMalloc(length);
+    
+    if(!buffer) {
+        DBLog("iscsi: couldn't allocate memory for PDU data (ProcessDataIn)\n");
+        return;
+    }
     
     // If task not found, flush stream
     if(!parallelTask)
@@ -1020,15 +1272,36 @@ void iSCSIVirtualHBA::ProcessDataIn(iSCSISession * session,
         DBLog("iscsi: Task not found (sid: %d, cid: %d)\n",
               session->sessionId,connection->cid);
         RecvPDUData(session,connection,buffer,length,MSG_WAITALL);
+        IOFree(buffer,length);
         return;
     }
     
     // System buffer offset for this PDU data segment...
     UInt32 dataOffset = OSSwapBigToHostInt32(bhs->bufferOffset);
+    UInt64 requestedLength = GetRequestedDataTransferCount(parallelTask);
     
     if(RecvPDUData(session,connection,buffer,length,0))
         DBLog("iscsi: Error in retrieving data segment length (sid: %d, cid: %d)\n",
               session->sessionId,connection->cid);
+    // The target must not send more data than was requested; the task can't
+    // complete correctly and the target can't be trusted, so fail the task
+    // and drop the connection (RFC3720, section 12.12)
+    else if(!iSCSIPDUDataInIsWithinTransfer(dataOffset,length,requestedLength)) {
+        DBLog("iscsi: Data-in PDU exceeds requested transfer length (sid: %d, cid: %d)\n",
+              session->sessionId,connection->cid);
+        
+        IOFree(buffer,length);
+        
+        CompleteParallelTask(session,
+                             connection,
+                             parallelTask,
+                             kSCSITaskStatus_DeliveryFailure,
+                             kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE);
+        connection->taskQueue->completeCurrentTask();
+        
+        HandleConnectionTimeout(session->sessionId,connection->cid);
+        return;
+    }
     else {
         IOMemoryDescriptor  * dataDesc = GetDataBuffer(parallelTask);
         dataDesc->writeBytes(dataOffset,buffer,length);
@@ -1036,6 +1309,8 @@ void iSCSIVirtualHBA::ProcessDataIn(iSCSISession * session,
         connection->dataToTransfer -= length;
     }
     
+    IOFree(buffer,length);
+    
     // If the PDU contains a status response, complete this task
     if((bhs->flags & kiSCSIPDUDataInFinalFlag) && (bhs->flags & kiSCSIPDUDataInStatusFlag))
     {
@@ -1239,8 +1514,15 @@ void iSCSIVirtualHBA::ProcessReject(iSCSISession * session,
         return;
     }
     
-    UInt8 buffer[length];
+    UInt8 * buffer = (UInt8*)IOMalloc(length);
+    
+    if(!buffer) {
+        DBLog("iscsi: couldn't allocate memory for PDU data (ProcessReject)\n");
+        return;
+    }
+    
     RecvPDUData(session,connection,buffer,length,MSG_WAITALL);
+    IOFree(buffer,length);
     
     enum iSCSIPDURejectCode rejectCode = (enum iSCSIPDURejectCode)bhs->reason;
     
@@ -1291,6 +1573,377 @@ void iSCSIVirtualHBA::MeasureConnectionLatency(iSCSISession * session,
     SendPDU(session,connection,(iSCSIPDUInitiatorBHS*)&bhs,NULL,data,length);
 }
 
+void iSCSIVirtualHBA::TracePDU(iSCSIConnection * connection,
+                               UInt8 eventType,
+                               const void * bhs)
+{
+    if(!connection || !connection->traceRecords || !bhs)
+        return;
+    
+    // Claim a slot; the ring size is a power of two so the (wrapping)
+    // head counter can simply be masked to obtain the index
+    UInt32 index = (UInt32)OSIncrementAtomic(&connection->traceHead) & (kiSCSIHBAPDUTraceRecordCount-1);
+    iSCSIHBAPDUTraceRecord * record = &connection->traceRecords[index];
+    
+    const UInt8 * header = (const UInt8 *)bhs;
+    UInt8 opCode = header[0] & ~kiSCSIPDUImmediateDeliveryFlag;
+    
+    record->timestamp = mach_absolute_time();
+    record->eventType = eventType;
+    record->opCode = opCode;
+    record->flags = header[1];
+    record->reserved = 0;
+    record->dataSegmentLength = GetDataSegmentLength((iSCSIPDUTargetBHS *)bhs);
+    record->latencyUSec = 0;
+    
+    // Task tags are kept in host byte order; sequence numbers are on the wire.
+    // These occupy the same offsets for both initiator and target PDUs.
+    record->initiatorTaskTag = OSReadLittleInt32(header,16);
+    record->sequenceNumber = OSReadBigInt32(header,24);
+    record->expSequenceNumber = OSReadBigInt32(header,28);
+    
+    // DataSN (R2TSN) and buffer offset are only meaningful for these PDUs
+    if(opCode == kiSCSIPDUOpCodeDataOut || opCode == kiSCSIPDUOpCodeDataIn ||
+       opCode == kiSCSIPDUOpCodeR2T)
+    {
+        record->dataSN = OSReadBigInt32(header,36);
+        record->bufferOffset = OSReadBigInt32(header,40);
+    }
+    else {
+        record->dataSN = 0;
+        record->bufferOffset = 0;
+    }
+}
+
+void iSCSIVirtualHBA::TraceTaskCompletion(iSCSIConnection * connection,
+                                          UInt32 initiatorTaskTag,
+                                          UInt32 bytesTransferred,
+                                          UInt32 latencyUSec)
+{
+    if(!connection || !connection->traceRecords)
+        return;
+    
+    UInt32 index = (UInt32)OSIncrementAtomic(&connection->traceHead) & (kiSCSIHBAPDUTraceRecordCount-1);
+    iSCSIHBAPDUTraceRecord * record = &connection->traceRecords[index];
+    
+    memset(record,0,sizeof(iSCSIHBAPDUTraceRecord));
+    record->timestamp = mach_absolute_time();
+    record->eventType = kiSCSIHBAPDUTraceTaskComplete;
+    record->opCode = kiSCSIPDUOpCodeSCSICmd;
+    record->initiatorTaskTag = initiatorTaskTag;
+    record->dataSegmentLength = bytesTransferred;
+    record->latencyUSec = latencyUSec;
+}
+
+/*! Helper function used to add a numeric value to a statistics dictionary. */
+static void SetStatisticsNumber(OSDictionary * dict,const char * key,UInt64 value)
+{
+    OSNumber * number = OSNumber::withNumber(value,64);
+    
+    if(number) {
+        dict->setObject(key,number);
+        number->release();
+    }
+}
+
+/*! Helper function used to add a latency histogram to a statistics dictionary. */
+static void SetStatisticsHistogram(OSDictionary * dict,const char * key,iSCSIHBALatencyHistogram * histogram)
+{
+    OSData * data = OSData::withBytes(histogram,sizeof(iSCSIHBALatencyHistogram));
+    
+    if(data) {
+        dict->setObject(key,data);
+        data->release();
+    }
+}
+
+/*! Helper function used to add a set of histograms, one per latency type
+ *  (see iSCSIHBALatencyTypes), to a statistics dictionary. */
+static void SetStatisticsHistograms(OSDictionary * dict,const char * key,iSCSIHBALatencyHistogram * histograms)
+{
+    OSDictionary * histogramDict = OSDictionary::withCapacity(kiSCSIHBALatencyTypeCount);
+    
+    if(histogramDict) {
+        SetStatisticsHistogram(histogramDict,kiSCSIStatisticsLatencyQueueKey,&histograms[kiSCSIHBALatencyQueue]);
+        SetStatisticsHistogram(histogramDict,kiSCSIStatisticsLatencyWireKey,&histograms[kiSCSIHBALatencyWire]);
+        SetStatisticsHistogram(histogramDict,kiSCSIStatisticsLatencyTotalKey,&histograms[kiSCSIHBALatencyTotal]);
+        dict->setObject(key,histogramDict);
+        histogramDict->release();
+    }
+}
+
+OSDictionary * iSCSIVirtualHBA::CreateStatisticsForSession(iSCSISession * session)
+{
+    OSDictionary * dict = OSDictionary::withCapacity(8);
+    OSArray * connections = OSArray::withCapacity(kMaxConnectionsPerSession);
+    OSArray * LUNs = OSArray::withCapacity(1);
+    
+    if(!dict || !connections || !LUNs)
+        goto STATISTICS_ALLOC_FAILURE;
+    
+    SetStatisticsNumber(dict,kiSCSIStatisticsCommandsIssuedKey,session->statistics.commandsIssued);
+    SetStatisticsNumber(dict,kiSCSIStatisticsCommandsCompletedKey,session->statistics.commandsCompleted);
+    SetStatisticsNumber(dict,kiSCSIStatisticsOutstandingTasksKey,
+                        session->statistics.outstandingTasks > 0 ? session->statistics.outstandingTasks : 0);
+    SetStatisticsNumber(dict,kiSCSIStatisticsTaskTimeoutsKey,session->statistics.taskTimeouts);
+    SetStatisticsNumber(dict,kiSCSIStatisticsConnectionTimeoutsKey,session->statistics.connectionTimeouts);
+    
+    OSDictionary * histogramsDict = OSDictionary::withCapacity(kiSCSIHBACommandClassCount);
+    
+    if(histogramsDict) {
+        SetStatisticsHistograms(histogramsDict,kiSCSIStatisticsCommandClassReadKey,
+                                session->statistics.latency[kiSCSIHBACommandClassRead]);
+        SetStatisticsHistograms(histogramsDict,kiSCSIStatisticsCommandClassWriteKey,
+                                session->statistics.latency[kiSCSIHBACommandClassWrite]);
+        SetStatisticsHistograms(histogramsDict,kiSCSIStatisticsCommandClassOtherKey,
+                                session->statistics.latency[kiSCSIHBACommandClassOther]);
+        dict->setObject(kiSCSIStatisticsLatencyHistogramsKey,histogramsDict);
+        histogramsDict->release();
+    }
+    
+    for(ConnectionIdentifier connectionId = 0; connectionId < kMaxConnectionsPerSession; connectionId++)
+    {
+        iSCSIConnection * connection = session->connections[connectionId];
+        OSDictionary * connectionDict;
+        
+        if(!connection || !(connectionDict = OSDictionary::withCapacity(13)))
+            continue;
+        
+        iSCSIConnectionStatistics * stats = &connection->statistics;
+        
+        SetStatisticsNumber(connectionDict,kiSCSIStatisticsConnectionIdKey,connection->cid);
+        SetStatisticsNumber(connectionDict,kiSCSIStatisticsTxPDUsKey,stats->txPDUs);
+        SetStatisticsNumber(connectionDict,kiSCSIStatisticsRxPDUsKey,stats->rxPDUs);
+        SetStatisticsNumber(connectionDict,kiSCSIStatisticsTxBytesKey,stats->txBytes);
+        SetStatisticsNumber(connectionDict,kiSCSIStatisticsRxBytesKey,stats->rxBytes);
+        SetStatisticsNumber(connectionDict,kiSCSIStatisticsTxDataOutPDUsKey,stats->txDataOutPDUs);
+        SetStatisticsNumber(connectionDict,kiSCSIStatisticsRxDataInPDUsKey,stats->rxDataInPDUs);
+        SetStatisticsNumber(connectionDict,kiSCSIStatisticsRxR2TPDUsKey,stats->rxR2TPDUs);
+        SetStatisticsNumber(connectionDict,kiSCSIStatisticsHeaderDigestErrorsKey,stats->headerDigestErrors);
+        SetStatisticsNumber(connectionDict,kiSCSIStatisticsDataDigestErrorsKey,stats->dataDigestErrors);
+        SetStatisticsNumber(connectionDict,kiSCSIStatisticsBytesPerSecondKey,connection->bytesPerSecond);
+        SetStatisticsNumber(connectionDict,kiSCSIStatisticsLatencyKey,connection->latency_ms);
+        SetStatisticsHistograms(connectionDict,kiSCSIStatisticsLatencyHistogramsKey,stats->latency);
+        
+        connections->setObject(connectionDict);
+        connectionDict->release();
+    }
+    
+    // Only report LUNs that have seen traffic
+    for(UInt8 LUN = 0; LUN < session->statistics.kLUNStatisticsCount; LUN++)
+    {
+        iSCSILUNStatistics * stats = &session->statistics.LUNs[LUN];
+        OSDictionary * LUNDict;
+        
+        if(stats->commands == 0 || !(LUNDict = OSDictionary::withCapacity(6)))
+            continue;
+        
+        SetStatisticsNumber(LUNDict,kiSCSIStatisticsLUNKey,LUN);
+        SetStatisticsNumber(LUNDict,kiSCSIStatisticsLUNCommandsKey,stats->commands);
+        SetStatisticsNumber(LUNDict,kiSCSIStatisticsLUNBytesReadKey,stats->bytesRead);
+        SetStatisticsNumber(LUNDict,kiSCSIStatisticsLUNBytesWrittenKey,stats->bytesWritten);
+        SetStatisticsNumber(LUNDict,kiSCSIStatisticsLUNErrorsKey,stats->errors);
+        SetStatisticsHistogram(LUNDict,kiSCSIStatisticsLatencyHistogramsKey,&stats->latency);
+        
+        LUNs->setObject(LUNDict);
+        LUNDict->release();
+    }
+    
+    dict->setObject(kiSCSIStatisticsConnectionsKey,connections);
+    dict->setObject(kiSCSIStatisticsLUNsKey,LUNs);
+    connections->release();
+    LUNs->release();
+    
+    return dict;
+    
+STATISTICS_ALLOC_FAILURE:
+    if(dict)
+        dict->release();
+    if(connections)
+        connections->release();
+    if(LUNs)
+        LUNs->release();
+    
+    return NULL;
+}
+
+void iSCSIVirtualHBA::PublishTargetList()
+{
+    // Publish a snapshot so that the registry never serializes the lookup
+    // table while it is being modified
+    OSDictionary * targets = OSDictionary::withDictionary(targetList);
+    
+    if(!targets)
+        return;
+    
+    setProperty(kiSCSITargetIdentifiersKey,targets);
+    targets->release();
+}
+
+void iSCSIVirtualHBA::PublishStatistics(OSObject * owner,IOTimerEventSource * sender)
+{
+    iSCSIVirtualHBA * hba = OSDynamicCast(iSCSIVirtualHBA,owner);
+    
+    if(!hba)
+        return;
+    
+    // Retry a notification signal that the daemon did not receive, so that
+    // queued notifications are not left waiting for the next notification
+    iSCSIHBAUserClient * client = (iSCSIHBAUserClient*)hba->getClient();
+    
+    if(client)
+        client->flushNotifications();
+    
+    for(SessionIdentifier sessionId = 0; sessionId < kMaxSessions; sessionId++)
+    {
+        iSCSISession * session = hba->sessionList[sessionId];
+        IOService * device;
+        
+        // Statistics are attached to the target device, which only exists
+        // once the session has been activated
+        if(!session || !(device = (IOService*)hba->GetTargetForID(sessionId)))
+            continue;
+        
+        OSDictionary * dict = hba->CreateStatisticsForSession(session);
+        
+        if(dict) {
+            device->setProperty(kiSCSIStatisticsKey,dict);
+            dict->release();
+        }
+    }
+    
+    sender->setTimeoutMS(kiSCSIStatisticsPublishIntervalMs);
+}
+
+/*! Clears a counter that may be updated concurrently using atomic operations.
+ *  The value that was read is subtracted rather than storing zero, so that
+ *  an update racing the reset is not lost.
+ *  @param counter the counter to clear. */
+static void ResetCounter(UInt64 * counter)
+{
+    OSAddAtomic64(-(SInt64)*counter,(SInt64*)counter);
+}
+
+/*! Clears a histogram that may be updated concurrently (see RecordLatency).
+ *  @param histogram the histogram to clear. */
+static void ResetHistogram(iSCSIHBALatencyHistogram * histogram)
+{
+    ResetCounter(&histogram->count);
+    ResetCounter(&histogram->sumUSec);
+    OSCompareAndSwap64(histogram->maxUSec,0,&histogram->maxUSec);
+    
+    for(UInt32 bucket = 0; bucket < kiSCSIHBALatencyHistogramBucketCount; bucket++)
+        OSAddAtomic(-(SInt32)histogram->buckets[bucket],(SInt32*)&histogram->buckets[bucket]);
+}
+
+void iSCSIVirtualHBA::ResetStatistics(iSCSISession * session)
+{
+    // Outstanding tasks are a gauge rather than a counter and are left as-is
+    iSCSISessionStatistics * stats = &session->statistics;
+    
+    ResetCounter(&stats->commandsIssued);
+    ResetCounter(&stats->commandsCompleted);
+    ResetCounter(&stats->taskTimeouts);
+    ResetCounter(&stats->connectionTimeouts);
+    
+    for(UInt8 LUN = 0; LUN < stats->kLUNStatisticsCount; LUN++)
+    {
+        ResetCounter(&stats->LUNs[LUN].commands);
+        ResetCounter(&stats->LUNs[LUN].bytesRead);
+        ResetCounter(&stats->LUNs[LUN].bytesWritten);
+        ResetCounter(&stats->LUNs[LUN].errors);
+        ResetHistogram(&stats->LUNs[LUN].latency);
+    }
+    
+    for(UInt32 commandClass = 0; commandClass < kiSCSIHBACommandClassCount; commandClass++)
+        for(UInt32 type = 0; type < kiSCSIHBALatencyTypeCount; type++)
+            ResetHistogram(&stats->latency[commandClass][type]);
+    
+    for(ConnectionIdentifier connectionId = 0; connectionId < kMaxConnectionsPerSession; connectionId++)
+    {
+        iSCSIConnection * connection = session->connections[connectionId];
+        
+        if(!connection)
+            continue;
+        
+        iSCSIConnectionStatistics * connStats = &connection->statistics;
+        
+        ResetCounter(&connStats->txPDUs);
+        ResetCounter(&connStats->rxPDUs);
+        ResetCounter(&connStats->txBytes);
+        ResetCounter(&connStats->rxBytes);
+        ResetCounter(&connStats->txDataOutPDUs);
+        ResetCounter(&connStats->rxDataInPDUs);
+        ResetCounter(&connStats->rxR2TPDUs);
+        ResetCounter(&connStats->headerDigestErrors);
+        ResetCounter(&connStats->dataDigestErrors);
+        
+        for(UInt32 type = 0; type < kiSCSIHBALatencyTypeCount; type++)
+            ResetHistogram(&connStats->latency[type]);
+    }
+}
+
+IOReturn iSCSIVirtualHBA::ResetStatisticsAction(OSObject * owner,
+                                                void * arg0,
+                                                void * arg1,
+                                                void * arg2,
+                                                void * arg3)
+{
+    iSCSIVirtualHBA * hba = OSDynamicCast(iSCSIVirtualHBA,owner);
+    SessionIdentifier targetSessionId = (SessionIdentifier)(uintptr_t)arg0;
+    
+    if(!hba)
+        return kIOReturnBadArgument;
+    
+    // Sessions are unpublished with the work loop gate held, so any session
+    // found here remains valid until this action returns
+    for(SessionIdentifier sessionId = 0; sessionId < kMaxSessions; sessionId++)
+    {
+        iSCSISession * session = hba->sessionList[sessionId];
+        
+        if(!session || (targetSessionId != kiSCSIInvalidSessionId && sessionId != targetSessionId))
+            continue;
+        
+        hba->ResetStatistics(session);
+    }
+    
+    return kIOReturnSuccess;
+}
+
+IOReturn iSCSIVirtualHBA::setProperties(OSObject * properties)
+{
+    OSDictionary * dict = OSDynamicCast(OSDictionary,properties);
+    OSObject * value;
+    
+    if(!dict || !(value = dict->getObject(kiSCSIResetStatisticsKey)))
+        return super::setProperties(properties);
+    
+    // Only administrators may reset statistics
+    if(IOUserClient::clientHasPrivilege(current_task(),kIOClientPrivilegeAdministrator) != kIOReturnSuccess)
+        return kIOReturnNotPrivileged;
+    
+    OSString * targetIQN = OSDynamicCast(OSString,value);
+    
+    if(!targetIQN && value != kOSBooleanTrue)
+        return kIOReturnBadArgument;
+    
+    // Resetting a single target requires looking up its session identifier
+    SessionIdentifier targetSessionId = kiSCSIInvalidSessionId;
+    
+    if(targetIQN) {
+        OSNumber * sessionIdNumber = OSDynamicCast(OSNumber,targetList->getObject(targetIQN));
+        
+        if(!sessionIdNumber)
+            return kIOReturnNotFound;
+        
+        targetSessionId = sessionIdNumber->unsigned16BitValue();
+    }
+    
+    // Serialize with task completion and session teardown
+    return GetCommandGate()->runAction(&ResetStatisticsAction,
+                                       (void*)(uintptr_t)targetSessionId);
+}
+
 
 //////////////////////////////// iSCSI FUNCTIONS ///////////////////////////////
 
@@ -1353,10 +2006,15 @@ errno_t iSCSIVirtualHBA::CreateSession(OSString * targetIQN,
     newSession->sessionId = sessionIdx;
     newSession->numActiveConnections = 0;
     newSession->active = false;
+    newSession->retainTarget = false;
+    newSession->heldTasks = NULL;
+    newSession->lastHeldTask = NULL;
     newSession->cmdSN = 0;
     newSession->expCmdSN = 0;
     newSession->maxCmdSN = 0;
     
+    memset(&newSession->statistics,0,sizeof(iSCSISessionStatistics));
+    
     newSession->targetPortalGroupTag = 0;
     newSession->targetSessionId = 0;
     
@@ -1378,6 +2036,7 @@ errno_t iSCSIVirtualHBA::CreateSession(OSString * targetIQN,
 
     // Add target to lookup table...
     targetList->setObject(targetIQN->getCStringNoCopy(),OSNumber::withNumber(sessionIdx,sizeof(sessionIdx)*8));
+    PublishTargetList();
 
     // Create a connection associated with this session
     if((error = CreateConnection(*sessionId,portalAddress,portalPort,hostInterface,
@@ -1391,6 +2050,7 @@ SESSION_CREATE_CONNECTION_FAILURE:
 
     // Remove target from lookup table
     targetList->removeObject(targetIQN);
+    PublishTargetList();
     IOFree(newSession->connections,kMaxConnectionsPerSession*sizeof(iSCSIConnection*));
     sessionList[sessionIdx] = nullptr;
     *sessionId = kiSCSIInvalidSessionId;
@@ -1443,8 +2103,18 @@ void iSCSIVirtualHBA::ReleaseSession(SessionIdentifier sessionId)
             ReleaseConnection(sessionId,connectionId);
     }
     
-    // Prevent others from accessing the session
+    // Fail the tasks held for a target that was retained without connections
+    ReleaseHeldParallelTasks(theSession,false);
+    
+    // Un-mount a target that was retained without connections
+    if(GetTargetForID(sessionId))
+        DestroyTargetForID(sessionId);
+    
+    // Prevent others from accessing the session; statistics are reset on
+    // the work loop, so the session is unpublished with its gate held
+    GetWorkLoop()->closeGate();
     sessionList[sessionId] = NULL;
+    GetWorkLoop()->openGate();
     
     // Free connection list and session object
     IOFree(theSession->connections,kMaxConnectionsPerSession*sizeof(iSCSIConnection*));
@@ -1463,6 +2133,9 @@ void iSCSIVirtualHBA::ReleaseSession(SessionIdentifier sessionId)
             break;
         }
     }
+    iter->release();
+    
+    PublishTargetList();
 }
 
 /*! Allocates a new iSCSI connection associated with the particular session.
@@ -1511,6 +2184,8 @@ errno_t iSCSIVirtualHBA::CreateConnection(SessionIdentifier sessionId,
     newConn->bytesPerSecond = 0;
     newConn->cid = index;
     
+    memset(&newConn->statistics,0,sizeof(iSCSIConnectionStatistics));
+    
     newConn->maxRecvDataSegmentLength = kRFC3720_MaxRecvDataSegmentLength;
     newConn->maxSendDataSegmentLength = kRFC3720_MaxRecvDataSegmentLength;
     newConn->useDataDigest = kRFC3720_DataDigest;
@@ -1520,6 +2195,16 @@ errno_t iSCSIVirtualHBA::CreateConnection(SessionIdentifier sessionId,
     newConn->OFMarkInt = kRFC3720_OFMarkInt;
     newConn->IFMarkInt = kRFC3720_IFMarkInt;
     
+    // Login is performed without digests; the transport is selected again
+    // when the connection is activated using the negotiated parameters
+    SelectPDUTransport(newConn);
+    
+    // Allocate PDU trace ring (tracing is simply disabled if this fails)
+    newConn->traceHead = 0;
+    newConn->traceRecords = (iSCSIHBAPDUTraceRecord*)IOMalloc(sizeof(iSCSIHBAPDUTraceRecord)*kiSCSIHBAPDUTraceRecordCount);
+    if(newConn->traceRecords)
+        memset(newConn->traceRecords,0,sizeof(iSCSIHBAPDUTraceRecord)*kiSCSIHBAPDUTraceRecordCount);
+    
     session->connections[index] = newConn;
     *connectionId = index;
     
@@ -1617,6 +2302,9 @@ TASKQUEUE_INIT_FAILURE:
 TASKQUEUE_ALLOC_FAILURE:
 
     session->connections[index] = 0;
+    
+    if(newConn->traceRecords)
+        IOFree(newConn->traceRecords,sizeof(iSCSIHBAPDUTraceRecord)*kiSCSIHBAPDUTraceRecordCount);
     IOFree(newConn,sizeof(iSCSIConnection));
     
     return error;
@@ -1660,6 +2348,9 @@ void iSCSIVirtualHBA::ReleaseConnection(SessionIdentifier sessionId,
     connection->taskQueue->release();
     connection->dataToTransfer = 0;
     
+    if(connection->traceRecords)
+        IOFree(connection->traceRecords,sizeof(iSCSIHBAPDUTraceRecord)*kiSCSIHBAPDUTraceRecordCount);
+    
     IOFree(connection,sizeof(iSCSIConnection));
     
     DBLog("iscsi: Released connection (sid: %d, cid: %d)\n",sessionId,connectionId);
@@ -1692,11 +2383,15 @@ errno_t iSCSIVirtualHBA::ActivateConnection(SessionIdentifier sessionId,Connecti
     connection->immediateDataLength = min(connection->maxSendDataSegmentLength,
                                           session->firstBurstLength);
     
+    // Use send and receive routines specialized for the negotiated digests
+    SelectPDUTransport(connection);
+    
     connection->taskQueue->enable();
     connection->dataRecvEventSource->enable();
     
-    // If this is the first active connection, mount the target
-    if(session->numActiveConnections == 0) {
+    // If this is the first active connection, mount the target (unless it
+    // was retained while the session had no connections)
+    if(session->numActiveConnections == 0 && !GetTargetForID(sessionId)) {
         if(!CreateTargetForID(sessionId))
         {
             connection->taskQueue->disable();
@@ -1706,6 +2401,9 @@ errno_t iSCSIVirtualHBA::ActivateConnection(SessionIdentifier sessionId,Connecti
     }
 
     OSIncrementAtomic(&session->numActiveConnections);
+    
+    // Resubmit the tasks that arrived while the session had no connections
+    ReleaseHeldParallelTasks(session,true);
 
     return 0;
 }
@@ -1783,7 +2481,7 @@ errno_t iSCSIVirtualHBA::DeactivateConnection(SessionIdentifier sessionId,Connec
     OSDecrementAtomic(&session->numActiveConnections);
     
     // If this is the last active connection, un-mount the target
-    if(session->numActiveConnections == 0)
+    if(session->numActiveConnections == 0 && !session->retainTarget)
         DestroyTargetForID(sessionId);
     
     DBLog("iscsi: Deactivated connection (sid: %d, cid: %d)\n",sessionId,connectionId);
@@ -1845,6 +2543,27 @@ errno_t iSCSIVirtualHBA::SendPDU(iSCSISession * session,
     if(!session || !connection || !bhs)
         return EINVAL;
     
+    return (this->*connection->transport->sendPDU)(session,connection,bhs,ahs,data,length);
+}
+
+/*! Sends a PDU using a fixed digest configuration (see SendPDU()).  Digest
+ *  checks are resolved at compile time so that each variant only builds the
+ *  I/O vectors it needs.
+ *  @param session the session associated with the PDU.
+ *  @param connection the connection used to send the PDU.
+ *  @param bhs the basic header segment to send.
+ *  @param ahs the additional header segments, if any
+ *  @param data the data segment to send.
+ *  @param length the byte size of the data segment
+ *  @return error code indicating result of operation. */
+template<bool kHeaderDigest,bool kDataDigest>
+errno_t iSCSIVirtualHBA::SendPDUWithDigests(iSCSISession * session,
+                                            iSCSIConnection * connection,
+                                            iSCSIPDUInitiatorBHS * bhs,
+                                            iSCSIPDUCommonAHS * ahs,
+                                            const void * data,
+                                            size_t length)
+{
     // Set the command sequence number & expected status sequence number
     if(bhs->opCodeAndDeliveryMarker != kiSCSIPDUOpCodeDataOut) {
         bhs->cmdSN = OSSwapHostToBigInt32(session->cmdSN);
@@ -1859,10 +2578,13 @@ errno_t iSCSIVirtualHBA::SendPDU(iSCSISession * session,
     SetDataSegmentLength((iSCSIPDUInitiatorBHS*)bhs,(UInt32)length);
 
     // Send data over the network, return true if all bytes were sent
+    // BHS, header digest, data, padding and data digest
     struct msghdr msg;
-    struct iovec  iovec[5];
+    struct iovec  iovec[3 + kHeaderDigest + kDataDigest];
     memset(&msg,0,sizeof(struct msghdr));
     
+    UInt32 headerDigest = 0, dataDigest = 0, padding = 0;
+    
     msg.msg_iov = iovec;
     unsigned int iovecCnt = 0;
     
@@ -1875,9 +2597,7 @@ errno_t iSCSIVirtualHBA::SendPDU(iSCSISession * session,
           bhs->opCodeAndDeliveryMarker,session->sessionId,connection->cid);
     
     // Leave room for a header digest
-    if(connection->useHeaderDigest)    {
-        UInt32 headerDigest;
-        
+    if(kHeaderDigest) {
         // Compute digest
         headerDigest = crc32c(0,bhs,kiSCSIPDUBasicHeaderSegmentSize);
         DBLog("iscsi: Header digest: %#x\n",headerDigest);
@@ -1888,8 +2608,6 @@ errno_t iSCSIVirtualHBA::SendPDU(iSCSISession * session,
     }
     
     // If theres data to send...
-    UInt32 padding = 0;
-    
     if(data && length)
     {
         // Add data segment
@@ -1909,9 +2627,7 @@ errno_t iSCSIVirtualHBA::SendPDU(iSCSISession * session,
         DBLog("iscsi: Sending data length: %zu\n",length);
 
         // Leave room for a data digest
-        if(connection->useDataDigest) {
-            UInt32 dataDigest;
-            
+        if(kDataDigest) {
             // Compute digest
             dataDigest = crc32c(0,data,length);
             
@@ -1923,6 +2639,8 @@ errno_t iSCSIVirtualHBA::SendPDU(iSCSISession * session,
         }
     }
     
+    TracePDU(connection,kiSCSIHBAPDUTraceSend,bhs);
+    
     // Update io vector count, send data
     msg.msg_iovlen = iovecCnt;
     size_t bytesSent = 0;
@@ -1935,6 +2653,12 @@ errno_t iSCSIVirtualHBA::SendPDU(iSCSISession * session,
         return error;
     }
     
+    OSIncrementAtomic64((SInt64*)&connection->statistics.txPDUs);
+    OSAddAtomic64(bytesSent,(SInt64*)&connection->statistics.txBytes);
+    
+    if(bhs->opCodeAndDeliveryMarker == kiSCSIPDUOpCodeDataOut)
+        OSIncrementAtomic64((SInt64*)&connection->statistics.txDataOutPDUs);
+    
     return error;
 }
 
@@ -1953,6 +2677,24 @@ bool iSCSIVirtualHBA::isPDUAvailable(iSCSIConnection * connection)
 }
 
 
+/*! Advances a session sequence number (MaxCmdSN or ExpCmdSN) to a value
+ *  reported by the target.  The number only moves forward, as determined
+ *  by serial number arithmetic (RFC 1982) so that wrap-around is handled,
+ *  and is updated atomically since each connection receives on its own.
+ *  @param sequenceNumber the sequence number to advance.
+ *  @param value the value reported by the target. */
+static void AdvanceSequenceNumber(UInt32 * sequenceNumber,UInt32 value)
+{
+    UInt32 current;
+    
+    do {
+        current = *(volatile UInt32 *)sequenceNumber;
+        
+        if((SInt32)(value - current) <= 0)
+            return;
+    } while(!OSCompareAndSwap(current,value,sequenceNumber));
+}
+
 /*! Receives a basic header segment over a kernel socket.
  *  @param sessionId the qualifier part of the ISID (see RFC3720).
  *  @param connectionId the connection associated with the session.
@@ -1968,9 +2710,25 @@ errno_t iSCSIVirtualHBA::RecvPDUHeader(iSCSISession * session,
     if(!session || !connection || !bhs)
         return EINVAL;
     
+    return (this->*connection->transport->recvPDUHeader)(session,connection,bhs,flags);
+}
+
+/*! Receives a basic header segment using a fixed header digest
+ *  configuration (see RecvPDUHeader()).
+ *  @param session the session associated with the PDU.
+ *  @param connection the connection used to receive the PDU.
+ *  @param bhs the basic header segment received.
+ *  @param flags optional flags to be passed onto sock_recv.
+ *  @return error code indicating result of operation. */
+template<bool kHeaderDigest>
+errno_t iSCSIVirtualHBA::RecvPDUHeaderWithDigest(iSCSISession * session,
+                                                 iSCSIConnection * connection,
+                                                 iSCSIPDUTargetBHS * bhs,
+                                                 int flags)
+{
     // Receive data over the network
     struct msghdr msg;
-    struct iovec  iovec[2];
+    struct iovec  iovec[1 + kHeaderDigest];
     memset(&msg,0,sizeof(struct msghdr));
     
     msg.msg_iov = iovec;
@@ -1984,7 +2742,7 @@ errno_t iSCSIVirtualHBA::RecvPDUHeader(iSCSISession * session,
     UInt32 headerDigest = 0;
     
     // Retrieve header digest, if one exists
-    if(connection->useHeaderDigest)
+    if(kHeaderDigest)
     {
         iovec[iovecCnt].iov_base = &headerDigest;
         iovec[iovecCnt].iov_len  = sizeof(headerDigest);
@@ -2020,12 +2778,13 @@ errno_t iSCSIVirtualHBA::RecvPDUHeader(iSCSISession * session,
     }
     
     // Verify digest if present
-    if(headerDigest)
+    if(kHeaderDigest)
     {
         // Compute digest (should be 0 since we start with the digest)
         if(headerDigest != crc32c(0,bhs,kiSCSIPDUBasicHeaderSegmentSize))
         {
             DBLog("iscsi: Failed header digest (sid: %d, cid: %d)\n",session->sessionId,connection->cid);
+            OSIncrementAtomic64((SInt64*)&connection->statistics.headerDigestErrors);
             
 // TODO: handle error
             
@@ -2033,6 +2792,16 @@ errno_t iSCSIVirtualHBA::RecvPDUHeader(iSCSISession * session,
         }
     }
     
+    TracePDU(connection,kiSCSIHBAPDUTraceRecv,bhs);
+    
+    OSIncrementAtomic64((SInt64*)&connection->statistics.rxPDUs);
+    OSAddAtomic64(bytesRecv,(SInt64*)&connection->statistics.rxBytes);
+    
+    if(bhs->opCode == kiSCSIPDUOpCodeDataIn)
+        OSIncrementAtomic64((SInt64*)&connection->statistics.rxDataInPDUs);
+    else if(bhs->opCode == kiSCSIPDUOpCodeR2T)
+        OSIncrementAtomic64((SInt64*)&connection->statistics.rxR2TPDUs);
+    
     // Update command sequence numbers only if the PDU was not a data PDU
     // (unless the data PDU contains a SCSI service response)
 
@@ -2047,10 +2816,9 @@ errno_t iSCSIVirtualHBA::RecvPDUHeader(iSCSISession * session,
     bhs->expCmdSN = OSSwapBigToHostInt32(bhs->expCmdSN);
     bhs->statSN = OSSwapBigToHostInt32(bhs->statSN);
     
-    if(bhs->maxCmdSN > session->maxCmdSN)
-        OSWriteLittleInt32(&session->maxCmdSN,0,bhs->maxCmdSN);
-    if(bhs->expCmdSN > session->expCmdSN)
-        OSWriteLittleInt32(&session->expCmdSN,0,bhs->expCmdSN);
+    // Sibling connections receive concurrently, so only move these forward
+    AdvanceSequenceNumber(&session->maxCmdSN,bhs->maxCmdSN);
+    AdvanceSequenceNumber(&session->expCmdSN,bhs->expCmdSN);
     
     if(bhs->opCode != kiSCSIPDUOpCodeR2T && bhs->statSN != 0xffffffff && bhs->initiatorTaskTag != 0xffffffff)
         OSIncrementAtomic(&connection->expStatSN);
@@ -2077,9 +2845,27 @@ errno_t iSCSIVirtualHBA::RecvPDUData(iSCSISession * session,
     if(!session || !connection || !data)
         return EINVAL;
     
+    return (this->*connection->transport->recvPDUData)(session,connection,data,length,flags);
+}
+
+/*! Receives a data segment using a fixed data digest configuration (see
+ *  RecvPDUData()).
+ *  @param session the session associated with the PDU.
+ *  @param connection the connection used to receive the PDU.
+ *  @param data the data received.
+ *  @param length the length of the data buffer.
+ *  @param flags optional flags to be passed onto sock_recv.
+ *  @return error code indicating result of operation. */
+template<bool kDataDigest>
+errno_t iSCSIVirtualHBA::RecvPDUDataWithDigest(iSCSISession * session,
+                                               iSCSIConnection * connection,
+                                               void * data,
+                                               size_t length,
+                                               int flags)
+{
     // Setup message with required iovec
     struct msghdr msg;
-    struct iovec  iovec[4];
+    struct iovec  iovec[2 + kDataDigest];
     memset(&msg,0,sizeof(struct msghdr));
     msg.msg_iov = iovec;
     unsigned int iovecCnt = 0;
@@ -2102,7 +2888,7 @@ errno_t iSCSIVirtualHBA::RecvPDUData(iSCSISession * session,
     UInt32 dataDigest = 0;
     
     // Retrieve data digest, if one exists
-    if(connection->useDataDigest)
+    if(kDataDigest)
     {
         iovec[iovecCnt].iov_base = &dataDigest;
         iovec[iovecCnt].iov_len  = sizeof(dataDigest);
@@ -2127,7 +2913,7 @@ errno_t iSCSIVirtualHBA::RecvPDUData(iSCSISession * session,
     }
     
     // Verify digest if present
-    if(connection->useDataDigest)
+    if(kDataDigest)
     {
         // Compute digest including padding...
         UInt32 calcDigest = crc32c(0,data,length);
@@ -2135,12 +2921,53 @@ errno_t iSCSIVirtualHBA::RecvPDUData(iSCSISession * session,
         if(dataDigest != calcDigest)
         {
             DBLog("iscsi: Failed data digest (sid: %d, cid: %d)\n",session->sessionId,connection->cid);
+            OSIncrementAtomic64((SInt64*)&connection->statistics.dataDigestErrors);
             
 // TODO: handle error
             
             return EIO;
         }
     }
+    
+    OSAddAtomic64(bytesRecv,(SInt64*)&connection->statistics.rxBytes);
 
     return error;
 }
+
+/*! Send and receive routines for each digest configuration, indexed by
+ *  kPDUTransportHeaderDigest and kPDUTransportDataDigest. */
+const iSCSIPDUTransport iSCSIVirtualHBA::PDUTransports[kPDUTransportCount] = {
+    {
+        &iSCSIVirtualHBA::SendPDUWithDigests<false,false>,
+        &iSCSIVirtualHBA::RecvPDUHeaderWithDigest<false>,
+        &iSCSIVirtualHBA::RecvPDUDataWithDigest<false>
+    },
+    {
+        &iSCSIVirtualHBA::SendPDUWithDigests<true,false>,
+        &iSCSIVirtualHBA::RecvPDUHeaderWithDigest<true>,
+        &iSCSIVirtualHBA::RecvPDUDataWithDigest<false>
+    },
+    {
+        &iSCSIVirtualHBA::SendPDUWithDigests<false,true>,
+        &iSCSIVirtualHBA::RecvPDUHeaderWithDigest<false>,
+        &iSCSIVirtualHBA::RecvPDUDataWithDigest<true>
+    },
+    {
+        &iSCSIVirtualHBA::SendPDUWithDigests<true,true>,
+        &iSCSIVirtualHBA::RecvPDUHeaderWithDigest<true>,
+        &iSCSIVirtualHBA::RecvPDUDataWithDigest<true>
+    }
+};
+
+void iSCSIVirtualHBA::SelectPDUTransport(iSCSIConnection * connection)
+{
+    UInt32 index = 0;
+    
+    if(connection->useHeaderDigest)
+        index |= kPDUTransportHeaderDigest;
+    
+    if(connection->useDataDigest)
+        index |= kPDUTransportDataDigest;
+    
+    connection->transport = &PDUTransports[index];
+}
@@ -36,6 +36,7 @@
 
 // Libkern includes
 #include <libkern/c++/OSArray.h>
+#include <IOKit/IOTimerEventSource.h>
 
 // iSCSI includes
 #include "iSCSIKernelClasses.h"
@@ -73,6 +74,12 @@ public:
 	 *	@return highest addressable LUN. */
 	virtual SCSILogicalUnitNumber ReportHBAHighestLogicalUnitNumber();
 	
+	/*! Handles properties set from user-space.  This is used to reset
+	 *  statistics (see kiSCSIResetStatisticsKey).
+	 *  @param properties a dictionary of properties to set.
+	 *  @return an IOKit return code indicating the result of the operation. */
+	virtual IOReturn setProperties(OSObject * properties);
+	
 	/*! Gets whether HBA supports a particular SCSI feature.
 	 *	@param theFeature the SCSI feature to check.
 	 *	@return true if the specified feature is supported. */
@@ -157,6 +164,26 @@ public:
      *  @return a response that indicates the processing status of the task. */
 	virtual SCSIServiceResponse ProcessParallelTask(SCSIParallelTaskIdentifier parallelTask);
     
+    /*! Holds a task if the session retains its target but has no active
+     *  connections (e.g., while the session reconnects after sleep).
+     *  @param session the session the task was submitted to.
+     *  @param parallelTask the task to hold.
+     *  @return true if the task was held. */
+    bool HoldParallelTask(iSCSISession * session,SCSIParallelTaskIdentifier parallelTask);
+    
+    /*! Removes a task from the tasks held by a session (e.g., if it timed out).
+     *  @param session the session the task was submitted to.
+     *  @param parallelTask the task to remove.
+     *  @return true if the task was held by the session. */
+    bool RemoveHeldParallelTask(iSCSISession * session,SCSIParallelTaskIdentifier parallelTask);
+    
+    /*! Resubmits the tasks held by a session once it has an active
+     *  connection, or fails them if the session is being released.
+     *  @param session the session that holds the tasks.
+     *  @param resubmit true to resubmit the tasks, false to fail them (the
+     *  session then no longer holds tasks). */
+    void ReleaseHeldParallelTasks(iSCSISession * session,bool resubmit);
+    
     /*! Processes a task immediately. This function may be called from
      *  ProcessParallelTask() to process a task right away or might be called
      *  by our software interrupt source (iSCSIIOEventSource) to process the
@@ -326,6 +353,53 @@ public:
     
 private:
     
+    /*! Flags used to index the table of PDU transports. */
+    enum PDUTransportFlags {
+        
+        /*! The transport computes and verifies header digests. */
+        kPDUTransportHeaderDigest = 0x01,
+        
+        /*! The transport computes and verifies data digests. */
+        kPDUTransportDataDigest = 0x02,
+        
+        /*! Number of entries in the table of PDU transports. */
+        kPDUTransportCount = 0x04
+    };
+    
+    /*! Send and receive routines for each digest configuration. */
+    static const iSCSIPDUTransport PDUTransports[kPDUTransportCount];
+    
+    /*! Selects the send and receive routines of a connection based on its
+     *  header and data digest settings.
+     *  @param connection the connection to update. */
+    void SelectPDUTransport(iSCSIConnection * connection);
+    
+    /*! Sends a PDU using a fixed digest configuration (see SendPDU()). */
+    template<bool kHeaderDigest,bool kDataDigest>
+    errno_t SendPDUWithDigests(iSCSISession * session,
+                               iSCSIConnection * connection,
+                               iSCSIPDUInitiatorBHS * bhs,
+                               iSCSIPDU::iSCSIPDUCommonAHS * ahs,
+                               const void * data,
+                               size_t length);
+    
+    /*! Receives a basic header segment using a fixed header digest
+     *  configuration (see RecvPDUHeader()). */
+    template<bool kHeaderDigest>
+    errno_t RecvPDUHeaderWithDigest(iSCSISession * session,
+                                    iSCSIConnection * connection,
+                                    iSCSIPDUTargetBHS * bhs,
+                                    int flags);
+    
+    /*! Receives a data segment using a fixed data digest configuration
+     *  (see RecvPDUData()). */
+    template<bool kDataDigest>
+    errno_t RecvPDUDataWithDigest(iSCSISession * session,
+                                  iSCSIConnection * connection,
+                                  void * data,
+                                  size_t length,
+                                  int flags);
+    
     /*! Process an incoming task management response PDU.
      *  @param session the session associated with the task mgmt response.
      *  @param connection the connection associated with the task mgmt response.
@@ -406,6 +480,62 @@ private:
     void MeasureConnectionLatency(iSCSISession * session,
                                   iSCSIConnection * connection);
     
+    /*! Appends a record describing a PDU to the trace ring buffer of a
+     *  connection.  This function never blocks or allocates; if tracing is
+     *  unavailable for the connection the call has no effect.
+     *  @param connection the connection the PDU was sent or received on.
+     *  @param eventType the trace event (see iSCSIHBAPDUTraceEvents).
+     *  @param bhs the basic header segment of the PDU (in network byte order). */
+    void TracePDU(iSCSIConnection * connection,
+                  UInt8 eventType,
+                  const void * bhs);
+    
+    /*! Appends a task completion record to the trace ring buffer of a
+     *  connection.
+     *  @param connection the connection associated with the task.
+     *  @param initiatorTaskTag the initiator task tag of the completed task.
+     *  @param bytesTransferred the number of bytes transferred by the task.
+     *  @param latencyUSec the duration of the task in microseconds. */
+    void TraceTaskCompletion(iSCSIConnection * connection,
+                             UInt32 initiatorTaskTag,
+                             UInt32 bytesTransferred,
+                             UInt32 latencyUSec);
+    
+    /*! Publishes the lookup table that maps target names to target
+     *  identifiers to the IORegistry (see kiSCSITargetIdentifiersKey).
+     *  Invoked whenever the lookup table changes. */
+    void PublishTargetList();
+    
+    /*! Publishes the performance counters of every active session to the
+     *  IORegistry, as a dictionary property of the session's target device.
+     *  Invoked periodically on the work loop by the statistics timer, which
+     *  also retries notification signals the daemon did not receive.
+     *  @param owner the virtual HBA.
+     *  @param sender the timer event source that fired. */
+    static void PublishStatistics(OSObject * owner,IOTimerEventSource * sender);
+    
+    /*! Creates a dictionary containing the performance counters of a session.
+     *  @param session the session.
+     *  @return a dictionary of counters that the caller must release. */
+    OSDictionary * CreateStatisticsForSession(iSCSISession * session);
+    
+    /*! Resets the performance counters and latency histograms of a session
+     *  and its connections.
+     *  @param session the session. */
+    void ResetStatistics(iSCSISession * session);
+    
+    /*! Resets the statistics of one or all sessions.  Invoked on the work
+     *  loop through the command gate.
+     *  @param owner the virtual HBA.
+     *  @param arg0 the session identifier of the session to reset, or
+     *  kiSCSIInvalidSessionId to reset every session.
+     *  @return an IOKit return code indicating the result of the operation. */
+    static IOReturn ResetStatisticsAction(OSObject * owner,
+                                          void * arg0,
+                                          void * arg1,
+                                          void * arg2,
+                                          void * arg3);
+    
     
 	
     /*! Maximum allowable sessions. */
@@ -501,9 +631,40 @@ private:
     /*! Lookup table mapping target names (IQN names) to session identifiers. */
     OSDictionary * targetList;
     
+    /*! Timer used to periodically publish statistics to the IORegistry. */
+    IOTimerEventSource * statisticsTimer;
+    
     friend class iSCSITaskQueue;
 };
 
+/*! Send and receive routines specialized for a particular combination of
+ *  header and data digests.  Each connection points to the entry matching
+ *  its negotiated parameters so that digest settings aren't tested for
+ *  every PDU. */
+struct iSCSIPDUTransport {
+    
+    /*! Sends a PDU (see iSCSIVirtualHBA::SendPDU()). */
+    errno_t (iSCSIVirtualHBA::*sendPDU)(iSCSISession * session,
+                                        iSCSIConnection * connection,
+                                        iSCSIPDUInitiatorBHS * bhs,
+                                        iSCSIPDU::iSCSIPDUCommonAHS * ahs,
+                                        const void * data,
+                                        size_t length);
+    
+    /*! Receives a basic header segment (see iSCSIVirtualHBA::RecvPDUHeader()). */
+    errno_t (iSCSIVirtualHBA::*recvPDUHeader)(iSCSISession * session,
+                                              iSCSIConnection * connection,
+                                              iSCSIPDUTargetBHS * bhs,
+                                              int flags);
+    
+    /*! Receives a data segment (see iSCSIVirtualHBA::RecvPDUData()). */
+    errno_t (iSCSIVirtualHBA::*recvPDUData)(iSCSISession * session,
+                                            iSCSIConnection * connection,
+                                            void * data,
+                                            size_t length,
+                                            int flags);
+};
+
 
 #endif /* defined(__iSCSI_Initiator__iSCSIInitiatorVirtualHBA__) */
 
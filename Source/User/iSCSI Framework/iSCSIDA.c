@@ -29,79 +29,301 @@
 #include "iSCSIDA.h"
 #include "iSCSIIORegistry.h"
 
-typedef struct iSCSIDiskOperationContext {
-    DASessionRef session;
-    iSCSITargetRef target;
-    iSCSIDACallback callback;
-    void * context;
+/*! Disk counts for a single target of a batched operation. */
+typedef struct iSCSIDATargetCounts {
     CFIndex diskCount;
     CFIndex successCount;
     CFIndex processedCount;
+} iSCSIDATargetCounts;
+
+/*! A mount or unmount operation across all IOMedia of several targets. */
+typedef struct iSCSIDABatchOperation {
+    DASessionRef session;
+    CFArrayRef targets;
+    iSCSIDABatchCallback callback;
+    void * context;
+    CFTimeInterval timeout;
     DADiskUnmountOptions options;
+    Boolean mount;
+    
+    /*! Index of the target whose IOMedia are being queued. */
+    CFIndex targetIdx;
+    
+    /*! Number of disks not yet processed (plus one until all disks have
+     *  been queued). */
+    CFIndex remaining;
+    
+    /*! Number of references to the operation (one for the operation itself
+     *  and one for each disk awaiting its disk arbitration callback). */
+    CFIndex references;
+    
+    /*! Disk counts, indexed by target. */
+    iSCSIDATargetCounts counts[];
+    
+} iSCSIDABatchOperation;
+
+/*! A mount or unmount of a single disk, part of a batched operation. */
+typedef struct iSCSIDADiskOperation {
+    iSCSIDABatchOperation * batch;
+    CFIndex targetIdx;
+    CFRunLoopTimerRef timer;
+    
+    /*! Whether the disk was accounted for (completed or timed out). */
+    Boolean processed;
+    
+} iSCSIDADiskOperation;
 
-} iSCSIDiskOperationContext;
+/*! A mount or unmount operation for a single target. */
+typedef struct iSCSIDATargetOperation {
+    iSCSITargetRef target;
+    iSCSIDACallback callback;
+    void * context;
+} iSCSIDATargetOperation;
+
+/*! Releases a reference to a batched operation, freeing it once the last
+ *  reference is gone. */
+void iSCSIDABatchRelease(iSCSIDABatchOperation * batch)
+{
+    if(--batch->references > 0)
+        return;
+    
+    CFRelease(batch->targets);
+    CFRelease(batch->session);
+    free(batch);
+}
 
-void iSCSIDADiskUnmountComplete(DADiskRef disk,DADissenterRef dissenter,void * context)
+/*! Called when a disk was processed; calls the callback function of the
+ *  batched operation once every disk has been processed. */
+void iSCSIDABatchDiskProcessed(iSCSIDABatchOperation * batch)
 {
-    iSCSIDiskOperationContext * opContext = (iSCSIDiskOperationContext*)context;
-    opContext->processedCount++;
+    if(--batch->remaining > 0)
+        return;
     
-    if(!dissenter)
-        opContext->successCount++;
+    CFIndex targetCount = CFArrayGetCount(batch->targets);
+    enum iSCSIDAOperationResult results[targetCount];
     
-    if(opContext->diskCount == opContext->processedCount) {
-        enum iSCSIDAOperationResult result = kISCSIDAOperationPartialSuccess;
+    for(CFIndex idx = 0; idx < targetCount; idx++)
+    {
+        iSCSIDATargetCounts * counts = &batch->counts[idx];
         
-        if(opContext->processedCount == opContext->successCount)
-            result = kiSCSIDAOperationSuccess;
-        else if(opContext->successCount == 0)
-            result = kiSCSIDAOperationFail;
+        // Targets without volumes succeed trivially
+        if(counts->successCount == counts->diskCount)
+            results[idx] = kiSCSIDAOperationSuccess;
+        else if(counts->successCount == 0)
+            results[idx] = kiSCSIDAOperationFail;
+        else
+            results[idx] = kISCSIDAOperationPartialSuccess;
+    }
+    
+    // If callback was specified...
+    if(batch->callback)
+        (*batch->callback)(batch->targets,results,batch->context);
+}
+
+/*! Disk arbitration callback for a mount or unmount of a single disk. */
+void iSCSIDADiskOperationComplete(DADiskRef disk,DADissenterRef dissenter,void * context)
+{
+    iSCSIDADiskOperation * diskOp = (iSCSIDADiskOperation*)context;
+    iSCSIDABatchOperation * batch = diskOp->batch;
+    
+    if(diskOp->timer) {
+        CFRunLoopTimerInvalidate(diskOp->timer);
+        CFRelease(diskOp->timer);
+    }
+    
+    // The disk counts as failed if it timed out, even if it succeeds later
+    if(!diskOp->processed) {
+        iSCSIDATargetCounts * counts = &batch->counts[diskOp->targetIdx];
+        counts->processedCount++;
         
-        // If callback was specified...
-        if(opContext->callback)
-            (*opContext->callback)(opContext->target,result,opContext->context);
+        if(!dissenter)
+            counts->successCount++;
         
-        free(opContext);
+        iSCSIDABatchDiskProcessed(batch);
     }
+    
+    free(diskOp);
+    iSCSIDABatchRelease(batch);
+}
+
+/*! Timer callback for a disk that was not mounted or unmounted in time. */
+void iSCSIDADiskOperationTimeout(CFRunLoopTimerRef timer,void * info)
+{
+    iSCSIDADiskOperation * diskOp = (iSCSIDADiskOperation*)info;
+    
+    if(diskOp->processed)
+        return;
+    
+    diskOp->processed = true;
+    diskOp->batch->counts[diskOp->targetIdx].processedCount++;
+    iSCSIDABatchDiskProcessed(diskOp->batch);
 }
 
-void iSCSIDADiskMountComplete(DADiskRef disk,DADissenterRef dissenter,void * context)
+/*! Callback function used to mount or unmount all IOMedia objects. */
+void iSCSIDABatchApplierFunc(io_object_t entry,void * context)
 {
-    iSCSIDiskOperationContext * opContext = (iSCSIDiskOperationContext*)context;
-    opContext->processedCount++;
+    iSCSIDABatchOperation * batch = (iSCSIDABatchOperation*)context;
+    DADiskRef disk = DADiskCreateFromIOMedia(kCFAllocatorDefault,batch->session,entry);
+    
+    if(!disk)
+        return;
+    
+    iSCSIDADiskOperation * diskOp = malloc(sizeof(iSCSIDADiskOperation));
+    
+    if(!diskOp) {
+        CFRelease(disk);
+        return;
+    }
+    
+    diskOp->batch = batch;
+    diskOp->targetIdx = batch->targetIdx;
+    diskOp->timer = NULL;
+    diskOp->processed = false;
+    
+    // Each disk is timed individually, so that a disk that doesn't respond
+    // holds up the operation for no longer than the timeout
+    if(batch->timeout > 0) {
+        CFRunLoopTimerContext timerContext = { 0, diskOp, NULL, NULL, NULL };
+        diskOp->timer = CFRunLoopTimerCreate(kCFAllocatorDefault,
+                                             CFAbsoluteTimeGetCurrent() + batch->timeout,
+                                             0,0,0,&iSCSIDADiskOperationTimeout,&timerContext);
+        CFRunLoopAddTimer(CFRunLoopGetCurrent(),diskOp->timer,kCFRunLoopCommonModes);
+    }
+    
+    batch->counts[batch->targetIdx].diskCount++;
+    batch->remaining++;
+    batch->references++;
     
-    if(!dissenter)
-        opContext->successCount++;
+    if(batch->mount)
+        DADiskMount(disk,NULL,batch->options,iSCSIDADiskOperationComplete,diskOp);
+    else
+        DADiskUnmount(disk,batch->options,iSCSIDADiskOperationComplete,diskOp);
     
-    if(opContext->diskCount == opContext->processedCount) {
-        enum iSCSIDAOperationResult result = kISCSIDAOperationPartialSuccess;
+    CFRelease(disk);
+}
+
+/*! Queues a mount or unmount of all IOMedia of the specified targets. */
+void iSCSIDABatchStart(DASessionRef session,
+                       DADiskUnmountOptions options,
+                       Boolean mount,
+                       CFArrayRef targets,
+                       CFTimeInterval timeout,
+                       iSCSIDABatchCallback callback,
+                       void * context)
+{
+    CFIndex targetCount = CFArrayGetCount(targets);
+    iSCSIDABatchOperation * batch = malloc(sizeof(iSCSIDABatchOperation) + targetCount*sizeof(iSCSIDATargetCounts));
+    
+    // The operation failed for every target
+    if(!batch) {
+        enum iSCSIDAOperationResult results[targetCount > 0 ? targetCount : 1];
+        
+        for(CFIndex idx = 0; idx < targetCount; idx++)
+            results[idx] = kiSCSIDAOperationFail;
         
-        if(opContext->processedCount == opContext->successCount)
-            result = kiSCSIDAOperationSuccess;
-        else if(opContext->successCount == 0)
-            result = kiSCSIDAOperationFail;
+        if(callback)
+            (*callback)(targets,results,context);
+        return;
+    }
+    
+    batch->session = session;
+    batch->targets = CFArrayCreateCopy(kCFAllocatorDefault,targets);
+    batch->callback = callback;
+    batch->context = context;
+    batch->timeout = timeout;
+    batch->options = options;
+    batch->mount = mount;
+    batch->remaining = 1;
+    batch->references = 1;
+    memset(batch->counts,0,targetCount*sizeof(iSCSIDATargetCounts));
+    
+    // Disk arbitration callbacks may arrive after the operation completed
+    // (if a disk timed out); keep the session until then
+    CFRetain(session);
+    
+    // Queue operations for the IOMedia objects of all targets at once
+    for(CFIndex idx = 0; idx < targetCount; idx++)
+    {
+        iSCSITargetRef target = (iSCSITargetRef)CFArrayGetValueAtIndex(targets,idx);
+        io_object_t targetObj = iSCSIIORegistryGetTargetEntry(iSCSITargetGetIQN(target));
         
-        // If callback was specified...
-        if(opContext->callback)
-            (*opContext->callback)(opContext->target,result,opContext->context);
+        if(targetObj == IO_OBJECT_NULL)
+            continue;
         
-        free(opContext);
+        batch->targetIdx = idx;
+        iSCSIIORegistryIOMediaApplyFunction(targetObj,&iSCSIDABatchApplierFunc,batch);
+        IOObjectRelease(targetObj);
     }
+    
+    // Complete the operation if there are no disks (or all have completed)
+    iSCSIDABatchDiskProcessed(batch);
+    iSCSIDABatchRelease(batch);
+}
+
+/*! Unmounts all media associated with the specified iSCSI targets, and
+ *  calls the specified callback function with a context parameter when
+ *  all mounted volumes have been unmounted (or timed out). */
+void iSCSIDAUnmountForTargets(DASessionRef session,
+                              DADiskUnmountOptions options,
+                              CFArrayRef targets,
+                              CFTimeInterval timeout,
+                              iSCSIDABatchCallback callback,
+                              void * context)
+{
+    iSCSIDABatchStart(session,options,false,targets,timeout,callback,context);
+}
+
+/*! Mounts all IOMedia associated with the specified iSCSI targets, and
+ *  calls the specified callback function with a context parameter when
+ *  all existing volumes have been mounted (or timed out). */
+void iSCSIDAMountForTargets(DASessionRef session,
+                            DADiskUnmountOptions options,
+                            CFArrayRef targets,
+                            CFTimeInterval timeout,
+                            iSCSIDABatchCallback callback,
+                            void * context)
+{
+    iSCSIDABatchStart(session,options,true,targets,timeout,callback,context);
 }
 
-/*! Callback function used to unmount all IOMedia objects. */
-void iSCSIDAUnmountApplierFunc(io_object_t entry, void * context)
+/*! Callback of a batched operation started for a single target. */
+void iSCSIDATargetOperationComplete(CFArrayRef targets,
+                                    const enum iSCSIDAOperationResult * results,
+                                    void * context)
 {
-    iSCSIDiskOperationContext * opContext = (iSCSIDiskOperationContext*)context;
-    DADiskRef disk = DADiskCreateFromIOMedia(kCFAllocatorDefault,opContext->session,entry);
+    iSCSIDATargetOperation * targetOp = (iSCSIDATargetOperation*)context;
     
-    if(disk) {
-        DADiskUnmount(disk,opContext->options,iSCSIDADiskUnmountComplete,context);
-        CFRelease(disk);
-        opContext->diskCount++;
-    }
+    // If callback was specified...
+    if(targetOp->callback)
+        (*targetOp->callback)(targetOp->target,results[0],targetOp->context);
+    
+    free(targetOp);
 }
 
+/*! Starts a batched operation for a single target. */
+void iSCSIDATargetOperationStart(DASessionRef session,
+                                 DADiskUnmountOptions options,
+                                 Boolean mount,
+                                 iSCSITargetRef target,
+                                 iSCSIDACallback callback,
+                                 void * context)
+{
+    iSCSIDATargetOperation * targetOp = malloc(sizeof(iSCSIDATargetOperation));
+    
+    if(!targetOp) {
+        if(callback)
+            (*callback)(target,kiSCSIDAOperationFail,context);
+        return;
+    }
+    
+    targetOp->target = target;
+    targetOp->callback = callback;
+    targetOp->context = context;
+    
+    CFArrayRef targets = CFArrayCreate(kCFAllocatorDefault,(const void **)&target,1,&kCFTypeArrayCallBacks);
+    iSCSIDABatchStart(session,options,mount,targets,0,&iSCSIDATargetOperationComplete,targetOp);
+    CFRelease(targets);
+}
 
 /*! Unmounts all media associated with a particular iSCSI session, and
  *  calls the specified callback function with a context parameter when
@@ -112,38 +334,7 @@ void iSCSIDAUnmountForTarget(DASessionRef session,
                              iSCSIDACallback callback,
                              void * context)
 {
-    // Find the target associated with the session
-    CFStringRef targetIQN = iSCSITargetGetIQN(target);
-    io_object_t targetObj = iSCSIIORegistryGetTargetEntry(targetIQN);
-    
-    
-    iSCSIDiskOperationContext * opContext = malloc(sizeof(iSCSIDiskOperationContext));
-    opContext->callback = callback;
-    opContext->session = session;
-    opContext->target = (void*)target;
-    opContext->context = context;
-    opContext->diskCount = 0;
-    opContext->processedCount = 0;
-    opContext->successCount = 0;
-    opContext->options = options;
-    
-    // Queue unmount all IOMedia objects
-    if(target != IO_OBJECT_NULL)
-        iSCSIIORegistryIOMediaApplyFunction(targetObj,&iSCSIDAUnmountApplierFunc,opContext);
-}
-
-/*! Callback function used to unmount all IOMedia objects. */
-void iSCSIDAMountApplierFunc(io_object_t entry, void * context)
-{
-    iSCSIDiskOperationContext * opContext = (iSCSIDiskOperationContext*)context;
-    
-    DADiskRef disk = DADiskCreateFromIOMedia(kCFAllocatorDefault,opContext->session,entry);
-    
-    if(disk) {
-        DADiskMount(disk,NULL,opContext->options,iSCSIDADiskMountComplete,context);
-        CFRelease(disk);
-        opContext->diskCount++;
-    }
+    iSCSIDATargetOperationStart(session,options,false,target,callback,context);
 }
 
 /*! Mounts all IOMedia associated with a particular iSCSI session, and
@@ -155,21 +346,5 @@ void iSCSIDAMountForTarget(DASessionRef session,
                            iSCSIDACallback callback,
                            void * context)
 {
-    // Find the target associated with the session
-    CFStringRef targetIQN = iSCSITargetGetIQN(target);
-    io_object_t targetObj = iSCSIIORegistryGetTargetEntry(targetIQN);
-    
-    iSCSIDiskOperationContext * opContext = malloc(sizeof(iSCSIDiskOperationContext));
-    opContext->callback = callback;
-    opContext->session = session;
-    opContext->target = (void*)target;
-    opContext->context = context;
-    opContext->diskCount = 0;
-    opContext->processedCount = 0;
-    opContext->successCount = 0;
-    opContext->options = options;
-    
-    // Queue mount all IOMedia objects
-    if(target != IO_OBJECT_NULL)
-        iSCSIIORegistryIOMediaApplyFunction(targetObj,&iSCSIDAMountApplierFunc,opContext);
-}
\ No newline at end of file
+    iSCSIDATargetOperationStart(session,options,true,target,callback,context);
+}
@@ -49,6 +49,10 @@ enum iSCSIDAOperationResult {
 /*! Mount and unmount operation callback function. */
 typedef void (*iSCSIDACallback)(iSCSITargetRef,enum iSCSIDAOperationResult,void *);
 
+/*! Callback function for mount and unmount operations across several
+ *  targets.  The results are ordered like the targets. */
+typedef void (*iSCSIDABatchCallback)(CFArrayRef,const enum iSCSIDAOperationResult *,void *);
+
 /*! Mounts all IOMedia associated with a particular iSCSI session, and
  *  calls the specified callback function with a context parameter when
  *  all existing volumes have been mounted. */
@@ -67,5 +71,34 @@ void iSCSIDAUnmountForTarget(DASessionRef session,
                              iSCSIDACallback callback,
                              void * context);
 
+/*! Mounts all IOMedia associated with the specified iSCSI targets, and
+ *  calls the specified callback function with a context parameter when
+ *  all existing volumes have been mounted.  All volumes are mounted
+ *  concurrently; a volume that is not mounted within the timeout counts as
+ *  failed.  The callback is called from the current run loop (or before
+ *  this function returns, if the targets have no volumes).
+ *  @param timeout the time allowed for each volume, in seconds (zero to
+ *  wait indefinitely). */
+void iSCSIDAMountForTargets(DASessionRef session,
+                            DADiskUnmountOptions options,
+                            CFArrayRef targets,
+                            CFTimeInterval timeout,
+                            iSCSIDABatchCallback callback,
+                            void * context);
+
+/*! Unmounts all media associated with the specified iSCSI targets, and
+ *  calls the specified callback function with a context parameter when
+ *  all mounted volumes have been unmounted.  All volumes are unmounted
+ *  concurrently; a volume that is not unmounted within the timeout counts
+ *  as failed.  The callback is called from the current run loop (or before
+ *  this function returns, if the targets have no volumes).
+ *  @param timeout the time allowed for each volume, in seconds (zero to
+ *  wait indefinitely). */
+void iSCSIDAUnmountForTargets(DASessionRef session,
+                              DADiskUnmountOptions options,
+                              CFArrayRef targets,
+                              CFTimeInterval timeout,
+                              iSCSIDABatchCallback callback,
+                              void * context);
 
 #endif /* defined(__ISCSI_DA_H__) */
@@ -39,6 +39,13 @@ static const int kiSCSIDaemonConnectTimeoutMilliSec = 100;
  *  operation (potentially over the network). */
 static const int kiSCSIDaemonDefaultTimeoutSec = 10;
 
+/*! Copy of the preferences taken when the preferences lock was acquired,
+ *  used to send only the changes to the daemon when the lock is released. */
+static iSCSIPreferencesRef preferencesLockBase = NULL;
+
+/*! Daemon connection that acquired the preferences lock. */
+static iSCSIDaemonHandle preferencesLockHandle = -1;
+
 
 const iSCSIDMsgLoginCmd iSCSIDMsgLoginCmdInit  = {
     .funcCode = kiSCSIDLogin,
@@ -105,6 +112,22 @@ const iSCSIDMsgRemoveSharedSecretCmd iSCSIDMsgRemoveSharedSecretCmdInit = {
     .funcCode = kiSCSIDRemoveSharedSecret
 };
 
+const iSCSIDMsgLoginTargetsCmd iSCSIDMsgLoginTargetsCmdInit = {
+    .funcCode = kiSCSIDLoginTargets
+};
+
+const iSCSIDMsgLogoutTargetsCmd iSCSIDMsgLogoutTargetsCmdInit = {
+    .funcCode = kiSCSIDLogoutTargets
+};
+
+const iSCSIDMsgCreateCFPropertiesForAllSessionsCmd iSCSIDMsgCreateCFPropertiesForAllSessionsCmdInit = {
+    .funcCode = kiSCSIDCreateCFPropertiesForAllSessions
+};
+
+const iSCSIDMsgCreateCFPropertiesForLoginSchedulerCmd iSCSIDMsgCreateCFPropertiesForLoginSchedulerCmdInit = {
+    .funcCode = kiSCSIDCreateCFPropertiesForLoginScheduler
+};
+
 iSCSIDaemonHandle iSCSIDaemonConnect()
 {
     iSCSIDaemonHandle handle = socket(PF_LOCAL,SOCK_STREAM,0);
@@ -223,6 +246,157 @@ errno_t iSCSIDaemonLogin(iSCSIDaemonHandle handle,
 }
 
 
+/*! Helper function. Sends a command that applies to several targets and
+ *  receives the result for each target.  Since the daemon responds once the
+ *  operation has completed for every target, the receive timeout is extended
+ *  in proportion to the number of targets for the duration of the call. */
+static errno_t iSCSIDaemonSendTargetsCmd(iSCSIDaemonHandle handle,
+                                         AuthorizationRef authorization,
+                                         CFArrayRef targets,
+                                         UInt16 funcCode,
+                                         errno_t * errorCodes,
+                                         UInt16 * statusCodes)
+{
+    CFIndex targetCount = CFArrayGetCount(targets);
+    CFDataRef targetsData = iSCSITargetCreateDataForArray(targets);
+    
+    if(!targetsData)
+        return EINVAL;
+    
+    AuthorizationExternalForm authExtForm;
+    AuthorizationMakeExternalForm(authorization,&authExtForm);
+    
+    CFDataRef authData = CFDataCreateWithBytesNoCopy(kCFAllocatorDefault,
+                                                     (UInt8*)&authExtForm.bytes,
+                                                     kAuthorizationExternalFormLength,
+                                                     kCFAllocatorNull);
+    errno_t error = 0;
+    
+    // The login and logout commands have the same layout
+    if(funcCode == kiSCSIDLoginTargets) {
+        iSCSIDMsgLoginTargetsCmd cmd = iSCSIDMsgLoginTargetsCmdInit;
+        cmd.authLength = kAuthorizationExternalFormLength;
+        cmd.targetsLength = (UInt32)CFDataGetLength(targetsData);
+        error = iSCSIDaemonSendMsg(handle,(iSCSIDMsgGeneric *)&cmd,authData,targetsData,NULL);
+    }
+    else {
+        iSCSIDMsgLogoutTargetsCmd cmd = iSCSIDMsgLogoutTargetsCmdInit;
+        cmd.authLength = kAuthorizationExternalFormLength;
+        cmd.targetsLength = (UInt32)CFDataGetLength(targetsData);
+        error = iSCSIDaemonSendMsg(handle,(iSCSIDMsgGeneric *)&cmd,authData,targetsData,NULL);
+    }
+    
+    CFRelease(authData);
+    CFRelease(targetsData);
+    
+    if(error)
+        return error;
+    
+    struct timeval tv, batchTimeout;
+    socklen_t tvLength = sizeof(tv);
+    getsockopt(handle,SOL_SOCKET,SO_RCVTIMEO,&tv,&tvLength);
+    
+    memset(&batchTimeout,0,sizeof(batchTimeout));
+    batchTimeout.tv_sec = kiSCSIDaemonDefaultTimeoutSec*(targetCount > 0 ? targetCount : 1);
+    setsockopt(handle,SOL_SOCKET,SO_RCVTIMEO,&batchTimeout,sizeof(batchTimeout));
+    
+    iSCSIDMsgLoginTargetsRsp rsp;
+    
+    if(recv(handle,&rsp,sizeof(rsp),0) != sizeof(rsp) || rsp.funcCode != funcCode)
+        error = EIO;
+    
+    setsockopt(handle,SOL_SOCKET,SO_RCVTIMEO,&tv,sizeof(tv));
+    
+    if(!error)
+        error = rsp.errorCode;
+    
+    if(!error && rsp.resultsLength != targetCount*sizeof(iSCSIDMsgTargetResult))
+        error = EIO;
+    
+    CFDataRef resultsData = NULL;
+    
+    if(!error && rsp.resultsLength > 0)
+        error = iSCSIDaemonRecvMsg(handle,0,&resultsData,rsp.resultsLength,NULL);
+    
+    if(!error && resultsData) {
+        const iSCSIDMsgTargetResult * results = (const iSCSIDMsgTargetResult *)CFDataGetBytePtr(resultsData);
+        
+        for(CFIndex idx = 0; idx < targetCount; idx++) {
+            errorCodes[idx] = results[idx].errorCode;
+            statusCodes[idx] = results[idx].statusCode;
+        }
+    }
+    
+    if(resultsData)
+        CFRelease(resultsData);
+    
+    return error;
+}
+
+/*! Logs into several targets, each over all of the portals in the database.
+ *  The daemon performs the logins concurrently and responds once all of them
+ *  have completed.
+ *  @param handle a handle to a daemon connection.
+ *  @param authorization an authorization for the right kiSCSIAuthModifyLogin
+ *  @param targets an array of targets to login to.
+ *  @param errorCodes the result of the login for each target (an array with
+ *  an entry for each target).
+ *  @param statusCodes iSCSI response code indicating login status for each
+ *  target (an array with an entry for each target).
+ *  @return an error code indicating whether the operation was successful. */
+errno_t iSCSIDaemonLoginTargets(iSCSIDaemonHandle handle,
+                                AuthorizationRef authorization,
+                                CFArrayRef targets,
+                                errno_t * errorCodes,
+                                enum iSCSILoginStatusCode * statusCodes)
+{
+    if(handle < 0 || !targets || !authorization || !errorCodes || !statusCodes)
+        return EINVAL;
+    
+    CFIndex targetCount = CFArrayGetCount(targets);
+    UInt16 statusCodesReceived[targetCount > 0 ? targetCount : 1];
+    
+    errno_t error = iSCSIDaemonSendTargetsCmd(handle,authorization,targets,kiSCSIDLoginTargets,
+                                              errorCodes,statusCodesReceived);
+    
+    for(CFIndex idx = 0; !error && idx < targetCount; idx++)
+        statusCodes[idx] = statusCodesReceived[idx];
+    
+    return error;
+}
+
+/*! Logs out of several targets (all connections of each session).  The
+ *  daemon performs the logouts concurrently and responds once all of them
+ *  have completed.
+ *  @param handle a handle to a daemon connection.
+ *  @param authorization an authorization for the right kiSCSIAuthModifyLogin
+ *  @param targets an array of targets to logout of.
+ *  @param errorCodes the result of the logout for each target (an array with
+ *  an entry for each target).
+ *  @param statusCodes iSCSI response code indicating logout status for each
+ *  target (an array with an entry for each target).
+ *  @return an error code indicating whether the operation was successful. */
+errno_t iSCSIDaemonLogoutTargets(iSCSIDaemonHandle handle,
+                                 AuthorizationRef authorization,
+                                 CFArrayRef targets,
+                                 errno_t * errorCodes,
+                                 enum iSCSILogoutStatusCode * statusCodes)
+{
+    if(handle < 0 || !targets || !authorization || !errorCodes || !statusCodes)
+        return EINVAL;
+    
+    CFIndex targetCount = CFArrayGetCount(targets);
+    UInt16 statusCodesReceived[targetCount > 0 ? targetCount : 1];
+    
+    errno_t error = iSCSIDaemonSendTargetsCmd(handle,authorization,targets,kiSCSIDLogoutTargets,
+                                              errorCodes,statusCodesReceived);
+    
+    for(CFIndex idx = 0; !error && idx < targetCount; idx++)
+        statusCodes[idx] = statusCodesReceived[idx];
+    
+    return error;
+}
+
 /*! Closes the iSCSI connection and frees the session qualifier.
  *  @param handle a handle to a daemon connection.
  *  @param authorization an authorization for the right kiSCSIAuthModifyLogin
@@ -432,16 +606,8 @@ CFArrayRef iSCSIDaemonCreateArrayOfActiveTargets(iSCSIDaemonHandle handle)
         error = iSCSIDaemonRecvMsg(handle,0,&data,rsp.dataLength,NULL);
         
         if(!error && data) {
-            CFPropertyListFormat format;
-            activeTargets = CFPropertyListCreateWithData(kCFAllocatorDefault,data,0,&format,NULL);
+            activeTargets = iSCSITargetCreateArrayWithData(data);
             CFRelease(data);
-            
-            if(format != kCFPropertyListBinaryFormat_v1_0) {
-                if(activeTargets) {
-                    CFRelease(activeTargets);
-                    activeTargets = NULL;
-                }
-            }
         }
     }
 
@@ -478,16 +644,8 @@ CFArrayRef iSCSIDaemonCreateArrayOfActivePortalsForTarget(iSCSIDaemonHandle hand
         error = iSCSIDaemonRecvMsg(handle,0,&data,rsp.dataLength,NULL);
 
         if(!error && data) {
-            CFPropertyListFormat format;
-            activePortals = CFPropertyListCreateWithData(kCFAllocatorDefault,data,0,&format,NULL);
+            activePortals = iSCSITargetCreateArrayWithData(data);
             CFRelease(data);
-
-            if(format != kCFPropertyListBinaryFormat_v1_0) {
-                if(activePortals) {
-                    CFRelease(activePortals);
-                    activePortals = NULL;
-                }
-            }
         }
     }
     return activePortals;
@@ -538,6 +696,94 @@ CFDictionaryRef iSCSIDaemonCreateCFPropertiesForSession(iSCSIDaemonHandle handle
 }
 
 
+/*! Creates a dictionary of session and connection parameters for all active
+ *  sessions, using a single request to the daemon.
+ *  @param handle a handle to a daemon connection.
+ *  @return a dictionary keyed by target name; each value is a dictionary of
+ *  session properties (see iSCSIDaemonCreateCFPropertiesForSession()) that
+ *  also contains, under kRFC3720_Key_Connections, a dictionary of connection
+ *  properties keyed by portal address. */
+CFDictionaryRef iSCSIDaemonCreateCFPropertiesForAllSessions(iSCSIDaemonHandle handle)
+{
+    // Validate inputs
+    if(handle < 0)
+        return NULL;
+    
+    CFDictionaryRef properties = NULL;
+    
+    // Send command to daemon
+    iSCSIDMsgCreateCFPropertiesForAllSessionsCmd cmd = iSCSIDMsgCreateCFPropertiesForAllSessionsCmdInit;
+    
+    errno_t error = 0;
+    
+    if(send(handle,&cmd,sizeof(cmd),0) != sizeof(cmd))
+        error = EIO;
+    
+    iSCSIDMsgCreateCFPropertiesForAllSessionsRsp rsp;
+    
+    if(!error)
+        error = iSCSIDaemonRecvMsg(handle,(iSCSIDMsgGeneric*)&rsp,NULL);
+    
+    if(!error && rsp.funcCode != kiSCSIDCreateCFPropertiesForAllSessions)
+        error = EIO;
+    
+    if(!error) {
+        CFDataRef data = NULL;
+        error = iSCSIDaemonRecvMsg(handle,0,&data,rsp.dataLength,NULL);
+        
+        if(!error && data) {
+            CFPropertyListFormat format;
+            properties = CFPropertyListCreateWithData(kCFAllocatorDefault,data,0,&format,NULL);
+            CFRelease(data);
+        }
+    }
+    return properties;
+}
+
+/*! Creates a dictionary describing the state of the daemon's login
+ *  scheduler: the login history of each portal and the logins that are
+ *  pending after session timeouts or failed logins.
+ *  @param handle a handle to a daemon connection.
+ *  @return a dictionary containing a dictionary of portal histories keyed by
+ *  portal address (under kiSCSIDLoginSchedulerPortalsKey) and a dictionary
+ *  of relogins keyed by target name (under kiSCSIDLoginSchedulerReloginsKey). */
+CFDictionaryRef iSCSIDaemonCreateCFPropertiesForLoginScheduler(iSCSIDaemonHandle handle)
+{
+    // Validate inputs
+    if(handle < 0)
+        return NULL;
+    
+    CFDictionaryRef properties = NULL;
+    
+    // Send command to daemon
+    iSCSIDMsgCreateCFPropertiesForLoginSchedulerCmd cmd = iSCSIDMsgCreateCFPropertiesForLoginSchedulerCmdInit;
+    
+    errno_t error = 0;
+    
+    if(send(handle,&cmd,sizeof(cmd),0) != sizeof(cmd))
+        error = EIO;
+    
+    iSCSIDMsgCreateCFPropertiesForLoginSchedulerRsp rsp;
+    
+    if(!error)
+        error = iSCSIDaemonRecvMsg(handle,(iSCSIDMsgGeneric*)&rsp,NULL);
+    
+    if(!error && rsp.funcCode != kiSCSIDCreateCFPropertiesForLoginScheduler)
+        error = EIO;
+    
+    if(!error) {
+        CFDataRef data = NULL;
+        error = iSCSIDaemonRecvMsg(handle,0,&data,rsp.dataLength,NULL);
+        
+        if(!error && data) {
+            CFPropertyListFormat format;
+            properties = CFPropertyListCreateWithData(kCFAllocatorDefault,data,0,&format,NULL);
+            CFRelease(data);
+        }
+    }
+    return properties;
+}
+
 /*! Creates a dictionary of connection parameters for the connection associated
  *  with the specified target and portal, if one exists.
  *  @param handle a handle to a daemon connection.
@@ -653,6 +899,12 @@ errno_t iSCSIDaemonPreferencesIOLockAndSync(iSCSIDaemonHandle handle,
         // Force preferences to synchronize after obtaining lock
         // (this ensures that the client has the most up-to-date preferences data)
         iSCSIPreferencesUpdateWithAppValues(preferences);
+        
+        if(preferencesLockBase)
+            iSCSIPreferencesRelease(preferencesLockBase);
+        
+        preferencesLockBase = iSCSIPreferencesCreateWithDictionary(iSCSIPreferencesCreateDictionary(preferences));
+        preferencesLockHandle = handle;
     }
     
     return rsp.errorCode;
@@ -672,22 +924,43 @@ errno_t iSCSIDaemonPreferencesIOUnlockAndSync(iSCSIDaemonHandle handle,
     if(handle < 0)
         return EINVAL;
     
-    CFDataRef preferencesData = NULL;
+    CFDataRef preferencesData = NULL, deltaData = NULL;
     
     iSCSIDMsgPreferencesIOUnlockAndSyncCmd cmd = iSCSIDMsgPreferencesIOUnlockAndSyncCmdInit;
+    cmd.preferencesLength = 0;
+    cmd.deltaLength = 0;
+    
+    // Send only what changed since the lock was acquired, if possible (if
+    // nothing changed, nothing is sent and the daemon only unlocks)
+    Boolean haveBase = (preferencesLockBase && preferencesLockHandle == handle);
     
-    if(preferences) {
+    if(preferences && haveBase) {
+        deltaData = iSCSIPreferencesCreateDeltaData(preferencesLockBase,preferences);
+        
+        if(deltaData)
+            cmd.deltaLength = (UInt32)CFDataGetLength(deltaData);
+    }
+    else if(preferences) {
         preferencesData = iSCSIPreferencesCreateData(preferences);
         cmd.preferencesLength = (UInt32)CFDataGetLength(preferencesData);
     }
-    else
-        cmd.preferencesLength = 0;
     
-    errno_t error = iSCSIDaemonSendMsg(handle,(iSCSIDMsgGeneric *)&cmd,preferencesData,NULL);
+    if(preferencesLockBase) {
+        iSCSIPreferencesRelease(preferencesLockBase);
+        preferencesLockBase = NULL;
+        preferencesLockHandle = -1;
+    }
+    
+    // At most one of these is present (the data list ends at the first NULL)
+    errno_t error = iSCSIDaemonSendMsg(handle,(iSCSIDMsgGeneric *)&cmd,
+                                       deltaData ? deltaData : preferencesData,NULL);
     
     if(preferencesData)
         CFRelease(preferencesData);
     
+    if(deltaData)
+        CFRelease(deltaData);
+    
     if(error)
         return error;
     
@@ -68,6 +68,40 @@ errno_t iSCSIDaemonLogin(iSCSIDaemonHandle handle,
                          iSCSIPortalRef portal,
                          enum iSCSILoginStatusCode * statusCode);
 
+/*! Logs into several targets, each over all of the portals in the database.
+ *  The daemon performs the logins concurrently and responds once all of them
+ *  have completed.
+ *  @param handle a handle to a daemon connection.
+ *  @param authorization an authorization for the right kiSCSIAuthModifyLogin
+ *  @param targets an array of targets to login to.
+ *  @param errorCodes the result of the login for each target (an array with
+ *  an entry for each target).
+ *  @param statusCodes iSCSI response code indicating login status for each
+ *  target (an array with an entry for each target).
+ *  @return an error code indicating whether the operation was successful. */
+errno_t iSCSIDaemonLoginTargets(iSCSIDaemonHandle handle,
+                                AuthorizationRef authorization,
+                                CFArrayRef targets,
+                                errno_t * errorCodes,
+                                enum iSCSILoginStatusCode * statusCodes);
+
+/*! Logs out of several targets (all connections of each session).  The
+ *  daemon performs the logouts concurrently and responds once all of them
+ *  have completed.
+ *  @param handle a handle to a daemon connection.
+ *  @param authorization an authorization for the right kiSCSIAuthModifyLogin
+ *  @param targets an array of targets to logout of.
+ *  @param errorCodes the result of the logout for each target (an array with
+ *  an entry for each target).
+ *  @param statusCodes iSCSI response code indicating logout status for each
+ *  target (an array with an entry for each target).
+ *  @return an error code indicating whether the operation was successful. */
+errno_t iSCSIDaemonLogoutTargets(iSCSIDaemonHandle handle,
+                                 AuthorizationRef authorization,
+                                 CFArrayRef targets,
+                                 errno_t * errorCodes,
+                                 enum iSCSILogoutStatusCode * statusCodes);
+
 /*! Closes the iSCSI connection and frees the session qualifier.
  *  @param handle a handle to a daemon connection.
  *  @param authorization an authorization for the right kiSCSIAuthModifyLogin
@@ -118,6 +152,45 @@ errno_t iSCSIDaemonQueryTargetForAuthMethod(iSCSIDaemonHandle handle,
                                             enum iSCSIAuthMethods * authMethod,
                                             enum iSCSILoginStatusCode * statusCode);
 
+/*! Creates a dictionary of session and connection parameters for all active
+ *  sessions, using a single request to the daemon.
+ *  @param handle a handle to a daemon connection.
+ *  @return a dictionary keyed by target name; each value is a dictionary of
+ *  session properties (see iSCSIDaemonCreateCFPropertiesForSession()) that
+ *  also contains, under kRFC3720_Key_Connections, a dictionary of connection
+ *  properties keyed by portal address. */
+CFDictionaryRef iSCSIDaemonCreateCFPropertiesForAllSessions(iSCSIDaemonHandle handle);
+
+/*! Dictionary of portal login histories, keyed by portal address. */
+static CFStringRef kiSCSIDLoginSchedulerPortalsKey = CFSTR("Portals");
+
+/*! Dictionary of pending relogins and recent failures, keyed by target name. */
+static CFStringRef kiSCSIDLoginSchedulerReloginsKey = CFSTR("Relogins");
+
+/*! Portal login history keys (CFNumber values; times are in seconds). */
+static CFStringRef kiSCSIDPortalLoginAttemptsKey = CFSTR("Login Attempts");
+static CFStringRef kiSCSIDPortalLoginSuccessesKey = CFSTR("Successful Logins");
+static CFStringRef kiSCSIDPortalConsecutiveFailuresKey = CFSTR("Consecutive Failures");
+static CFStringRef kiSCSIDPortalLoginLatencyKey = CFSTR("Login Latency");
+static CFStringRef kiSCSIDPortalHealthScoreKey = CFSTR("Health Score");
+static CFStringRef kiSCSIDPortalTimeSinceLastAttemptKey = CFSTR("Time Since Last Attempt");
+static CFStringRef kiSCSIDPortalLastErrorKey = CFSTR("Last Error");
+static CFStringRef kiSCSIDPortalLastStatusCodeKey = CFSTR("Last Status Code");
+
+/*! Relogin keys (CFNumber values; times are in seconds). */
+static CFStringRef kiSCSIDReloginFailuresKey = CFSTR("Failures");
+static CFStringRef kiSCSIDReloginTimeSinceLastFailureKey = CFSTR("Time Since Last Failure");
+static CFStringRef kiSCSIDReloginTimeUntilLoginKey = CFSTR("Time Until Login");
+
+/*! Creates a dictionary describing the state of the daemon's login
+ *  scheduler: the login history of each portal and the logins that are
+ *  pending after session timeouts or failed logins.
+ *  @param handle a handle to a daemon connection.
+ *  @return a dictionary containing a dictionary of portal histories keyed by
+ *  portal address (under kiSCSIDLoginSchedulerPortalsKey) and a dictionary
+ *  of relogins keyed by target name (under kiSCSIDLoginSchedulerReloginsKey). */
+CFDictionaryRef iSCSIDaemonCreateCFPropertiesForLoginScheduler(iSCSIDaemonHandle handle);
+
 /*! Creates a dictionary of session parameters for the session associated with
  *  the specified target, if one exists.
  *  @param handle a handle to a daemon connection.
@@ -444,7 +444,9 @@ typedef struct __iSCSIDMsgPreferencesIOLockAndSyncRsp {
 } __attribute__((packed)) iSCSIDMsgPreferencesIOLockAndSyncRsp;
 
 
-/*! Command IO unlock and sync preferences. */
+/*! Command IO unlock and sync preferences.  Either the complete preferences
+ *  or only the changes made since the lock was acquired (see
+ *  iSCSIPreferencesCreateDeltaData()) are sent, followed by the other. */
 typedef struct __iSCSIDMsgPreferencesIOUnlockAndSyncCmd {
     
     const UInt16 funcCode;
@@ -452,7 +454,7 @@ typedef struct __iSCSIDMsgPreferencesIOUnlockAndSyncCmd {
     UInt32  reserved2;
     UInt32  reserved3;
     UInt32  reserved4;
-    UInt32  reserved5;
+    UInt32  deltaLength;
     UInt32  preferencesLength;
     
 } __attribute__((packed)) iSCSIDMsgPreferencesIOUnlockAndSyncCmd;
@@ -536,6 +538,139 @@ typedef struct __iSCSIDMsgRemoveSharedSecretRsp {
     
 } __attribute__((packed)) iSCSIDMsgRemoveSharedSecretRsp;
 
+/*! Result for a single target of a login or logout command that applies to
+ *  several targets.  The response to such a command is followed by one
+ *  result for each target, in the order in which the targets were sent. */
+typedef struct __iSCSIDMsgTargetResult {
+    
+    UInt32 errorCode;
+    UInt16 statusCode;
+    UInt16 reserved;
+    
+} __attribute__((packed)) iSCSIDMsgTargetResult;
+
+/*! Command to login to several targets (over all portals of each target).
+ *  The targets are sent as an array (see iSCSITargetCreateDataForArray()). */
+typedef struct __iSCSIDMsgLoginTargetsCmd {
+    
+    const UInt16 funcCode;
+    UInt16  reserved;
+    UInt32  authLength;
+    UInt32  targetsLength;
+    UInt32  reserved2;
+    UInt32  reserved3;
+    UInt32  reserved4;
+    
+} __attribute__((packed)) iSCSIDMsgLoginTargetsCmd;
+
+/*! Default initialization for a command to login to several targets. */
+extern const iSCSIDMsgLoginTargetsCmd iSCSIDMsgLoginTargetsCmdInit;
+
+/*! Response to a command to login to several targets. */
+typedef struct __iSCSIDMsgLoginTargetsRsp {
+    
+    const UInt8 funcCode;
+    UInt8 reserved;
+    UInt32 errorCode;
+    UInt16 reserved2;
+    UInt32 reserved3;
+    UInt32 reserved4;
+    UInt32 reserved5;
+    UInt32 resultsLength;
+    
+} __attribute__((packed)) iSCSIDMsgLoginTargetsRsp;
+
+/*! Command to logout of several targets (all connections of each session).
+ *  The targets are sent as an array (see iSCSITargetCreateDataForArray()). */
+typedef struct __iSCSIDMsgLogoutTargetsCmd {
+    
+    const UInt16 funcCode;
+    UInt16  reserved;
+    UInt32  authLength;
+    UInt32  targetsLength;
+    UInt32  reserved2;
+    UInt32  reserved3;
+    UInt32  reserved4;
+    
+} __attribute__((packed)) iSCSIDMsgLogoutTargetsCmd;
+
+/*! Default initialization for a command to logout of several targets. */
+extern const iSCSIDMsgLogoutTargetsCmd iSCSIDMsgLogoutTargetsCmdInit;
+
+/*! Response to a command to logout of several targets. */
+typedef struct __iSCSIDMsgLogoutTargetsRsp {
+    
+    const UInt8 funcCode;
+    UInt8 reserved;
+    UInt32 errorCode;
+    UInt16 reserved2;
+    UInt32 reserved3;
+    UInt32 reserved4;
+    UInt32 reserved5;
+    UInt32 resultsLength;
+    
+} __attribute__((packed)) iSCSIDMsgLogoutTargetsRsp;
+
+/*! Command to get information about all sessions and their connections. */
+typedef struct __iSCSIDMsgCreateCFPropertiesForAllSessionsCmd {
+    
+    const UInt16 funcCode;
+    UInt16  reserved;
+    UInt32  reserved2;
+    UInt32  reserved3;
+    UInt32  reserved4;
+    UInt32  reserved5;
+    UInt32  reserved6;
+    
+} __attribute__((packed)) iSCSIDMsgCreateCFPropertiesForAllSessionsCmd;
+
+/*! Default initialization for a command to get information about all sessions. */
+extern const iSCSIDMsgCreateCFPropertiesForAllSessionsCmd iSCSIDMsgCreateCFPropertiesForAllSessionsCmdInit;
+
+/*! Response to a command to get information about all sessions. */
+typedef struct __iSCSIDMsgCreateCFPropertiesForAllSessionsRsp {
+    
+    const UInt8 funcCode;
+    UInt16 reserved;
+    UInt32 errorCode;
+    UInt8  reserved2;
+    UInt32 reserved3;
+    UInt32 reserved4;
+    UInt32 reserved5;
+    UInt32 dataLength;
+    
+} __attribute__((packed)) iSCSIDMsgCreateCFPropertiesForAllSessionsRsp;
+
+/*! Command to get the state of the login scheduler. */
+typedef struct __iSCSIDMsgCreateCFPropertiesForLoginSchedulerCmd {
+    
+    const UInt16 funcCode;
+    UInt16  reserved;
+    UInt32  reserved2;
+    UInt32  reserved3;
+    UInt32  reserved4;
+    UInt32  reserved5;
+    UInt32  reserved6;
+    
+} __attribute__((packed)) iSCSIDMsgCreateCFPropertiesForLoginSchedulerCmd;
+
+/*! Default initialization for a command to get the state of the login scheduler. */
+extern const iSCSIDMsgCreateCFPropertiesForLoginSchedulerCmd iSCSIDMsgCreateCFPropertiesForLoginSchedulerCmdInit;
+
+/*! Response to a command to get the state of the login scheduler. */
+typedef struct __iSCSIDMsgCreateCFPropertiesForLoginSchedulerRsp {
+    
+    const UInt8 funcCode;
+    UInt16 reserved;
+    UInt32 errorCode;
+    UInt8  reserved2;
+    UInt32 reserved3;
+    UInt32 reserved4;
+    UInt32 reserved5;
+    UInt32 dataLength;
+    
+} __attribute__((packed)) iSCSIDMsgCreateCFPropertiesForLoginSchedulerRsp;
+
 ////////////////////////////// DAEMON FUNCTIONS ////////////////////////////////
 
 enum iSCSIDFunctionCodes {
@@ -594,6 +729,18 @@ enum iSCSIDFunctionCodes {
     /*! Remove a SCSI shared secret. */
     kiSCSIDRemoveSharedSecret = 17,
 
+    /*! Login to several targets over all of their portals. */
+    kiSCSIDLoginTargets = 18,
+    
+    /*! Logout of several targets. */
+    kiSCSIDLogoutTargets = 19,
+    
+    /*! Get negotiated parameters for all sessions and their connections. */
+    kiSCSIDCreateCFPropertiesForAllSessions = 20,
+    
+    /*! Get portal login histories and pending relogins. */
+    kiSCSIDCreateCFPropertiesForLoginScheduler = 21,
+
     /*! Invalid daemon command. */
     kiSCSIDInvalidFunctionCode
 };
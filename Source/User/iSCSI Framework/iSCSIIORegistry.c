@@ -40,9 +40,131 @@
 
 #include "iSCSIHBATypes.h"
 
+#include <dispatch/dispatch.h>
+#include <pthread.h>
 
-/*! Gets the iSCSIVirtualHBA object in the IO registry.*/
-io_object_t iSCSIIORegistryGetiSCSIHBAEntry()
+/*! Name of the IOKit class used for iSCSI targets (children of the HBA). */
+#define kiSCSIIORegistryTargetClassName "IOSCSIParallelInterfaceDevice"
+
+/*! Guards the lookup cache below. */
+static pthread_mutex_t iSCSIIORegistryCacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+/*! Used to set up the notifications that invalidate the cache exactly once. */
+static pthread_once_t iSCSIIORegistryCacheOnce = PTHREAD_ONCE_INIT;
+
+/*! Set once notifications have been armed; nothing is cached otherwise,
+ *  since stale entries could never be detected. */
+static Boolean iSCSIIORegistryCacheEnabled = false;
+
+/*! Cached iSCSIVirtualHBA object (holds a reference), or IO_OBJECT_NULL. */
+static io_object_t iSCSIIORegistryCachedHBA = IO_OBJECT_NULL;
+
+/*! Maps target names (IQNs) to cached target objects.  Each object is stored
+ *  as a CFNumber and holds a reference that is dropped when the entry is
+ *  flushed. */
+static CFMutableDictionaryRef iSCSIIORegistryCachedTargets = NULL;
+
+/*! Incremented each time the cache is flushed, so that lookups that raced
+ *  with a termination are not cached. */
+static UInt32 iSCSIIORegistryCacheGeneration = 0;
+
+/*! Drops every cached object.  Must be called with the cache lock held. */
+static void iSCSIIORegistryCacheFlushLocked()
+{
+    if(iSCSIIORegistryCachedHBA != IO_OBJECT_NULL) {
+        IOObjectRelease(iSCSIIORegistryCachedHBA);
+        iSCSIIORegistryCachedHBA = IO_OBJECT_NULL;
+    }
+    
+    if(!iSCSIIORegistryCachedTargets)
+        return;
+    
+    CFIndex count = CFDictionaryGetCount(iSCSIIORegistryCachedTargets);
+    
+    if(count > 0) {
+        const void * values[count];
+        CFDictionaryGetKeysAndValues(iSCSIIORegistryCachedTargets,NULL,values);
+        
+        for(CFIndex idx = 0; idx < count; idx++) {
+            io_object_t entry = IO_OBJECT_NULL;
+            CFNumberGetValue(values[idx],kCFNumberSInt32Type,&entry);
+            IOObjectRelease(entry);
+        }
+    }
+    CFDictionaryRemoveAllValues(iSCSIIORegistryCachedTargets);
+}
+
+/*! Invoked when an HBA or a target is terminated.  Drains the notification
+ *  iterator (which re-arms it) and flushes the cache.
+ *  @param context unused.
+ *  @param iterator iterator over the terminated objects. */
+static void iSCSIIORegistryCacheInvalidate(void * context,io_iterator_t iterator)
+{
+    io_object_t entry;
+    while((entry = IOIteratorNext(iterator)) != IO_OBJECT_NULL)
+        IOObjectRelease(entry);
+    
+    pthread_mutex_lock(&iSCSIIORegistryCacheLock);
+    iSCSIIORegistryCacheFlushLocked();
+    iSCSIIORegistryCacheGeneration++;
+    pthread_mutex_unlock(&iSCSIIORegistryCacheLock);
+}
+
+/*! Registers for termination notifications of the specified IOKit class.
+ *  @param port the notification port to use.
+ *  @param className the class of objects to watch.
+ *  @return true if the notification was armed. */
+static Boolean iSCSIIORegistryCacheWatchClass(IONotificationPortRef port,const char * className)
+{
+    io_iterator_t iterator = IO_OBJECT_NULL;
+    
+    // The matching dictionary is consumed by this call
+    if(IOServiceAddMatchingNotification(port,kIOTerminatedNotification,IOServiceMatching(className),
+                                        iSCSIIORegistryCacheInvalidate,NULL,&iterator) != kIOReturnSuccess)
+        return false;
+    
+    // Drain the iterator to arm the notification (the iterator is kept)
+    iSCSIIORegistryCacheInvalidate(NULL,iterator);
+    return true;
+}
+
+/*! Sets up the notifications used to invalidate the cache.  Notifications
+ *  are delivered on a private queue so that the cache is invalidated
+ *  regardless of whether the caller runs a run loop. */
+static void iSCSIIORegistryCacheInitialize()
+{
+    dispatch_queue_t queue = dispatch_queue_create("com.github.iscsi-osx.ioregistry",DISPATCH_QUEUE_SERIAL);
+    IONotificationPortRef port = IONotificationPortCreate(kIOMasterPortDefault);
+    
+    if(!queue || !port)
+        goto CACHE_INITIALIZE_FAILURE;
+    
+    IONotificationPortSetDispatchQueue(port,queue);
+    
+    if(!iSCSIIORegistryCacheWatchClass(port,kiSCSIVirtualHBA_IOClassName) ||
+       !iSCSIIORegistryCacheWatchClass(port,kiSCSIIORegistryTargetClassName))
+        goto CACHE_INITIALIZE_FAILURE;
+    
+    iSCSIIORegistryCachedTargets = CFDictionaryCreateMutable(kCFAllocatorDefault,0,
+                                                             &kCFTypeDictionaryKeyCallBacks,
+                                                             &kCFTypeDictionaryValueCallBacks);
+    if(!iSCSIIORegistryCachedTargets)
+        goto CACHE_INITIALIZE_FAILURE;
+    
+    // The port and queue live for the remainder of the process
+    iSCSIIORegistryCacheEnabled = true;
+    return;
+    
+CACHE_INITIALIZE_FAILURE:
+    // Notifications that were armed on the port are torn down with it
+    if(port)
+        IONotificationPortDestroy(port);
+    if(queue)
+        dispatch_release(queue);
+}
+
+/*! Creates the iSCSIVirtualHBA object by querying the IO registry. */
+static io_object_t iSCSIIORegistryCopyiSCSIHBAEntry()
 {
     // Create a dictionary to match iSCSIkext
     CFMutableDictionaryRef matchingDict = NULL;
@@ -53,15 +175,34 @@ io_object_t iSCSIIORegistryGetiSCSIHBAEntry()
     return service;
 }
 
-/*! Finds the target object (IOSCSIParallelInterfaceDevice) in the IO registry that
- *  corresponds to the specified target.
- *  @param targetIQN the name of the target.
- *  @return the IO registry object of the IOSCSITargetDevice for this session. */
-io_object_t iSCSIIORegistryGetTargetEntry(CFStringRef targetIQN)
+/*! Gets the iSCSIVirtualHBA object in the IO registry.*/
+io_object_t iSCSIIORegistryGetiSCSIHBAEntry()
 {
-    if(!targetIQN)
-        return IO_OBJECT_NULL;
+    pthread_once(&iSCSIIORegistryCacheOnce,iSCSIIORegistryCacheInitialize);
+    
+    if(!iSCSIIORegistryCacheEnabled)
+        return iSCSIIORegistryCopyiSCSIHBAEntry();
+    
+    pthread_mutex_lock(&iSCSIIORegistryCacheLock);
+    
+    if(iSCSIIORegistryCachedHBA == IO_OBJECT_NULL)
+        iSCSIIORegistryCachedHBA = iSCSIIORegistryCopyiSCSIHBAEntry();
     
+    // Callers release the returned object
+    io_object_t service = iSCSIIORegistryCachedHBA;
+    if(service != IO_OBJECT_NULL)
+        IOObjectRetain(service);
+    
+    pthread_mutex_unlock(&iSCSIIORegistryCacheLock);
+    return service;
+}
+
+/*! Finds a target by iterating over the children of the HBA and comparing
+ *  names.  Used for kernel extensions that do not publish kiSCSITargetNameKey.
+ *  @param targetIQN the name of the target.
+ *  @return the IO registry object of the target, or IO_OBJECT_NULL. */
+static io_object_t iSCSIIORegistrySearchTargetEntry(CFStringRef targetIQN)
+{
     io_service_t service;
     if(!(service = iSCSIIORegistryGetiSCSIHBAEntry()))
         return IO_OBJECT_NULL;
@@ -69,6 +210,7 @@ io_object_t iSCSIIORegistryGetTargetEntry(CFStringRef targetIQN)
     // Iterate over the targets and find the specified target by name
     io_iterator_t iterator = IO_OBJECT_NULL;
     IORegistryEntryGetChildIterator(service,kIOServicePlane,&iterator);
+    IOObjectRelease(service);
     
     io_object_t entry;
     while((entry = IOIteratorNext(iterator)) != IO_OBJECT_NULL)
@@ -79,7 +221,7 @@ io_object_t iSCSIIORegistryGetTargetEntry(CFStringRef targetIQN)
         if(protocolDict)
         {
             CFStringRef IQN = CFDictionaryGetValue(protocolDict,CFSTR(kIOPropertyiSCSIQualifiedNameKey));
-            if(CFStringCompare(IQN,targetIQN,0) == kCFCompareEqualTo)
+            if(IQN && CFStringCompare(IQN,targetIQN,0) == kCFCompareEqualTo)
             {
                 CFRelease(protocolDict);
                 IOObjectRelease(iterator);
@@ -94,6 +236,97 @@ io_object_t iSCSIIORegistryGetTargetEntry(CFStringRef targetIQN)
     return IO_OBJECT_NULL;
 }
 
+/*! Finds a target using a matching dictionary on the name published by the
+ *  kernel extension (see kiSCSITargetNameKey).
+ *  @param targetIQN the name of the target.
+ *  @return the IO registry object of the target, or IO_OBJECT_NULL. */
+static io_object_t iSCSIIORegistryMatchTargetEntry(CFStringRef targetIQN)
+{
+    CFMutableDictionaryRef matchingDict = IOServiceMatching(kiSCSIIORegistryTargetClassName);
+    
+    if(!matchingDict)
+        return IO_OBJECT_NULL;
+    
+    const void * keys[] = { CFSTR(kiSCSITargetNameKey) };
+    const void * values[] = { targetIQN };
+    
+    CFDictionaryRef propertyDict = CFDictionaryCreate(kCFAllocatorDefault,keys,values,1,
+                                                      &kCFTypeDictionaryKeyCallBacks,
+                                                      &kCFTypeDictionaryValueCallBacks);
+    if(!propertyDict) {
+        CFRelease(matchingDict);
+        return IO_OBJECT_NULL;
+    }
+    
+    CFDictionarySetValue(matchingDict,CFSTR(kIOPropertyMatchKey),propertyDict);
+    CFRelease(propertyDict);
+    
+    // The matching dictionary is consumed by this call
+    return IOServiceGetMatchingService(kIOMasterPortDefault,matchingDict);
+}
+
+/*! Finds the target object (IOSCSIParallelInterfaceDevice) in the IO registry that
+ *  corresponds to the specified target.  Lookups are cached until a target
+ *  or the HBA is terminated.
+ *  @param targetIQN the name of the target.
+ *  @return the IO registry object of the IOSCSITargetDevice for this session. */
+io_object_t iSCSIIORegistryGetTargetEntry(CFStringRef targetIQN)
+{
+    if(!targetIQN)
+        return IO_OBJECT_NULL;
+    
+    pthread_once(&iSCSIIORegistryCacheOnce,iSCSIIORegistryCacheInitialize);
+    
+    io_object_t entry = IO_OBJECT_NULL;
+    UInt32 generation = 0;
+    
+    if(iSCSIIORegistryCacheEnabled) {
+        pthread_mutex_lock(&iSCSIIORegistryCacheLock);
+        
+        generation = iSCSIIORegistryCacheGeneration;
+        CFNumberRef cached = CFDictionaryGetValue(iSCSIIORegistryCachedTargets,targetIQN);
+        if(cached) {
+            CFNumberGetValue(cached,kCFNumberSInt32Type,&entry);
+            IOObjectRetain(entry);
+        }
+        
+        pthread_mutex_unlock(&iSCSIIORegistryCacheLock);
+        
+        if(entry != IO_OBJECT_NULL)
+            return entry;
+    }
+    
+    if((entry = iSCSIIORegistryMatchTargetEntry(targetIQN)) == IO_OBJECT_NULL)
+        entry = iSCSIIORegistrySearchTargetEntry(targetIQN);
+    
+    if(entry == IO_OBJECT_NULL || !iSCSIIORegistryCacheEnabled)
+        return entry;
+    
+    // Cache the entry unless a target was terminated while it was being
+    // looked up, in which case the entry may already be stale
+    pthread_mutex_lock(&iSCSIIORegistryCacheLock);
+    
+    if(generation == iSCSIIORegistryCacheGeneration &&
+       !CFDictionaryContainsKey(iSCSIIORegistryCachedTargets,targetIQN))
+    {
+        CFStringRef key = CFStringCreateCopy(kCFAllocatorDefault,targetIQN);
+        CFNumberRef value = CFNumberCreate(kCFAllocatorDefault,kCFNumberSInt32Type,&entry);
+        
+        if(key && value) {
+            IOObjectRetain(entry);
+            CFDictionarySetValue(iSCSIIORegistryCachedTargets,key,value);
+        }
+        
+        if(key)
+            CFRelease(key);
+        if(value)
+            CFRelease(value);
+    }
+    
+    pthread_mutex_unlock(&iSCSIIORegistryCacheLock);
+    return entry;
+}
+
 /*! Gets an iterator for traversing iSCSI targets in the I/O registry.
  *  As targets are iterated, this function may also return an IOObject that
  *  corresponds to the user client, if one is active.  Users can check for
@@ -300,3 +533,43 @@ CFDictionaryRef iSCSIIORegistryCreateCFPropertiesForIOMedia(io_object_t IOMedia)
     return propertiesDict;
 }
 
+/*! Creates a dictionary of performance counters for the session backing
+ *  the specified target.  The counters are published periodically by the
+ *  kernel extension (see kiSCSIStatisticsKey and related keys).  Counters
+ *  are cumulative; rates can be obtained by sampling at an interval.
+ *  @param target the target IO registry object.
+ *  @return a dictionary of counters, or NULL if no statistics have been
+ *  published for the target. */
+CFDictionaryRef iSCSIIORegistryCreateCFStatisticsForTarget(io_object_t target)
+{
+    if(target == IO_OBJECT_NULL)
+        return NULL;
+    
+    CFTypeRef statistics = IORegistryEntryCreateCFProperty(target,CFSTR(kiSCSIStatisticsKey),
+                                                           kCFAllocatorDefault,0);
+    
+    if(statistics && CFGetTypeID(statistics) != CFDictionaryGetTypeID()) {
+        CFRelease(statistics);
+        statistics = NULL;
+    }
+    
+    return (CFDictionaryRef)statistics;
+}
+
+/*! Resets the performance counters and latency histograms published for
+ *  a target.  Requires administrator privileges.
+ *  @param targetIQN the name of the target, or NULL to reset all targets.
+ *  @return a kernel error code indicating the result of the operation. */
+kern_return_t iSCSIIORegistryResetStatistics(CFStringRef targetIQN)
+{
+    io_object_t service = iSCSIIORegistryGetiSCSIHBAEntry();
+    
+    if(service == IO_OBJECT_NULL)
+        return kIOReturnNotFound;
+    
+    CFTypeRef value = targetIQN ? (CFTypeRef)targetIQN : (CFTypeRef)kCFBooleanTrue;
+    kern_return_t result = IORegistryEntrySetCFProperty(service,CFSTR(kiSCSIResetStatisticsKey),value);
+    
+    IOObjectRelease(service);
+    return result;
+}
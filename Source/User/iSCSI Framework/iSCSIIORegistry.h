@@ -124,4 +124,19 @@ CFDictionaryRef iSCSIIORegistryCreateCFPropertiesForLUN(io_object_t LUN);
  *  could not be found. */
 CFDictionaryRef iSCSIIORegistryCreateCFPropertiesForIOMedia(io_object_t IOMedia);
 
+/*! Creates a dictionary of performance counters for the session backing
+ *  the specified target.  The counters are published periodically by the
+ *  kernel extension (see kiSCSIStatisticsKey and related keys).  Counters
+ *  are cumulative; rates can be obtained by sampling at an interval.
+ *  @param target the target IO registry object.
+ *  @return a dictionary of counters, or NULL if no statistics have been
+ *  published for the target. */
+CFDictionaryRef iSCSIIORegistryCreateCFStatisticsForTarget(io_object_t target);
+
+/*! Resets the performance counters and latency histograms published for
+ *  a target.  Requires administrator privileges.
+ *  @param targetIQN the name of the target, or NULL to reset all targets.
+ *  @return a kernel error code indicating the result of the operation. */
+kern_return_t iSCSIIORegistryResetStatistics(CFStringRef targetIQN);
+
 #endif
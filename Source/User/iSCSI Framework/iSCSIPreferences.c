@@ -28,9 +28,14 @@
 
 #include "iSCSIPreferences.h"
 
+#include <notify.h>
+
 /*! App ID. */
 CFStringRef kiSCSIPKAppId = CFSTR(CF_PREFERENCES_APP_ID);
 
+/*! Name of the notification posted when preferences are synchronized. */
+const char * kiSCSIPreferencesChangedNotification = CF_PREFERENCES_APP_ID ".preferences";
+
 /*! Preference key name for iSCSI initiator dictionary. */
 CFStringRef kiSCSIPKInitiator = CFSTR("Initiator Node");
 
@@ -63,6 +68,9 @@ CFStringRef kiSCSIPKAutoLogin = CFSTR("Automatic Login");
 /*! Preference key name for target persistence. */
 CFStringRef kiSCSIPKPersistent = CFSTR("Persistent");
 
+/*! Preference key name for targets that must be logged in first at startup. */
+CFStringRef kiSCSIPKBootCritical = CFSTR("Boot Critical");
+
 /*! Preference key name for error recovery level. */
 CFStringRef kiSCSIPKErrorRecoveryLevel = CFSTR("Error Recovery Level");
 
@@ -109,6 +117,12 @@ CFStringRef kiSCSIPKInitiatorIQN = CFSTR("Name");
 /*! Preference key name for iSCSI initiator alias. */
 CFStringRef kiSCSIPKInitiatorAlias = CFSTR("Alias");
 
+/*! Preference key name for the maximum number of concurrent logins. */
+CFStringRef kiSCSIPKMaxConcurrentLogins = CFSTR("Maximum Concurrent Logins");
+
+/*! Preference key name for retaining sessions while the system sleeps. */
+CFStringRef kiSCSIPKRetainSessionsDuringSleep = CFSTR("Retain Sessions During Sleep");
+
 /*! Default initiator alias to use. */
 CFStringRef kiSCSIPVDefaultInitiatorAlias = CFSTR("localhost");
 
@@ -580,6 +594,48 @@ CFStringRef iSCSIPreferencesCopyInitiatorCHAPName(iSCSIPreferencesRef preference
     return CFStringCreateCopy(kCFAllocatorDefault,name);
 }
 
+/*! Sets the maximum number of logins the initiator performs concurrently
+ *  (e.g., during startup).  A value of zero selects the default. */
+void iSCSIPreferencesSetInitiatorMaxConcurrentLogins(iSCSIPreferencesRef preferences,UInt32 maxLogins)
+{
+    CFMutableDictionaryRef initiatorDict = iSCSIPreferencesGetInitiatorDict(preferences,true);
+    CFNumberRef value = CFNumberCreate(kCFAllocatorDefault,kCFNumberIntType,&maxLogins);
+    CFDictionarySetValue(initiatorDict,kiSCSIPKMaxConcurrentLogins,value);
+    CFRelease(value);
+}
+
+/*! Gets the maximum number of logins the initiator performs concurrently.
+ *  @return the maximum number of logins, or zero if the default is used. */
+UInt32 iSCSIPreferencesGetInitiatorMaxConcurrentLogins(iSCSIPreferencesRef preferences)
+{
+    CFMutableDictionaryRef initiatorDict = iSCSIPreferencesGetInitiatorDict(preferences,true);
+    CFNumberRef value = CFDictionaryGetValue(initiatorDict,kiSCSIPKMaxConcurrentLogins);
+    
+    UInt32 maxLogins = 0;
+    
+    if(value)
+        CFNumberGetValue(value,kCFNumberIntType,&maxLogins);
+    
+    return maxLogins;
+}
+
+/*! Sets whether sessions are kept (rather than logged out) while the
+ *  system sleeps. */
+void iSCSIPreferencesSetInitiatorRetainSessionsDuringSleep(iSCSIPreferencesRef preferences,Boolean retain)
+{
+    CFMutableDictionaryRef initiatorDict = iSCSIPreferencesGetInitiatorDict(preferences,true);
+    CFDictionarySetValue(initiatorDict,kiSCSIPKRetainSessionsDuringSleep,retain ? kCFBooleanTrue : kCFBooleanFalse);
+}
+
+/*! Gets whether sessions are kept (rather than logged out) while the
+ *  system sleeps.
+ *  @return true if sessions are kept, false otherwise (the default). */
+Boolean iSCSIPreferencesGetInitiatorRetainSessionsDuringSleep(iSCSIPreferencesRef preferences)
+{
+    CFMutableDictionaryRef initiatorDict = iSCSIPreferencesGetInitiatorDict(preferences,true);
+    return (CFDictionaryGetValue(initiatorDict,kiSCSIPKRetainSessionsDuringSleep) == kCFBooleanTrue);
+}
+
 /*! Sets the CHAP secret associated with the initiator.
  *  @return status indicating the result of the operation. */
 OSStatus iSCSIPreferencesSetInitiatorCHAPSecret(iSCSIPreferencesRef preferences,CFStringRef secret)
@@ -713,6 +769,43 @@ Boolean iSCSIPreferencesGetPersistenceForTarget(iSCSIPreferencesRef preferences,
     return persistent;
 }
 
+/*! Sets whether the target is required to boot (e.g., it backs a volume
+ *  needed early during startup) and should be logged in before others.
+ *  @param preferences an iSCSI preferences object.
+ *  @param targetIQN the target iSCSI qualified name (IQN).
+ *  @param bootCritical true if the target is boot-critical, false otherwise. */
+void iSCSIPreferencesSetBootCriticalForTarget(iSCSIPreferencesRef preferences,
+                                              CFStringRef targetIQN,
+                                              Boolean bootCritical)
+{
+    CFMutableDictionaryRef targetDict = iSCSIPreferencesGetTargetDict(preferences,targetIQN,true);
+    
+    if(targetDict) {
+        if(bootCritical)
+            CFDictionarySetValue(targetDict,kiSCSIPKBootCritical,kCFBooleanTrue);
+        else
+            CFDictionarySetValue(targetDict,kiSCSIPKBootCritical,kCFBooleanFalse);
+    }
+}
+
+/*! Gets whether the target is required to boot and should be logged in
+ *  before others.
+ *  @param preferences an iSCSI preferences object.
+ *  @param targetIQN the target iSCSI qualified name (IQN). */
+Boolean iSCSIPreferencesGetBootCriticalForTarget(iSCSIPreferencesRef preferences,
+                                                 CFStringRef targetIQN)
+{
+    CFMutableDictionaryRef targetDict = iSCSIPreferencesGetTargetDict(preferences,targetIQN,true);
+    Boolean bootCritical = false;
+    
+    if(targetDict) {
+        if(CFDictionaryGetValue(targetDict,kiSCSIPKBootCritical) == kCFBooleanTrue)
+            bootCritical = true;
+    }
+    
+    return bootCritical;
+}
+
 /*! Adds a target object with a specified portal.
  *  @param targetIQN the target iSCSI qualified name (IQN).
  *  @param portal the portal object to set. */
@@ -1332,6 +1425,357 @@ CFDataRef iSCSIPreferencesCreateData(iSCSIPreferencesRef preferences)
                                     kCFPropertyListBinaryFormat_v1_0,0,NULL);
 }
 
+/*! Keys used in the dictionary that represents the difference between two
+ *  preferences objects.  Top-level preferences (initiator and discovery)
+ *  are included in their entirety if they changed; targets are included
+ *  individually. */
+static CFStringRef kiSCSIPDeltaChangedTargets = CFSTR("Changed Targets");
+static CFStringRef kiSCSIPDeltaRemovedTargets = CFSTR("Removed Targets");
+static CFStringRef kiSCSIPDeltaRemovedKeys = CFSTR("Removed Keys");
+
+/*! Creates a binary representation of the changes made to a preferences
+ *  object since it was copied from another preferences object.
+ *  @param base the preferences object that the changes were made to.
+ *  @param preferences the changed preferences object.
+ *  @return a binary data representation of the changes, or NULL if there
+ *  are no changes. */
+CFDataRef iSCSIPreferencesCreateDeltaData(iSCSIPreferencesRef base,iSCSIPreferencesRef preferences)
+{
+    if(!base || !preferences)
+        return NULL;
+    
+    CFMutableDictionaryRef delta = CFDictionaryCreateMutable(kCFAllocatorDefault,0,
+                                                             &kCFTypeDictionaryKeyCallBacks,
+                                                             &kCFTypeDictionaryValueCallBacks);
+    
+    // Top-level preferences other than targets are small; include them whole
+    CFStringRef keys[] = { kiSCSIPKInitiator, kiSCSIPKDiscovery, kiSCSIPKTargets };
+    CFMutableArrayRef removedKeys = NULL;
+    
+    for(CFIndex idx = 0; idx < (CFIndex)(sizeof(keys)/sizeof(keys[0])); idx++)
+    {
+        CFDictionaryRef value = CFDictionaryGetValue(preferences,keys[idx]);
+        CFDictionaryRef baseValue = CFDictionaryGetValue(base,keys[idx]);
+        
+        if(!value && baseValue) {
+            if(!removedKeys)
+                removedKeys = CFArrayCreateMutable(kCFAllocatorDefault,0,&kCFTypeArrayCallBacks);
+            CFArrayAppendValue(removedKeys,keys[idx]);
+        }
+        else if(value && keys[idx] != kiSCSIPKTargets && (!baseValue || !CFEqual(value,baseValue)))
+            CFDictionarySetValue(delta,keys[idx],value);
+    }
+    
+    if(removedKeys) {
+        CFDictionarySetValue(delta,kiSCSIPDeltaRemovedKeys,removedKeys);
+        CFRelease(removedKeys);
+    }
+    
+    // Include targets that were added or changed
+    CFDictionaryRef targets = CFDictionaryGetValue(preferences,kiSCSIPKTargets);
+    CFDictionaryRef baseTargets = CFDictionaryGetValue(base,kiSCSIPKTargets);
+    CFIndex targetCount = targets ? CFDictionaryGetCount(targets) : 0;
+    CFIndex baseTargetCount = baseTargets ? CFDictionaryGetCount(baseTargets) : 0;
+    
+    if(targetCount > 0)
+    {
+        const void * targetIQNs[targetCount];
+        const void * targetDicts[targetCount];
+        CFDictionaryGetKeysAndValues(targets,targetIQNs,targetDicts);
+        
+        CFMutableDictionaryRef changedTargets = NULL;
+        
+        for(CFIndex idx = 0; idx < targetCount; idx++)
+        {
+            CFDictionaryRef baseTarget = baseTargets ? CFDictionaryGetValue(baseTargets,targetIQNs[idx]) : NULL;
+            
+            if(baseTarget && CFEqual(baseTarget,targetDicts[idx]))
+                continue;
+            
+            if(!changedTargets)
+                changedTargets = CFDictionaryCreateMutable(kCFAllocatorDefault,0,
+                                                           &kCFTypeDictionaryKeyCallBacks,
+                                                           &kCFTypeDictionaryValueCallBacks);
+            
+            CFDictionarySetValue(changedTargets,targetIQNs[idx],targetDicts[idx]);
+        }
+        
+        if(changedTargets) {
+            CFDictionarySetValue(delta,kiSCSIPDeltaChangedTargets,changedTargets);
+            CFRelease(changedTargets);
+        }
+    }
+    
+    // Include the names of targets that were removed
+    if(baseTargetCount > 0 && targets)
+    {
+        const void * baseTargetIQNs[baseTargetCount];
+        CFDictionaryGetKeysAndValues(baseTargets,baseTargetIQNs,NULL);
+        
+        CFMutableArrayRef removedTargets = NULL;
+        
+        for(CFIndex idx = 0; idx < baseTargetCount; idx++)
+        {
+            if(CFDictionaryContainsKey(targets,baseTargetIQNs[idx]))
+                continue;
+            
+            if(!removedTargets)
+                removedTargets = CFArrayCreateMutable(kCFAllocatorDefault,0,&kCFTypeArrayCallBacks);
+            
+            CFArrayAppendValue(removedTargets,baseTargetIQNs[idx]);
+        }
+        
+        if(removedTargets) {
+            CFDictionarySetValue(delta,kiSCSIPDeltaRemovedTargets,removedTargets);
+            CFRelease(removedTargets);
+        }
+    }
+    
+    CFDataRef data = NULL;
+    
+    if(CFDictionaryGetCount(delta) > 0)
+        data = CFPropertyListCreateData(kCFAllocatorDefault,delta,kCFPropertyListBinaryFormat_v1_0,0,NULL);
+    
+    CFRelease(delta);
+    return data;
+}
+
+/*! Determines whether a value is present and of the specified type. */
+static Boolean iSCSIPreferencesIsType(CFTypeRef value,CFTypeID typeID)
+{
+    return value && CFGetTypeID(value) == typeID;
+}
+
+/*! Determines whether the values of the specified keys of a dictionary are
+ *  either absent or of the specified type. */
+static Boolean iSCSIPreferencesHasValuesOfType(CFDictionaryRef dict,
+                                               const CFStringRef * keys,
+                                               CFIndex keyCount,
+                                               CFTypeID typeID)
+{
+    for(CFIndex idx = 0; idx < keyCount; idx++)
+    {
+        CFTypeRef value = CFDictionaryGetValue(dict,keys[idx]);
+        
+        if(value && CFGetTypeID(value) != typeID)
+            return false;
+    }
+    return true;
+}
+
+/*! Determines whether an array only contains strings. */
+static Boolean iSCSIPreferencesIsArrayOfStrings(CFTypeRef array)
+{
+    if(!iSCSIPreferencesIsType(array,CFArrayGetTypeID()))
+        return false;
+    
+    CFIndex count = CFArrayGetCount(array);
+    
+    for(CFIndex idx = 0; idx < count; idx++)
+        if(!iSCSIPreferencesIsType(CFArrayGetValueAtIndex(array,idx),CFStringGetTypeID()))
+            return false;
+    
+    return true;
+}
+
+/*! Determines whether a dictionary of portals (keyed by portal address) is
+ *  valid, as found in target and discovery preferences.
+ *  @param discovery true if the portals are discovery portals. */
+static Boolean iSCSIPreferencesIsValidPortals(CFTypeRef portals,Boolean discovery)
+{
+    if(!iSCSIPreferencesIsType(portals,CFDictionaryGetTypeID()))
+        return false;
+    
+    CFIndex count = CFDictionaryGetCount(portals);
+    const void * addresses[count];
+    const void * portalDicts[count];
+    CFDictionaryGetKeysAndValues(portals,addresses,portalDicts);
+    
+    const CFStringRef stringKeys[] = { kiSCSIPKPortalPort, kiSCSIPKPortalHostInterface };
+    
+    for(CFIndex idx = 0; idx < count; idx++)
+    {
+        if(!iSCSIPreferencesIsType(addresses[idx],CFStringGetTypeID()) ||
+           !iSCSIPreferencesIsType(portalDicts[idx],CFDictionaryGetTypeID()) ||
+           !iSCSIPreferencesHasValuesOfType(portalDicts[idx],stringKeys,2,CFStringGetTypeID()))
+            return false;
+        
+        CFTypeRef targets = CFDictionaryGetValue(portalDicts[idx],kiSCSIPKDiscoveryTargetsForPortal);
+        
+        if(discovery && targets && !iSCSIPreferencesIsArrayOfStrings(targets))
+            return false;
+    }
+    return true;
+}
+
+/*! Determines whether the initiator or discovery dictionary of a delta has
+ *  values of the types the preferences functions expect.
+ *  @param key either kiSCSIPKInitiator or kiSCSIPKDiscovery. */
+static Boolean iSCSIPreferencesIsValidSection(CFStringRef key,CFTypeRef dict)
+{
+    if(!iSCSIPreferencesIsType(dict,CFDictionaryGetTypeID()))
+        return false;
+    
+    if(key == kiSCSIPKInitiator) {
+        const CFStringRef stringKeys[] = {
+            kiSCSIPKInitiatorIQN, kiSCSIPKInitiatorAlias, kiSCSIPKAuth, kiSCSIPKAuthCHAPName
+        };
+        const CFStringRef numberKeys[] = { kiSCSIPKMaxConcurrentLogins };
+        
+        return iSCSIPreferencesHasValuesOfType(dict,stringKeys,4,CFStringGetTypeID()) &&
+               iSCSIPreferencesHasValuesOfType(dict,numberKeys,1,CFNumberGetTypeID());
+    }
+    
+    const CFStringRef numberKeys[] = { kiSCSIPKDiscoveryInterval };
+    CFTypeRef portals = CFDictionaryGetValue(dict,kiSCSIPKDiscoveryPortals);
+    
+    return iSCSIPreferencesHasValuesOfType(dict,numberKeys,1,CFNumberGetTypeID()) &&
+           (!portals || iSCSIPreferencesIsValidPortals(portals,true));
+}
+
+/*! Determines whether a target dictionary of a delta has values of the
+ *  types the preferences functions expect. */
+static Boolean iSCSIPreferencesIsValidTarget(CFTypeRef targetIQN,CFTypeRef targetDict)
+{
+    if(!iSCSIPreferencesIsType(targetIQN,CFStringGetTypeID()) ||
+       !iSCSIPreferencesIsType(targetDict,CFDictionaryGetTypeID()))
+        return false;
+    
+    const CFStringRef stringKeys[] = {
+        kiSCSIPKTargetAlias, kiSCSIPKTargetConfigType, kiSCSIPKDataDigest, kiSCSIPKHeaderDigest,
+        kiSCSIPKAuth, kiSCSIPKAuthCHAPName, kiSCSIPKSendTargetsPortal
+    };
+    const CFStringRef numberKeys[] = { kiSCSIPKErrorRecoveryLevel, kiSCSIPKMaxConnections };
+    CFTypeRef portals = CFDictionaryGetValue(targetDict,kiSCSIPKPortals);
+    
+    return iSCSIPreferencesHasValuesOfType(targetDict,stringKeys,7,CFStringGetTypeID()) &&
+           iSCSIPreferencesHasValuesOfType(targetDict,numberKeys,2,CFNumberGetTypeID()) &&
+           (!portals || iSCSIPreferencesIsValidPortals(portals,false));
+}
+
+/*! Determines whether a delta created by iSCSIPreferencesCreateDeltaData()
+ *  is well-formed, so that it can be applied without further checks. */
+static Boolean iSCSIPreferencesIsValidDelta(CFDictionaryRef delta)
+{
+    CFTypeRef removedKeys = CFDictionaryGetValue(delta,kiSCSIPDeltaRemovedKeys);
+    
+    if(removedKeys) {
+        if(!iSCSIPreferencesIsArrayOfStrings(removedKeys))
+            return false;
+        
+        // Only the initiator, targets and discovery sections are removed
+        CFIndex count = CFArrayGetCount(removedKeys);
+        
+        for(CFIndex idx = 0; idx < count; idx++)
+        {
+            CFStringRef key = CFArrayGetValueAtIndex(removedKeys,idx);
+            
+            if(!CFEqual(key,kiSCSIPKInitiator) && !CFEqual(key,kiSCSIPKTargets) && !CFEqual(key,kiSCSIPKDiscovery))
+                return false;
+        }
+    }
+    
+    CFStringRef keys[] = { kiSCSIPKInitiator, kiSCSIPKDiscovery };
+    
+    for(CFIndex idx = 0; idx < (CFIndex)(sizeof(keys)/sizeof(keys[0])); idx++)
+    {
+        CFTypeRef value = CFDictionaryGetValue(delta,keys[idx]);
+        
+        if(value && !iSCSIPreferencesIsValidSection(keys[idx],value))
+            return false;
+    }
+    
+    CFTypeRef changedTargets = CFDictionaryGetValue(delta,kiSCSIPDeltaChangedTargets);
+    
+    if(changedTargets)
+    {
+        if(!iSCSIPreferencesIsType(changedTargets,CFDictionaryGetTypeID()))
+            return false;
+        
+        CFIndex count = CFDictionaryGetCount(changedTargets);
+        const void * targetIQNs[count];
+        const void * targetDicts[count];
+        CFDictionaryGetKeysAndValues(changedTargets,targetIQNs,targetDicts);
+        
+        for(CFIndex idx = 0; idx < count; idx++)
+            if(!iSCSIPreferencesIsValidTarget(targetIQNs[idx],targetDicts[idx]))
+                return false;
+    }
+    
+    CFTypeRef removedTargets = CFDictionaryGetValue(delta,kiSCSIPDeltaRemovedTargets);
+    
+    return !removedTargets || iSCSIPreferencesIsArrayOfStrings(removedTargets);
+}
+
+/*! Applies changes created by iSCSIPreferencesCreateDeltaData() to a
+ *  preferences object.
+ *  @param preferences the preferences object to update.
+ *  @param data the binary data representation of the changes.
+ *  @return true if the changes were applied, false if the data is invalid. */
+Boolean iSCSIPreferencesApplyDeltaData(iSCSIPreferencesRef preferences,CFDataRef data)
+{
+    if(!preferences || !data)
+        return false;
+    
+    CFPropertyListFormat format;
+    CFDictionaryRef delta = CFPropertyListCreateWithData(kCFAllocatorDefault,data,
+                                                         kCFPropertyListMutableContainersAndLeaves,
+                                                         &format,NULL);
+    if(!delta)
+        return false;
+    
+    // Nothing is changed unless the whole delta is valid
+    if(format != kCFPropertyListBinaryFormat_v1_0 || CFGetTypeID(delta) != CFDictionaryGetTypeID() ||
+       !iSCSIPreferencesIsValidDelta(delta)) {
+        CFRelease(delta);
+        return false;
+    }
+    
+    CFArrayRef removedKeys = CFDictionaryGetValue(delta,kiSCSIPDeltaRemovedKeys);
+    CFIndex removedKeyCount = removedKeys ? CFArrayGetCount(removedKeys) : 0;
+    
+    for(CFIndex idx = 0; idx < removedKeyCount; idx++)
+        CFDictionaryRemoveValue(preferences,CFArrayGetValueAtIndex(removedKeys,idx));
+    
+    CFStringRef keys[] = { kiSCSIPKInitiator, kiSCSIPKDiscovery };
+    
+    for(CFIndex idx = 0; idx < (CFIndex)(sizeof(keys)/sizeof(keys[0])); idx++)
+    {
+        CFDictionaryRef value = CFDictionaryGetValue(delta,keys[idx]);
+        
+        if(value)
+            CFDictionarySetValue(preferences,keys[idx],value);
+    }
+    
+    CFDictionaryRef changedTargets = CFDictionaryGetValue(delta,kiSCSIPDeltaChangedTargets);
+    CFArrayRef removedTargets = CFDictionaryGetValue(delta,kiSCSIPDeltaRemovedTargets);
+    
+    if(changedTargets || removedTargets)
+    {
+        CFMutableDictionaryRef targets = iSCSIPreferencesGetTargets(preferences,true);
+        
+        if(changedTargets) {
+            CFIndex targetCount = CFDictionaryGetCount(changedTargets);
+            const void * targetIQNs[targetCount];
+            const void * targetDicts[targetCount];
+            CFDictionaryGetKeysAndValues(changedTargets,targetIQNs,targetDicts);
+            
+            for(CFIndex idx = 0; idx < targetCount; idx++)
+                CFDictionarySetValue(targets,targetIQNs[idx],targetDicts[idx]);
+        }
+        
+        if(removedTargets) {
+            CFIndex targetCount = CFArrayGetCount(removedTargets);
+            
+            for(CFIndex idx = 0; idx < targetCount; idx++)
+                CFDictionaryRemoveValue(targets,CFArrayGetValueAtIndex(removedTargets,idx));
+        }
+    }
+    
+    CFRelease(delta);
+    return true;
+}
+
 /*! Creates a new iSCSI preferences object.
  *  @return a new (empty) preferences object. */
 iSCSIPreferencesRef iSCSIPreferencesCreate()
@@ -1421,7 +1865,13 @@ void iSCSIPreferencesUpdateWithAppValues(iSCSIPreferencesRef preferences)
 Boolean iSCSIPreferencesSynchronzeAppValues(iSCSIPreferencesRef preferences)
 {
     CFPreferencesSetMultiple((CFDictionaryRef)preferences,0,kiSCSIPKAppId,kCFPreferencesAnyUser,kCFPreferencesCurrentHost);
-    return CFPreferencesSynchronize(kiSCSIPKAppId,kCFPreferencesAnyUser,kCFPreferencesCurrentHost);
+    
+    if(!CFPreferencesSynchronize(kiSCSIPKAppId,kCFPreferencesAnyUser,kCFPreferencesCurrentHost))
+        return false;
+    
+    // Let the daemon (and other clients) know that their copies are stale
+    notify_post(kiSCSIPreferencesChangedNotification);
+    return true;
 }
 
 
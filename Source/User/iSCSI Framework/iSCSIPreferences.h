@@ -39,6 +39,10 @@
 
 typedef CFMutableDictionaryRef iSCSIPreferencesRef;
 
+/*! Name of the notification (see notify(3)) that is posted whenever the
+ *  stored preferences are updated by iSCSIPreferencesSynchronzeAppValues(). */
+extern const char * kiSCSIPreferencesChangedNotification;
+
 
 /*! Copies the initiator name from preferences into a CFString object.
  *  @param preferences an iSCSI preferences object.
@@ -80,6 +84,32 @@ void iSCSIPreferencesSetInitiatorCHAPName(iSCSIPreferencesRef preferences,
  *  @param preferences an iSCSI preferences object. */
 CFStringRef iSCSIPreferencesCopyInitiatorCHAPName(iSCSIPreferencesRef preferences);
 
+/*! Sets the maximum number of logins the initiator performs concurrently
+ *  (e.g., during startup).
+ *  @param preferences an iSCSI preferences object.
+ *  @param maxLogins the maximum number of logins (zero selects the default). */
+void iSCSIPreferencesSetInitiatorMaxConcurrentLogins(iSCSIPreferencesRef preferences,
+                                                     UInt32 maxLogins);
+
+/*! Gets the maximum number of logins the initiator performs concurrently.
+ *  @param preferences an iSCSI preferences object.
+ *  @return the maximum number of logins, or zero if the default is used. */
+UInt32 iSCSIPreferencesGetInitiatorMaxConcurrentLogins(iSCSIPreferencesRef preferences);
+
+/*! Sets whether sessions are kept while the system sleeps.  If set, the
+ *  connections of each session are closed before the system sleeps and
+ *  restored upon wakeup, while volumes remain mounted; otherwise volumes
+ *  are unmounted and sessions are logged out.
+ *  @param preferences an iSCSI preferences object.
+ *  @param retain true to keep sessions while the system sleeps. */
+void iSCSIPreferencesSetInitiatorRetainSessionsDuringSleep(iSCSIPreferencesRef preferences,
+                                                           Boolean retain);
+
+/*! Gets whether sessions are kept while the system sleeps.
+ *  @param preferences an iSCSI preferences object.
+ *  @return true if sessions are kept, false otherwise (the default). */
+Boolean iSCSIPreferencesGetInitiatorRetainSessionsDuringSleep(iSCSIPreferencesRef preferences);
+
 /*! Copies a target object for the specified target.
  *  @param preferences an iSCSI preferences object.
  *  @param targetIQN the target iSCSI qualified name (IQN).
@@ -168,6 +198,22 @@ void iSCSIPreferencesSetPersistenceForTarget(iSCSIPreferencesRef preferences,
 Boolean iSCSIPreferencesGetPersistenceForTarget(iSCSIPreferencesRef preferences,
                                                 CFStringRef targetIQN);
 
+/*! Sets whether the target is required to boot (e.g., it backs a volume
+ *  needed early during startup) and should be logged in before others.
+ *  @param preferences an iSCSI preferences object.
+ *  @param targetIQN the target iSCSI qualified name (IQN).
+ *  @param bootCritical true if the target is boot-critical, false otherwise. */
+void iSCSIPreferencesSetBootCriticalForTarget(iSCSIPreferencesRef preferences,
+                                              CFStringRef targetIQN,
+                                              Boolean bootCritical);
+
+/*! Gets whether the target is required to boot and should be logged in
+ *  before others.
+ *  @param preferences an iSCSI preferences object.
+ *  @param targetIQN the target iSCSI qualified name (IQN). */
+Boolean iSCSIPreferencesGetBootCriticalForTarget(iSCSIPreferencesRef preferences,
+                                                 CFStringRef targetIQN);
+
 /*! Sets the maximum number of connections for the specified target.
  *  @param preferences an iSCSI preferences object.
  *  @param targetIQN the target iSCSI qualified name (IQN).
@@ -410,6 +456,22 @@ CFDictionaryRef iSCSIPreferencesCreateDictionary(iSCSIPreferencesRef preferences
  *  @return a binary data representation of a preferences object. */
 CFDataRef iSCSIPreferencesCreateData(iSCSIPreferencesRef preferences);
 
+/*! Creates a binary representation of the changes made to a preferences
+ *  object since it was copied from another preferences object.  Only the
+ *  targets that were added, changed or removed are included.
+ *  @param base the preferences object that the changes were made to.
+ *  @param preferences the changed preferences object.
+ *  @return a binary data representation of the changes, or NULL if there
+ *  are no changes. */
+CFDataRef iSCSIPreferencesCreateDeltaData(iSCSIPreferencesRef base,iSCSIPreferencesRef preferences);
+
+/*! Applies changes created by iSCSIPreferencesCreateDeltaData() to a
+ *  preferences object.
+ *  @param preferences the preferences object to update.
+ *  @param data the binary data representation of the changes.
+ *  @return true if the changes were applied, false if the data is invalid. */
+Boolean iSCSIPreferencesApplyDeltaData(iSCSIPreferencesRef preferences,CFDataRef data);
+
 /*! Creates a new iSCSI preferences object.
  *  @return a new (empty) preferences object. */
 iSCSIPreferencesRef iSCSIPreferencesCreate(void);
@@ -433,7 +495,8 @@ iSCSIPreferencesRef iSCSIPreferencesCreateWithData(CFDataRef data);
  *  @param preferences an iSCSI preferences object. */
 void iSCSIPreferencesUpdateWithAppValues(iSCSIPreferencesRef preferences);
 
-/*! Synchronizes application values with those in the preferences object.
+/*! Synchronizes application values with those in the preferences object
+ *  and posts kiSCSIPreferencesChangedNotification.
  *  @param preferences an iSCSI preferences object.
  *  @return true if application values were successfully updated. */
 Boolean iSCSIPreferencesSynchronzeAppValues(iSCSIPreferencesRef preferences);
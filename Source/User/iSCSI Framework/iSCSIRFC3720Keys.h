@@ -116,4 +116,8 @@ static CFStringRef kRFC3720_Key_SessionId = CFSTR("SessionId");
 // Not technically a RFC3720 key but used to get the connection identifier
 static CFStringRef kRFC3720_Key_ConnectionId = CFSTR("ConnectionId");
 
+// Not technically a RFC3720 key but used to list the properties of each
+// connection of a session (keyed by portal address) with those of the session
+static CFStringRef kRFC3720_Key_Connections = CFSTR("Connections");
+
 #endif
@@ -27,6 +27,7 @@
  */
 
 #include "iSCSITypes.h"
+#include <string.h>
 
 /*! iSCSI portal records are dictionaries with three keys with string values
  *  that specify the address (DNS name or IP address), the port, and the
@@ -37,20 +38,265 @@ CFStringRef kiSCSIPortalHostInterfaceKey = CFSTR("Host Interface");
 
 
 
-/*! Creates a new portal object from byte representation. */
-iSCSIPortalRef iSCSIPortalCreateWithData(CFDataRef data)
+/*! Portals and targets are exchanged between the daemon and its clients in
+ *  a compact binary format rather than as property lists.  A record starts
+ *  with a header (version, record type and the number of strings that
+ *  follow), followed by the strings of the record.  Each string is a 16-bit
+ *  length followed by that many bytes of UTF-8 (a length of
+ *  kiSCSIWireStringAbsent indicates that the value is not present).  Lengths
+ *  are in host byte order, since both ends run on the same host.  Records
+ *  are decoded in place from the received bytes. */
+typedef struct iSCSIWireHeader {
+    UInt8 version;
+    UInt8 type;
+    UInt16 count;
+} __attribute__((packed)) iSCSIWireHeader;
+
+/*! Version of the wire format. */
+static const UInt8 kiSCSIWireVersion = 1;
+
+/*! Record types. */
+enum iSCSIWireRecordTypes {
+    
+    /*! Portal (address, port and host interface). */
+    kiSCSIWireRecordPortal = 1,
+    
+    /*! Target (name and alias). */
+    kiSCSIWireRecordTarget = 2,
+    
+    /*! Array of targets (the count is the number of targets). */
+    kiSCSIWireRecordTargetArray = 3
+};
+
+/*! String length used to indicate that a value is not present. */
+static const UInt16 kiSCSIWireStringAbsent = 0xFFFF;
+
+/*! Number of strings in each portal record. */
+#define kiSCSIWirePortalStringCount 3
+
+/*! Number of strings in each target record. */
+#define kiSCSIWireTargetStringCount 2
+
+/*! Appends a header to wire format data. */
+static void iSCSIWireAppendHeader(CFMutableDataRef data,UInt8 type,UInt16 count)
 {
-    CFPropertyListFormat format;
-    iSCSIPortalRef portal = CFPropertyListCreateWithData(
-            kCFAllocatorDefault,data,kCFPropertyListImmutable,&format,NULL);
+    iSCSIWireHeader header = { .version = kiSCSIWireVersion, .type = type, .count = count };
+    CFDataAppendBytes(data,(const UInt8 *)&header,sizeof(header));
+}
+
+/*! Appends a string to wire format data.
+ *  @return true if the string was appended, false if it is too long. */
+static Boolean iSCSIWireAppendString(CFMutableDataRef data,CFStringRef string)
+{
+    UInt16 length = kiSCSIWireStringAbsent;
     
-    if(format == kCFPropertyListBinaryFormat_v1_0)
-        return portal;
+    if(!string || CFGetTypeID(string) != CFStringGetTypeID()) {
+        CFDataAppendBytes(data,(const UInt8 *)&length,sizeof(length));
+        return true;
+    }
+    
+    CFRange range = CFRangeMake(0,CFStringGetLength(string));
+    CFIndex byteCount = 0;
+    CFStringGetBytes(string,range,kCFStringEncodingUTF8,0,false,NULL,0,&byteCount);
+    
+    if(byteCount >= kiSCSIWireStringAbsent)
+        return false;
+    
+    length = (UInt16)byteCount;
+    CFDataAppendBytes(data,(const UInt8 *)&length,sizeof(length));
+    
+    CFIndex offset = CFDataGetLength(data);
+    CFDataIncreaseLength(data,byteCount);
+    CFStringGetBytes(string,range,kCFStringEncodingUTF8,0,false,
+                     CFDataGetMutableBytePtr(data) + offset,byteCount,NULL);
+    return true;
+}
+
+/*! Reads a header from wire format data.
+ *  @return true if a valid header of the specified type was read. */
+static Boolean iSCSIWireGetHeader(const UInt8 * * cursor,const UInt8 * end,UInt8 type,UInt16 * count)
+{
+    iSCSIWireHeader header;
+    
+    if(end - *cursor < (ptrdiff_t)sizeof(header))
+        return false;
+    
+    memcpy(&header,*cursor,sizeof(header));
+    *cursor += sizeof(header);
+    *count = header.count;
+    
+    return header.version == kiSCSIWireVersion && header.type == type;
+}
 
-    CFRelease(portal);
+/*! Reads a string from wire format data.
+ *  @param string set to the string that was read (NULL if the value is not
+ *  present); must be released by the caller.
+ *  @return true if a string was read, false if the data is malformed. */
+static Boolean iSCSIWireGetString(const UInt8 * * cursor,const UInt8 * end,CFStringRef * string)
+{
+    UInt16 length;
+    *string = NULL;
+    
+    if(end - *cursor < (ptrdiff_t)sizeof(length))
+        return false;
+    
+    memcpy(&length,*cursor,sizeof(length));
+    *cursor += sizeof(length);
+    
+    if(length == kiSCSIWireStringAbsent)
+        return true;
+    
+    if(end - *cursor < length)
+        return false;
+    
+    *string = CFStringCreateWithBytes(kCFAllocatorDefault,*cursor,length,kCFStringEncodingUTF8,false);
+    *cursor += length;
+    
+    return (*string != NULL);
+}
+
+/*! Reads a record with the specified keys from wire format data and creates
+ *  a dictionary with the values that are present.
+ *  @param requiredCount the number of leading keys that must be present.
+ *  @return the dictionary, or NULL if the data is malformed. */
+static CFDictionaryRef iSCSIWireCreateDictionary(const UInt8 * * cursor,
+                                                 const UInt8 * end,
+                                                 const CFStringRef * keys,
+                                                 CFIndex keyCount,
+                                                 CFIndex requiredCount)
+{
+    const void * presentKeys[keyCount];
+    const void * values[keyCount];
+    CFIndex count = 0;
+    Boolean valid = true;
+    
+    for(CFIndex idx = 0; idx < keyCount && valid; idx++)
+    {
+        CFStringRef value = NULL;
+        
+        if((valid = iSCSIWireGetString(cursor,end,&value)) && value) {
+            presentKeys[count] = keys[idx];
+            values[count++] = value;
+        }
+        else if(idx < requiredCount)
+            valid = false;
+    }
+    
+    CFDictionaryRef dict = NULL;
+    
+    if(valid)
+        dict = CFDictionaryCreate(kCFAllocatorDefault,presentKeys,values,count,
+                                  &kCFTypeDictionaryKeyCallBacks,
+                                  &kCFTypeDictionaryValueCallBacks);
+    
+    for(CFIndex idx = 0; idx < count; idx++)
+        CFRelease(values[idx]);
+    
+    return dict;
+}
+
+/*! Reads a single record of the specified type from wire format data.  The
+ *  record must be the only content of the data.
+ *  @param requiredCount the number of leading keys that must be present.
+ *  @return the record, or NULL if the data is malformed. */
+static CFDictionaryRef iSCSIWireCreateRecord(CFDataRef data,
+                                             UInt8 type,
+                                             const CFStringRef * keys,
+                                             CFIndex keyCount,
+                                             CFIndex requiredCount)
+{
+    const UInt8 * cursor = CFDataGetBytePtr(data);
+    const UInt8 * end = cursor + CFDataGetLength(data);
+    
+    UInt16 count;
+    if(!iSCSIWireGetHeader(&cursor,end,type,&count) || count != keyCount)
+        return NULL;
+    
+    CFDictionaryRef dict = iSCSIWireCreateDictionary(&cursor,end,keys,keyCount,requiredCount);
+    
+    if(dict && cursor != end) {
+        CFRelease(dict);
+        return NULL;
+    }
+    
+    return dict;
+}
+
+/*! Determines whether a record decoded from a property list has string
+ *  values for the required (leading) keys. */
+static Boolean iSCSIWireHasRequiredStrings(CFTypeRef record,const CFStringRef * keys,CFIndex requiredCount)
+{
+    if(CFGetTypeID(record) != CFDictionaryGetTypeID())
+        return false;
+    
+    for(CFIndex idx = 0; idx < requiredCount; idx++)
+    {
+        CFTypeRef value = CFDictionaryGetValue(record,keys[idx]);
+        
+        if(!value || CFGetTypeID(value) != CFStringGetTypeID())
+            return false;
+    }
+    
+    return true;
+}
+
+/*! Determines whether data is a binary property list (used by earlier
+ *  versions of the framework), rather than wire format data. */
+static Boolean iSCSIWireIsPropertyList(CFDataRef data)
+{
+    static const UInt8 magic[] = { 'b','p','l','i','s','t' };
+    
+    return CFDataGetLength(data) >= (CFIndex)sizeof(magic) &&
+           memcmp(CFDataGetBytePtr(data),magic,sizeof(magic)) == 0;
+}
+
+/*! Creates an object from a binary property list (used by earlier versions
+ *  of the framework).
+ *  @param data the property list data.
+ *  @param typeID the expected type of the object (e.g., a dictionary).
+ *  @return the object, or NULL if the data is not a binary property list
+ *  of the expected type. */
+static CFPropertyListRef iSCSIWireCreateWithPropertyList(CFDataRef data,CFTypeID typeID)
+{
+    CFPropertyListFormat format = 0;
+    CFPropertyListRef plist = CFPropertyListCreateWithData(
+            kCFAllocatorDefault,data,kCFPropertyListImmutable,&format,NULL);
+    
+    if(!plist)
+        return NULL;
+    
+    if(format == kCFPropertyListBinaryFormat_v1_0 && CFGetTypeID(plist) == typeID)
+        return plist;
+    
+    CFRelease(plist);
     return NULL;
 }
 
+/*! Creates a new portal object from byte representation. */
+iSCSIPortalRef iSCSIPortalCreateWithData(CFDataRef data)
+{
+    if(!data)
+        return NULL;
+    
+    // Every portal has an address, a port and a host interface
+    const CFStringRef keys[kiSCSIWirePortalStringCount] = {
+        kiSCSIPortalAddresssKey, kiSCSIPortalPortKey, kiSCSIPortalHostInterfaceKey
+    };
+    
+    if(!iSCSIWireIsPropertyList(data))
+        return iSCSIWireCreateRecord(data,kiSCSIWireRecordPortal,keys,
+                                     kiSCSIWirePortalStringCount,kiSCSIWirePortalStringCount);
+    
+    iSCSIPortalRef portal = iSCSIWireCreateWithPropertyList(data,CFDictionaryGetTypeID());
+    
+    if(portal && !iSCSIWireHasRequiredStrings(portal,keys,kiSCSIWirePortalStringCount)) {
+        CFRelease(portal);
+        return NULL;
+    }
+    
+    return portal;
+}
+
 /*! Convenience function.  Creates a new iSCSIPortalRef with the above keys. */
 iSCSIMutablePortalRef iSCSIPortalCreateMutable()
 {
@@ -127,29 +373,51 @@ CFDictionaryRef iSCSIPortalCreateDictionary(iSCSIPortalRef portal)
 /*! Copies the portal object to a byte array representation. */
 CFDataRef iSCSIPortalCreateData(iSCSIPortalRef portal)
 {
-    return CFPropertyListCreateData(kCFAllocatorDefault,(CFPropertyListRef) portal ,kCFPropertyListBinaryFormat_v1_0,0,NULL);
+    if(!portal)
+        return NULL;
+    
+    CFMutableDataRef data = CFDataCreateMutable(kCFAllocatorDefault,0);
+    iSCSIWireAppendHeader(data,kiSCSIWireRecordPortal,kiSCSIWirePortalStringCount);
+    
+    if(!iSCSIWireAppendString(data,iSCSIPortalGetAddress(portal)) ||
+       !iSCSIWireAppendString(data,iSCSIPortalGetPort(portal)) ||
+       !iSCSIWireAppendString(data,iSCSIPortalGetHostInterface(portal)))
+    {
+        CFRelease(data);
+        return NULL;
+    }
+    
+    return data;
 }
 
 
+/*! iSCSI target records are dictionaries with keys with string values
+ *  that specify the target name and other parameters. */
+CFStringRef kiSCSITargetIQNKey = CFSTR("Target Name");
+CFStringRef kiSCSITargetAliasKey = CFSTR("Target Alias");
+
 /*! Creates a new target object from byte representation. */
 iSCSISessionConfigRef iSCSITargetCreateWithData(CFDataRef data)
 {
-    CFPropertyListFormat format;
+    if(!data)
+        return NULL;
     
-    iSCSITargetRef target = CFPropertyListCreateWithData(kCFAllocatorDefault,data,0,&format,NULL);
-
-    if(format == kCFPropertyListBinaryFormat_v1_0)
-        return target;
-
-    CFRelease(target);
-    return NULL;
+    // Every target has a name; the alias is optional
+    const CFStringRef keys[kiSCSIWireTargetStringCount] = { kiSCSITargetIQNKey, kiSCSITargetAliasKey };
+    
+    if(!iSCSIWireIsPropertyList(data))
+        return iSCSIWireCreateRecord(data,kiSCSIWireRecordTarget,keys,kiSCSIWireTargetStringCount,1);
+    
+    iSCSITargetRef target = iSCSIWireCreateWithPropertyList(data,CFDictionaryGetTypeID());
+    
+    if(target && !iSCSIWireHasRequiredStrings(target,keys,1)) {
+        CFRelease(target);
+        return NULL;
+    }
+    
+    return target;
 }
 
-/*! iSCSI target records are dictionaries with keys with string values
- *  that specify the target name and other parameters. */
-CFStringRef kiSCSITargetIQNKey = CFSTR("Target Name");
-CFStringRef kiSCSITargetAliasKey = CFSTR("Target Alias");
-
 /*! Convenience function.  Creates a new iSCSITargetRef with the above keys. */
 iSCSIMutableTargetRef iSCSITargetCreateMutable()
 {
@@ -227,7 +495,100 @@ CFDictionaryRef iSCSITargetCreateDictionary(iSCSITargetRef target)
 /*! Copies the target object to a byte array representation. */
 CFDataRef iSCSITargetCreateData(iSCSITargetRef target)
 {
-    return CFPropertyListCreateData(kCFAllocatorDefault,target,kCFPropertyListBinaryFormat_v1_0,0,NULL);
+    if(!target)
+        return NULL;
+    
+    CFMutableDataRef data = CFDataCreateMutable(kCFAllocatorDefault,0);
+    iSCSIWireAppendHeader(data,kiSCSIWireRecordTarget,kiSCSIWireTargetStringCount);
+    
+    if(!iSCSIWireAppendString(data,iSCSITargetGetIQN(target)) ||
+       !iSCSIWireAppendString(data,CFDictionaryGetValue(target,kiSCSITargetAliasKey)))
+    {
+        CFRelease(data);
+        return NULL;
+    }
+    
+    return data;
+}
+
+/*! Copies an array of target objects to a byte array representation. */
+CFDataRef iSCSITargetCreateDataForArray(CFArrayRef targets)
+{
+    CFIndex targetCount = targets ? CFArrayGetCount(targets) : 0;
+    
+    if(targetCount > UINT16_MAX)
+        return NULL;
+    
+    CFMutableDataRef data = CFDataCreateMutable(kCFAllocatorDefault,0);
+    iSCSIWireAppendHeader(data,kiSCSIWireRecordTargetArray,(UInt16)targetCount);
+    
+    for(CFIndex idx = 0; idx < targetCount; idx++)
+    {
+        iSCSITargetRef target = CFArrayGetValueAtIndex(targets,idx);
+        
+        if(!iSCSIWireAppendString(data,iSCSITargetGetIQN(target)) ||
+           !iSCSIWireAppendString(data,CFDictionaryGetValue(target,kiSCSITargetAliasKey)))
+        {
+            CFRelease(data);
+            return NULL;
+        }
+    }
+    
+    return data;
+}
+
+/*! Creates an array of target objects from byte representation. */
+CFArrayRef iSCSITargetCreateArrayWithData(CFDataRef data)
+{
+    if(!data)
+        return NULL;
+    
+    const CFStringRef keys[kiSCSIWireTargetStringCount] = { kiSCSITargetIQNKey, kiSCSITargetAliasKey };
+    
+    // Earlier versions of the daemon send the array as a property list
+    if(iSCSIWireIsPropertyList(data))
+    {
+        CFArrayRef targets = iSCSIWireCreateWithPropertyList(data,CFArrayGetTypeID());
+        CFIndex targetCount = targets ? CFArrayGetCount(targets) : 0;
+        
+        for(CFIndex idx = 0; idx < targetCount; idx++)
+        {
+            if(!iSCSIWireHasRequiredStrings(CFArrayGetValueAtIndex(targets,idx),keys,1)) {
+                CFRelease(targets);
+                return NULL;
+            }
+        }
+        return targets;
+    }
+    
+    const UInt8 * cursor = CFDataGetBytePtr(data);
+    const UInt8 * end = cursor + CFDataGetLength(data);
+    
+    UInt16 targetCount;
+    if(!iSCSIWireGetHeader(&cursor,end,kiSCSIWireRecordTargetArray,&targetCount))
+        return NULL;
+    
+    CFMutableArrayRef targets = CFArrayCreateMutable(kCFAllocatorDefault,targetCount,&kCFTypeArrayCallBacks);
+    
+    for(UInt16 idx = 0; idx < targetCount; idx++)
+    {
+        CFDictionaryRef target = iSCSIWireCreateDictionary(&cursor,end,keys,kiSCSIWireTargetStringCount,1);
+        
+        if(!target) {
+            CFRelease(targets);
+            return NULL;
+        }
+        
+        CFArrayAppendValue(targets,target);
+        CFRelease(target);
+    }
+    
+    if(cursor != end) {
+        CFRelease(targets);
+        return NULL;
+    }
+    
+    return targets;
 }
 
 /*! Creates a new authentication object from byte representation. */
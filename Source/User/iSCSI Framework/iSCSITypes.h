@@ -349,6 +349,17 @@ CFDictionaryRef iSCSITargetCreateDictionary(iSCSITargetRef target);
  *  @return data representing the target or NULL if the target is invalid. */
 CFDataRef iSCSITargetCreateData(iSCSITargetRef target);
 
+/*! Copies an array of target objects to a byte array representation.
+ *  @param targets an array of iSCSI target objects.
+ *  @return data representing the targets or NULL if a target is invalid. */
+CFDataRef iSCSITargetCreateDataForArray(CFArrayRef targets);
+
+/*! Creates an array of target objects from an external data representation
+ *  (see iSCSITargetCreateDataForArray()).
+ *  @param data data used to construct the array.
+ *  @return an array of iSCSI target objects or NULL if the data is invalid. */
+CFArrayRef iSCSITargetCreateArrayWithData(CFDataRef data);
+
 
 
 /*! Creates a new iSCSIAuth object with empty authentication parameters
@@ -99,6 +99,10 @@ enum iSCSIHBASessionParameters {
     /*! Target portal group tag (TPGT). */
     kiSCSIHBASOTargetPortalGroupTag,
     
+    /*! Keep the SCSI target (and its logical units) while the session has
+     *  no active connections (bool). */
+    kiSCSIHBASORetainTarget,
+    
 };
 
 
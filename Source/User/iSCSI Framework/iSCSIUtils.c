@@ -28,6 +28,11 @@
 
 #include "iSCSIUtils.h"
 #include <ifaddrs.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <net/if.h>
 
 /*! Minimum TCP port. */
 static int PORT_MIN = 0;
@@ -35,6 +40,91 @@ static int PORT_MIN = 0;
 /*! Maximum TCP port. */
 static int PORT_MAX = (1 << sizeof(in_port_t)*8) -1;
 
+/*! Time (seconds) for which the resolved addresses of a portal are cached. */
+static const CFTimeInterval kiSCSIUtilsAddressCacheTTL = 60;
+
+/*! Time (seconds) for which a failed portal name resolution is cached. */
+static const CFTimeInterval kiSCSIUtilsAddressCacheNegativeTTL = 5;
+
+/*! Time (seconds) for which the address of a host interface is cached. */
+static const CFTimeInterval kiSCSIUtilsInterfaceCacheTTL = 10;
+
+/*! Delay before a connection attempt to the next address of a portal is
+ *  started while the previous attempts are still pending (RFC 8305). */
+static const int kiSCSIUtilsConnectAttemptDelayMilliSec = 250;
+
+/*! Time after which connection attempts to the addresses of a portal are
+ *  abandoned. */
+static const int kiSCSIUtilsConnectTimeoutMilliSec = 10000;
+
+/*! Maximum number of addresses kept (and tried) for a portal. */
+#define kiSCSIUtilsMaxAddressesPerPortal 8
+
+/*! Resolved addresses of a portal (host name and port). */
+typedef struct iSCSIUtilsAddressCacheEntry {
+    
+    /*! Next entry in the cache. */
+    struct iSCSIUtilsAddressCacheEntry * next;
+    
+    /*! Host name or address of the portal. */
+    char host[NI_MAXHOST];
+    
+    /*! Port of the portal. */
+    char port[NI_MAXSERV];
+    
+    /*! Addresses, in the order in which they should be tried. */
+    struct sockaddr_storage addresses[kiSCSIUtilsMaxAddressesPerPortal];
+    
+    /*! Number of addresses. */
+    unsigned int addressCount;
+    
+    /*! Result of the name resolution. */
+    errno_t error;
+    
+    /*! Time after which the entry must be resolved again. */
+    CFAbsoluteTime expiration;
+    
+    /*! Indicates that a resolution is in progress. */
+    Boolean resolving;
+    
+} iSCSIUtilsAddressCacheEntry;
+
+/*! Address of a host interface for an address family. */
+typedef struct iSCSIUtilsInterfaceCacheEntry {
+    
+    /*! Next entry in the cache. */
+    struct iSCSIUtilsInterfaceCacheEntry * next;
+    
+    /*! Name of the interface. */
+    char name[IF_NAMESIZE];
+    
+    /*! Address family. */
+    sa_family_t family;
+    
+    /*! Address of the interface (if error is zero). */
+    struct sockaddr_storage address;
+    
+    /*! Result of the lookup. */
+    errno_t error;
+    
+    /*! Time after which the entry must be looked up again. */
+    CFAbsoluteTime expiration;
+    
+} iSCSIUtilsInterfaceCacheEntry;
+
+/*! Protects the address and interface caches. */
+static pthread_mutex_t addressCacheMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*! Signaled when a name resolution completes. */
+static pthread_cond_t addressCacheCond = PTHREAD_COND_INITIALIZER;
+
+/*! Cached portal addresses.  Entries are never freed (there is one entry
+ *  for each distinct portal that was used). */
+static iSCSIUtilsAddressCacheEntry * addressCache = NULL;
+
+/*! Cached host interface addresses. */
+static iSCSIUtilsInterfaceCacheEntry * interfaceCache = NULL;
+
 /*! Verifies whether specified iSCSI qualified name (IQN) is valid per RFC3720.
  *  This function also validates 64-bit EUI names expressed as strings that
  *  start with the "eui" prefix.
@@ -274,109 +364,578 @@ CFStringRef iSCSIUtilsGetStringForLogoutStatus(enum iSCSILogoutStatusCode status
     return CFSTR("");
 }
 
-/*! Creates address structures for an iSCSI target and the host (initiator)
- *  given an iSCSI portal reference. This function may be helpful when
- *  interfacing to low-level C networking APIs or other foundation libraries.
- *  @param portal an iSCSI portal.
- *  @param the target address structure (returned by this function).
- *  @param the host address structure (returned by this function). */
-errno_t iSCSIUtilsGetAddressForPortal(iSCSIPortalRef portal,
-                                     struct sockaddr_storage * remoteAddress,
-                                     struct sockaddr_storage * localAddress)
+/*! Helper function. Gets the host name and port of a portal as C strings.
+ *  @return true if the strings were copied into the buffers. */
+static Boolean iSCSIUtilsGetHostAndPortForPortal(iSCSIPortalRef portal,
+                                                 char host[NI_MAXHOST],
+                                                 char port[NI_MAXSERV])
 {
-    if (!portal || !remoteAddress || !localAddress)
-        return EINVAL;
+    return CFStringGetCString(iSCSIPortalGetAddress(portal),host,NI_MAXHOST,kCFStringEncodingASCII) &&
+           CFStringGetCString(iSCSIPortalGetPort(portal),port,NI_MAXSERV,kCFStringEncodingASCII);
+}
+
+/*! Helper function. Finds the cache entry for the specified host and port,
+ *  creating an (expired) entry if one does not exist.  The cache mutex must
+ *  be held.
+ *  @return the cache entry, or NULL if it could not be allocated. */
+static iSCSIUtilsAddressCacheEntry * iSCSIUtilsAddressCacheGetEntry(const char * host,const char * port)
+{
+    iSCSIUtilsAddressCacheEntry * entry = addressCache;
     
-    errno_t error = 0;
+    while(entry) {
+        if(strcasecmp(entry->host,host) == 0 && strcmp(entry->port,port) == 0)
+            return entry;
+        entry = entry->next;
+    }
     
-    // Resolve the target node first and get a sockaddr info for it
-    CFStringRef targetAddr = iSCSIPortalGetAddress(portal);
-    CFIndex targetAddrLength = CFStringGetMaximumSizeForEncoding(CFStringGetLength(targetAddr),kCFStringEncodingASCII) + sizeof('\0');
-    char targetAddrBuffer[targetAddrLength];
-    CFStringGetCString(targetAddr,targetAddrBuffer,targetAddrLength,kCFStringEncodingASCII);
+    if(!(entry = calloc(1,sizeof(iSCSIUtilsAddressCacheEntry))))
+        return NULL;
     
-    CFStringRef targetPort = iSCSIPortalGetPort(portal);
-    CFIndex targetPortLength = CFStringGetMaximumSizeForEncoding(CFStringGetLength(targetPort),kCFStringEncodingASCII) + sizeof('\0');
-    char targetPortBuffer[targetPortLength];
-    CFStringGetCString(targetPort,targetPortBuffer,targetPortLength,kCFStringEncodingASCII);
+    strlcpy(entry->host,host,sizeof(entry->host));
+    strlcpy(entry->port,port,sizeof(entry->port));
+    entry->next = addressCache;
+    addressCache = entry;
     
+    return entry;
+}
+
+/*! Helper function. Resolves the host and port of a cache entry and stores
+ *  the result in the entry.  The addresses are ordered so that address
+ *  families alternate, starting with the family of the first address
+ *  returned by the resolver (RFC 8305).  Must be called without the cache
+ *  mutex held, after marking the entry as resolving. */
+static void iSCSIUtilsAddressCacheResolve(iSCSIUtilsAddressCacheEntry * entry)
+{
     struct addrinfo hints = {
         .ai_family = AF_UNSPEC,
         .ai_socktype = SOCK_STREAM,
         .ai_protocol = IPPROTO_TCP,
     };
     
-    struct addrinfo * aiTarget = NULL;
-    if((error = getaddrinfo(targetAddrBuffer,targetPortBuffer,&hints,&aiTarget)))
-        return error;
+    struct sockaddr_storage primary[kiSCSIUtilsMaxAddressesPerPortal];
+    struct sockaddr_storage secondary[kiSCSIUtilsMaxAddressesPerPortal];
+    unsigned int primaryCount = 0, secondaryCount = 0;
+    
+    struct addrinfo * aiList = NULL;
+    errno_t error = getaddrinfo(entry->host,entry->port,&hints,&aiList);
     
-    // Copy the sock_addr structure into a sockaddr_storage structure (this
-    // may be either an IPv4 or IPv6 sockaddr structure)
-    memcpy(remoteAddress,aiTarget->ai_addr,aiTarget->ai_addrlen);
+    for(struct addrinfo * ai = aiList; !error && ai; ai = ai->ai_next)
+    {
+        if(ai->ai_addrlen > sizeof(struct sockaddr_storage))
+            continue;
+        
+        struct sockaddr_storage * address = NULL;
+        
+        if(ai->ai_family == aiList->ai_family && primaryCount < kiSCSIUtilsMaxAddressesPerPortal)
+            address = &primary[primaryCount++];
+        else if(ai->ai_family != aiList->ai_family && secondaryCount < kiSCSIUtilsMaxAddressesPerPortal)
+            address = &secondary[secondaryCount++];
+        
+        if(address) {
+            bzero(address,sizeof(struct sockaddr_storage));
+            memcpy(address,ai->ai_addr,ai->ai_addrlen);
+        }
+    }
     
-    freeaddrinfo(aiTarget);
+    if(aiList)
+        freeaddrinfo(aiList);
     
-    // If the default interface is to be used, prepare a structure for it
-    CFStringRef hostIface = iSCSIPortalGetHostInterface(portal);
+    if(!error && primaryCount == 0)
+        error = EAI_NONAME;
     
-    if(CFStringCompare(hostIface,kiSCSIDefaultHostInterface,0) == kCFCompareEqualTo)
+    pthread_mutex_lock(&addressCacheMutex);
+    
+    entry->addressCount = 0;
+    
+    for(unsigned int idx = 0; entry->addressCount < kiSCSIUtilsMaxAddressesPerPortal; idx++)
     {
-        localAddress->ss_family = remoteAddress->ss_family;
+        if(idx >= primaryCount && idx >= secondaryCount)
+            break;
         
-        // For completeness, setup the sockaddr_in structure
-        if(localAddress->ss_family == AF_INET)
-        {
-            struct sockaddr_in * sa = (struct sockaddr_in *)localAddress;
-            sa->sin_port = 0;
-            sa->sin_addr.s_addr = htonl(INADDR_ANY);
-            sa->sin_len = sizeof(struct sockaddr_in);
-        }
+        if(idx < primaryCount)
+            entry->addresses[entry->addressCount++] = primary[idx];
         
-        // TODO: test IPv6 functionality
-        else if(localAddress->ss_family == AF_INET6)
-        {
-            struct sockaddr_in6 * sa = (struct sockaddr_in6 *)localAddress;
-            sa->sin6_addr = in6addr_any;
-        }
+        if(idx < secondaryCount && entry->addressCount < kiSCSIUtilsMaxAddressesPerPortal)
+            entry->addresses[entry->addressCount++] = secondary[idx];
+    }
+    
+    entry->error = error;
+    entry->expiration = CFAbsoluteTimeGetCurrent() +
+        (error ? kiSCSIUtilsAddressCacheNegativeTTL : kiSCSIUtilsAddressCacheTTL);
+    entry->resolving = false;
+    
+    pthread_cond_broadcast(&addressCacheCond);
+    pthread_mutex_unlock(&addressCacheMutex);
+}
+
+/*! Helper function. Gets the addresses of the specified host and port from
+ *  the cache, resolving them if they are not cached or have expired.  If a
+ *  resolution of the same host and port is already in progress (e.g., one
+ *  started by iSCSIUtilsPrefetchAddressForPortal()) its result is used.
+ *  @return an error code indicating the result of the name resolution. */
+static errno_t iSCSIUtilsCopyAddressesForHost(const char * host,
+                                              const char * port,
+                                              struct sockaddr_storage * addresses,
+                                              unsigned int * addressCount)
+{
+    pthread_mutex_lock(&addressCacheMutex);
+    
+    iSCSIUtilsAddressCacheEntry * entry = iSCSIUtilsAddressCacheGetEntry(host,port);
+    
+    if(!entry) {
+        pthread_mutex_unlock(&addressCacheMutex);
+        return ENOMEM;
+    }
+    
+    while(entry->resolving)
+        pthread_cond_wait(&addressCacheCond,&addressCacheMutex);
+    
+    if(CFAbsoluteTimeGetCurrent() >= entry->expiration) {
+        entry->resolving = true;
+        pthread_mutex_unlock(&addressCacheMutex);
+        iSCSIUtilsAddressCacheResolve(entry);
+        pthread_mutex_lock(&addressCacheMutex);
+    }
+    
+    errno_t error = entry->error;
+    *addressCount = entry->addressCount;
+    memcpy(addresses,entry->addresses,entry->addressCount*sizeof(struct sockaddr_storage));
+    
+    pthread_mutex_unlock(&addressCacheMutex);
+    return error;
+}
+
+/*! Helper function. Moves an address of a cached portal to the front of the
+ *  list so that it is tried first the next time. */
+static void iSCSIUtilsAddressCachePromote(const char * host,
+                                          const char * port,
+                                          const struct sockaddr_storage * address)
+{
+    pthread_mutex_lock(&addressCacheMutex);
+    
+    iSCSIUtilsAddressCacheEntry * entry = iSCSIUtilsAddressCacheGetEntry(host,port);
+    
+    for(unsigned int idx = 1; entry && !entry->resolving && idx < entry->addressCount; idx++)
+    {
+        if(memcmp(&entry->addresses[idx],address,sizeof(struct sockaddr_storage)) != 0)
+            continue;
         
+        memmove(&entry->addresses[1],&entry->addresses[0],idx*sizeof(struct sockaddr_storage));
+        entry->addresses[0] = *address;
+        break;
+    }
+    
+    pthread_mutex_unlock(&addressCacheMutex);
+}
+
+/*! Helper function. Resolves the addresses of a cache entry; runs on a
+ *  detached thread started by iSCSIUtilsPrefetchAddressForPortal(). */
+static void * iSCSIUtilsPrefetchWorker(void * context)
+{
+    iSCSIUtilsAddressCacheResolve((iSCSIUtilsAddressCacheEntry *)context);
+    return NULL;
+}
+
+/*! Starts resolving the address of a portal in the background, unless it is
+ *  already cached.  A subsequent call to iSCSIUtilsGetAddressForPortal() or
+ *  iSCSIUtilsSelectAddressForPortal() uses the result of the resolution
+ *  (waiting for it to complete, if necessary).  This allows the names of
+ *  several portals to be resolved concurrently.
+ *  @param portal an iSCSI portal. */
+void iSCSIUtilsPrefetchAddressForPortal(iSCSIPortalRef portal)
+{
+    char host[NI_MAXHOST], port[NI_MAXSERV];
+    
+    if(!portal || !iSCSIUtilsGetHostAndPortForPortal(portal,host,port))
+        return;
+    
+    pthread_mutex_lock(&addressCacheMutex);
+    
+    iSCSIUtilsAddressCacheEntry * entry = iSCSIUtilsAddressCacheGetEntry(host,port);
+    
+    if(!entry || entry->resolving || CFAbsoluteTimeGetCurrent() < entry->expiration) {
+        pthread_mutex_unlock(&addressCacheMutex);
+        return;
+    }
+    
+    entry->resolving = true;
+    pthread_mutex_unlock(&addressCacheMutex);
+    
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr,PTHREAD_CREATE_DETACHED);
+    
+    // If a thread could not be created the address is resolved on demand
+    if(pthread_create(&thread,&attr,iSCSIUtilsPrefetchWorker,entry)) {
+        pthread_mutex_lock(&addressCacheMutex);
+        entry->resolving = false;
+        pthread_cond_broadcast(&addressCacheCond);
+        pthread_mutex_unlock(&addressCacheMutex);
+    }
+    
+    pthread_attr_destroy(&attr);
+}
+
+/*! Discards all cached portal and host interface addresses (e.g., after
+ *  the network configuration has changed).  Resolutions that are in
+ *  progress are not affected. */
+void iSCSIUtilsFlushAddressCache()
+{
+    pthread_mutex_lock(&addressCacheMutex);
+    
+    for(iSCSIUtilsAddressCacheEntry * entry = addressCache; entry; entry = entry->next)
+        if(!entry->resolving)
+            entry->expiration = 0;
+    
+    for(iSCSIUtilsInterfaceCacheEntry * entry = interfaceCache; entry; entry = entry->next)
+        entry->expiration = 0;
+    
+    pthread_mutex_unlock(&addressCacheMutex);
+}
+
+/*! Helper function. Prepares an address structure that can be used to bind
+ *  to any local address of the specified family. */
+static void iSCSIUtilsGetAnyAddress(sa_family_t family,struct sockaddr_storage * address)
+{
+    bzero(address,sizeof(struct sockaddr_storage));
+    address->ss_family = family;
+    
+    if(family == AF_INET)
+    {
+        struct sockaddr_in * sa = (struct sockaddr_in *)address;
+        sa->sin_port = 0;
+        sa->sin_addr.s_addr = htonl(INADDR_ANY);
+        sa->sin_len = sizeof(struct sockaddr_in);
+    }
+    else if(family == AF_INET6)
+    {
+        struct sockaddr_in6 * sa = (struct sockaddr_in6 *)address;
+        sa->sin6_port = 0;
+        sa->sin6_addr = in6addr_any;
+        sa->sin6_len = sizeof(struct sockaddr_in6);
+    }
+}
+
+/*! Helper function. Gets the address of a host interface for the specified
+ *  address family.  Results are cached for kiSCSIUtilsInterfaceCacheTTL
+ *  seconds so that the list of interfaces is not searched on every login.
+ *  @return an error code indicating whether an address was found. */
+static errno_t iSCSIUtilsGetAddressForInterface(CFStringRef hostIface,
+                                                sa_family_t family,
+                                                struct sockaddr_storage * address)
+{
+    char name[IF_NAMESIZE];
+    
+    if(!CFStringGetCString(hostIface,name,sizeof(name),kCFStringEncodingUTF8))
+        return EAFNOSUPPORT;
+    
+    pthread_mutex_lock(&addressCacheMutex);
+    
+    iSCSIUtilsInterfaceCacheEntry * entry = interfaceCache;
+    
+    while(entry) {
+        if(entry->family == family && strcasecmp(entry->name,name) == 0)
+            break;
+        entry = entry->next;
+    }
+    
+    if(entry && CFAbsoluteTimeGetCurrent() < entry->expiration) {
+        errno_t error = entry->error;
+        *address = entry->address;
+        pthread_mutex_unlock(&addressCacheMutex);
         return error;
     }
     
-    // Otherwise we have to search the list of all interfaces for the specified
-    // interface and copy the corresponding address structure
+    pthread_mutex_unlock(&addressCacheMutex);
+    
+    // Search the list of all interfaces for the specified interface and
+    // copy the corresponding address structure
     struct ifaddrs * interfaceList;
+    errno_t error = 0;
     
     if((error = getifaddrs(&interfaceList)))
         return error;
     
     error = EAFNOSUPPORT;
-    struct ifaddrs * interface = interfaceList;
+    bzero(address,sizeof(struct sockaddr_storage));
     
-    while(interface)
+    for(struct ifaddrs * interface = interfaceList; interface; interface = interface->ifa_next)
     {
         // Check if interface supports the targets address family (e.g., IPv4)
-        if(interface->ifa_addr->sa_family == remoteAddress->ss_family)
+        // and if the interface names match...
+        if(interface->ifa_addr && interface->ifa_addr->sa_family == family &&
+           strcasecmp(interface->ifa_name,name) == 0)
         {
-            CFStringRef currIface = CFStringCreateWithCStringNoCopy(
-                                                                    kCFAllocatorDefault,
-                                                                    interface->ifa_name,
-                                                                    kCFStringEncodingUTF8,
-                                                                    kCFAllocatorNull);
+            memcpy(address,interface->ifa_addr,interface->ifa_addr->sa_len);
+            error = 0;
+            break;
+        }
+    }
+    
+    freeifaddrs(interfaceList);
+    
+    pthread_mutex_lock(&addressCacheMutex);
+    
+    // The entry may have been added by another thread in the meantime
+    for(entry = interfaceCache; entry; entry = entry->next)
+        if(entry->family == family && strcasecmp(entry->name,name) == 0)
+            break;
+    
+    if(!entry && (entry = calloc(1,sizeof(iSCSIUtilsInterfaceCacheEntry)))) {
+        strlcpy(entry->name,name,sizeof(entry->name));
+        entry->family = family;
+        entry->next = interfaceCache;
+        interfaceCache = entry;
+    }
+    
+    if(entry) {
+        entry->address = *address;
+        entry->error = error;
+        entry->expiration = CFAbsoluteTimeGetCurrent() + kiSCSIUtilsInterfaceCacheTTL;
+    }
+    
+    pthread_mutex_unlock(&addressCacheMutex);
+    return error;
+}
+
+/*! Helper function. Gets the candidate remote addresses of a portal (from
+ *  the cache), along with the local address to use for each.  Addresses of
+ *  a family that the portal's host interface does not support are skipped.
+ *  @return an error code indicating whether any candidates were found. */
+static errno_t iSCSIUtilsGetCandidatesForPortal(iSCSIPortalRef portal,
+                                                const char * host,
+                                                const char * port,
+                                                struct sockaddr_storage * remoteAddresses,
+                                                struct sockaddr_storage * localAddresses,
+                                                unsigned int * candidateCount)
+{
+    struct sockaddr_storage addresses[kiSCSIUtilsMaxAddressesPerPortal];
+    unsigned int addressCount = 0;
+    errno_t error = 0;
+    
+    *candidateCount = 0;
+    
+    if((error = iSCSIUtilsCopyAddressesForHost(host,port,addresses,&addressCount)))
+        return error;
+    
+    CFStringRef hostIface = iSCSIPortalGetHostInterface(portal);
+    Boolean defaultIface = (CFStringCompare(hostIface,kiSCSIDefaultHostInterface,0) == kCFCompareEqualTo);
+    
+    for(unsigned int idx = 0; idx < addressCount; idx++)
+    {
+        sa_family_t family = addresses[idx].ss_family;
+        
+        if(defaultIface)
+            iSCSIUtilsGetAnyAddress(family,&localAddresses[*candidateCount]);
+        else if(iSCSIUtilsGetAddressForInterface(hostIface,family,&localAddresses[*candidateCount]))
+            continue;
+        
+        remoteAddresses[(*candidateCount)++] = addresses[idx];
+    }
+    
+    return (*candidateCount > 0) ? 0 : EAFNOSUPPORT;
+}
+
+/*! Helper function. Races TCP connection attempts to several addresses and
+ *  determines which one connects first.  An attempt is started for the next
+ *  address every kiSCSIUtilsConnectAttemptDelayMilliSec, or as soon as all
+ *  pending attempts have failed, so that an address that does not respond
+ *  does not delay the others (RFC 8305).  The connections are closed before
+ *  this function returns.
+ *  @param remoteAddresses the addresses to connect to, in order of preference.
+ *  @param localAddresses the local address to bind to for each remote
+ *  address, or NULL to let the system choose.
+ *  @param count the number of addresses.
+ *  @param winner the index of the address that connected first (returned).
+ *  @return an error code if none of the addresses could be reached. */
+static errno_t iSCSIUtilsRaceConnect(const struct sockaddr_storage * remoteAddresses,
+                                     const struct sockaddr_storage * localAddresses,
+                                     unsigned int count,
+                                     unsigned int * winner)
+{
+    int sockets[kiSCSIUtilsMaxAddressesPerPortal];
+    unsigned int started = 0, failed = 0;
+    Boolean connected = false;
+    errno_t error = ETIMEDOUT;
+    
+    CFAbsoluteTime startTime = CFAbsoluteTimeGetCurrent();
+    int elapsed = 0;
+    
+    while(!connected && failed < count && elapsed < kiSCSIUtilsConnectTimeoutMilliSec)
+    {
+        // Start the next attempt when it is due, or immediately if all of
+        // the pending attempts have already failed
+        if(started < count && (elapsed >= (int)started*kiSCSIUtilsConnectAttemptDelayMilliSec || failed == started))
+        {
+            unsigned int idx = started++;
+            const struct sockaddr * remote = (const struct sockaddr *)&remoteAddresses[idx];
+            int sock = socket(remote->sa_family,SOCK_STREAM,IPPROTO_TCP);
             
-            Boolean ifaceNameMatch =
-            CFStringCompare(currIface,hostIface,kCFCompareCaseInsensitive) == kCFCompareEqualTo;
-            CFRelease(currIface);
-            // Check if interface names match...
-            if(ifaceNameMatch)
+            sockets[idx] = sock;
+            
+            if(sock < 0 || fcntl(sock,F_SETFL,O_NONBLOCK) == -1 ||
+               (localAddresses && bind(sock,(const struct sockaddr *)&localAddresses[idx],
+                                       ((const struct sockaddr *)&localAddresses[idx])->sa_len) == -1))
             {
-                memcpy(localAddress,interface->ifa_addr,interface->ifa_addr->sa_len);
-                error = 0;
+                error = errno;
+            }
+            else if(connect(sock,remote,remote->sa_len) == 0) {
+                *winner = idx;
+                connected = true;
                 break;
             }
+            else if(errno == EINPROGRESS)
+                continue;
+            else
+                error = errno;
+            
+            if(sock >= 0)
+                close(sock);
+            sockets[idx] = -1;
+            failed++;
+            continue;
+        }
+        
+        // Wait for a pending attempt to complete, or until the next
+        // attempt is due
+        struct pollfd fds[kiSCSIUtilsMaxAddressesPerPortal];
+        unsigned int fdIndex[kiSCSIUtilsMaxAddressesPerPortal];
+        nfds_t fdCount = 0;
+        
+        for(unsigned int idx = 0; idx < started; idx++) {
+            if(sockets[idx] < 0)
+                continue;
+            fds[fdCount].fd = sockets[idx];
+            fds[fdCount].events = POLLOUT;
+            fds[fdCount].revents = 0;
+            fdIndex[fdCount++] = idx;
         }
-        interface = interface->ifa_next;
+        
+        int timeout = kiSCSIUtilsConnectTimeoutMilliSec - elapsed;
+        
+        if(started < count && (int)started*kiSCSIUtilsConnectAttemptDelayMilliSec - elapsed < timeout)
+            timeout = (int)started*kiSCSIUtilsConnectAttemptDelayMilliSec - elapsed;
+        
+        if(timeout < 0)
+            timeout = 0;
+        
+        if(poll(fds,fdCount,timeout) > 0)
+        {
+            for(nfds_t fdIdx = 0; fdIdx < fdCount && !connected; fdIdx++)
+            {
+                if(!fds[fdIdx].revents)
+                    continue;
+                
+                unsigned int idx = fdIndex[fdIdx];
+                int sockError = 0;
+                socklen_t sockErrorLength = sizeof(sockError);
+                
+                if(getsockopt(sockets[idx],SOL_SOCKET,SO_ERROR,&sockError,&sockErrorLength) == -1)
+                    sockError = errno;
+                
+                if(!sockError) {
+                    *winner = idx;
+                    connected = true;
+                }
+                else {
+                    error = sockError;
+                    close(sockets[idx]);
+                    sockets[idx] = -1;
+                    failed++;
+                }
+            }
+        }
+        
+        elapsed = (int)((CFAbsoluteTimeGetCurrent() - startTime)*1000);
     }
     
-    freeifaddrs(interfaceList);
-    return error;
+    for(unsigned int idx = 0; idx < started; idx++)
+        if(sockets[idx] >= 0)
+            close(sockets[idx]);
+    
+    return connected ? 0 : error;
+}
+
+/*! Creates address structures for an iSCSI target and the host (initiator)
+ *  given an iSCSI portal reference. This function may be helpful when
+ *  interfacing to low-level C networking APIs or other foundation libraries.
+ *  The portal name is resolved using a cache; if the portal has several
+ *  addresses the one that most recently connected is returned.
+ *  @param portal an iSCSI portal.
+ *  @param the target address structure (returned by this function).
+ *  @param the host address structure (returned by this function). */
+errno_t iSCSIUtilsGetAddressForPortal(iSCSIPortalRef portal,
+                                     struct sockaddr_storage * remoteAddress,
+                                     struct sockaddr_storage * localAddress)
+{
+    if (!portal || !remoteAddress || !localAddress)
+        return EINVAL;
+    
+    char host[NI_MAXHOST], port[NI_MAXSERV];
+    
+    if(!iSCSIUtilsGetHostAndPortForPortal(portal,host,port))
+        return EINVAL;
+    
+    struct sockaddr_storage remoteAddresses[kiSCSIUtilsMaxAddressesPerPortal];
+    struct sockaddr_storage localAddresses[kiSCSIUtilsMaxAddressesPerPortal];
+    unsigned int candidateCount = 0;
+    errno_t error = 0;
+    
+    if((error = iSCSIUtilsGetCandidatesForPortal(portal,host,port,remoteAddresses,
+                                                 localAddresses,&candidateCount)))
+        return error;
+    
+    *remoteAddress = remoteAddresses[0];
+    *localAddress = localAddresses[0];
+    return 0;
+}
+
+/*! Creates address structures for an iSCSI target and the host (initiator)
+ *  given an iSCSI portal reference, choosing the target address to connect
+ *  to.  If the portal name resolves to several addresses (e.g., both IPv4
+ *  and IPv6 addresses), connection attempts to them are raced and the
+ *  address that connects first is returned (and preferred in the future),
+ *  so that an unreachable address does not cost a full connection timeout.
+ *  This function may block while the connection attempts are made.
+ *  @param portal an iSCSI portal.
+ *  @param the target address structure (returned by this function).
+ *  @param the host address structure (returned by this function). */
+errno_t iSCSIUtilsSelectAddressForPortal(iSCSIPortalRef portal,
+                                         struct sockaddr_storage * remoteAddress,
+                                         struct sockaddr_storage * localAddress)
+{
+    if (!portal || !remoteAddress || !localAddress)
+        return EINVAL;
+    
+    char host[NI_MAXHOST], port[NI_MAXSERV];
+    
+    if(!iSCSIUtilsGetHostAndPortForPortal(portal,host,port))
+        return EINVAL;
+    
+    struct sockaddr_storage remoteAddresses[kiSCSIUtilsMaxAddressesPerPortal];
+    struct sockaddr_storage localAddresses[kiSCSIUtilsMaxAddressesPerPortal];
+    unsigned int candidateCount = 0, winner = 0;
+    errno_t error = 0;
+    
+    if((error = iSCSIUtilsGetCandidatesForPortal(portal,host,port,remoteAddresses,
+                                                 localAddresses,&candidateCount)))
+        return error;
+    
+    // A single address is left to the kernel to connect to
+    if(candidateCount > 1)
+    {
+        Boolean defaultIface = (CFStringCompare(iSCSIPortalGetHostInterface(portal),
+                                                kiSCSIDefaultHostInterface,0) == kCFCompareEqualTo);
+        
+        if((error = iSCSIUtilsRaceConnect(remoteAddresses,defaultIface ? NULL : localAddresses,
+                                          candidateCount,&winner)))
+            return error;
+        
+        iSCSIUtilsAddressCachePromote(host,port,&remoteAddresses[winner]);
+    }
+    
+    *remoteAddress = remoteAddresses[winner];
+    *localAddress = localAddresses[winner];
+    return 0;
 }
@@ -80,6 +80,8 @@ CFStringRef iSCSIUtilsGetStringForLogoutStatus(enum iSCSILogoutStatusCode status
 /*! Creates address structures for an iSCSI target and the host (initiator)
  *  given an iSCSI portal reference. This function may be helpful when
  *  interfacing to low-level C networking APIs or other foundation libraries.
+ *  The portal name is resolved using a cache; if the portal has several
+ *  addresses the one that most recently connected is returned.
  *  @param portal an iSCSI portal.
  *  @param the target address structure (returned by this function).
  *  @param the host address structure (returned by this function). */
@@ -87,4 +89,31 @@ errno_t iSCSIUtilsGetAddressForPortal(iSCSIPortalRef portal,
                                       struct sockaddr_storage * remoteAddress,
                                       struct sockaddr_storage * localAddress);
 
+/*! Creates address structures for an iSCSI target and the host (initiator)
+ *  given an iSCSI portal reference, choosing the target address to connect
+ *  to.  If the portal name resolves to several addresses (e.g., both IPv4
+ *  and IPv6 addresses), connection attempts to them are raced and the
+ *  address that connects first is returned (and preferred in the future),
+ *  so that an unreachable address does not cost a full connection timeout.
+ *  This function may block while the connection attempts are made.
+ *  @param portal an iSCSI portal.
+ *  @param the target address structure (returned by this function).
+ *  @param the host address structure (returned by this function). */
+errno_t iSCSIUtilsSelectAddressForPortal(iSCSIPortalRef portal,
+                                         struct sockaddr_storage * remoteAddress,
+                                         struct sockaddr_storage * localAddress);
+
+/*! Starts resolving the address of a portal in the background, unless it is
+ *  already cached.  A subsequent call to iSCSIUtilsGetAddressForPortal() or
+ *  iSCSIUtilsSelectAddressForPortal() uses the result of the resolution
+ *  (waiting for it to complete, if necessary).  This allows the names of
+ *  several portals to be resolved concurrently.
+ *  @param portal an iSCSI portal. */
+void iSCSIUtilsPrefetchAddressForPortal(iSCSIPortalRef portal);
+
+/*! Discards all cached portal and host interface addresses (e.g., after
+ *  the network configuration has changed).  Resolutions that are in
+ *  progress are not affected. */
+void iSCSIUtilsFlushAddressCache();
+
 #endif /* defined(__ISCSI_UTILS_H__) */
@@ -39,6 +39,7 @@
 #include "iSCSIIORegistry.h"
 #include "iSCSIUtils.h"
 #include "iSCSIAuthRIghts.h"
+#include "iSCSIHBATypes.h"
 
 #include <netdb.h>
 #include <ifaddrs.h>
@@ -65,6 +66,9 @@ enum iSCSICtlCmds {
     /*! Logout (target). */
     kiSCSICtlCmdLogout,
 
+    /*! Display performance statistics (targets). */
+    kiSCSICtlCmdStats,
+
     /*! Invalid mode of operation. */
     kiSCSICtlCmdInvalid
 };
@@ -94,6 +98,9 @@ enum iSCSICtlSubCmds {
     /*! Sub mode for LUN operations. */
     kiSCSICtlSubCmdLUNs,
 
+    /*! Sub mode for login scheduler operations. */
+    kiSCSICtlSubCmdLoginScheduler,
+
     /*! Invalid sub-mode. */
     kiSCSICtlSubCmdInvalid
 };
@@ -104,6 +111,9 @@ CFStringRef kOptKeyTarget = CFSTR("target");
 /*! Portal command-line option. */
 CFStringRef kOptKeyPortal = CFSTR("portal");
 
+/*! Targets command-line option (used when several targets are specified). */
+CFStringRef kOptKeyTargets = CFSTR("targets");
+
 /*! Port command-line option. */
 CFStringRef kOptKeyPort = CFSTR("port");
 
@@ -116,6 +126,15 @@ CFStringRef kOptKeyAutoLogin = CFSTR("auto-login");
 /*! Persistent command-line option. */
 CFStringRef kOptKeyPersistent = CFSTR("persistent");
 
+/*! Boot-critical command-line option. */
+CFStringRef kOptKeyBootCritical = CFSTR("boot-critical");
+
+/*! Boot-critical enable/disable command-line value. */
+CFStringRef kOptValueBootCriticalEnable = CFSTR("enable");
+
+/*! Boot-critical enable/disable command-line value. */
+CFStringRef kOptValueBootCriticalDisable = CFSTR("disable");
+
 /*! Auto-login enable/disable command-line value. */
 CFStringRef kOptValueAutoLoginEnable = CFSTR("enable");
 
@@ -152,6 +171,18 @@ CFStringRef kOptKeyNodeName = CFSTR("node-name");
 /*! Node alias command-line option. */
 CFStringRef kOptKeyNodeAlias = CFSTR("node-alias");
 
+/*! Maximum number of concurrent logins command-line option. */
+CFStringRef kOptKeyMaxConcurrentLogins = CFSTR("max-concurrent-logins");
+
+/*! Retain sessions during sleep command-line option. */
+CFStringRef kOptKeyRetainSessionsDuringSleep = CFSTR("retain-sessions-during-sleep");
+
+/*! Retain sessions during sleep enable/disable command-line value. */
+CFStringRef kOptValueRetainSessionsEnable = CFSTR("enable");
+
+/*! Retain sessions during sleep enable/disable command-line value. */
+CFStringRef kOptValueRetainSessionsDisable = CFSTR("disable");
+
 /*! Max connections command line option. */
 CFStringRef kOptKeyMaxConnections = CFSTR("MaxConnections");
 
@@ -182,6 +213,18 @@ CFStringRef kOptValueDiscoveryDisable = CFSTR("disable");
 /*! Discovery interval command-line option. */
 CFStringRef kOptKeyDiscoveryInterval = CFSTR("interval");
 
+/*! Statistics sampling interval command-line option. */
+CFStringRef kOptKeyStatsInterval = CFSTR("interval");
+
+/*! Statistics sample count command-line option. */
+CFStringRef kOptKeyStatsCount = CFSTR("count");
+
+/*! Statistics latency histogram command-line option. */
+CFStringRef kOptKeyStatsLatency = CFSTR("latency");
+
+/*! Statistics reset command-line option. */
+CFStringRef kOptKeyStatsReset = CFSTR("reset");
+
 /*! Empty value. */
 CFStringRef kOptValueEmpty = CFSTR("");
 
@@ -212,6 +255,7 @@ enum iSCSICtlCmds iSCSICtlGetCmdFromArguments(CFArrayRef arguments)
     CFDictionarySetValue(modesDict,CFSTR("list") ,(const void *)kiSCSICtlCmdList);
     CFDictionarySetValue(modesDict,CFSTR("login"),(const void *)kiSCSICtlCmdLogin);
     CFDictionarySetValue(modesDict,CFSTR("logout"),(const void *)kiSCSICtlCmdLogout);
+    CFDictionarySetValue(modesDict,CFSTR("stats"),(const void *)kiSCSICtlCmdStats);
 
     // If a mode was supplied (first argument after executable name)
     if(CFArrayGetCount(arguments) > 1) {
@@ -234,6 +278,7 @@ enum iSCSICtlSubCmds iSCSICtlGetSubCmdFromArguments(CFArrayRef arguments)
     CFDictionaryAddValue(subModesDict,CFSTR("discovery-portal"),(const void *)kiSCSICtlSubCmdDiscoveryPortal);
     CFDictionaryAddValue(subModesDict,CFSTR("discovery-config"),(const void *)kiSCSICtlSubCmdDiscoveryConfig);
     CFDictionaryAddValue(subModesDict,CFSTR("luns"),(const void *)kiSCSICtlSubCmdLUNs);
+    CFDictionaryAddValue(subModesDict,CFSTR("login-scheduler"),(const void *)kiSCSICtlSubCmdLoginScheduler);
 
     // If a mode was supplied (first argument after executable name)
     if(CFArrayGetCount(arguments) > 2) {
@@ -280,6 +325,37 @@ void iSCSICtlParseTargetAndPortalToDictionary(CFArrayRef arguments,
             else
                 CFDictionaryAddValue(optDictionary,kOptKeyTarget,arg);
         }
+        CFRelease(argParts);
+        
+        // Several targets may follow (e.g., iscsictl login <target> <target>),
+        // in which case they are all collected so that they can be processed
+        // using a single request to the daemon
+        if(!CFDictionaryContainsKey(optDictionary,kOptKeyTarget))
+            return;
+        
+        CFMutableArrayRef targets = CFArrayCreateMutable(kCFAllocatorDefault,0,&kCFTypeArrayCallBacks);
+        CFArrayAppendValue(targets,CFDictionaryGetValue(optDictionary,kOptKeyTarget));
+        
+        CFIndex argCount = CFArrayGetCount(arguments);
+        for(CFIndex idx = targetAndPortalIdx + 1; idx < argCount; idx++)
+        {
+            arg = CFArrayGetValueAtIndex(arguments,idx);
+            
+            // Stop at the first switch
+            if(CFStringGetLength(arg) == 0 || CFStringGetCharacterAtIndex(arg,0) == '-')
+                break;
+            
+            if(!CFStringHasPrefix(arg,CFSTR("iqn.")) && !CFStringHasPrefix(arg,CFSTR("eui.")))
+                break;
+            
+            CFArrayAppendValue(targets,arg);
+        }
+        
+        // A portal cannot be combined with several targets
+        if(CFArrayGetCount(targets) > 1 && !CFDictionaryContainsKey(optDictionary,kOptKeyPortal))
+            CFDictionarySetValue(optDictionary,kOptKeyTargets,targets);
+        
+        CFRelease(targets);
     }
 }
 
@@ -357,7 +433,9 @@ void iSCSICtlDisplayUsage()
                                 "       iscsictl remove target <target>[,<portal>]\n\n"));
     
     iSCSICtlDisplayString(CFSTR("       iscsictl login  <target>[,<portal>]\n"
-                                "       iscsictl logout <target>[,<portal>]\n\n"));
+                                "       iscsictl login  <target> <target> [...]\n"
+                                "       iscsictl logout <target>[,<portal>]\n"
+                                "       iscsictl logout <target> <target> [...]\n\n"));
     
     iSCSICtlDisplayString(CFSTR("       iscsictl modify initiator-config [...]\n"
                                 "       iscsictl modify target-config <target>[,<portal>] [...]\n"
@@ -371,7 +449,11 @@ void iSCSICtlDisplayUsage()
                                 "       iscsictl remove discovery-portal <portal>\n\n"));
                                         
     iSCSICtlDisplayString(CFSTR("       iscsictl list targets\n"
-                                "       iscsictl list luns\n"));
+                                "       iscsictl list luns\n"
+                                "       iscsictl list login-scheduler\n\n"));
+
+    iSCSICtlDisplayString(CFSTR("       iscsictl stats [<target>] [-interval <seconds>] [-count <samples>] [-latency]\n"
+                                "       iscsictl stats [<target>] -reset\n"));
 }
 
 CFStringRef iSCSICtlCreateSecretFromInput(CFIndex retries)
@@ -651,10 +733,112 @@ void iSCSICtlDisconnectFromDaemon(iSCSIDaemonHandle handle)
     iSCSIDaemonDisconnect(handle);
 }
 
+/*! Creates an array of target objects from the targets specified on the
+ *  command line, verifying that each one is well-formed and (optionally)
+ *  defined in the preferences.  Displays an error message and returns NULL
+ *  if any of the targets is invalid.
+ *  @param options command-line options.
+ *  @param preferences preferences in which the targets must exist, or NULL.
+ *  @return an array of target objects, or NULL. */
+CFArrayRef iSCSICtlCreateArrayOfTargetsFromOptions(CFDictionaryRef options,
+                                                   iSCSIPreferencesRef preferences)
+{
+    CFArrayRef targetIQNs = NULL;
+    
+    if(!CFDictionaryGetValueIfPresent(options,kOptKeyTargets,(const void **)&targetIQNs))
+        return NULL;
+    
+    CFIndex targetCount = CFArrayGetCount(targetIQNs);
+    CFMutableArrayRef targets = CFArrayCreateMutable(kCFAllocatorDefault,targetCount,&kCFTypeArrayCallBacks);
+    
+    for(CFIndex idx = 0; idx < targetCount; idx++)
+    {
+        CFStringRef targetIQN = CFArrayGetValueAtIndex(targetIQNs,idx);
+        
+        if(!iSCSIUtilsValidateIQN(targetIQN)) {
+            CFStringRef errorString = CFStringCreateWithFormat(
+                kCFAllocatorDefault,0,CFSTR("%@ is not a valid IQN or EUI-64 identifier"),targetIQN);
+            iSCSICtlDisplayError(errorString);
+            CFRelease(errorString);
+            CFRelease(targets);
+            return NULL;
+        }
+        
+        if(preferences && !iSCSIPreferencesContainsTarget(preferences,targetIQN)) {
+            CFStringRef errorString = CFStringCreateWithFormat(
+                kCFAllocatorDefault,0,CFSTR("The target %@ does not exist"),targetIQN);
+            iSCSICtlDisplayError(errorString);
+            CFRelease(errorString);
+            CFRelease(targets);
+            return NULL;
+        }
+        
+        iSCSIMutableTargetRef target = iSCSITargetCreateMutable();
+        iSCSITargetSetIQN(target,targetIQN);
+        CFArrayAppendValue(targets,target);
+        iSCSITargetRelease(target);
+    }
+    return targets;
+}
+
+/*! Logs into several targets using a single request to the daemon, which
+ *  performs the logins concurrently.
+ *  @param authorization an authorization for the right kiSCSIAuthModifyLogin
+ *  @param options the command-line options.
+ *  @return an error code indicating the result of the operation. */
+errno_t iSCSICtlLoginTargets(AuthorizationRef authorization,CFDictionaryRef options)
+{
+    iSCSIDaemonHandle handle = -1;
+    CFArrayRef targets = NULL;
+    errno_t error = 0;
+    
+    iSCSIPreferencesRef preferences = iSCSIPreferencesCreateFromAppValues();
+    
+    if(!(targets = iSCSICtlCreateArrayOfTargetsFromOptions(options,preferences)))
+        error = EINVAL;
+    
+    if(!error)
+        error = iSCSICtlConnectToDaemon(&handle);
+    
+    if(!error) {
+        CFIndex targetCount = CFArrayGetCount(targets);
+        errno_t errorCodes[targetCount];
+        enum iSCSILoginStatusCode statusCodes[targetCount];
+        
+        error = iSCSIDaemonLoginTargets(handle,authorization,targets,errorCodes,statusCodes);
+        
+        for(CFIndex idx = 0; !error && idx < targetCount; idx++)
+        {
+            iSCSITargetRef target = CFArrayGetValueAtIndex(targets,idx);
+            
+            if(errorCodes[idx] == EBUSY)
+                iSCSICtlDisplayString(CFSTR("The specified target has an active session\n"));
+            else if(errorCodes[idx])
+                iSCSICtlDisplayErrorCode(errorCodes[idx]);
+            else
+                iSCSICtlDisplayLoginStatus(statusCodes[idx],target,NULL);
+        }
+        
+        if(error)
+            iSCSICtlDisplayErrorCode(error);
+    }
+    
+    if(targets)
+        CFRelease(targets);
+    if(preferences)
+        iSCSIPreferencesRelease(preferences);
+    iSCSICtlDisconnectFromDaemon(handle);
+    
+    return error;
+}
+
 errno_t iSCSICtlLogin(AuthorizationRef authorization,CFDictionaryRef options)
 {
     if(!authorization || !options)
         return EINVAL;
+    
+    if(CFDictionaryContainsKey(options,kOptKeyTargets))
+        return iSCSICtlLoginTargets(authorization,options);
 
     iSCSIDaemonHandle handle = -1;
     iSCSITargetRef target = NULL;
@@ -760,11 +944,61 @@ errno_t iSCSICtlLogin(AuthorizationRef authorization,CFDictionaryRef options)
     return error;
 }
 
+/*! Logs out of several targets using a single request to the daemon, which
+ *  performs the logouts concurrently.
+ *  @param authorization an authorization for the right kiSCSIAuthModifyLogin
+ *  @param options the command-line options.
+ *  @return an error code indicating the result of the operation. */
+errno_t iSCSICtlLogoutTargets(AuthorizationRef authorization,CFDictionaryRef options)
+{
+    iSCSIDaemonHandle handle = -1;
+    CFArrayRef targets = NULL;
+    errno_t error = 0;
+    
+    if(!(targets = iSCSICtlCreateArrayOfTargetsFromOptions(options,NULL)))
+        error = EINVAL;
+    
+    if(!error)
+        error = iSCSICtlConnectToDaemon(&handle);
+    
+    if(!error) {
+        CFIndex targetCount = CFArrayGetCount(targets);
+        errno_t errorCodes[targetCount];
+        enum iSCSILogoutStatusCode statusCodes[targetCount];
+        
+        error = iSCSIDaemonLogoutTargets(handle,authorization,targets,errorCodes,statusCodes);
+        
+        for(CFIndex idx = 0; !error && idx < targetCount; idx++)
+        {
+            iSCSITargetRef target = CFArrayGetValueAtIndex(targets,idx);
+            
+            if(errorCodes[idx] == EINVAL)
+                iSCSICtlDisplayString(CFSTR("The specified target has no active session\n"));
+            else if(errorCodes[idx])
+                iSCSICtlDisplayErrorCode(errorCodes[idx]);
+            else
+                iSCSICtlDisplayLogoutStatus(statusCodes[idx],target,NULL);
+        }
+        
+        if(error)
+            iSCSICtlDisplayErrorCode(error);
+    }
+    
+    if(targets)
+        CFRelease(targets);
+    iSCSICtlDisconnectFromDaemon(handle);
+    
+    return error;
+}
+
 errno_t iSCSICtlLogout(AuthorizationRef authorization,CFDictionaryRef options)
 {
     if(!authorization || !options)
         return EINVAL;
     
+    if(CFDictionaryContainsKey(options,kOptKeyTargets))
+        return iSCSICtlLogoutTargets(authorization,options);
+    
     iSCSIDaemonHandle handle = -1;
     iSCSITargetRef target = NULL;
     iSCSIPortalRef portal = NULL;
@@ -1099,6 +1333,39 @@ errno_t iSCSICtlModifyInitiator(AuthorizationRef authorization,CFDictionaryRef o
         validOption = true;
     }
 
+    // Check for maximum number of concurrent logins (zero selects the default)
+    if(!error && CFDictionaryGetValueIfPresent(options,kOptKeyMaxConcurrentLogins,(const void**)&value))
+    {
+        SInt32 maxLogins = CFStringGetIntValue(value);
+        
+        if(CFStringCompare(value,kOptValueEmpty,0) == kCFCompareEqualTo || maxLogins < 0) {
+            iSCSICtlDisplayError(CFSTR("The specified maximum number of concurrent logins is invalid"));
+            error = EINVAL;
+        }
+        else
+            iSCSIPreferencesSetInitiatorMaxConcurrentLogins(preferences,maxLogins);
+        
+        validOption = true;
+    }
+
+    // Check for retaining sessions while the system sleeps
+    if(!error && CFDictionaryGetValueIfPresent(options,kOptKeyRetainSessionsDuringSleep,(const void**)&value))
+    {
+        if(CFStringCompare(value,kOptValueRetainSessionsEnable,kCFCompareCaseInsensitive) == kCFCompareEqualTo)
+            iSCSIPreferencesSetInitiatorRetainSessionsDuringSleep(preferences,true);
+        else if(CFStringCompare(value,kOptValueRetainSessionsDisable,kCFCompareCaseInsensitive) == kCFCompareEqualTo)
+            iSCSIPreferencesSetInitiatorRetainSessionsDuringSleep(preferences,false);
+        else {
+            CFStringRef errorString = CFStringCreateWithFormat(
+                kCFAllocatorDefault,0,CFSTR("Invalid argument for %@"),kOptKeyRetainSessionsDuringSleep);
+            iSCSICtlDisplayError(errorString);
+            CFRelease(errorString);
+            error = EINVAL;
+        }
+        
+        validOption = true;
+    }
+
     // Check for initiator IQN
     if(!error && CFDictionaryGetValueIfPresent(options,kOptKeyNodeName,(const void **)&value))
     {
@@ -1238,6 +1505,25 @@ errno_t iSCSICtlModifyTargetFromOptions(AuthorizationRef authorization,
         validOption = true;
     }
 
+    // Check for boot-critical
+    if(!error && CFDictionaryGetValueIfPresent(options,kOptKeyBootCritical,(const void **)&value))
+    {
+        
+        if(CFStringCompare(value,kOptValueBootCriticalEnable,kCFCompareCaseInsensitive) == kCFCompareEqualTo)
+            iSCSIPreferencesSetBootCriticalForTarget(preferences,targetIQN,true);
+        else if(CFStringCompare(value,kOptValueBootCriticalDisable,kCFCompareCaseInsensitive) == kCFCompareEqualTo)
+            iSCSIPreferencesSetBootCriticalForTarget(preferences,targetIQN,false);
+        else {
+            CFStringRef errorString = CFStringCreateWithFormat(
+                kCFAllocatorDefault,0,CFSTR("Invalid argument for %@"),kOptKeyBootCritical);
+            iSCSICtlDisplayError(errorString);
+            CFRelease(errorString);
+            error = EINVAL;
+        }
+        
+        validOption = true;
+    }
+
     // Check for maximum connections
     if(!error && CFDictionaryGetValueIfPresent(options,kOptKeyMaxConnections,(const void **)&value))
     {
@@ -1551,6 +1837,7 @@ errno_t iSCSICtlListTargets(CFDictionaryRef options)
     // assumed to be disconnected.
     iSCSIDaemonHandle handle = 0;
     CFArrayRef targetsList;
+    CFDictionaryRef sessionsProperties = NULL;
     errno_t error = 0;
     iSCSIPreferencesRef preferences = iSCSIPreferencesCreateFromAppValues();
 
@@ -1560,6 +1847,10 @@ errno_t iSCSICtlListTargets(CFDictionaryRef options)
     else
         error = iSCSICtlConnectToDaemon(&handle);
     
+    // Retrieve the properties of all sessions and connections at once
+    if(targetsList && !error)
+        sessionsProperties = iSCSIDaemonCreateCFPropertiesForAllSessions(handle);
+    
     // If we connected to the daemon and we have defined targets
     if(targetsList) {
         
@@ -1574,9 +1865,11 @@ errno_t iSCSICtlListTargets(CFDictionaryRef options)
                 continue;
 
             // If we connected to the daemon get status of any active sessions
-            CFDictionaryRef properties = NULL;
-            if(!error)
-                properties = iSCSIDaemonCreateCFPropertiesForSession(handle,target);
+            CFDictionaryRef properties = NULL, connectionsProperties = NULL;
+            if(sessionsProperties)
+                properties = CFDictionaryGetValue(sessionsProperties,targetIQN);
+            if(properties)
+                connectionsProperties = CFDictionaryGetValue(properties,kRFC3720_Key_Connections);
 
             displayTargetInfo(target,properties);
             
@@ -1592,8 +1885,9 @@ errno_t iSCSICtlListTargets(CFDictionaryRef options)
                     CFDictionaryRef properties = NULL;
 
                     // If we connected to the the daemon get status of active portals
-                    if(!error)
-                        properties = iSCSIDaemonCreateCFPropertiesForConnection(handle,target,portal);
+                    if(connectionsProperties)
+                        properties = CFDictionaryGetValue(connectionsProperties,
+                                                          iSCSIPortalGetAddress(portal));
 
                     displayPortalInfo(target,portal,properties);
                     iSCSIPortalRelease(portal);
@@ -1607,6 +1901,8 @@ errno_t iSCSICtlListTargets(CFDictionaryRef options)
 
     if(targetsList)
         CFRelease(targetsList);
+    if(sessionsProperties)
+        CFRelease(sessionsProperties);
     
     iSCSIPreferencesRelease(preferences);
     iSCSICtlDisconnectFromDaemon(handle);
@@ -1674,6 +1970,16 @@ errno_t iSCSICtlListTarget(CFDictionaryRef options)
     iSCSICtlDisplayString(persistentString);
     CFRelease(persistentString);
     
+    // Get information about boot-critical targets
+    CFStringRef bootCritical = CFSTR("no");
+    
+    if(iSCSIPreferencesGetBootCriticalForTarget(preferences,targetIQN))
+        bootCritical = CFSTR("yes");
+    
+    CFStringRef bootCriticalString = CFStringCreateWithFormat(kCFAllocatorDefault,0,CFSTR("\t%@: %@\n"),kOptKeyBootCritical,bootCritical);
+    iSCSICtlDisplayString(bootCriticalString);
+    CFRelease(bootCriticalString);
+    
     if(iSCSIPreferencesGetTargetConfigType(preferences,targetIQN) == kiSCSITargetConfigDynamicSendTargets)
     {
         CFStringRef discoveryPortal = iSCSIPreferencesGetDiscoveryPortalForTarget(preferences,targetIQN);
@@ -1878,12 +2184,24 @@ errno_t iSCSICtlListInitiatorConfig()
     if(!iSCSIKeychainContainsCHAPSecretForNode(initiatorIQN))
         CHAPSecret = CFSTR("<unspecified>");
 
+    CFStringRef maxLogins = NULL;
+    UInt32 maxLoginsValue = iSCSIPreferencesGetInitiatorMaxConcurrentLogins(preferences);
+    if(maxLoginsValue)
+        maxLogins = CFStringCreateWithFormat(kCFAllocatorDefault,0,CFSTR("%u"),maxLoginsValue);
+    else
+        maxLogins = CFStringCreateCopy(kCFAllocatorDefault,CFSTR("<default>"));
+
+    CFStringRef retainSessions = CFSTR("disabled");
+    if(iSCSIPreferencesGetInitiatorRetainSessionsDuringSleep(preferences))
+        retainSessions = CFSTR("enabled");
 
     CFStringRef format = CFSTR("%@"
                                "\n\t%@ %@"
                                "\n\tAuthentication: %@"
                                "\n\t\t%@ %@"  // CHAP-name
                                "\n\t\t%@ %@"  // CHAP-secret
+                               "\n\t%@ %@"     // max-concurrent-logins
+                               "\n\t%@ %@"     // retain-sessions-during-sleep
                                "\n");
 
     CFStringRef initiatorConfig = CFStringCreateWithFormat(
@@ -1892,9 +2210,12 @@ errno_t iSCSICtlListInitiatorConfig()
         kOptKeyNodeAlias,alias,
         authMethod,
         kOptKeyCHAPName,CHAPName,
-        kOptKeyCHAPSecret,CHAPSecret);
+        kOptKeyCHAPSecret,CHAPSecret,
+        kOptKeyMaxConcurrentLogins,maxLogins,
+        kOptKeyRetainSessionsDuringSleep,retainSessions);
 
     CFRelease(initiatorIQN);
+    CFRelease(maxLogins);
     CFRelease(alias);
     CFRelease(CHAPName);
 
@@ -1906,6 +2227,165 @@ errno_t iSCSICtlListInitiatorConfig()
     return 0;
 }
 
+/*! Compares the login histories of two portals by health score (used to
+ *  list the healthiest portals first). */
+CFComparisonResult iSCSICtlComparePortalHealth(const void * value1,const void * value2,void * context)
+{
+    CFDictionaryRef portals = context;
+    double score1 = 0, score2 = 0;
+    
+    CFNumberRef score = CFDictionaryGetValue(CFDictionaryGetValue(portals,value1),kiSCSIDPortalHealthScoreKey);
+    if(score)
+        CFNumberGetValue(score,kCFNumberDoubleType,&score1);
+    
+    score = CFDictionaryGetValue(CFDictionaryGetValue(portals,value2),kiSCSIDPortalHealthScoreKey);
+    if(score)
+        CFNumberGetValue(score,kCFNumberDoubleType,&score2);
+    
+    if(score1 > score2)
+        return kCFCompareLessThan;
+    if(score1 < score2)
+        return kCFCompareGreaterThan;
+    return CFStringCompare(value1,value2,0);
+}
+
+/*! Helper function.  Gets a value from a dictionary of numbers.
+ *  @return true if the value exists. */
+Boolean iSCSICtlGetNumber(CFDictionaryRef dict,CFStringRef key,CFNumberType type,void * value)
+{
+    CFNumberRef number = CFDictionaryGetValue(dict,key);
+    return number && CFNumberGetValue(number,type,value);
+}
+
+/*! Displays the login history of each portal (healthiest portal first) and
+ *  the logins the daemon will retry after session timeouts or failed logins.
+ *  @return an error code indicating the result of the operation. */
+errno_t iSCSICtlListLoginScheduler()
+{
+    iSCSIDaemonHandle handle = 0;
+    errno_t error = iSCSICtlConnectToDaemon(&handle);
+    
+    if(error)
+        return error;
+    
+    CFDictionaryRef scheduler = iSCSIDaemonCreateCFPropertiesForLoginScheduler(handle);
+    iSCSICtlDisconnectFromDaemon(handle);
+    
+    if(!scheduler) {
+        iSCSICtlDisplayError(CFSTR("Could not retrieve the state of the login scheduler"));
+        return EIO;
+    }
+    
+    CFDictionaryRef portals = CFDictionaryGetValue(scheduler,kiSCSIDLoginSchedulerPortalsKey);
+    CFIndex portalCount = portals ? CFDictionaryGetCount(portals) : 0;
+    
+    CFStringRef header = CFStringCreateWithFormat(kCFAllocatorDefault,0,CFSTR("portals: %ld\n"),portalCount);
+    iSCSICtlDisplayString(header);
+    CFRelease(header);
+    
+    if(portalCount > 0)
+    {
+        const void * addresses[portalCount];
+        CFDictionaryGetKeysAndValues(portals,addresses,NULL);
+        
+        CFMutableArrayRef sortedAddresses = CFArrayCreateMutable(kCFAllocatorDefault,portalCount,&kCFTypeArrayCallBacks);
+        for(CFIndex idx = 0; idx < portalCount; idx++)
+            CFArrayAppendValue(sortedAddresses,addresses[idx]);
+        
+        CFArraySortValues(sortedAddresses,CFRangeMake(0,portalCount),iSCSICtlComparePortalHealth,(void *)portals);
+        
+        for(CFIndex idx = 0; idx < portalCount; idx++)
+        {
+            CFStringRef portalAddress = CFArrayGetValueAtIndex(sortedAddresses,idx);
+            CFDictionaryRef health = CFDictionaryGetValue(portals,portalAddress);
+            
+            SInt32 attempts = 0, successes = 0, failures = 0;
+            double latency = 0, score = 0, elapsed = 0;
+            
+            iSCSICtlGetNumber(health,kiSCSIDPortalLoginAttemptsKey,kCFNumberSInt32Type,&attempts);
+            iSCSICtlGetNumber(health,kiSCSIDPortalLoginSuccessesKey,kCFNumberSInt32Type,&successes);
+            iSCSICtlGetNumber(health,kiSCSIDPortalConsecutiveFailuresKey,kCFNumberSInt32Type,&failures);
+            iSCSICtlGetNumber(health,kiSCSIDPortalLoginLatencyKey,kCFNumberDoubleType,&latency);
+            iSCSICtlGetNumber(health,kiSCSIDPortalHealthScoreKey,kCFNumberDoubleType,&score);
+            
+            CFStringRef lastAttempt = NULL;
+            if(iSCSICtlGetNumber(health,kiSCSIDPortalTimeSinceLastAttemptKey,kCFNumberDoubleType,&elapsed))
+                lastAttempt = CFStringCreateWithFormat(kCFAllocatorDefault,0,CFSTR("%.0f s ago"),elapsed);
+            else
+                lastAttempt = CFStringCreateCopy(kCFAllocatorDefault,CFSTR("never"));
+            
+            char portalAddressBuffer[NI_MAXHOST];
+            CFStringGetCString(portalAddress,portalAddressBuffer,NI_MAXHOST,kCFStringEncodingASCII);
+            
+            CFStringRef entry = CFStringCreateWithFormat(
+                kCFAllocatorDefault,0,
+                CFSTR("\t%-15s <score %.2f, logins %d/%d, latency %.0f ms, failures %d, last attempt %@>\n"),
+                portalAddressBuffer,score,successes,attempts,latency*1000,failures,lastAttempt);
+            
+            iSCSICtlDisplayString(entry);
+            CFRelease(entry);
+            CFRelease(lastAttempt);
+            
+            // Show why the portal last failed
+            SInt32 lastError = 0, lastStatusCode = kiSCSILoginInvalidStatusCode;
+            if(iSCSICtlGetNumber(health,kiSCSIDPortalLastErrorKey,kCFNumberSInt32Type,&lastError))
+            {
+                iSCSICtlGetNumber(health,kiSCSIDPortalLastStatusCodeKey,kCFNumberSInt32Type,&lastStatusCode);
+                
+                if(lastError)
+                    entry = CFStringCreateWithFormat(kCFAllocatorDefault,0,CFSTR("\t\tlast error: %s\n"),strerror(lastError));
+                else
+                    entry = CFStringCreateWithFormat(kCFAllocatorDefault,0,CFSTR("\t\tlast error: %@\n"),
+                                                     iSCSIUtilsGetStringForLoginStatus(lastStatusCode));
+                iSCSICtlDisplayString(entry);
+                CFRelease(entry);
+            }
+        }
+        CFRelease(sortedAddresses);
+    }
+    
+    CFDictionaryRef relogins = CFDictionaryGetValue(scheduler,kiSCSIDLoginSchedulerReloginsKey);
+    CFIndex reloginCount = relogins ? CFDictionaryGetCount(relogins) : 0;
+    
+    header = CFStringCreateWithFormat(kCFAllocatorDefault,0,CFSTR("relogins: %ld\n"),reloginCount);
+    iSCSICtlDisplayString(header);
+    CFRelease(header);
+    
+    if(reloginCount > 0)
+    {
+        const void * targetIQNs[reloginCount];
+        const void * values[reloginCount];
+        CFDictionaryGetKeysAndValues(relogins,targetIQNs,values);
+        
+        for(CFIndex idx = 0; idx < reloginCount; idx++)
+        {
+            SInt32 failures = 0;
+            double sinceFailure = 0, untilLogin = 0;
+            
+            iSCSICtlGetNumber(values[idx],kiSCSIDReloginFailuresKey,kCFNumberSInt32Type,&failures);
+            iSCSICtlGetNumber(values[idx],kiSCSIDReloginTimeSinceLastFailureKey,kCFNumberDoubleType,&sinceFailure);
+            
+            CFStringRef next = NULL;
+            if(iSCSICtlGetNumber(values[idx],kiSCSIDReloginTimeUntilLoginKey,kCFNumberDoubleType,&untilLogin))
+                next = CFStringCreateWithFormat(kCFAllocatorDefault,0,CFSTR("next login in %.1f s"),untilLogin);
+            else
+                next = CFStringCreateCopy(kCFAllocatorDefault,CFSTR("no login pending"));
+            
+            CFStringRef entry = CFStringCreateWithFormat(
+                kCFAllocatorDefault,0,
+                CFSTR("\t%@ <failures %d, last failure %.0f s ago, %@>\n"),
+                targetIQNs[idx],failures,sinceFailure,next);
+            
+            iSCSICtlDisplayString(entry);
+            CFRelease(entry);
+            CFRelease(next);
+        }
+    }
+    
+    CFRelease(scheduler);
+    return 0;
+}
+
 /*! Adds a discovery portal for SendTargets discovery.
  *  @param handle handle to the iSCSI daemon.
  *  @param options the command-line options dictionary.
@@ -2328,6 +2808,448 @@ errno_t iSCSICtlListLUNs(CFDictionaryRef options)
     return 0;
 }
 
+/*! Gets a counter from a statistics dictionary.
+ *  @param dict the statistics dictionary.
+ *  @param key the counter key.
+ *  @return the value of the counter, or 0 if it does not exist. */
+UInt64 iSCSICtlGetStatistic(CFDictionaryRef dict,CFStringRef key)
+{
+    SInt64 value = 0;
+    CFNumberRef number = NULL;
+    
+    if(dict && CFDictionaryGetValueIfPresent(dict,key,(const void **)&number))
+        CFNumberGetValue(number,kCFNumberSInt64Type,&value);
+    
+    return (UInt64)value;
+}
+
+/*! Finds the entry of an array of statistics dictionaries whose identifier
+ *  (e.g., connection ID or LUN) matches that of the specified dictionary.
+ *  @param array the array of statistics dictionaries to search.
+ *  @param key the identifier key.
+ *  @param dict the dictionary to match.
+ *  @return the matching dictionary, or NULL if none exists. */
+CFDictionaryRef iSCSICtlFindStatistics(CFArrayRef array,CFStringRef key,CFDictionaryRef dict)
+{
+    if(!array)
+        return NULL;
+    
+    UInt64 identifier = iSCSICtlGetStatistic(dict,key);
+    
+    for(CFIndex idx = 0; idx < CFArrayGetCount(array); idx++) {
+        CFDictionaryRef entry = CFArrayGetValueAtIndex(array,idx);
+        if(iSCSICtlGetStatistic(entry,key) == identifier)
+            return entry;
+    }
+    return NULL;
+}
+
+/*! Displays the statistics of a single target.  If a previous sample is
+ *  provided, rates over the sampling interval are displayed; otherwise
+ *  cumulative counters are displayed.
+ *  @param targetIQN the name of the target.
+ *  @param current the current statistics sample.
+ *  @param previous the previous statistics sample (may be NULL).
+ *  @param interval the time between the two samples, in seconds. */
+void displayTargetStatistics(CFStringRef targetIQN,
+                             CFDictionaryRef current,
+                             CFDictionaryRef previous,
+                             double interval)
+{
+    // Rates are computed as (current - previous) / interval; when there is no
+    // previous sample the cumulative counters are displayed instead
+    #define STAT(dict,prevDict,key) \
+        ((prevDict) ? (iSCSICtlGetStatistic(dict,CFSTR(key)) - iSCSICtlGetStatistic(prevDict,CFSTR(key)))/interval \
+                    : (double)iSCSICtlGetStatistic(dict,CFSTR(key)))
+
+    CFStringRef unit = previous ? CFSTR("/s") : CFSTR("");
+    CFStringRef string = CFStringCreateWithFormat(kCFAllocatorDefault,NULL,CFSTR("%@\n"),targetIQN);
+    iSCSICtlDisplayString(string);
+    CFRelease(string);
+    
+    string = CFStringCreateWithFormat(
+        kCFAllocatorDefault,NULL,
+        CFSTR("\tcommands: %.0f issued%@, %.0f completed%@, %llu outstanding, %.0f task timeouts, %.0f connection timeouts\n"),
+        STAT(current,previous,kiSCSIStatisticsCommandsIssuedKey),unit,
+        STAT(current,previous,kiSCSIStatisticsCommandsCompletedKey),unit,
+        iSCSICtlGetStatistic(current,CFSTR(kiSCSIStatisticsOutstandingTasksKey)),
+        STAT(current,previous,kiSCSIStatisticsTaskTimeoutsKey),
+        STAT(current,previous,kiSCSIStatisticsConnectionTimeoutsKey));
+    iSCSICtlDisplayString(string);
+    CFRelease(string);
+    
+    CFArrayRef connections = CFDictionaryGetValue(current,CFSTR(kiSCSIStatisticsConnectionsKey));
+    CFArrayRef prevConnections = previous ? CFDictionaryGetValue(previous,CFSTR(kiSCSIStatisticsConnectionsKey)) : NULL;
+    
+    for(CFIndex idx = 0; connections && idx < CFArrayGetCount(connections); idx++)
+    {
+        CFDictionaryRef conn = CFArrayGetValueAtIndex(connections,idx);
+        CFDictionaryRef prevConn = previous ? iSCSICtlFindStatistics(prevConnections,CFSTR(kiSCSIStatisticsConnectionIdKey),conn) : NULL;
+        
+        // Skip connections that did not exist during the previous sample
+        if(previous && !prevConn)
+            continue;
+        
+        string = CFStringCreateWithFormat(
+            kCFAllocatorDefault,NULL,
+            CFSTR("\tconnection %llu: tx %.0f PDUs%@ (%.0f bytes%@), rx %.0f PDUs%@ (%.0f bytes%@)\n"),
+            iSCSICtlGetStatistic(conn,CFSTR(kiSCSIStatisticsConnectionIdKey)),
+            STAT(conn,prevConn,kiSCSIStatisticsTxPDUsKey),unit,
+            STAT(conn,prevConn,kiSCSIStatisticsTxBytesKey),unit,
+            STAT(conn,prevConn,kiSCSIStatisticsRxPDUsKey),unit,
+            STAT(conn,prevConn,kiSCSIStatisticsRxBytesKey),unit);
+        iSCSICtlDisplayString(string);
+        CFRelease(string);
+        
+        string = CFStringCreateWithFormat(
+            kCFAllocatorDefault,NULL,
+            CFSTR("\t\t%.0f data-out, %.0f data-in, %.0f R2T, %.0f/%.0f digest errors, %llu bytes/s peak, %llu ms latency\n"),
+            STAT(conn,prevConn,kiSCSIStatisticsTxDataOutPDUsKey),
+            STAT(conn,prevConn,kiSCSIStatisticsRxDataInPDUsKey),
+            STAT(conn,prevConn,kiSCSIStatisticsRxR2TPDUsKey),
+            STAT(conn,prevConn,kiSCSIStatisticsHeaderDigestErrorsKey),
+            STAT(conn,prevConn,kiSCSIStatisticsDataDigestErrorsKey),
+            iSCSICtlGetStatistic(conn,CFSTR(kiSCSIStatisticsBytesPerSecondKey)),
+            iSCSICtlGetStatistic(conn,CFSTR(kiSCSIStatisticsLatencyKey)));
+        iSCSICtlDisplayString(string);
+        CFRelease(string);
+    }
+    
+    CFArrayRef LUNs = CFDictionaryGetValue(current,CFSTR(kiSCSIStatisticsLUNsKey));
+    CFArrayRef prevLUNs = previous ? CFDictionaryGetValue(previous,CFSTR(kiSCSIStatisticsLUNsKey)) : NULL;
+    
+    for(CFIndex idx = 0; LUNs && idx < CFArrayGetCount(LUNs); idx++)
+    {
+        CFDictionaryRef LUN = CFArrayGetValueAtIndex(LUNs,idx);
+        CFDictionaryRef prevLUN = previous ? iSCSICtlFindStatistics(prevLUNs,CFSTR(kiSCSIStatisticsLUNKey),LUN) : NULL;
+        
+        // A LUN that first appears in this sample has no prior traffic
+        CFDictionaryRef emptyDict = NULL;
+        if(previous && !prevLUN)
+            prevLUN = emptyDict = CFDictionaryCreate(kCFAllocatorDefault,NULL,NULL,0,
+                                                     &kCFTypeDictionaryKeyCallBacks,
+                                                     &kCFTypeDictionaryValueCallBacks);
+        
+        string = CFStringCreateWithFormat(
+            kCFAllocatorDefault,NULL,
+            CFSTR("\tlun %llu: %.0f commands%@, %.0f bytes read%@, %.0f bytes written%@, %.0f errors\n"),
+            iSCSICtlGetStatistic(LUN,CFSTR(kiSCSIStatisticsLUNKey)),
+            STAT(LUN,prevLUN,kiSCSIStatisticsLUNCommandsKey),unit,
+            STAT(LUN,prevLUN,kiSCSIStatisticsLUNBytesReadKey),unit,
+            STAT(LUN,prevLUN,kiSCSIStatisticsLUNBytesWrittenKey),unit,
+            STAT(LUN,prevLUN,kiSCSIStatisticsLUNErrorsKey));
+        iSCSICtlDisplayString(string);
+        CFRelease(string);
+        
+        if(emptyDict)
+            CFRelease(emptyDict);
+    }
+    
+    #undef STAT
+}
+
+/*! Gets a latency histogram from a statistics dictionary.  If a previous
+ *  histogram is provided, the returned histogram only contains the samples
+ *  recorded since then (the maximum is that of the current histogram).
+ *  @param data the histogram data.
+ *  @param prevData the previous histogram data (may be NULL).
+ *  @param histogram the histogram.
+ *  @return true if a histogram was retrieved. */
+Boolean iSCSICtlGetLatencyHistogram(CFDataRef data,
+                                    CFDataRef prevData,
+                                    iSCSIHBALatencyHistogram * histogram)
+{
+    if(!data || CFDataGetLength(data) != sizeof(iSCSIHBALatencyHistogram))
+        return false;
+    
+    CFDataGetBytes(data,CFRangeMake(0,sizeof(iSCSIHBALatencyHistogram)),(UInt8 *)histogram);
+    
+    if(!prevData || CFDataGetLength(prevData) != sizeof(iSCSIHBALatencyHistogram))
+        return true;
+    
+    iSCSIHBALatencyHistogram previous;
+    CFDataGetBytes(prevData,CFRangeMake(0,sizeof(iSCSIHBALatencyHistogram)),(UInt8 *)&previous);
+    
+    // Counters were reset during the interval; use the current histogram
+    if(previous.count > histogram->count)
+        return true;
+    
+    histogram->count -= previous.count;
+    histogram->sumUSec -= previous.sumUSec;
+    
+    for(UInt32 bucket = 0; bucket < kiSCSIHBALatencyHistogramBucketCount; bucket++)
+        histogram->buckets[bucket] -= previous.buckets[bucket];
+    
+    return true;
+}
+
+/*! Gets a percentile from a latency histogram.  The result is the upper
+ *  bound of the bucket that contains the percentile.
+ *  @param histogram the histogram.
+ *  @param percentile the percentile (between 0 and 100).
+ *  @return the latency in microseconds. */
+UInt64 iSCSICtlGetLatencyPercentile(iSCSIHBALatencyHistogram * histogram,double percentile)
+{
+    UInt64 target = (UInt64)(histogram->count * percentile / 100.0 + 0.5);
+    UInt64 cumulative = 0;
+    
+    if(target == 0)
+        target = 1;
+    
+    for(UInt32 bucket = 0; bucket < kiSCSIHBALatencyHistogramBucketCount - 1; bucket++) {
+        cumulative += histogram->buckets[bucket];
+        
+        if(cumulative >= target) {
+            UInt64 upperBound = iSCSIHBALatencyHistogramGetBucketLowerBound(bucket + 1) - 1;
+            return upperBound < histogram->maxUSec ? upperBound : histogram->maxUSec;
+        }
+    }
+    return histogram->maxUSec;
+}
+
+/*! Displays a row of the latency table.
+ *  @param label the label of the row.
+ *  @param data the histogram data.
+ *  @param prevData the previous histogram data (may be NULL). */
+void displayLatencyHistogram(CFStringRef label,CFDataRef data,CFDataRef prevData)
+{
+    iSCSIHBALatencyHistogram histogram;
+    
+    if(!iSCSICtlGetLatencyHistogram(data,prevData,&histogram) || histogram.count == 0)
+        return;
+    
+    char labelBuffer[32];
+    CFStringGetCString(label,labelBuffer,sizeof(labelBuffer),kCFStringEncodingUTF8);
+    
+    CFStringRef string = CFStringCreateWithFormat(
+        kCFAllocatorDefault,NULL,CFSTR("\t%-18s %10llu %9llu %9llu %9llu %9llu %9llu %9llu\n"),
+        labelBuffer,histogram.count,histogram.sumUSec/histogram.count,
+        iSCSICtlGetLatencyPercentile(&histogram,50),
+        iSCSICtlGetLatencyPercentile(&histogram,90),
+        iSCSICtlGetLatencyPercentile(&histogram,99),
+        iSCSICtlGetLatencyPercentile(&histogram,99.9),
+        histogram.maxUSec);
+    iSCSICtlDisplayString(string);
+    CFRelease(string);
+}
+
+/*! Displays a row of the latency table for each latency type.
+ *  @param prefix the label prefix for the rows.
+ *  @param histograms a dictionary of histograms keyed by latency type.
+ *  @param prevHistograms the previous dictionary of histograms (may be NULL). */
+void displayLatencyHistograms(CFStringRef prefix,CFDictionaryRef histograms,CFDictionaryRef prevHistograms)
+{
+    CFStringRef keys[] = {
+        CFSTR(kiSCSIStatisticsLatencyQueueKey),
+        CFSTR(kiSCSIStatisticsLatencyWireKey),
+        CFSTR(kiSCSIStatisticsLatencyTotalKey)
+    };
+    
+    if(!histograms)
+        return;
+    
+    for(CFIndex idx = 0; idx < sizeof(keys)/sizeof(CFStringRef); idx++) {
+        CFStringRef label = CFStringCreateWithFormat(kCFAllocatorDefault,NULL,CFSTR("%@ %@"),prefix,keys[idx]);
+        displayLatencyHistogram(label,CFDictionaryGetValue(histograms,keys[idx]),
+                                prevHistograms ? CFDictionaryGetValue(prevHistograms,keys[idx]) : NULL);
+        CFRelease(label);
+    }
+}
+
+/*! Displays a table of latency percentiles (in microseconds) for a target,
+ *  by command class, connection and LUN.
+ *  @param current the current statistics sample.
+ *  @param previous the previous statistics sample (may be NULL). */
+void displayTargetLatency(CFDictionaryRef current,CFDictionaryRef previous)
+{
+    iSCSICtlDisplayString(CFSTR("\tlatency (us)            count      mean       p50       p90       p99     p99.9       max\n"));
+    
+    CFStringRef classes[] = {
+        CFSTR(kiSCSIStatisticsCommandClassReadKey),
+        CFSTR(kiSCSIStatisticsCommandClassWriteKey),
+        CFSTR(kiSCSIStatisticsCommandClassOtherKey)
+    };
+    
+    CFDictionaryRef histograms = CFDictionaryGetValue(current,CFSTR(kiSCSIStatisticsLatencyHistogramsKey));
+    CFDictionaryRef prevHistograms = previous ? CFDictionaryGetValue(previous,CFSTR(kiSCSIStatisticsLatencyHistogramsKey)) : NULL;
+    
+    for(CFIndex idx = 0; histograms && idx < sizeof(classes)/sizeof(CFStringRef); idx++)
+        displayLatencyHistograms(classes[idx],CFDictionaryGetValue(histograms,classes[idx]),
+                                 prevHistograms ? CFDictionaryGetValue(prevHistograms,classes[idx]) : NULL);
+    
+    CFArrayRef connections = CFDictionaryGetValue(current,CFSTR(kiSCSIStatisticsConnectionsKey));
+    CFArrayRef prevConnections = previous ? CFDictionaryGetValue(previous,CFSTR(kiSCSIStatisticsConnectionsKey)) : NULL;
+    
+    for(CFIndex idx = 0; connections && idx < CFArrayGetCount(connections); idx++)
+    {
+        CFDictionaryRef conn = CFArrayGetValueAtIndex(connections,idx);
+        CFDictionaryRef prevConn = iSCSICtlFindStatistics(prevConnections,CFSTR(kiSCSIStatisticsConnectionIdKey),conn);
+        
+        CFStringRef prefix = CFStringCreateWithFormat(kCFAllocatorDefault,NULL,CFSTR("cid %llu"),
+                                                      iSCSICtlGetStatistic(conn,CFSTR(kiSCSIStatisticsConnectionIdKey)));
+        displayLatencyHistograms(prefix,CFDictionaryGetValue(conn,CFSTR(kiSCSIStatisticsLatencyHistogramsKey)),
+                                 prevConn ? CFDictionaryGetValue(prevConn,CFSTR(kiSCSIStatisticsLatencyHistogramsKey)) : NULL);
+        CFRelease(prefix);
+    }
+    
+    CFArrayRef LUNs = CFDictionaryGetValue(current,CFSTR(kiSCSIStatisticsLUNsKey));
+    CFArrayRef prevLUNs = previous ? CFDictionaryGetValue(previous,CFSTR(kiSCSIStatisticsLUNsKey)) : NULL;
+    
+    for(CFIndex idx = 0; LUNs && idx < CFArrayGetCount(LUNs); idx++)
+    {
+        CFDictionaryRef LUN = CFArrayGetValueAtIndex(LUNs,idx);
+        CFDictionaryRef prevLUN = iSCSICtlFindStatistics(prevLUNs,CFSTR(kiSCSIStatisticsLUNKey),LUN);
+        
+        CFStringRef label = CFStringCreateWithFormat(kCFAllocatorDefault,NULL,CFSTR("lun %llu Total"),
+                                                     iSCSICtlGetStatistic(LUN,CFSTR(kiSCSIStatisticsLUNKey)));
+        displayLatencyHistogram(label,CFDictionaryGetValue(LUN,CFSTR(kiSCSIStatisticsLatencyHistogramsKey)),
+                                prevLUN ? CFDictionaryGetValue(prevLUN,CFSTR(kiSCSIStatisticsLatencyHistogramsKey)) : NULL);
+        CFRelease(label);
+    }
+}
+
+/*! Creates a dictionary that maps the names of active targets to their
+ *  statistics, as published in the IO registry.
+ *  @param targetIQN if specified, only this target is included.
+ *  @return a dictionary of statistics keyed by target name. */
+CFDictionaryRef iSCSICtlCreateStatisticsForTargets(CFStringRef targetIQN)
+{
+    CFMutableDictionaryRef statistics = CFDictionaryCreateMutable(kCFAllocatorDefault,0,
+                                                                  &kCFTypeDictionaryKeyCallBacks,
+                                                                  &kCFTypeDictionaryValueCallBacks);
+    io_iterator_t iterator = IO_OBJECT_NULL;
+    
+    if(iSCSIIORegistryGetTargets(&iterator) != kIOReturnSuccess)
+        return statistics;
+    
+    io_object_t target;
+    while((target = IOIteratorNext(iterator)) != IO_OBJECT_NULL)
+    {
+        CFDictionaryRef protocolDict = IORegistryEntryCreateCFProperty(
+            target,CFSTR(kIOPropertyProtocolCharacteristicsKey),kCFAllocatorDefault,0);
+        CFStringRef IQN = NULL;
+        
+        if(protocolDict)
+            IQN = CFDictionaryGetValue(protocolDict,CFSTR(kIOPropertyiSCSIQualifiedNameKey));
+        
+        if(IQN && (!targetIQN || CFStringCompare(IQN,targetIQN,0) == kCFCompareEqualTo)) {
+            CFDictionaryRef targetStats = iSCSIIORegistryCreateCFStatisticsForTarget(target);
+            if(targetStats) {
+                CFDictionarySetValue(statistics,IQN,targetStats);
+                CFRelease(targetStats);
+            }
+        }
+        
+        if(protocolDict)
+            CFRelease(protocolDict);
+        IOObjectRelease(target);
+    }
+    
+    IOObjectRelease(iterator);
+    return statistics;
+}
+
+/*! Displays performance statistics for active targets.  If an interval is
+ *  specified, statistics are sampled at that interval and displayed as rates.
+ *  @param options the command-line options dictionary.
+ *  @return an error code indicating the result of the operation. */
+errno_t iSCSICtlDisplayStatistics(CFDictionaryRef options)
+{
+    if(!options)
+        return EINVAL;
+    
+    CFStringRef targetIQN = NULL;
+    CFDictionaryGetValueIfPresent(options,kOptKeyTarget,(const void **)&targetIQN);
+    
+    SInt32 interval = 0, count = 0;
+    CFStringRef value = NULL;
+    
+    if(CFDictionaryGetValueIfPresent(options,kOptKeyStatsInterval,(const void **)&value)) {
+        if((interval = CFStringGetIntValue(value)) <= 0) {
+            iSCSICtlDisplayError(CFSTR("The specified interval is invalid"));
+            return EINVAL;
+        }
+    }
+    
+    if(CFDictionaryGetValueIfPresent(options,kOptKeyStatsCount,(const void **)&value)) {
+        if((count = CFStringGetIntValue(value)) <= 0) {
+            iSCSICtlDisplayError(CFSTR("The specified sample count is invalid"));
+            return EINVAL;
+        }
+    }
+    
+    // Reset statistics rather than displaying them
+    if(CFDictionaryContainsKey(options,kOptKeyStatsReset)) {
+        kern_return_t result = iSCSIIORegistryResetStatistics(targetIQN);
+        
+        if(result == kIOReturnNotPrivileged)
+            iSCSICtlDisplayError(kPermissionsErrorString);
+        else if(result == kIOReturnNotFound)
+            iSCSICtlDisplayError(CFSTR("The specified target has no active session"));
+        else if(result != kIOReturnSuccess)
+            iSCSICtlDisplayError(CFSTR("Failed to reset statistics"));
+        
+        return result == kIOReturnSuccess ? 0 : EIO;
+    }
+    
+    Boolean showLatency = CFDictionaryContainsKey(options,kOptKeyStatsLatency);
+    CFDictionaryRef previous = iSCSICtlCreateStatisticsForTargets(targetIQN);
+    
+    if(CFDictionaryGetCount(previous) == 0) {
+        iSCSICtlDisplayString(CFSTR("No statistics are available for active targets\n"));
+        CFRelease(previous);
+        return 0;
+    }
+    
+    // Without an interval simply display the cumulative counters
+    if(interval == 0) {
+        CFIndex targetCount = CFDictionaryGetCount(previous);
+        const void * keys[targetCount], * values[targetCount];
+        CFDictionaryGetKeysAndValues(previous,keys,values);
+        
+        for(CFIndex idx = 0; idx < targetCount; idx++) {
+            displayTargetStatistics(keys[idx],values[idx],NULL,0);
+            
+            if(showLatency)
+                displayTargetLatency(values[idx],NULL);
+        }
+        
+        CFRelease(previous);
+        return 0;
+    }
+    
+    // Sample at the requested interval (until interrupted if no count was given)
+    for(SInt32 sample = 0; count == 0 || sample < count; sample++)
+    {
+        sleep(interval);
+        
+        CFDictionaryRef current = iSCSICtlCreateStatisticsForTargets(targetIQN);
+        CFIndex targetCount = CFDictionaryGetCount(current);
+        const void * keys[targetCount], * values[targetCount];
+        CFDictionaryGetKeysAndValues(current,keys,values);
+        
+        for(CFIndex idx = 0; idx < targetCount; idx++) {
+            CFDictionaryRef prevStats = CFDictionaryGetValue(previous,keys[idx]);
+            
+            // Targets that were logged into during this interval are skipped
+            if(prevStats) {
+                displayTargetStatistics(keys[idx],values[idx],prevStats,interval);
+                
+                if(showLatency)
+                    displayTargetLatency(values[idx],prevStats);
+            }
+        }
+        
+        iSCSICtlDisplayString(CFSTR("\n"));
+        
+        CFRelease(previous);
+        previous = current;
+    }
+    
+    CFRelease(previous);
+    return 0;
+}
+
 /*! Entry point.  Parses command line arguments, establishes a connection to the
  *  iSCSI deamon and executes requested iSCSI tasks. */
 int main(int argc, char * argv[])
@@ -2415,6 +3337,8 @@ int main(int argc, char * argv[])
                 error = iSCSICtlListDiscoveryConfig();
             else if(subCmd == kiSCSICtlSubCmdInitiatorConfig)
                 error = iSCSICtlListInitiatorConfig();
+            else if(subCmd == kiSCSICtlSubCmdLoginScheduler)
+                error = iSCSICtlListLoginScheduler();
             else
                 iSCSICtlDisplayError(CFSTR("Invalid subcommand for list"));
             break;
@@ -2423,6 +3347,8 @@ int main(int argc, char * argv[])
             error = iSCSICtlLogin(authorization,optDictionary); break;
         case kiSCSICtlCmdLogout:
             error = iSCSICtlLogout(authorization,optDictionary); break;
+        case kiSCSICtlCmdStats:
+            error = iSCSICtlDisplayStatistics(optDictionary); break;
         case kiSCSICtlCmdInvalid:
             iSCSICtlDisplayUsage();
 
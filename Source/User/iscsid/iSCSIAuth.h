@@ -46,6 +46,18 @@ errno_t iSCSIAuthNegotiate(iSCSISessionManagerRef manager,
                            ConnectionIdentifier connectionId,
                            enum iSCSILoginStatusCode * statusCode);
 
+/*! Populates a dictionary with the keys sent in the first login request of
+ *  a connection (session type, target and initiator names and the offered
+ *  authentication methods).
+ *  @param target the target to login to.
+ *  @param initiatorAuth the initiator authentication parameters.
+ *  @param targetAuth the target authentication parameters.
+ *  @param authCmd the dictionary to populate. */
+void iSCSIAuthNegotiateBuildDict(iSCSITargetRef target,
+                                 iSCSIAuthRef initiatorAuth,
+                                 iSCSIAuthRef targetAuth,
+                                 CFMutableDictionaryRef authCmd);
+
 /*! Authentication function defined in the authentication module
  *  (in the file iSCSIAuth.h). */
 errno_t iSCSIAuthInterrogate(iSCSISessionManagerRef manager,
@@ -44,6 +44,7 @@
 #include <asl.h>
 #include <assert.h>
 #include <pthread.h>
+#include <notify.h>
 
 // Foundation includes
 #include <launch.h>
@@ -62,6 +63,7 @@
 // iSCSI includes
 #include "iSCSISession.h"
 #include "iSCSIDaemonInterfaceShared.h"
+#include "iSCSIDaemonInterface.h"
 #include "iSCSIPreferences.h"
 #include "iSCSIDA.h"
 #include "iSCSIAuthRights.h"
@@ -98,17 +100,105 @@ pthread_mutex_t preferencesMutex = PTHREAD_MUTEX_INITIALIZER;
 /*! Preferences object used to syncrhonize iSCSI preferences. */
 iSCSIPreferencesRef preferences = NULL;
 
-/*! Incoming request information struct. */
-struct iSCSIDIncomingRequestInfo * reqInfo = NULL;
+/*! Token used to check for changes to the stored preferences (see
+ *  kiSCSIPreferencesChangedNotification). */
+int preferencesNotifyToken = NOTIFY_TOKEN_INVALID;
+
+/*! True if the preferences object has changes that have not been written
+ *  back to the stored preferences. */
+Boolean preferencesDirty = false;
+
+/*! Timer used to write back changes to the preferences (coalesces changes
+ *  made in quick succession into a single write). */
+CFRunLoopTimerRef preferencesFlushTimer = NULL;
+
+/*! Delay (seconds) before changes to the preferences are written back. */
+static const CFTimeInterval kiSCSIDPreferencesFlushDelay = 2;
+
+/*! Login history of each portal, keyed by portal address.  Values are
+ *  CFMutableData objects that hold an iSCSIDPortalHealth structure.  Only
+ *  accessed from the main thread. */
+static CFMutableDictionaryRef portalHealth = NULL;
 
 /*! Used to manage iSCSI sessions. */
 iSCSISessionManagerRef sessionManager = NULL;
 
-struct iSCSIDIncomingRequestInfo {
+/*! State associated with each connected client.  Clients are only accessed
+ *  from the main thread. */
+typedef struct iSCSIDClient {
+    
+    /*! Socket used to communicate with the client. */
     CFSocketRef socket;
-    CFRunLoopSourceRef socketSourceRead;
+    
+    /*! Runloop source for the socket (signals that a request has arrived). */
+    CFRunLoopSourceRef socketSource;
+    
+    /*! Native socket handle. */
     int fd;
-};
+    
+    /*! Number of requests whose responses are still being prepared (e.g.,
+     *  by a worker thread).  No further requests are read from the client
+     *  and the client is not released while this is non-zero. */
+    CFIndex pendingResponses;
+    
+    /*! Set when the client has disconnected or must be disconnected. */
+    Boolean closed;
+    
+    /*! Next client waiting for the preferences lock. */
+    struct iSCSIDClient * nextLockWaiter;
+    
+} iSCSIDClient;
+
+/*! Client whose request is currently being processed (main thread). */
+iSCSIDClient * currentClient = NULL;
+
+/*! Client that holds the preferences lock (see iSCSIDPreferencesIOLockAndSync). */
+iSCSIDClient * preferencesLockOwner = NULL;
+
+/*! Clients waiting to acquire the preferences lock, in order of arrival. */
+iSCSIDClient * preferencesLockWaiters = NULL;
+
+/*! A request that is processed on a worker thread, so that long-running
+ *  operations (e.g., logins) do not hold up requests from other clients. */
+typedef struct iSCSIDClientRequest {
+    
+    /*! Client that issued the request. */
+    iSCSIDClient * client;
+    
+    /*! Performs the request; called on a worker thread. */
+    void (*run)(struct iSCSIDClientRequest * request);
+    
+    /*! Sends the response and releases the request; called on the main thread. */
+    void (*complete)(struct iSCSIDClientRequest * request);
+    
+    /*! Request-specific state. */
+    void * context;
+    
+    /*! Next request in a queue. */
+    struct iSCSIDClientRequest * next;
+    
+} iSCSIDClientRequest;
+
+/*! Number of worker threads used to process client requests. */
+static const int kiSCSIDClientWorkerCount = 4;
+
+/*! Number of worker threads that have been started. */
+static int clientWorkersStarted = 0;
+
+/*! Requests waiting for a worker thread. */
+static iSCSIDClientRequest * clientRequestsPending = NULL;
+
+/*! Requests processed by a worker thread, awaiting completion on the main thread. */
+static iSCSIDClientRequest * clientRequestsCompleted = NULL;
+
+/*! Protects the client request queues. */
+static pthread_mutex_t clientRequestsMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*! Signaled when a request is added to clientRequestsPending. */
+static pthread_cond_t clientRequestsCondition = PTHREAD_COND_INITIALIZER;
+
+/*! Runloop source signaled by workers when a client request has been processed. */
+CFRunLoopSourceRef clientRequestSource = NULL;
 
 struct iSCSIDQueueLoginForTargetPortal {
     iSCSITargetRef target;
@@ -193,23 +283,492 @@ const iSCSIDMsgRemoveSharedSecretRsp iSCSIDMsgRemoveSharedSecretRspInit = {
     .errorCode = 0,
 };
 
+const iSCSIDMsgLoginTargetsRsp iSCSIDMsgLoginTargetsRspInit = {
+    .funcCode = kiSCSIDLoginTargets,
+    .errorCode = 0,
+    .resultsLength = 0
+};
+
+const iSCSIDMsgLogoutTargetsRsp iSCSIDMsgLogoutTargetsRspInit = {
+    .funcCode = kiSCSIDLogoutTargets,
+    .errorCode = 0,
+    .resultsLength = 0
+};
+
+const iSCSIDMsgCreateCFPropertiesForAllSessionsRsp iSCSIDMsgCreateCFPropertiesForAllSessionsRspInit = {
+    .funcCode = kiSCSIDCreateCFPropertiesForAllSessions,
+    .errorCode = 0,
+    .dataLength = 0
+};
+
+const iSCSIDMsgCreateCFPropertiesForLoginSchedulerRsp iSCSIDMsgCreateCFPropertiesForLoginSchedulerRspInit = {
+    .funcCode = kiSCSIDCreateCFPropertiesForLoginScheduler,
+    .errorCode = 0,
+    .dataLength = 0
+};
+
 /*! Used for the logout process. */
 typedef struct iSCSIDLogoutContext {
-    int fd;
-    DASessionRef diskSession;
+    iSCSIDClient * client;
+    iSCSITargetRef target;
     iSCSIPortalRef portal;
     errno_t errorCode;
+    enum iSCSILogoutStatusCode statusCode;
+    
+    /*! Session (and connection, for a portal logout) to log out. */
+    SessionIdentifier sessionId;
+    ConnectionIdentifier connectionId;
+    
+    /*! True if the target was added to loginActiveTargets, which keeps
+     *  logins away from the target until the logout has completed. */
+    Boolean fenced;
+    
+    /*! Logout of several targets this logout is part of (or NULL), and the
+     *  index of the target within it. */
+    struct iSCSIDClientBatch * batch;
+    CFIndex batchIndex;
     
 } iSCSIDLogoutContext;
 
+/*! Time allowed for each volume to unmount before a target is logged out
+ *  (or the system sleeps), in seconds.  Volumes that take longer count as
+ *  busy. */
+static const CFTimeInterval kiSCSIDUnmountTimeout = 30;
+
+
+/*! Drops the login history of portals that are no longer defined for any
+ *  target in the preferences.  Must be called from the main thread. */
+void iSCSIDPortalHealthPrune()
+{
+    CFIndex count = portalHealth ? CFDictionaryGetCount(portalHealth) : 0;
+    
+    if(count == 0 || !preferences)
+        return;
+    
+    CFMutableSetRef portalAddresses = CFSetCreateMutable(kCFAllocatorDefault,0,&kCFTypeSetCallBacks);
+    
+    if(!portalAddresses)
+        return;
+    
+    CFArrayRef targets = iSCSIPreferencesCreateArrayOfTargets(preferences);
+    CFIndex targetCount = targets ? CFArrayGetCount(targets) : 0;
+    
+    for(CFIndex targetIdx = 0; targetIdx < targetCount; targetIdx++)
+    {
+        CFStringRef targetIQN = CFArrayGetValueAtIndex(targets,targetIdx);
+        CFArrayRef portals = iSCSIPreferencesCreateArrayOfPortalsForTarget(preferences,targetIQN);
+        
+        if(!portals)
+            continue;
+        
+        CFIndex portalCount = CFArrayGetCount(portals);
+        
+        for(CFIndex portalIdx = 0; portalIdx < portalCount; portalIdx++)
+            CFSetAddValue(portalAddresses,CFArrayGetValueAtIndex(portals,portalIdx));
+        
+        CFRelease(portals);
+    }
+    
+    const void * keys[count];
+    CFDictionaryGetKeysAndValues(portalHealth,keys,NULL);
+    
+    for(CFIndex idx = 0; idx < count; idx++)
+        if(!CFSetContainsValue(portalAddresses,keys[idx]))
+            CFDictionaryRemoveValue(portalHealth,keys[idx]);
+    
+    if(targets)
+        CFRelease(targets);
+    CFRelease(portalAddresses);
+}
 
-/*! Helper function. Updates the preferences object using application values. */
+/*! Helper function. Updates the preferences object using application values.
+ *  The stored preferences are only read if they were changed since they were
+ *  last read or written by the daemon.  Changes made by another application
+ *  take precedence over changes that have not yet been written back. */
 void iSCSIDUpdatePreferencesFromAppValues()
 {
+    int changed = 1;
+    
+    if(preferencesNotifyToken == NOTIFY_TOKEN_INVALID &&
+       notify_register_check(kiSCSIPreferencesChangedNotification,&preferencesNotifyToken) != NOTIFY_STATUS_OK)
+        preferencesNotifyToken = NOTIFY_TOKEN_INVALID;
+    
+    if(preferencesNotifyToken != NOTIFY_TOKEN_INVALID)
+        notify_check(preferencesNotifyToken,&changed);
+    
+    if(preferences != NULL && !changed)
+        return;
+    
     if(preferences != NULL)
         iSCSIPreferencesRelease(preferences);
     
     preferences = iSCSIPreferencesCreateFromAppValues();
+    preferencesDirty = false;
+    
+    // Discovery and target portals may have been removed by another application
+    iSCSIDiscoveryPruneTargetHashes(preferences);
+    iSCSIDPortalHealthPrune();
+}
+
+/*! Helper function. Writes the preferences object back to application values
+ *  if it has changes that have not been written.  Must be called with the
+ *  preferences mutex held. */
+void iSCSIDFlushPreferences()
+{
+    if(!preferencesDirty || !preferences)
+        return;
+    
+    iSCSIPreferencesSynchronzeAppValues(preferences);
+    preferencesDirty = false;
+    
+    // Consume the notification posted for our own write
+    int changed;
+    if(preferencesNotifyToken != NOTIFY_TOKEN_INVALID)
+        notify_check(preferencesNotifyToken,&changed);
+}
+
+/*! Timer callback that writes back pending changes to the preferences. */
+void iSCSIDFlushPreferencesTimer(CFRunLoopTimerRef timer,void * info)
+{
+    // A client holds the preferences; try again later
+    if(pthread_mutex_trylock(&preferencesMutex)) {
+        CFRunLoopTimerSetNextFireDate(timer,CFAbsoluteTimeGetCurrent() + kiSCSIDPreferencesFlushDelay);
+        return;
+    }
+    
+    iSCSIDFlushPreferences();
+    pthread_mutex_unlock(&preferencesMutex);
+}
+
+/*! Helper function. Marks the preferences object as changed and schedules a
+ *  write back of the changes.  Must be called from the main thread. */
+void iSCSIDPreferencesDidChange()
+{
+    preferencesDirty = true;
+    
+    // Portals may have been removed along with their targets
+    iSCSIDPortalHealthPrune();
+    
+    if(!preferencesFlushTimer) {
+        preferencesFlushTimer = CFRunLoopTimerCreate(kCFAllocatorDefault,
+                                                     CFAbsoluteTimeGetCurrent() + kiSCSIDPreferencesFlushDelay,
+                                                     1.0e10,0,0,&iSCSIDFlushPreferencesTimer,NULL);
+        CFRunLoopAddTimer(CFRunLoopGetMain(),preferencesFlushTimer,kCFRunLoopDefaultMode);
+    }
+    else
+        CFRunLoopTimerSetNextFireDate(preferencesFlushTimer,CFAbsoluteTimeGetCurrent() + kiSCSIDPreferencesFlushDelay);
+}
+
+/*! Defers the response to the request that is being processed until
+ *  iSCSIDClientResponseSent() is called.  No further requests are read from
+ *  the client in the meantime.  Must be called from the main thread while
+ *  processing a request.
+ *  @return the client that issued the request. */
+iSCSIDClient * iSCSIDClientDeferResponse()
+{
+    // The read callback is re-enabled once there are no pending responses
+    currentClient->pendingResponses++;
+    return currentClient;
+}
+
+/*! Grants the preferences lock to a client and writes back pending changes
+ *  so that the client sees them.  Must be called with the preferences mutex
+ *  held. */
+void iSCSIDPreferencesLockGrant(iSCSIDClient * client)
+{
+    preferencesLockOwner = client;
+    iSCSIDFlushPreferences();
+}
+
+/*! Releases the preferences lock held by a client and grants it to the next
+ *  waiting client, if any. */
+void iSCSIDPreferencesLockRelease()
+{
+    preferencesLockOwner = NULL;
+    
+    if(!preferencesLockWaiters) {
+        pthread_mutex_unlock(&preferencesMutex);
+        
+        // Discovery results may have been held back while the lock was held
+        if(discoveryRecords)
+            CFRunLoopSourceSignal(discoverySource);
+        return;
+    }
+    
+    iSCSIDClient * client = preferencesLockWaiters;
+    preferencesLockWaiters = client->nextLockWaiter;
+    client->nextLockWaiter = NULL;
+    
+    iSCSIDPreferencesLockGrant(client);
+    
+    iSCSIDMsgPreferencesIOLockAndSyncRsp rsp = iSCSIDMsgPreferencesIOLockAndSyncRspInit;
+    rsp.errorCode = 0;
+    send(client->fd,&rsp,sizeof(rsp),0);
+    
+    // Resume reading requests (a waiting client can't have been closed,
+    // since nothing is read from it while it waits)
+    if(--client->pendingResponses == 0)
+        CFSocketEnableCallBacks(client->socket,kCFSocketReadCallBack);
+}
+
+/*! Disconnects a client and releases its resources. */
+void iSCSIDClientRelease(iSCSIDClient * client)
+{
+    if(preferencesLockOwner == client)
+        iSCSIDPreferencesLockRelease();
+    
+    CFRunLoopRemoveSource(CFRunLoopGetMain(),client->socketSource,kCFRunLoopDefaultMode);
+    CFSocketInvalidate(client->socket);
+    CFRelease(client->socketSource);
+    CFRelease(client->socket);
+    free(client);
+}
+
+/*! Disconnects a client once all of its pending responses have been sent. */
+void iSCSIDClientClose(iSCSIDClient * client)
+{
+    client->closed = true;
+    
+    if(client->pendingResponses == 0)
+        iSCSIDClientRelease(client);
+}
+
+/*! Indicates that a response deferred by iSCSIDClientDeferResponse() has
+ *  been sent, so that requests are read from the client again. */
+void iSCSIDClientResponseSent(iSCSIDClient * client)
+{
+    if(--client->pendingResponses > 0)
+        return;
+    
+    if(client->closed)
+        iSCSIDClientRelease(client);
+    else
+        CFSocketEnableCallBacks(client->socket,kCFSocketReadCallBack);
+}
+
+/*! Worker thread entry point; processes client requests. */
+void * iSCSIDClientWorker(void * context)
+{
+    pthread_mutex_lock(&clientRequestsMutex);
+    
+    while(true)
+    {
+        while(!clientRequestsPending)
+            pthread_cond_wait(&clientRequestsCondition,&clientRequestsMutex);
+        
+        iSCSIDClientRequest * request = clientRequestsPending;
+        clientRequestsPending = request->next;
+        pthread_mutex_unlock(&clientRequestsMutex);
+        
+        request->run(request);
+        
+        pthread_mutex_lock(&clientRequestsMutex);
+        request->next = clientRequestsCompleted;
+        clientRequestsCompleted = request;
+        
+        CFRunLoopSourceSignal(clientRequestSource);
+        CFRunLoopWakeUp(CFRunLoopGetMain());
+    }
+    
+    return NULL;
+}
+
+/*! Runloop source callback; completes client requests processed by worker
+ *  threads and responds to the clients. */
+void iSCSIDProcessCompletedClientRequests(void * info)
+{
+    pthread_mutex_lock(&clientRequestsMutex);
+    iSCSIDClientRequest * request = clientRequestsCompleted;
+    clientRequestsCompleted = NULL;
+    pthread_mutex_unlock(&clientRequestsMutex);
+    
+    while(request)
+    {
+        iSCSIDClientRequest * next = request->next;
+        iSCSIDClient * client = request->client;
+        
+        request->complete(request);
+        free(request);
+        
+        if(client)
+            iSCSIDClientResponseSent(client);
+        request = next;
+    }
+}
+
+/*! Queues a request to be processed by a worker thread.  Must be called
+ *  from the main thread.
+ *  @param client the client whose deferred response is accounted for once
+ *  the request completes, or NULL if the request completes it otherwise.
+ *  @param run performs the request (called on a worker thread).
+ *  @param complete sends the response (called on the main thread).
+ *  @param context request-specific state.
+ *  @return an error code if the request could not be queued. */
+errno_t iSCSIDClientRequestQueue(iSCSIDClient * client,
+                                 void (*run)(iSCSIDClientRequest * request),
+                                 void (*complete)(iSCSIDClientRequest * request),
+                                 void * context)
+{
+    // Start another worker if we haven't started them all
+    if(clientWorkersStarted < kiSCSIDClientWorkerCount)
+    {
+        pthread_attr_t attr;
+        pthread_t thread;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr,PTHREAD_CREATE_DETACHED);
+        
+        if(pthread_create(&thread,&attr,iSCSIDClientWorker,NULL) == 0)
+            clientWorkersStarted++;
+        
+        pthread_attr_destroy(&attr);
+    }
+    
+    if(clientWorkersStarted == 0)
+        return EAGAIN;
+    
+    iSCSIDClientRequest * request = malloc(sizeof(iSCSIDClientRequest));
+    
+    if(!request)
+        return ENOMEM;
+    
+    request->client = client;
+    request->run = run;
+    request->complete = complete;
+    request->context = context;
+    request->next = NULL;
+    
+    pthread_mutex_lock(&clientRequestsMutex);
+    
+    iSCSIDClientRequest * * link = &clientRequestsPending;
+    while(*link)
+        link = &(*link)->next;
+    *link = request;
+    
+    pthread_cond_signal(&clientRequestsCondition);
+    pthread_mutex_unlock(&clientRequestsMutex);
+    
+    return 0;
+}
+
+/*! Queues a request to be processed by a worker thread and defers the
+ *  response to the client until the request completes.  Must be called from
+ *  the main thread while processing a request.
+ *  @param run performs the request (called on a worker thread).
+ *  @param complete sends the response (called on the main thread).
+ *  @param context request-specific state.
+ *  @return an error code if the request could not be queued. */
+errno_t iSCSIDClientRequestDispatch(void (*run)(iSCSIDClientRequest * request),
+                                    void (*complete)(iSCSIDClientRequest * request),
+                                    void * context)
+{
+    errno_t error = iSCSIDClientRequestQueue(currentClient,run,complete,context);
+    
+    if(!error)
+        iSCSIDClientDeferResponse();
+    
+    return error;
+}
+
+/*! A login or logout of several targets requested by a client.  The
+ *  operations for the individual targets proceed independently, and a single
+ *  response with a result for each target is sent once they have all
+ *  completed.  Batches are only accessed from the main thread. */
+typedef struct iSCSIDClientBatch {
+    
+    /*! Client that issued the request. */
+    iSCSIDClient * client;
+    
+    /*! Function code of the request (kiSCSIDLoginTargets or kiSCSIDLogoutTargets). */
+    UInt16 funcCode;
+    
+    /*! Number of targets. */
+    CFIndex count;
+    
+    /*! Number of results still outstanding (plus one until all of the
+     *  operations have been started). */
+    CFIndex remaining;
+    
+    /*! Result for each target, in the order in which they were requested. */
+    iSCSIDMsgTargetResult results[];
+    
+} iSCSIDClientBatch;
+
+/*! Creates a batch for the request that is being processed and defers the
+ *  response to the client until iSCSIDClientBatchStarted() has been called
+ *  and a result was set for each target.  Must be called from the main
+ *  thread while processing a request.
+ *  @return the batch, or NULL if it could not be allocated. */
+iSCSIDClientBatch * iSCSIDClientBatchCreate(UInt16 funcCode,CFIndex count)
+{
+    iSCSIDClientBatch * batch = malloc(sizeof(iSCSIDClientBatch) + count*sizeof(iSCSIDMsgTargetResult));
+    
+    if(!batch)
+        return NULL;
+    
+    batch->client = iSCSIDClientDeferResponse();
+    batch->funcCode = funcCode;
+    batch->count = count;
+    batch->remaining = count + 1;
+    
+    for(CFIndex idx = 0; idx < count; idx++) {
+        batch->results[idx].errorCode = 0;
+        batch->results[idx].statusCode = kiSCSILoginInvalidStatusCode;
+        batch->results[idx].reserved = 0;
+    }
+    
+    return batch;
+}
+
+/*! Helper function. Accounts for a completed operation of a batch, and
+ *  responds to the client and releases the batch once all have completed. */
+void iSCSIDClientBatchOperationDone(iSCSIDClientBatch * batch)
+{
+    if(--batch->remaining > 0)
+        return;
+    
+    UInt32 resultsLength = (UInt32)(batch->count*sizeof(iSCSIDMsgTargetResult));
+    CFDataRef results = NULL;
+    
+    if(resultsLength)
+        results = CFDataCreateWithBytesNoCopy(kCFAllocatorDefault,(const UInt8 *)batch->results,
+                                              resultsLength,kCFAllocatorNull);
+    
+    // The responses differ only in their function code
+    if(batch->funcCode == kiSCSIDLoginTargets) {
+        iSCSIDMsgLoginTargetsRsp rsp = iSCSIDMsgLoginTargetsRspInit;
+        rsp.resultsLength = resultsLength;
+        iSCSIDaemonSendMsg(batch->client->fd,(iSCSIDMsgGeneric*)&rsp,results,NULL);
+    }
+    else {
+        iSCSIDMsgLogoutTargetsRsp rsp = iSCSIDMsgLogoutTargetsRspInit;
+        rsp.resultsLength = resultsLength;
+        iSCSIDaemonSendMsg(batch->client->fd,(iSCSIDMsgGeneric*)&rsp,results,NULL);
+    }
+    
+    if(results)
+        CFRelease(results);
+    
+    iSCSIDClient * client = batch->client;
+    free(batch);
+    iSCSIDClientResponseSent(client);
+}
+
+/*! Sets the result of the operation for a target of a batch. */
+void iSCSIDClientBatchSetResult(iSCSIDClientBatch * batch,
+                                CFIndex batchIndex,
+                                errno_t errorCode,
+                                UInt16 statusCode)
+{
+    batch->results[batchIndex].errorCode = errorCode;
+    batch->results[batchIndex].statusCode = statusCode;
+    iSCSIDClientBatchOperationDone(batch);
+}
+
+/*! Indicates that the operations for all targets of a batch have been
+ *  started (the response is sent once they have completed). */
+void iSCSIDClientBatchStarted(iSCSIDClientBatch * batch)
+{
+    iSCSIDClientBatchOperationDone(batch);
 }
 
 iSCSISessionConfigRef iSCSIDCreateSessionConfig(CFStringRef targetIQN)
@@ -314,52 +873,491 @@ iSCSIAuthRef iSCSIDCreateAuthenticationForInitiator()
     return auth;
 }
 
-errno_t iSCSIDLoginCommon(SessionIdentifier sessionId,
-                          iSCSIMutableTargetRef target,
-                          iSCSIPortalRef portal,
-                          enum iSCSILoginStatusCode * statusCode)
-{
-    errno_t error = 0;
-    iSCSISessionConfigRef sessCfg = NULL;
-    iSCSIConnectionConfigRef connCfg = NULL;
-    iSCSIAuthRef initiatorAuth = NULL, targetAuth = NULL;
-
-    ConnectionIdentifier connectionId = kiSCSIInvalidConnectionId;
-
-    *statusCode = kiSCSILoginInvalidStatusCode;
+/*! A login operation for a target over a single portal.  Jobs carry copies
+ *  of the session, connection and authentication configuration so that the
+ *  login itself can run on a worker thread without touching preferences. */
+typedef struct iSCSIDLoginJob {
+    
+    /*! The target to login to. */
+    iSCSIMutableTargetRef target;
+    
+    /*! The portal used for the login. */
+    iSCSIPortalRef portal;
+    
+    /*! Session configuration (used for a leading login). */
+    iSCSISessionConfigRef sessCfg;
+    
+    /*! Connection configuration. */
+    iSCSIConnectionConfigRef connCfg;
+    
+    /*! Initiator authentication. */
+    iSCSIAuthRef initiatorAuth;
+    
+    /*! Target authentication. */
+    iSCSIAuthRef targetAuth;
+    
+    /*! Whether the target was flagged as boot-critical. */
+    Boolean bootCritical;
+    
+    /*! Result of the login. */
+    errno_t errorCode;
+    
+    /*! Login status code returned by the target. */
+    enum iSCSILoginStatusCode statusCode;
+    
+    /*! Time taken by the login (s), or a negative value if no login was
+     *  attempted (e.g., the portal was already connected). */
+    CFTimeInterval loginLatency;
+    
+    /*! Session that the job tried to restore (see iSCSISessionReconnect),
+     *  or kiSCSIInvalidSessionId. */
+    SessionIdentifier reconnectSessionId;
+    
+    /*! Next job in a scheduler queue. */
+    struct iSCSIDLoginJob * next;
+    
+} iSCSIDLoginJob;
 
+/*! Creates a login job for the specified target and portal, copying the
+ *  configuration for the target from the preferences.  Must be called from
+ *  the main thread. */
+iSCSIDLoginJob * iSCSIDLoginJobCreate(iSCSITargetRef target,iSCSIPortalRef portal)
+{
+    iSCSIDLoginJob * job = malloc(sizeof(iSCSIDLoginJob));
+    
+    if(!job)
+        return NULL;
+    
     CFStringRef targetIQN = iSCSITargetGetIQN(target);
-
-    // If session needs to be logged in, copy session config from property list
-    if(sessionId == kiSCSIInvalidSessionId)
-        if(!(sessCfg = iSCSIDCreateSessionConfig(targetIQN)))
-            sessCfg = iSCSISessionConfigCreateMutable();
-
+    
+    job->target = iSCSITargetCreateMutableCopy(target);
+    job->portal = portal;
+    iSCSIPortalRetain(portal);
+    
+    // Start resolving the portal name while the job waits to be run
+    iSCSIUtilsPrefetchAddressForPortal(portal);
+    
+    // Copy session config from property list, create one if needed
+    if(!(job->sessCfg = iSCSIDCreateSessionConfig(targetIQN)))
+        job->sessCfg = iSCSISessionConfigCreateMutable();
+    
     // Get connection configuration from property list, create one if needed
-    if(!(connCfg = iSCSIDCreateConnectionConfig(targetIQN,iSCSIPortalGetAddress(portal))))
-        connCfg = iSCSIConnectionConfigCreateMutable();
-
+    if(!(job->connCfg = iSCSIDCreateConnectionConfig(targetIQN,iSCSIPortalGetAddress(portal))))
+        job->connCfg = iSCSIConnectionConfigCreateMutable();
+    
     // Get authentication configuration from property list, create one if needed
-    if(!(targetAuth = iSCSIDCreateAuthenticationForTarget(targetIQN)))
-        targetAuth = iSCSIAuthCreateNone();
-
-    if(!(initiatorAuth = iSCSIDCreateAuthenticationForInitiator()))
-       initiatorAuth = iSCSIAuthCreateNone();
+    if(!(job->targetAuth = iSCSIDCreateAuthenticationForTarget(targetIQN)))
+        job->targetAuth = iSCSIAuthCreateNone();
+    
+    if(!(job->initiatorAuth = iSCSIDCreateAuthenticationForInitiator()))
+        job->initiatorAuth = iSCSIAuthCreateNone();
+    
+    job->bootCritical = iSCSIPreferencesGetBootCriticalForTarget(preferences,targetIQN);
+    job->errorCode = 0;
+    job->statusCode = kiSCSILoginInvalidStatusCode;
+    job->loginLatency = -1;
+    job->reconnectSessionId = kiSCSIInvalidSessionId;
+    job->next = NULL;
+    
+    return job;
+}
 
-    // Do either session or connection login
+/*! Performs either a leading login (if sessionId is invalid) or adds a
+ *  connection to an existing session.  Safe to call from any thread. */
+void iSCSIDLoginJobLogin(iSCSIDLoginJob * job,SessionIdentifier sessionId)
+{
+    ConnectionIdentifier connectionId = kiSCSIInvalidConnectionId;
+    CFAbsoluteTime startTime = CFAbsoluteTimeGetCurrent();
+    
     if(sessionId == kiSCSIInvalidSessionId)
-        error = iSCSISessionLogin(sessionManager,target,portal,initiatorAuth,targetAuth,sessCfg,connCfg,&sessionId,&connectionId,statusCode);
+        job->errorCode = iSCSISessionLogin(sessionManager,job->target,job->portal,
+                                           job->initiatorAuth,job->targetAuth,
+                                           job->sessCfg,job->connCfg,
+                                           &sessionId,&connectionId,&job->statusCode);
     else
-        error = iSCSISessionAddConnection(sessionManager,sessionId,portal,initiatorAuth,targetAuth,connCfg,&connectionId,statusCode);
+        job->errorCode = iSCSISessionAddConnection(sessionManager,sessionId,job->portal,
+                                                   job->initiatorAuth,job->targetAuth,
+                                                   job->connCfg,&connectionId,&job->statusCode);
+    
+    job->loginLatency = CFAbsoluteTimeGetCurrent() - startTime;
+}
 
-    // Log error message
-    if(error) {
-        CFStringRef errorString = CFStringCreateWithFormat(
+/*! Gets the negotiated maximum number of connections for the session
+ *  associated with the target, or zero if it could not be retrieved. */
+CFIndex iSCSIDGetMaxConnectionsForTarget(iSCSITargetRef target)
+{
+    CFIndex maxConnections = 0;
+    CFDictionaryRef properties = iSCSISessionCopyCFPropertiesForTarget(sessionManager,target);
+    
+    if(properties) {
+        // Get max connections from property list
+        CFNumberRef number = CFDictionaryGetValue(properties,kRFC3720_Key_MaxConnections);
+        CFNumberGetValue(number,kCFNumberCFIndexType,&maxConnections);
+        CFRelease(properties);
+    }
+    
+    return maxConnections;
+}
+
+/*! Returns true if a failed login may succeed later without changing
+ *  anything (the target is temporarily unavailable).  A target that moved
+ *  (even temporarily) is not retried, since the address it redirects to
+ *  is not followed. */
+Boolean iSCSIDLoginStatusIsTransient(enum iSCSILoginStatusCode statusCode)
+{
+    switch(statusCode)
+    {
+        case kiSCSILoginTargetHWorSWError:
+        case kiSCSILoginServiceUnavailable:
+        case kiSCSILoginOutOfResources:
+            return true;
+        default:
+            return false;
+    };
+}
+
+/*! Returns true if the target refused to restore the session of a job
+ *  (as opposed to the session not being restored because of a network
+ *  error), in which case the session cannot be used anymore. */
+Boolean iSCSIDLoginJobSessionRejected(iSCSIDLoginJob * job)
+{
+    if(job->reconnectSessionId == kiSCSIInvalidSessionId)
+        return false;
+    
+    if(job->errorCode)
+        return job->errorCode == EAUTH;
+    
+    return job->statusCode != kiSCSILoginSuccess && !iSCSIDLoginStatusIsTransient(job->statusCode);
+}
+
+/*! Logs in to the job's target over the job's portal, adding a connection
+ *  if a session already exists and can support another connection.  Safe
+ *  to call from any thread. */
+void iSCSIDLoginJobRun(iSCSIDLoginJob * job)
+{
+    CFStringRef targetIQN = iSCSITargetGetIQN(job->target);
+    SessionIdentifier sessionId = iSCSISessionGetSessionIdForTarget(sessionManager,targetIQN);
+    
+    // Leading login
+    if(sessionId == kiSCSIInvalidSessionId) {
+        iSCSIDLoginJobLogin(job,sessionId);
+        return;
+    }
+    
+    // Existing session; nothing to do if there's already a connection
+    // over the specified portal
+    if(iSCSISessionGetConnectionIdForPortal(sessionManager,sessionId,job->portal) != kiSCSIInvalidConnectionId)
+        return;
+    
+    // See if the session can support an additional connection
+    CFIndex maxConnections = iSCSIDGetMaxConnectionsForTarget(job->target);
+    CFArrayRef connections = iSCSISessionCopyArrayOfConnectionIds(sessionManager,sessionId);
+    
+    if(connections)
+    {
+        CFIndex activeConnections = CFArrayGetCount(connections);
+        CFRelease(connections);
+        
+        // A session that lost all of its connections (e.g., after a
+        // timeout or while the system slept) is restored using the
+        // parameters negotiated before
+        if(activeConnections == 0) {
+            ConnectionIdentifier connectionId = kiSCSIInvalidConnectionId;
+            CFAbsoluteTime startTime = CFAbsoluteTimeGetCurrent();
+            job->errorCode = iSCSISessionReconnect(sessionManager,sessionId,job->portal,
+                                                   job->initiatorAuth,job->targetAuth,
+                                                   &connectionId,&job->statusCode);
+            job->loginLatency = CFAbsoluteTimeGetCurrent() - startTime;
+            
+            // The session (and a target that was kept for it) is kept if
+            // it could not be restored, and the login is retried.  It is
+            // released once the volumes are unmounted if the target rejects
+            // it, or if the retries of a target that is not persistent run
+            // out (see iSCSIDLoginJobDiscardSession)
+            if(job->errorCode != ENOENT && job->errorCode != EBUSY) {
+                job->reconnectSessionId = sessionId;
+                return;
+            }
+        }
+        
+        if(activeConnections < maxConnections)
+            iSCSIDLoginJobLogin(job,sessionId);
+    }
+}
+
+/*! Weight given to the latest login when averaging login latency. */
+static const double kiSCSIDPortalLatencyWeight = 0.25;
+
+/*! Login history of a portal.  Used to prefer portals that log in reliably
+ *  and quickly when several portals serve the same target. */
+typedef struct iSCSIDPortalHealth {
+    
+    /*! Number of logins attempted. */
+    UInt32 attempts;
+    
+    /*! Number of successful logins. */
+    UInt32 successes;
+    
+    /*! Number of failed logins (and session timeouts) since the last
+     *  successful login. */
+    UInt32 consecutiveFailures;
+    
+    /*! Moving average of the time taken by successful logins (s). */
+    CFTimeInterval latency;
+    
+    /*! Error of the last failed login or timeout. */
+    errno_t lastError;
+    
+    /*! Status code returned by the target for the last failed login. */
+    enum iSCSILoginStatusCode lastStatusCode;
+    
+    /*! Time of the last login attempt. */
+    CFAbsoluteTime lastAttempt;
+    
+    /*! Time of the last failure. */
+    CFAbsoluteTime lastFailure;
+    
+} iSCSIDPortalHealth;
+
+/*! Gets the login history of a portal, creating it if required.
+ *  @param portalAddress the portal address.
+ *  @return the login history, or NULL if it could not be created. */
+iSCSIDPortalHealth * iSCSIDPortalHealthGet(CFStringRef portalAddress)
+{
+    if(!portalHealth)
+        portalHealth = CFDictionaryCreateMutable(kCFAllocatorDefault,0,
+                                                 &kCFTypeDictionaryKeyCallBacks,
+                                                 &kCFTypeDictionaryValueCallBacks);
+    if(!portalHealth)
+        return NULL;
+    
+    CFMutableDataRef data = (CFMutableDataRef)CFDictionaryGetValue(portalHealth,portalAddress);
+    
+    if(!data) {
+        if(!(data = CFDataCreateMutable(kCFAllocatorDefault,sizeof(iSCSIDPortalHealth))))
+            return NULL;
+        
+        CFDataSetLength(data,sizeof(iSCSIDPortalHealth));
+        bzero(CFDataGetMutableBytePtr(data),sizeof(iSCSIDPortalHealth));
+        CFDictionarySetValue(portalHealth,portalAddress,data);
+        CFRelease(data);
+    }
+    
+    return (iSCSIDPortalHealth *)CFDataGetMutableBytePtr(data);
+}
+
+/*! Scores a portal based on its login history.  Portals that have not been
+ *  used score 0.5, ahead of portals that are failing; recent failures and
+ *  slow logins lower the score.
+ *  @param portalAddress the portal address.
+ *  @return a score between 0 and 1 (higher is healthier). */
+double iSCSIDPortalHealthGetScore(CFStringRef portalAddress)
+{
+    CFDataRef data = NULL;
+    
+    if(portalHealth)
+        data = CFDictionaryGetValue(portalHealth,portalAddress);
+    
+    if(!data)
+        return 0.5;
+    
+    const iSCSIDPortalHealth * health = (const iSCSIDPortalHealth *)CFDataGetBytePtr(data);
+    
+    double successRate = (health->successes + 1.0)/(health->attempts + 2.0);
+    return successRate/(1 + health->consecutiveFailures)/(1 + health->latency);
+}
+
+/*! Records the result of a login job in the history of its portal. */
+void iSCSIDPortalHealthRecordLogin(iSCSIDLoginJob * job)
+{
+    if(job->loginLatency < 0)
+        return;
+    
+    iSCSIDPortalHealth * health = iSCSIDPortalHealthGet(iSCSIPortalGetAddress(job->portal));
+    
+    if(!health)
+        return;
+    
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    
+    health->attempts++;
+    health->lastAttempt = now;
+    
+    if(!job->errorCode && job->statusCode == kiSCSILoginSuccess) {
+        if(health->successes++ == 0)
+            health->latency = job->loginLatency;
+        else
+            health->latency += kiSCSIDPortalLatencyWeight*(job->loginLatency - health->latency);
+        
+        health->consecutiveFailures = 0;
+    }
+    else {
+        health->consecutiveFailures++;
+        health->lastError = job->errorCode;
+        health->lastStatusCode = job->statusCode;
+        health->lastFailure = now;
+    }
+}
+
+/*! Records a session timeout in the history of a portal. */
+void iSCSIDPortalHealthRecordTimeout(iSCSIPortalRef portal)
+{
+    iSCSIDPortalHealth * health = iSCSIDPortalHealthGet(iSCSIPortalGetAddress(portal));
+    
+    if(!health)
+        return;
+    
+    health->consecutiveFailures++;
+    health->lastError = ETIMEDOUT;
+    health->lastStatusCode = kiSCSILoginInvalidStatusCode;
+    health->lastFailure = CFAbsoluteTimeGetCurrent();
+}
+
+/*! Compares portal addresses by health score (used to sort portals from
+ *  the healthiest to the least healthy). */
+CFComparisonResult iSCSIDPortalHealthCompare(const void * value1,const void * value2,void * context)
+{
+    double score1 = iSCSIDPortalHealthGetScore(value1);
+    double score2 = iSCSIDPortalHealthGetScore(value2);
+    
+    if(score1 > score2)
+        return kCFCompareLessThan;
+    if(score1 < score2)
+        return kCFCompareGreaterThan;
+    return kCFCompareEqualTo;
+}
+
+/*! Creates an array of the portal addresses defined for a target, ordered
+ *  from the healthiest portal to the least healthy one.  Portals with equal
+ *  scores keep the order in which they are defined.
+ *  @param targetIQN the target.
+ *  @return an array of portal addresses, or NULL if the target has none. */
+CFArrayRef iSCSIDCreateArrayOfPortalsForTargetByHealth(CFStringRef targetIQN)
+{
+    CFArrayRef portals = iSCSIPreferencesCreateArrayOfPortalsForTarget(preferences,targetIQN);
+    
+    if(!portals)
+        return NULL;
+    
+    CFMutableArrayRef sortedPortals = CFArrayCreateMutableCopy(kCFAllocatorDefault,0,portals);
+    CFRelease(portals);
+    
+    if(sortedPortals)
+        CFArraySortValues(sortedPortals,CFRangeMake(0,CFArrayGetCount(sortedPortals)),
+                          iSCSIDPortalHealthCompare,NULL);
+    
+    return sortedPortals;
+}
+
+/*! Creates a dictionary describing the login history of each portal
+ *  (see kiSCSIDLoginSchedulerPortalsKey). */
+CFDictionaryRef iSCSIDPortalHealthCreateCFProperties()
+{
+    CFIndex count = portalHealth ? CFDictionaryGetCount(portalHealth) : 0;
+    CFMutableDictionaryRef portals = CFDictionaryCreateMutable(kCFAllocatorDefault,count,
+                                                               &kCFTypeDictionaryKeyCallBacks,
+                                                               &kCFTypeDictionaryValueCallBacks);
+    if(!portals || count == 0)
+        return portals;
+    
+    const void * keys[count];
+    const void * values[count];
+    CFDictionaryGetKeysAndValues(portalHealth,keys,values);
+    
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    
+    for(CFIndex idx = 0; idx < count; idx++)
+    {
+        const iSCSIDPortalHealth * health = (const iSCSIDPortalHealth *)CFDataGetBytePtr(values[idx]);
+        
+        SInt32 attempts = health->attempts;
+        SInt32 successes = health->successes;
+        SInt32 consecutiveFailures = health->consecutiveFailures;
+        SInt32 lastError = health->lastError;
+        SInt32 lastStatusCode = health->lastStatusCode;
+        double latency = health->latency;
+        double score = iSCSIDPortalHealthGetScore(keys[idx]);
+        
+        CFMutableDictionaryRef properties = CFDictionaryCreateMutable(kCFAllocatorDefault,0,
+                                                                      &kCFTypeDictionaryKeyCallBacks,
+                                                                      &kCFTypeDictionaryValueCallBacks);
+        
+        CFNumberRef number;
+        
+        number = CFNumberCreate(kCFAllocatorDefault,kCFNumberSInt32Type,&attempts);
+        CFDictionarySetValue(properties,kiSCSIDPortalLoginAttemptsKey,number);
+        CFRelease(number);
+        
+        number = CFNumberCreate(kCFAllocatorDefault,kCFNumberSInt32Type,&successes);
+        CFDictionarySetValue(properties,kiSCSIDPortalLoginSuccessesKey,number);
+        CFRelease(number);
+        
+        number = CFNumberCreate(kCFAllocatorDefault,kCFNumberSInt32Type,&consecutiveFailures);
+        CFDictionarySetValue(properties,kiSCSIDPortalConsecutiveFailuresKey,number);
+        CFRelease(number);
+        
+        number = CFNumberCreate(kCFAllocatorDefault,kCFNumberDoubleType,&latency);
+        CFDictionarySetValue(properties,kiSCSIDPortalLoginLatencyKey,number);
+        CFRelease(number);
+        
+        number = CFNumberCreate(kCFAllocatorDefault,kCFNumberDoubleType,&score);
+        CFDictionarySetValue(properties,kiSCSIDPortalHealthScoreKey,number);
+        CFRelease(number);
+        
+        if(health->lastAttempt) {
+            double elapsed = now - health->lastAttempt;
+            number = CFNumberCreate(kCFAllocatorDefault,kCFNumberDoubleType,&elapsed);
+            CFDictionarySetValue(properties,kiSCSIDPortalTimeSinceLastAttemptKey,number);
+            CFRelease(number);
+        }
+        
+        if(health->lastFailure) {
+            number = CFNumberCreate(kCFAllocatorDefault,kCFNumberSInt32Type,&lastError);
+            CFDictionarySetValue(properties,kiSCSIDPortalLastErrorKey,number);
+            CFRelease(number);
+            
+            number = CFNumberCreate(kCFAllocatorDefault,kCFNumberSInt32Type,&lastStatusCode);
+            CFDictionarySetValue(properties,kiSCSIDPortalLastStatusCodeKey,number);
+            CFRelease(number);
+        }
+        
+        CFDictionarySetValue(portals,keys[idx],properties);
+        CFRelease(properties);
+    }
+    
+    return portals;
+}
+
+/*! Releases a login job without reporting its result. */
+void iSCSIDLoginJobRelease(iSCSIDLoginJob * job)
+{
+    iSCSITargetRelease(job->target);
+    iSCSIPortalRelease(job->portal);
+    iSCSISessionConfigRelease(job->sessCfg);
+    iSCSIConnectionConfigRelease(job->connCfg);
+    iSCSIAuthRelease(job->targetAuth);
+    iSCSIAuthRelease(job->initiatorAuth);
+    free(job);
+}
+
+/*! Reports the result of a login job and releases it.  Must be called from
+ *  the main thread.
+ *  @return the error code of the login. */
+errno_t iSCSIDLoginJobComplete(iSCSIDLoginJob * job)
+{
+    errno_t error = job->errorCode;
+    CFStringRef targetIQN = iSCSITargetGetIQN(job->target);
+    
+    iSCSIDPortalHealthRecordLogin(job);
+    
+    // Log error message
+    if(error) {
+        CFStringRef errorString = CFStringCreateWithFormat(
             kCFAllocatorDefault,0,
             CFSTR("login to %@,%@:%@ failed: %s\n"),
             targetIQN,
-            iSCSIPortalGetAddress(portal),
-            iSCSIPortalGetPort(portal),
+            iSCSIPortalGetAddress(job->portal),
+            iSCSIPortalGetPort(job->portal),
             strerror(error));
 
         CFIndex errorStringLength = CFStringGetMaximumSizeForEncoding(CFStringGetLength(errorString),kCFStringEncodingASCII) + sizeof('\0');
@@ -368,165 +1366,1058 @@ errno_t iSCSIDLoginCommon(SessionIdentifier sessionId,
         
         asl_log(NULL, NULL, ASL_LEVEL_ERR, "%s", errorStringBuffer);
         
-        CFRelease(errorString);
+        CFRelease(errorString);
+    }
+    // Update target alias in preferences (if one was furnished)
+    else
+    {
+        CFStringRef alias = iSCSITargetGetAlias(job->target);
+        CFStringRef currentAlias = iSCSIPreferencesGetTargetAlias(preferences,targetIQN);
+        
+        if(alias && iSCSIPreferencesContainsTarget(preferences,targetIQN) &&
+           (!currentAlias || !CFEqual(alias,currentAlias))) {
+            iSCSIPreferencesSetTargetAlias(preferences,targetIQN,alias);
+            iSCSIDPreferencesDidChange();
+        }
+    }
+    
+    iSCSIDLoginJobRelease(job);
+    return error;
+}
+
+errno_t iSCSIDLoginWithPortal(iSCSIMutableTargetRef target,
+                              iSCSIPortalRef portal,
+                              enum iSCSILoginStatusCode * statusCode)
+{
+    *statusCode = kiSCSILoginInvalidStatusCode;
+    
+    iSCSIDLoginJob * job = iSCSIDLoginJobCreate(target,portal);
+    
+    if(!job)
+        return ENOMEM;
+    
+    iSCSIDLoginJobRun(job);
+    *statusCode = job->statusCode;
+    
+    return iSCSIDLoginJobComplete(job);
+}
+
+/*! Default number of logins the scheduler runs concurrently, used if the
+ *  initiator preferences do not specify a limit. */
+static const UInt32 kiSCSIDDefaultMaxConcurrentLogins = 8;
+
+/*! Maximum number of logins that may run concurrently against a single
+ *  portal address, so that one slow or overloaded portal cannot occupy
+ *  every login slot. */
+static const CFIndex kiSCSIDMaxConcurrentLoginsPerPortal = 2;
+
+/*! Pending login jobs for boot-critical targets (dispatched first). */
+static iSCSIDLoginJob * loginQueueCritical = NULL;
+
+/*! Pending login jobs for all other targets. */
+static iSCSIDLoginJob * loginQueueNormal = NULL;
+
+/*! IQNs of targets with a login (or logout) in progress.  Logins to the
+ *  same target are serialized so that only one leading login is ever
+ *  performed, and logouts are not performed while a login is in progress
+ *  (see iSCSIDLogoutStart). */
+static CFMutableSetRef loginActiveTargets = NULL;
+
+/*! Portal addresses with logins in progress (one entry per login). */
+static CFMutableBagRef loginActivePortals = NULL;
+
+/*! Number of login jobs running on worker threads. */
+static UInt32 loginActiveCount = 0;
+
+/*! Jobs finished by worker threads, awaiting completion on the main thread. */
+static iSCSIDLoginJob * loginCompleted = NULL;
+
+/*! Protects loginCompleted (the only scheduler state touched by workers). */
+static pthread_mutex_t loginCompletedMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*! Runloop source signaled by login workers when a job has finished. */
+CFRunLoopSourceRef loginSource = NULL;
+
+/*! Appends a job to the end of a scheduler queue. */
+void iSCSIDLoginQueueAppend(iSCSIDLoginJob * * queue,iSCSIDLoginJob * job)
+{
+    while(*queue)
+        queue = &(*queue)->next;
+    
+    job->next = NULL;
+    *queue = job;
+}
+
+/*! Returns true if a login to the specified target is queued or running. */
+Boolean iSCSIDLoginIsScheduledForTarget(CFStringRef targetIQN)
+{
+    if(loginActiveTargets && CFSetContainsValue(loginActiveTargets,targetIQN))
+        return true;
+    
+    iSCSIDLoginJob * queues[] = { loginQueueCritical, loginQueueNormal };
+    
+    for(size_t idx = 0; idx < sizeof(queues)/sizeof(queues[0]); idx++)
+        for(iSCSIDLoginJob * job = queues[idx]; job; job = job->next)
+            if(CFStringCompare(iSCSITargetGetIQN(job->target),targetIQN,0) == kCFCompareEqualTo)
+                return true;
+    
+    return false;
+}
+
+/*! Worker thread entry point; performs a single login job. */
+void * iSCSIDLoginWorker(void * context)
+{
+    iSCSIDLoginJob * job = context;
+    
+    iSCSIDLoginJobRun(job);
+    
+    pthread_mutex_lock(&loginCompletedMutex);
+    job->next = loginCompleted;
+    loginCompleted = job;
+    pthread_mutex_unlock(&loginCompletedMutex);
+    
+    CFRunLoopSourceSignal(loginSource);
+    CFRunLoopWakeUp(CFRunLoopGetMain());
+    return NULL;
+}
+
+/*! Starts as many pending login jobs as the concurrency limits allow.
+ *  Boot-critical targets are started before all others. */
+void iSCSIDLoginDispatch()
+{
+    UInt32 maxLogins = iSCSIPreferencesGetInitiatorMaxConcurrentLogins(preferences);
+    
+    if(maxLogins == 0)
+        maxLogins = kiSCSIDDefaultMaxConcurrentLogins;
+    
+    iSCSIDLoginJob * * queues[] = { &loginQueueCritical, &loginQueueNormal };
+    
+    for(size_t idx = 0; idx < sizeof(queues)/sizeof(queues[0]); idx++)
+    {
+        iSCSIDLoginJob * * link = queues[idx];
+        
+        while(*link && loginActiveCount < maxLogins)
+        {
+            iSCSIDLoginJob * job = *link;
+            CFStringRef targetIQN = iSCSITargetGetIQN(job->target);
+            CFStringRef portalAddress = iSCSIPortalGetAddress(job->portal);
+            
+            // Skip jobs whose target or portal is busy; they are retried
+            // when a running job completes
+            if(CFSetContainsValue(loginActiveTargets,targetIQN) ||
+               CFBagGetCountOfValue(loginActivePortals,portalAddress) >= kiSCSIDMaxConcurrentLoginsPerPortal)
+            {
+                link = &job->next;
+                continue;
+            }
+            
+            *link = job->next;
+            job->next = NULL;
+            
+            CFSetAddValue(loginActiveTargets,targetIQN);
+            CFBagAddValue(loginActivePortals,portalAddress);
+            loginActiveCount++;
+            
+            pthread_attr_t attr;
+            pthread_t thread;
+            pthread_attr_init(&attr);
+            pthread_attr_setdetachstate(&attr,PTHREAD_CREATE_DETACHED);
+            
+            // Fall back to a synchronous login if a worker can't be created
+            if(pthread_create(&thread,&attr,iSCSIDLoginWorker,job))
+                iSCSIDLoginWorker(job);
+            
+            pthread_attr_destroy(&attr);
+        }
+    }
+}
+
+/*! Schedules an asynchronous login to the specified target over the
+ *  specified portal.  The login runs on a worker thread and its result is
+ *  reported on the main run loop.  Must be called from the main thread. */
+void iSCSIDScheduleLogin(iSCSITargetRef target,iSCSIPortalRef portal)
+{
+    iSCSIDLoginJob * job = iSCSIDLoginJobCreate(target,portal);
+    
+    if(!job)
+        return;
+    
+    if(!loginActiveTargets)
+        loginActiveTargets = CFSetCreateMutable(kCFAllocatorDefault,0,&kCFTypeSetCallBacks);
+    
+    if(!loginActivePortals)
+        loginActivePortals = CFBagCreateMutable(kCFAllocatorDefault,0,&kCFTypeBagCallBacks);
+    
+    if(job->bootCritical)
+        iSCSIDLoginQueueAppend(&loginQueueCritical,job);
+    else
+        iSCSIDLoginQueueAppend(&loginQueueNormal,job);
+    
+    iSCSIDLoginDispatch();
+}
+
+/*! Callback function used to process a queued login once
+ *  the network becomes available. */
+void iSCSIDProcessQueuedLogin(SCNetworkReachabilityRef reachabilityTarget,
+                              SCNetworkReachabilityFlags flags,
+                              void * info)
+{
+    // Keep waiting until the portal is reachable
+    if(!(flags & kSCNetworkReachabilityFlagsReachable))
+        return;
+    
+    struct iSCSIDQueueLoginForTargetPortal * loginRef = info;
+    
+    SCNetworkReachabilityUnscheduleFromRunLoop(reachabilityTarget,CFRunLoopGetMain(),kCFRunLoopDefaultMode);
+    SCNetworkReachabilitySetCallback(reachabilityTarget,NULL,NULL);
+    
+    iSCSIDScheduleLogin(loginRef->target,loginRef->portal);
+    
+    iSCSITargetRelease(loginRef->target);
+    iSCSIPortalRelease(loginRef->portal);
+    CFRelease(reachabilityTarget);
+    
+    free(loginRef);
+}
+
+/*! Helper function used by auto-login, sleep-mode and persistent
+ *  functions to login to the specified target using the specified
+ *  portal when the network becomes available. */
+void iSCSIDQueueLogin(iSCSITargetRef target,iSCSIPortalRef portal)
+{
+    if(!target || !portal)
+        return;
+    
+    iSCSITargetRetain(target);
+    iSCSIPortalRetain(portal);
+        
+    SCNetworkReachabilityRef reachabilityTarget;
+    SCNetworkReachabilityContext reachabilityContext;
+    
+    struct iSCSIDQueueLoginForTargetPortal * loginRef = malloc(sizeof(struct iSCSIDQueueLoginForTargetPortal));
+    loginRef->target = target;
+    loginRef->portal = portal;
+    
+    reachabilityContext.info = loginRef;
+    reachabilityContext.copyDescription = 0;
+    reachabilityContext.retain = 0;
+    reachabilityContext.release = 0;
+    
+    char portalAddressBuffer[NI_MAXHOST];
+    
+    if(!CFStringGetCString(iSCSIPortalGetAddress(portal),portalAddressBuffer,NI_MAXHOST,kCFStringEncodingASCII))
+        return;
+    
+    // If a specific host interface was specified, create with pair...
+    if(CFStringCompare(iSCSIPortalGetHostInterface(portal),kiSCSIDefaultHostInterface,0) == kCFCompareEqualTo)
+        reachabilityTarget = SCNetworkReachabilityCreateWithName(kCFAllocatorDefault,portalAddressBuffer);
+    else {
+
+        struct sockaddr_storage remoteAddress, localAddress;
+        iSCSIUtilsGetAddressForPortal(portal,&remoteAddress,&localAddress);
+        
+        reachabilityTarget = SCNetworkReachabilityCreateWithAddressPair(kCFAllocatorDefault,
+                                                                        (const struct sockaddr *)&localAddress,
+                                                                        (const struct sockaddr *)&remoteAddress);
+    }
+    
+    // If the target is reachable just login; otherwise queue the login ...
+    SCNetworkReachabilityFlags reachabilityFlags;
+    SCNetworkReachabilityGetFlags(reachabilityTarget,&reachabilityFlags);
+    
+    if(reachabilityFlags & kSCNetworkReachabilityFlagsReachable) {
+        iSCSIDScheduleLogin(target,portal);
+        
+        iSCSITargetRelease(target);
+        iSCSIPortalRelease(portal);
+        CFRelease(reachabilityTarget);
+        free(loginRef);
+    
+    }
+    else {
+        SCNetworkReachabilitySetCallback(reachabilityTarget,iSCSIDProcessQueuedLogin,&reachabilityContext);
+        SCNetworkReachabilityScheduleWithRunLoop(reachabilityTarget,CFRunLoopGetMain(),kCFRunLoopDefaultMode);
+    }
+}
+
+/*! Delay before a target whose session timed out (or whose login failed)
+ *  is logged in again (s).  The delay doubles with each failure of the same
+ *  target in quick succession, up to kiSCSIDReloginMaxDelay. */
+static const CFTimeInterval kiSCSIDReloginBaseDelay = 1;
+
+/*! Maximum delay before a target is logged in again (s). */
+static const CFTimeInterval kiSCSIDReloginMaxDelay = 60;
+
+/*! A target that has not failed for this long (s) is logged in again
+ *  after the base delay. */
+static const CFTimeInterval kiSCSIDReloginResetInterval = 300;
+
+/*! A login to be performed after a session timeout or a failed login. */
+typedef struct iSCSIDRelogin {
+    
+    /*! The target to login to. */
+    iSCSITargetRef target;
+    
+    /*! The portals that failed since the last login was started (used if
+     *  the preferences do not define them for the target). */
+    CFMutableArrayRef portals;
+    
+    /*! Number of failures of the target in quick succession. */
+    UInt32 failures;
+    
+    /*! Time of the last failure of the target. */
+    CFAbsoluteTime lastFailure;
+    
+    /*! Time at which the login is started, or zero if the login has been
+     *  started and only the failure history is kept. */
+    CFAbsoluteTime loginTime;
+    
+    /*! Next relogin (ordered by loginTime; history entries last). */
+    struct iSCSIDRelogin * next;
+    
+} iSCSIDRelogin;
+
+/*! Pending relogins and recent failure history, one entry per target. */
+static iSCSIDRelogin * relogins = NULL;
+
+/*! Timer that starts pending relogins. */
+CFRunLoopTimerRef reloginTimer = NULL;
+
+/*! Computes the backoff delay that follows a number of consecutive failures.
+ *  @param failures the number of failures (at least one).
+ *  @return the delay (s). */
+CFTimeInterval iSCSIDReloginGetBackoff(UInt32 failures)
+{
+    CFTimeInterval delay = kiSCSIDReloginBaseDelay;
+    
+    for(UInt32 idx = 1; idx < failures && delay < kiSCSIDReloginMaxDelay; idx++)
+        delay *= 2;
+    
+    if(delay > kiSCSIDReloginMaxDelay)
+        delay = kiSCSIDReloginMaxDelay;
+    
+    return delay;
+}
+
+/*! Returns true if a portal failed recently enough that it should not be
+ *  used for additional connections yet (see iSCSIDReloginGetBackoff()). */
+Boolean iSCSIDPortalHealthIsBackingOff(CFStringRef portalAddress,CFAbsoluteTime now)
+{
+    CFDataRef data = NULL;
+    
+    if(portalHealth)
+        data = CFDictionaryGetValue(portalHealth,portalAddress);
+    
+    if(!data)
+        return false;
+    
+    const iSCSIDPortalHealth * health = (const iSCSIDPortalHealth *)CFDataGetBytePtr(data);
+    
+    return health->consecutiveFailures > 0 &&
+           now - health->lastFailure < iSCSIDReloginGetBackoff(health->consecutiveFailures);
+}
+
+/*! Removes the entry for the specified target from the relogin list.
+ *  @return the entry, or NULL if there is none. */
+iSCSIDRelogin * iSCSIDReloginRemove(CFStringRef targetIQN)
+{
+    for(iSCSIDRelogin * * link = &relogins; *link; link = &(*link)->next)
+    {
+        iSCSIDRelogin * relogin = *link;
+        
+        if(CFStringCompare(iSCSITargetGetIQN(relogin->target),targetIQN,0) == kCFCompareEqualTo) {
+            *link = relogin->next;
+            relogin->next = NULL;
+            return relogin;
+        }
+    }
+    return NULL;
+}
+
+/*! Inserts an entry into the relogin list, keeping pending relogins ordered
+ *  by login time ahead of history entries. */
+void iSCSIDReloginInsert(iSCSIDRelogin * relogin)
+{
+    iSCSIDRelogin * * link = &relogins;
+    
+    if(relogin->loginTime)
+        while(*link && (*link)->loginTime && (*link)->loginTime <= relogin->loginTime)
+            link = &(*link)->next;
+    else
+        while(*link)
+            link = &(*link)->next;
+    
+    relogin->next = *link;
+    *link = relogin;
+}
+
+/*! Releases the portals of a relogin, leaving a history entry. */
+void iSCSIDReloginClear(iSCSIDRelogin * relogin)
+{
+    CFArrayRemoveAllValues(relogin->portals);
+    relogin->loginTime = 0;
+}
+
+/*! Frees a relogin entry. */
+void iSCSIDReloginFree(iSCSIDRelogin * relogin)
+{
+    CFRelease(relogin->portals);
+    iSCSITargetRelease(relogin->target);
+    free(relogin);
+}
+
+/*! Queues the logins of a relogin.  The healthiest portal of the target is
+ *  used for the leading login; other portals are used for additional
+ *  connections unless they failed recently.  Failed portals that are not
+ *  defined for the target in the preferences are used as well. */
+void iSCSIDReloginStart(iSCSIDRelogin * relogin,CFAbsoluteTime now)
+{
+    CFStringRef targetIQN = iSCSITargetGetIQN(relogin->target);
+    CFArrayRef portals = iSCSIDCreateArrayOfPortalsForTargetByHealth(targetIQN);
+    CFIndex portalCount = portals ? CFArrayGetCount(portals) : 0;
+    CFIndex queued = 0;
+    
+    for(CFIndex portalIdx = 0; portalIdx < portalCount; portalIdx++)
+    {
+        CFStringRef portalAddress = CFArrayGetValueAtIndex(portals,portalIdx);
+        
+        if(queued > 0 && iSCSIDPortalHealthIsBackingOff(portalAddress,now))
+            continue;
+        
+        iSCSIPortalRef portal = iSCSIPreferencesCopyPortalForTarget(preferences,targetIQN,portalAddress);
+        
+        if(portal) {
+            iSCSIDQueueLogin(relogin->target,portal);
+            iSCSIPortalRelease(portal);
+            queued++;
+        }
+    }
+    
+    CFIndex failedCount = CFArrayGetCount(relogin->portals);
+    
+    for(CFIndex failedIdx = 0; failedIdx < failedCount; failedIdx++)
+    {
+        iSCSIPortalRef portal = CFArrayGetValueAtIndex(relogin->portals,failedIdx);
+        CFStringRef portalAddress = iSCSIPortalGetAddress(portal);
+        
+        if(portals && CFArrayContainsValue(portals,CFRangeMake(0,portalCount),portalAddress))
+            continue;
+        
+        if(queued > 0 && iSCSIDPortalHealthIsBackingOff(portalAddress,now))
+            continue;
+        
+        iSCSIDQueueLogin(relogin->target,portal);
+        queued++;
+    }
+    
+    if(portals)
+        CFRelease(portals);
+}
+
+/*! Timer callback that starts the relogins that are due, drops failure
+ *  history that has expired and rearms the timer. */
+void iSCSIDReloginTimer(CFRunLoopTimerRef timer,void * info)
+{
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    
+    // Pending relogins come first, ordered by login time
+    while(relogins && relogins->loginTime && relogins->loginTime <= now)
+    {
+        iSCSIDRelogin * relogin = relogins;
+        relogins = relogin->next;
+        
+        iSCSIDReloginStart(relogin,now);
+        iSCSIDReloginClear(relogin);
+        iSCSIDReloginInsert(relogin);
+    }
+    
+    for(iSCSIDRelogin * * link = &relogins; *link; )
+    {
+        iSCSIDRelogin * relogin = *link;
+        
+        if(!relogin->loginTime && now - relogin->lastFailure > kiSCSIDReloginResetInterval) {
+            *link = relogin->next;
+            iSCSIDReloginFree(relogin);
+        }
+        else
+            link = &relogin->next;
+    }
+    
+    if(relogins && relogins->loginTime)
+        CFRunLoopTimerSetNextFireDate(timer,relogins->loginTime);
+    else if(relogins)
+        CFRunLoopTimerSetNextFireDate(timer,now + kiSCSIDReloginResetInterval);
+}
+
+/*! Schedules a login to a target whose session timed out or whose login
+ *  failed.  Failures of the same target are collapsed into a single login
+ *  (over all of the portals that failed in the meantime), and logins are
+ *  delayed by a randomized, exponentially increasing interval so that
+ *  targets that fail together (e.g., during a storage failover) are not
+ *  logged in all at once and dead portals are not retried continuously.
+ *  Must be called from the main thread.
+ *  @param target the target to login to.
+ *  @param portal the portal that failed. */
+void iSCSIDReloginSchedule(iSCSITargetRef target,iSCSIPortalRef portal)
+{
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    iSCSIDRelogin * relogin = iSCSIDReloginRemove(iSCSITargetGetIQN(target));
+    
+    if(!relogin) {
+        if(!(relogin = malloc(sizeof(iSCSIDRelogin))))
+            return;
+        
+        if(!(relogin->portals = CFArrayCreateMutable(kCFAllocatorDefault,0,&kCFTypeArrayCallBacks))) {
+            free(relogin);
+            return;
+        }
+        
+        iSCSITargetRetain(target);
+        relogin->target = target;
+        relogin->failures = 0;
+        relogin->loginTime = 0;
+    }
+    else if(now - relogin->lastFailure > kiSCSIDReloginResetInterval)
+        relogin->failures = 0;
+    
+    // A login that is already pending covers this failure as well
+    if(!relogin->loginTime)
+    {
+        relogin->failures++;
+        CFTimeInterval delay = iSCSIDReloginGetBackoff(relogin->failures);
+        
+        // Pick a time between half of the delay and the full delay
+        delay = delay/2 + (delay/2)*arc4random_uniform(1001)/1000.0;
+        
+        relogin->loginTime = now + delay;
+    }
+    
+    // Every portal that failed is logged in again
+    CFIndex portalCount = CFArrayGetCount(relogin->portals);
+    
+    for(CFIndex portalIdx = 0; portalIdx < portalCount; portalIdx++)
+    {
+        iSCSIPortalRef failed = CFArrayGetValueAtIndex(relogin->portals,portalIdx);
+        
+        if(CFStringCompare(iSCSIPortalGetAddress(failed),iSCSIPortalGetAddress(portal),0) == kCFCompareEqualTo) {
+            portal = NULL;
+            break;
+        }
+    }
+    
+    if(portal)
+        CFArrayAppendValue(relogin->portals,portal);
+    
+    relogin->lastFailure = now;
+    iSCSIDReloginInsert(relogin);
+    
+    if(!reloginTimer) {
+        reloginTimer = CFRunLoopTimerCreate(kCFAllocatorDefault,relogins->loginTime,
+                                            1.0e10,0,0,&iSCSIDReloginTimer,NULL);
+        CFRunLoopAddTimer(CFRunLoopGetMain(),reloginTimer,kCFRunLoopDefaultMode);
+    }
+    else
+        CFRunLoopTimerSetNextFireDate(reloginTimer,relogins->loginTime);
+}
+
+/*! Cancels a pending relogin of the specified target (e.g., because the
+ *  target is being logged out).  Must be called from the main thread. */
+void iSCSIDReloginCancel(CFStringRef targetIQN)
+{
+    iSCSIDRelogin * relogin = iSCSIDReloginRemove(targetIQN);
+    
+    if(!relogin)
+        return;
+    
+    iSCSIDReloginClear(relogin);
+    iSCSIDReloginInsert(relogin);
+}
+
+/*! Returns true if the target failed often enough in quick succession
+ *  that relogins are delayed by kiSCSIDReloginMaxDelay.  Must be called
+ *  from the main thread. */
+Boolean iSCSIDReloginIsBackoffExhausted(CFStringRef targetIQN)
+{
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    
+    for(iSCSIDRelogin * relogin = relogins; relogin; relogin = relogin->next)
+    {
+        if(CFStringCompare(iSCSITargetGetIQN(relogin->target),targetIQN,0) != kCFCompareEqualTo)
+            continue;
+        
+        // The failure count is reset once the target stops failing
+        return now - relogin->lastFailure <= kiSCSIDReloginResetInterval &&
+               iSCSIDReloginGetBackoff(relogin->failures) >= kiSCSIDReloginMaxDelay;
     }
-    // Update target alias in preferences (if one was furnished)
-    else
+    return false;
+}
+
+/*! Creates a dictionary describing the pending relogins and recent failures
+ *  of each target (see kiSCSIDLoginSchedulerReloginsKey). */
+CFDictionaryRef iSCSIDReloginCreateCFProperties()
+{
+    CFMutableDictionaryRef targets = CFDictionaryCreateMutable(kCFAllocatorDefault,0,
+                                                               &kCFTypeDictionaryKeyCallBacks,
+                                                               &kCFTypeDictionaryValueCallBacks);
+    if(!targets)
+        return NULL;
+    
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    
+    for(iSCSIDRelogin * relogin = relogins; relogin; relogin = relogin->next)
     {
-        iSCSIPreferencesSetTargetAlias(preferences,targetIQN,iSCSITargetGetAlias(target));
-        iSCSIPreferencesSynchronzeAppValues(preferences);
+        CFMutableDictionaryRef properties = CFDictionaryCreateMutable(kCFAllocatorDefault,0,
+                                                                      &kCFTypeDictionaryKeyCallBacks,
+                                                                      &kCFTypeDictionaryValueCallBacks);
+        SInt32 failures = relogin->failures;
+        double elapsed = now - relogin->lastFailure;
+        CFNumberRef number;
+        
+        number = CFNumberCreate(kCFAllocatorDefault,kCFNumberSInt32Type,&failures);
+        CFDictionarySetValue(properties,kiSCSIDReloginFailuresKey,number);
+        CFRelease(number);
+        
+        number = CFNumberCreate(kCFAllocatorDefault,kCFNumberDoubleType,&elapsed);
+        CFDictionarySetValue(properties,kiSCSIDReloginTimeSinceLastFailureKey,number);
+        CFRelease(number);
+        
+        if(relogin->loginTime) {
+            double remaining = relogin->loginTime > now ? relogin->loginTime - now : 0;
+            number = CFNumberCreate(kCFAllocatorDefault,kCFNumberDoubleType,&remaining);
+            CFDictionarySetValue(properties,kiSCSIDReloginTimeUntilLoginKey,number);
+            CFRelease(number);
+        }
+        
+        CFDictionarySetValue(targets,iSCSITargetGetIQN(relogin->target),properties);
+        CFRelease(properties);
     }
     
-    if(sessCfg)
-        iSCSISessionConfigRelease(sessCfg);
+    return targets;
+}
+
+/*! Returns true if the session of a job could not be restored and is not
+ *  retried anymore: the target is not persistent, and restoring the
+ *  session failed until the relogin backoff reached its limit. */
+Boolean iSCSIDLoginJobSessionAbandoned(iSCSIDLoginJob * job)
+{
+    if(job->reconnectSessionId == kiSCSIInvalidSessionId ||
+       (!job->errorCode && job->statusCode == kiSCSILoginSuccess))
+        return false;
+    
+    CFStringRef targetIQN = iSCSITargetGetIQN(job->target);
+    
+    return !iSCSIPreferencesGetPersistenceForTarget(preferences,targetIQN) &&
+           iSCSIDReloginIsBackoffExhausted(targetIQN);
+}
+
+/*! Returns true if a failed login job should be retried, which is the case
+ *  for persistent targets if the failure may be transient (a network error,
+ *  or the target being temporarily unavailable). */
+Boolean iSCSIDLoginJobShouldRetry(iSCSIDLoginJob * job)
+{
+    if(job->loginLatency < 0 || (!job->errorCode && job->statusCode == kiSCSILoginSuccess))
+        return false;
     
-    if(connCfg)
-        iSCSIConnectionConfigRelease(connCfg);
+    // A session that was kept (e.g., across sleep) is restored until the
+    // target rejects it; for targets that are not persistent, only until
+    // the relogin backoff reaches its limit
+    if(job->reconnectSessionId != kiSCSIInvalidSessionId)
+        return !iSCSIDLoginJobSessionRejected(job) && !iSCSIDLoginJobSessionAbandoned(job);
     
-    if(targetAuth)
-        iSCSIAuthRelease(targetAuth);
+    if(!iSCSIPreferencesGetPersistenceForTarget(preferences,iSCSITargetGetIQN(job->target)))
+        return false;
     
-    if(initiatorAuth)
-        iSCSIAuthRelease(initiatorAuth);
+    if(job->errorCode)
+        return true;
     
-    return error;
+    return iSCSIDLoginStatusIsTransient(job->statusCode);
 }
 
-
-errno_t iSCSIDLoginAllPortals(iSCSIMutableTargetRef target,
-                              enum iSCSILoginStatusCode * statusCode)
+/*! Called once the volumes of a target whose session was discarded have
+ *  been unmounted; releases the session and, if the context is a portal,
+ *  logs in from scratch over it. */
+void iSCSIDLoginJobDiscardSessionComplete(CFArrayRef targets,
+                                          const enum iSCSIDAOperationResult * results,
+                                          void * context)
 {
-    CFIndex activeConnections = 0;
-    CFIndex maxConnections = 0;
-
-    // Error code to return to daemon's client
-    errno_t errorCode = 0;
-    *statusCode = kiSCSILoginInvalidStatusCode;
-
-    CFStringRef targetIQN = iSCSITargetGetIQN(target);
-    SessionIdentifier sessionId = iSCSISessionGetSessionIdForTarget(sessionManager,targetIQN);
-
-    // Set initial values for maxConnections and activeConnections
-    if(sessionId == kiSCSIInvalidSessionId)
-//TODO: change to the maximum value that will be supported by this initiator
-        maxConnections = 1;
-    else {
-
-        // If session exists, get the max connections and active connections
-        CFDictionaryRef properties = iSCSISessionCopyCFPropertiesForTarget(sessionManager,target);
-
-        if(properties) {
-            // Get max connections from property list
-            CFNumberRef number = CFDictionaryGetValue(properties,kRFC3720_Key_MaxConnections);
-            CFNumberGetValue(number,kCFNumberSInt32Type,&maxConnections);
-            CFRelease(properties);
-
-            CFArrayRef connections = iSCSISessionCopyArrayOfConnectionIds(sessionManager,sessionId);
-
-            if(connections) {
-                activeConnections = CFArrayGetCount(connections);
-                CFRelease(connections);
-            }
+    iSCSIPortalRef portal = context;
+    iSCSITargetRef target = (iSCSITargetRef)CFArrayGetValueAtIndex(targets,0);
+    SessionIdentifier sessionId = iSCSISessionGetSessionIdForTarget(sessionManager,iSCSITargetGetIQN(target));
+    
+    // The session may have been restored over another portal meanwhile
+    CFArrayRef connections = NULL;
+    CFIndex connectionCount = 0;
+    
+    if(sessionId != kiSCSIInvalidSessionId &&
+       (connections = iSCSISessionCopyArrayOfConnectionIds(sessionManager,sessionId))) {
+        connectionCount = CFArrayGetCount(connections);
+        CFRelease(connections);
+    }
+    
+    if(connectionCount == 0)
+    {
+        if(sessionId != kiSCSIInvalidSessionId) {
+            enum iSCSILogoutStatusCode statusCode;
+            iSCSISessionLogout(sessionManager,sessionId,&statusCode);
         }
+        if(portal)
+            iSCSIDQueueLogin(target,portal);
     }
+    
+    if(portal)
+        iSCSIPortalRelease(portal);
+}
 
-    // Add portals to the session until we've run out of portals to add or
-    // reached the maximum connection limit
-    CFStringRef portalAddress = NULL;
-    CFArrayRef portals = iSCSIPreferencesCreateArrayOfPortalsForTarget(preferences,targetIQN);
-    CFIndex portalIdx = 0;
-    CFIndex portalCount = CFArrayGetCount(portals);
+/*! Releases the session of a job that the target refused to restore, or
+ *  that could not be restored (see iSCSIDLoginJobSessionAbandoned).  The
+ *  volumes of the target are unmounted first (the session has no
+ *  connections, so they are forced), then the session is released.  If the
+ *  target rejected the session a new session is logged in.  Must be called
+ *  from the main thread. */
+void iSCSIDLoginJobDiscardSession(iSCSIDLoginJob * job,Boolean relogin)
+{
+    CFStringRef targetIQN = iSCSITargetGetIQN(job->target);
+    CFIndex targetIQNLength = CFStringGetMaximumSizeForEncoding(CFStringGetLength(targetIQN),kCFStringEncodingASCII) + sizeof('\0');
+    char targetIQNBuffer[targetIQNLength];
+    CFStringGetCString(targetIQN,targetIQNBuffer,targetIQNLength,kCFStringEncodingASCII);
+    
+    if(relogin)
+        asl_log(NULL,NULL,ASL_LEVEL_ERR,"target %s rejected session %d, logging in again.",
+                targetIQNBuffer,job->reconnectSessionId);
+    else
+        asl_log(NULL,NULL,ASL_LEVEL_ERR,"session %d of target %s could not be restored, releasing it.",
+                job->reconnectSessionId,targetIQNBuffer);
+    
+    CFArrayRef targets = CFArrayCreate(kCFAllocatorDefault,(const void **)&job->target,1,&kCFTypeArrayCallBacks);
+    
+    DASessionRef diskSession = DASessionCreate(kCFAllocatorDefault);
+    DASessionScheduleWithRunLoop(diskSession,CFRunLoopGetMain(),kCFRunLoopDefaultMode);
+    
+    iSCSIPortalRef portal = relogin ? job->portal : NULL;
+    
+    if(portal)
+        iSCSIPortalRetain(portal);
+    
+    iSCSIDAUnmountForTargets(diskSession,kDADiskUnmountOptionWhole|kDADiskUnmountOptionForce,targets,
+                             kiSCSIDUnmountTimeout,&iSCSIDLoginJobDiscardSessionComplete,(void*)portal);
+    
+    CFRelease(diskSession);
+    CFRelease(targets);
+}
 
-    while( (activeConnections < maxConnections) && portalIdx < portalCount )
+/*! Runloop source callback; completes finished login jobs on the main
+ *  thread and dispatches pending ones. */
+void iSCSIDProcessCompletedLogins(void * info)
+{
+    pthread_mutex_lock(&loginCompletedMutex);
+    iSCSIDLoginJob * job = loginCompleted;
+    loginCompleted = NULL;
+    pthread_mutex_unlock(&loginCompletedMutex);
+    
+    while(job)
     {
-        portalAddress = CFArrayGetValueAtIndex(portals,portalIdx);
-
-        // Get portal object and login
-        iSCSIPortalRef portal = iSCSIPreferencesCopyPortalForTarget(preferences,targetIQN,portalAddress);
-        errorCode = iSCSIDLoginCommon(sessionId,target,portal,statusCode);
-        iSCSIPortalRelease(portal);
+        iSCSIDLoginJob * next = job->next;
+        
+        CFSetRemoveValue(loginActiveTargets,iSCSITargetGetIQN(job->target));
+        CFBagRemoveValue(loginActivePortals,iSCSIPortalGetAddress(job->portal));
+        loginActiveCount--;
+        
+        if(iSCSIDLoginJobSessionRejected(job))
+            iSCSIDLoginJobDiscardSession(job,true);
+        else if(iSCSIDLoginJobShouldRetry(job))
+            iSCSIDReloginSchedule(job->target,job->portal);
+        else if(iSCSIDLoginJobSessionAbandoned(job))
+            iSCSIDLoginJobDiscardSession(job,false);
+        
+        iSCSIDLoginJobComplete(job);
+        job = next;
+    }
+    
+    iSCSIDLoginDispatch();
+}
 
-        // Quit if there was an error communicating with the daemon
-        if(errorCode)
-            break;
+/*! A login requested by a client.  The jobs are created on the main thread
+ *  and the logins are performed on a worker thread. */
+typedef struct iSCSIDClientLogin {
+    
+    /*! Login jobs, one for each portal to use.  If the target has no session
+     *  the first job is used for the leading login. */
+    iSCSIDLoginJob * jobs[kiSCSIMaxConnectionsPerSession];
+    
+    /*! Indicates which jobs were performed (the others were not needed). */
+    Boolean jobsRun[kiSCSIMaxConnectionsPerSession];
+    
+    /*! Number of jobs. */
+    CFIndex jobCount;
+    
+    /*! True if only the portal specified by the client should be used. */
+    Boolean singlePortal;
+    
+    /*! Result of the login. */
+    errno_t errorCode;
+    
+    /*! Login status code returned by the target. */
+    enum iSCSILoginStatusCode statusCode;
+    
+    /*! Login of several targets this login is part of (or NULL), and the
+     *  index of the target within it. */
+    iSCSIDClientBatch * batch;
+    CFIndex batchIndex;
+    
+} iSCSIDClientLogin;
 
-        activeConnections++;
-        portalIdx++;
+/*! Context for a connection added to a session by iSCSIDClientLoginAllPortals. */
+typedef struct iSCSIDAddConnectionContext {
+    iSCSIDLoginJob * job;
+    SessionIdentifier sessionId;
+    pthread_t thread;
+    Boolean threadCreated;
+} iSCSIDAddConnectionContext;
 
-        // Determine how many connections this session supports
-        sessionId = iSCSISessionGetSessionIdForTarget(sessionManager,iSCSITargetGetIQN(target));
+/*! Thread entry point used to add a connection to an existing session. */
+void * iSCSIDAddConnectionWorker(void * context)
+{
+    iSCSIDAddConnectionContext * ctx = context;
+    iSCSIDLoginJobLogin(ctx->job,ctx->sessionId);
+    return NULL;
+}
 
-        // If this was the first connection of the session, get the number of
-        // allowed maximum connections
-        if(activeConnections == 1) {
-            CFDictionaryRef properties = iSCSISessionCopyCFPropertiesForTarget(sessionManager,target);
-            if(properties) {
-                // Get max connections from property list
-                CFNumberRef number = CFDictionaryGetValue(properties,kRFC3720_Key_MaxConnections);
-                CFNumberGetValue(number,kCFNumberSInt32Type,&maxConnections);
-                CFRelease(properties);
-            }
-        }
-    };
+/*! Performs a client login over all of the portals of the target.  Runs on
+ *  a worker thread. */
+void iSCSIDClientLoginAllPortals(iSCSIDClientLogin * login)
+{
+    CFStringRef targetIQN = iSCSITargetGetIQN(login->jobs[0]->target);
+    SessionIdentifier sessionId = iSCSISessionGetSessionIdForTarget(sessionManager,targetIQN);
+    CFIndex jobIdx = 0;
     
-    if(portals)
-        CFRelease(portals);
+    // If there's no session, perform the leading login over the first portal;
+    // this negotiates the maximum number of connections for the session
+    if(sessionId == kiSCSIInvalidSessionId)
+    {
+        iSCSIDLoginJob * job = login->jobs[jobIdx];
+        login->jobsRun[jobIdx++] = true;
+        
+        iSCSIDLoginJobLogin(job,kiSCSIInvalidSessionId);
+        login->errorCode = job->errorCode;
+        login->statusCode = job->statusCode;
+        
+        if(!login->errorCode)
+            sessionId = iSCSISessionGetSessionIdForTarget(sessionManager,targetIQN);
+    }
+    
+    if(login->errorCode || sessionId == kiSCSIInvalidSessionId)
+        return;
+    
+    // Determine how many more connections the session supports
+    CFIndex activeConnections = 0;
+    CFIndex maxConnections = iSCSIDGetMaxConnectionsForTarget(login->jobs[0]->target);
+    CFArrayRef connections = iSCSISessionCopyArrayOfConnectionIds(sessionManager,sessionId);
+    
+    if(connections) {
+        activeConnections = CFArrayGetCount(connections);
+        CFRelease(connections);
+    }
+    
+    // Use each remaining portal that isn't already in use, until we've run
+    // out of portals or reached the maximum connection limit
+    iSCSIDAddConnectionContext contexts[kiSCSIMaxConnectionsPerSession];
+    CFIndex contextCount = 0;
     
-    return errorCode;
+    for(; jobIdx < login->jobCount && activeConnections + contextCount < maxConnections; jobIdx++)
+    {
+        iSCSIDLoginJob * job = login->jobs[jobIdx];
+        
+        if(iSCSISessionGetConnectionIdForPortal(sessionManager,sessionId,job->portal) != kiSCSIInvalidConnectionId)
+            continue;
+        
+        login->jobsRun[jobIdx] = true;
+        contexts[contextCount].job = job;
+        contexts[contextCount].sessionId = sessionId;
+        contextCount++;
+    }
+    
+    // Add all connections concurrently (each login exchange waits on the
+    // target independently), then collect the results in portal order
+    for(CFIndex idx = 0; idx < contextCount; idx++)
+        contexts[idx].threadCreated = (pthread_create(&contexts[idx].thread,NULL,iSCSIDAddConnectionWorker,&contexts[idx]) == 0);
+    
+    for(CFIndex idx = 0; idx < contextCount; idx++)
+    {
+        if(contexts[idx].threadCreated)
+            pthread_join(contexts[idx].thread,NULL);
+        else
+            iSCSIDAddConnectionWorker(&contexts[idx]);
+        
+        iSCSIDLoginJob * job = contexts[idx].job;
+        
+        if(job->errorCode && !login->errorCode) {
+            login->errorCode = job->errorCode;
+            login->statusCode = job->statusCode;
+        }
+        else if(!login->errorCode)
+            login->statusCode = job->statusCode;
+    }
 }
 
+/*! Performs a client login; runs on a worker thread. */
+void iSCSIDClientLoginRun(iSCSIDClientRequest * request)
+{
+    iSCSIDClientLogin * login = request->context;
+    
+    if(login->singlePortal) {
+        login->jobsRun[0] = true;
+        iSCSIDLoginJobRun(login->jobs[0]);
+        login->errorCode = login->jobs[0]->errorCode;
+        login->statusCode = login->jobs[0]->statusCode;
+    }
+    else
+        iSCSIDClientLoginAllPortals(login);
+}
 
-errno_t iSCSIDLoginWithPortal(iSCSIMutableTargetRef target,
-                              iSCSIPortalRef portal,
-                              enum iSCSILoginStatusCode * statusCode)
+/*! Reports the result of a client login and responds to the client; runs
+ *  on the main thread. */
+void iSCSIDClientLoginComplete(iSCSIDClientRequest * request)
 {
-    // Check for active sessions before attempting loginb
-    SessionIdentifier sessionId = kiSCSIInvalidSessionId;
-    ConnectionIdentifier connectionId = kiSCSIInvalidConnectionId;
-    *statusCode = kiSCSILoginInvalidStatusCode;
-    errno_t errorCode = 0;
+    iSCSIDClientLogin * login = request->context;
+    
+    CFSetRemoveValue(loginActiveTargets,iSCSITargetGetIQN(login->jobs[0]->target));
+    
+    for(CFIndex jobIdx = 0; jobIdx < login->jobCount; jobIdx++)
+    {
+        if(login->jobsRun[jobIdx])
+            iSCSIDLoginJobComplete(login->jobs[jobIdx]);
+        else
+            iSCSIDLoginJobRelease(login->jobs[jobIdx]);
+    }
+    
+    // Compose a response to send back to the client (or record the result,
+    // if this login is one of several)
+    if(login->batch)
+        iSCSIDClientBatchSetResult(login->batch,login->batchIndex,login->errorCode,login->statusCode);
+    else {
+        iSCSIDMsgLoginRsp rsp = iSCSIDMsgLoginRspInit;
+        rsp.errorCode = login->errorCode;
+        rsp.statusCode = login->statusCode;
+        
+        send(request->client->fd,&rsp,sizeof(rsp),0);
+    }
+    free(login);
+    
+    // Scheduled logins to this target may have been held back
+    iSCSIDLoginDispatch();
+}
 
+/*! Starts a client login to the specified target, either over the specified
+ *  portal or over all of the target's portals (if portal is NULL).  The
+ *  response to the client is sent once the login completes.  Must be called
+ *  from the main thread while processing a request.
+ *  @param batch if not NULL, the result is recorded in the batch at the
+ *  specified index instead of being sent to the client.
+ *  @param started set to true if the login was started (and the response
+ *  to the client will be sent once it completes).
+ *  @return an error code if the login could not be started. */
+errno_t iSCSIDClientLoginStart(iSCSITargetRef target,
+                               iSCSIPortalRef portal,
+                               iSCSIDClientBatch * batch,
+                               CFIndex batchIndex,
+                               Boolean * started)
+{
+    *started = false;
+    
+    iSCSIDClientLogin * login = malloc(sizeof(iSCSIDClientLogin));
+    
+    if(!login)
+        return ENOMEM;
+    
+    bzero(login,sizeof(iSCSIDClientLogin));
+    login->statusCode = kiSCSILoginInvalidStatusCode;
+    login->singlePortal = (portal != NULL);
+    login->batch = batch;
+    login->batchIndex = batchIndex;
+    
     CFStringRef targetIQN = iSCSITargetGetIQN(target);
-    sessionId = iSCSISessionGetSessionIdForTarget(sessionManager,targetIQN);
-
-    // Existing session, add a connection
-    if(sessionId != kiSCSIInvalidSessionId) {
-
-        connectionId = iSCSISessionGetConnectionIdForPortal(sessionManager,sessionId,portal);
-
-        // If there's an active session display error otherwise login
-        if(connectionId != kiSCSIInvalidConnectionId)
-        {} //iSCSICtlDisplayError("The specified target has an active session over the specified portal.");
-        else {
-            // See if the session can support an additional connection
-            CFDictionaryRef properties = iSCSISessionCopyCFPropertiesForTarget(sessionManager,target);
-            if(properties) {
-                // Get max connections from property list
-                UInt32 maxConnections;
-                CFNumberRef number = CFDictionaryGetValue(properties,kRFC3720_Key_MaxConnections);
-                CFNumberGetValue(number,kCFNumberSInt32Type,&maxConnections);
-                CFRelease(properties);
-
-                CFArrayRef connections = iSCSISessionCopyArrayOfConnectionIds(sessionManager,sessionId);
-                if(connections)
-                {
-                    CFIndex activeConnections = CFArrayGetCount(connections);
-                    if(activeConnections == maxConnections)
-                    {} //iSCSICtlDisplayError("The active session cannot support additional connections.");
-                    else
-                        errorCode = iSCSIDLoginCommon(sessionId,target,portal,statusCode);
-                    CFRelease(connections);
-                }
-            }
+    
+    if(portal) {
+        if((login->jobs[0] = iSCSIDLoginJobCreate(target,portal)))
+            login->jobCount = 1;
+    }
+    else {
+        // The leading login uses the healthiest portal
+        CFArrayRef portals = iSCSIDCreateArrayOfPortalsForTargetByHealth(targetIQN);
+        CFIndex portalCount = portals ? CFArrayGetCount(portals) : 0;
+        
+        for(CFIndex portalIdx = 0; portalIdx < portalCount && login->jobCount < kiSCSIMaxConnectionsPerSession; portalIdx++)
+        {
+            CFStringRef portalAddress = CFArrayGetValueAtIndex(portals,portalIdx);
+            iSCSIPortalRef targetPortal = iSCSIPreferencesCopyPortalForTarget(preferences,targetIQN,portalAddress);
+            
+            if(!targetPortal)
+                continue;
+            
+            if((login->jobs[login->jobCount] = iSCSIDLoginJobCreate(target,targetPortal)))
+                login->jobCount++;
+            
+            iSCSIPortalRelease(targetPortal);
         }
-
+        
+        if(portals)
+            CFRelease(portals);
     }
-    else  // Leading login
-        errorCode = iSCSIDLoginCommon(sessionId,target,portal,statusCode);
-
-    return errorCode;
+    
+    // Nothing to do if the target has no portals (not an error)
+    if(login->jobCount == 0) {
+        free(login);
+        return portal ? ENOMEM : 0;
+    }
+    
+    errno_t error = iSCSIDClientRequestDispatch(&iSCSIDClientLoginRun,&iSCSIDClientLoginComplete,login);
+    
+    if(error) {
+        for(CFIndex jobIdx = 0; jobIdx < login->jobCount; jobIdx++)
+            iSCSIDLoginJobRelease(login->jobs[jobIdx]);
+        free(login);
+        return error;
+    }
+    
+    // Keep scheduled logins away from this target until we're done
+    if(!loginActiveTargets)
+        loginActiveTargets = CFSetCreateMutable(kCFAllocatorDefault,0,&kCFTypeSetCallBacks);
+    
+    CFSetAddValue(loginActiveTargets,targetIQN);
+    *started = true;
+    return 0;
 }
 
+/*! Helper function. Verifies that the authorization sent by a client
+ *  grants the specified right.
+ *  @param authorizationData external form of the authorization.
+ *  @return an error code indicating whether the right was acquired. */
+errno_t iSCSIDAcquireRightWithData(CFDataRef authorizationData,enum iSCSIAuthRights right)
+{
+    AuthorizationRef authorization = NULL;
+    
+    if(!authorizationData || CFDataGetLength(authorizationData) < kAuthorizationExternalFormLength)
+        return EINVAL;
+    
+    AuthorizationExternalForm authorizationExtForm;
+    
+    CFDataGetBytes(authorizationData,
+                   CFRangeMake(0,kAuthorizationExternalFormLength),
+                   (UInt8 *)&authorizationExtForm.bytes);
+    
+    AuthorizationCreateFromExternalForm(&authorizationExtForm,&authorization);
+    
+    if(!authorization)
+        return EINVAL;
+    
+    errno_t error = 0;
+    
+    if(iSCSIAuthRightsAcquire(authorization,right) != errAuthorizationSuccess)
+        error = EAUTH;
+    
+    AuthorizationFree(authorization,kAuthorizationFlagDefaults);
+    return error;
+}
 
 errno_t iSCSIDLogin(int fd,iSCSIDMsgLoginCmd * cmd)
 {
@@ -580,25 +2471,33 @@ errno_t iSCSIDLogin(int fd,iSCSIDMsgLoginCmd * cmd)
     // Synchronize property list
     iSCSIDUpdatePreferencesFromAppValues();
 
+    // Don't race a scheduled login (e.g., auto-login) to the same target
+    if(!errorCode && target && iSCSIDLoginIsScheduledForTarget(iSCSITargetGetIQN(target)))
+        errorCode = EBUSY;
+
+    // The login is performed on a worker thread, which responds to the client
+    Boolean responseDeferred = false;
+    
     if(!errorCode) {
-        if(target && portal)
-            errorCode = iSCSIDLoginWithPortal(target,portal,&statusCode);
-        else if(target)
-            errorCode = iSCSIDLoginAllPortals(target,&statusCode);
+        if(target)
+            errorCode = iSCSIDClientLoginStart(target,portal,NULL,0,&responseDeferred);
         else
             errorCode = EINVAL;
     }
-    
-    // Compose a response to send back to the client
-    iSCSIDMsgLoginRsp rsp = iSCSIDMsgLoginRspInit;
-    rsp.errorCode = errorCode;
-    rsp.statusCode = statusCode;
 
     if(target)
         iSCSITargetRelease(target);
 
     if(portal)
         iSCSIPortalRelease(portal);
+    
+    if(responseDeferred)
+        return 0;
+    
+    // Compose a response to send back to the client
+    iSCSIDMsgLoginRsp rsp = iSCSIDMsgLoginRspInit;
+    rsp.errorCode = errorCode;
+    rsp.statusCode = statusCode;
 
     if(send(fd,&rsp,sizeof(rsp),0) != sizeof(rsp))
         return EAGAIN;
@@ -606,43 +2505,101 @@ errno_t iSCSIDLogin(int fd,iSCSIDMsgLoginCmd * cmd)
     return 0;
 }
 
-void iSCSIDLogoutComplete(iSCSITargetRef target,enum iSCSIDAOperationResult result,void * context)
+/*! Logs in to several targets, each over all of its portals.  The logins
+ *  proceed concurrently; a single response with the result for each target
+ *  is sent once they have all completed. */
+errno_t iSCSIDLoginTargets(int fd,iSCSIDMsgLoginTargetsCmd * cmd)
 {
-    // At this point either the we logout the session or just the connection
-    // associated with the specified portal, if one was specified
-    iSCSIDLogoutContext * ctx = (iSCSIDLogoutContext*)context;
+    CFDataRef targetsData = NULL, authorizationData = NULL;
+    iSCSIDaemonRecvMsg(fd,0,&authorizationData,cmd->authLength,&targetsData,cmd->targetsLength,NULL);
+    
+    errno_t errorCode = iSCSIDAcquireRightWithData(authorizationData,kiSCSIAuthLoginRight);
+    CFArrayRef targets = NULL;
+    
+    if(authorizationData)
+        CFRelease(authorizationData);
+    
+    if(targetsData) {
+        targets = iSCSITargetCreateArrayWithData(targetsData);
+        CFRelease(targetsData);
+    }
+    
+    CFIndex targetCount = targets ? CFArrayGetCount(targets) : 0;
+    iSCSIDClientBatch * batch = NULL;
+    
+    if(!errorCode && !targets)
+        errorCode = EINVAL;
+    
+    if(!errorCode && !(batch = iSCSIDClientBatchCreate(kiSCSIDLoginTargets,targetCount)))
+        errorCode = ENOMEM;
+    
+    if(errorCode) {
+        if(targets)
+            CFRelease(targets);
+        
+        iSCSIDMsgLoginTargetsRsp rsp = iSCSIDMsgLoginTargetsRspInit;
+        rsp.errorCode = errorCode;
+        
+        if(send(fd,&rsp,sizeof(rsp),0) != sizeof(rsp))
+            return EAGAIN;
+        
+        return 0;
+    }
+    
+    // Synchronize property list
+    iSCSIDUpdatePreferencesFromAppValues();
+    
+    for(CFIndex idx = 0; idx < targetCount; idx++)
+    {
+        iSCSITargetRef target = CFArrayGetValueAtIndex(targets,idx);
+        Boolean started = false;
+        
+        // Don't race a scheduled login (e.g., auto-login) to the same target
+        if(iSCSIDLoginIsScheduledForTarget(iSCSITargetGetIQN(target)))
+            errorCode = EBUSY;
+        else
+            errorCode = iSCSIDClientLoginStart(target,NULL,batch,idx,&started);
+        
+        if(!started)
+            iSCSIDClientBatchSetResult(batch,idx,errorCode,kiSCSILoginInvalidStatusCode);
+    }
+    
+    CFRelease(targets);
+    iSCSIDClientBatchStarted(batch);
+    return 0;
+}
+
+/*! Logs out the session, or removes the connection, of a logout.  Runs on
+ *  a worker thread, since the logout waits for the target to respond. */
+void iSCSIDLogoutRun(iSCSIDClientRequest * request)
+{
+    iSCSIDLogoutContext * ctx = request->context;
+    
+    if(ctx->portal)
+        ctx->errorCode = iSCSISessionRemoveConnection(sessionManager,ctx->sessionId,ctx->connectionId,&ctx->statusCode);
+    else
+        ctx->errorCode = iSCSISessionLogout(sessionManager,ctx->sessionId,&ctx->statusCode);
+}
 
+/*! Completes a logout on the main thread: logs errors, lets logins to the
+ *  target proceed and responds to the client (or records the result in the
+ *  batch).  Releases the logout context. */
+void iSCSIDLogoutFinish(iSCSIDLogoutContext * ctx)
+{
     // Store local copies and free structure
-    int fd = ctx->fd;
+    iSCSIDClient * client = ctx->client;
+    iSCSIDClientBatch * batch = ctx->batch;
+    CFIndex batchIndex = ctx->batchIndex;
     errno_t errorCode = ctx->errorCode;
+    enum iSCSILogoutStatusCode statusCode = ctx->statusCode;
+    iSCSITargetRef target = ctx->target;
     iSCSIPortalRef portal = ctx->portal;
+    Boolean fenced = ctx->fenced;
     
-    if(ctx->diskSession)
-        CFRelease(ctx->diskSession);
     free(ctx);
-
-    enum iSCSILogoutStatusCode statusCode = kiSCSILogoutInvalidStatusCode;
-    
-    if(!errorCode)
-    {
-        SessionIdentifier sessionId = iSCSISessionGetSessionIdForTarget(sessionManager,iSCSITargetGetIQN(target));
-
-        // For session logout, ensure that disk unmount was successful...
-        if(!portal) {
-            
-            if(result == kiSCSIDAOperationSuccess)
-                errorCode = iSCSISessionLogout(sessionManager,sessionId,&statusCode);
-            else
-                errorCode = EBUSY;
-        }
-        else {
-            ConnectionIdentifier connectionId = iSCSISessionGetConnectionIdForPortal(sessionManager,sessionId,portal);
-            errorCode = iSCSISessionRemoveConnection(sessionManager,sessionId,connectionId,&statusCode);
-        }
-    }
     
     // Log error message
-    if(errorCode) {
+    if(errorCode && target) {
         CFStringRef errorString;
         
         if(!portal) {
@@ -670,65 +2627,144 @@ void iSCSIDLogoutComplete(iSCSITargetRef target,enum iSCSIDAOperationResult resu
         
         CFRelease(errorString);
     }
+    
+    // Logins that were held back while logging out may proceed
+    if(fenced) {
+        CFSetRemoveValue(loginActiveTargets,iSCSITargetGetIQN(target));
+        iSCSIDLoginDispatch();
+    }
 
     if(portal)
         iSCSIPortalRelease(portal);
-    iSCSITargetRelease(target);
+    if(target)
+        iSCSITargetRelease(target);
+    
+    // Record the result if this logout is one of several
+    if(batch) {
+        iSCSIDClientBatchSetResult(batch,batchIndex,errorCode,statusCode);
+        return;
+    }
     
     // Compose a response to send back to the client
     iSCSIDMsgLogoutRsp rsp = iSCSIDMsgLogoutRspInit;
     rsp.errorCode = errorCode;
     rsp.statusCode = statusCode;
     
-    send(fd,&rsp,sizeof(rsp),0);
+    send(client->fd,&rsp,sizeof(rsp),0);
+    iSCSIDClientResponseSent(client);
 }
 
-errno_t iSCSIDLogout(int fd,iSCSIDMsgLogoutCmd * cmd)
+/*! Completes a logout performed on a worker thread. */
+void iSCSIDLogoutRequestComplete(iSCSIDClientRequest * request)
 {
-    CFDataRef targetData = NULL, portalData = NULL, authorizationData = NULL;
-    iSCSIDaemonRecvMsg(fd,0,&authorizationData,cmd->authLength,&targetData,cmd->targetLength,&portalData,cmd->portalLength,NULL);
-    errno_t errorCode = 0;
-
-    iSCSITargetRef target = NULL;
+    iSCSIDLogoutFinish(request->context);
+}
 
-    if(targetData) {
-        target = iSCSITargetCreateWithData(targetData);
-        CFRelease(targetData);
+/*! Continues a logout once the volumes of the target have been unmounted
+ *  (or right away, for a portal logout or a logout that already failed). */
+void iSCSIDLogoutComplete(iSCSITargetRef target,enum iSCSIDAOperationResult result,void * context)
+{
+    // At this point either the we logout the session or just the connection
+    // associated with the specified portal, if one was specified
+    iSCSIDLogoutContext * ctx = (iSCSIDLogoutContext*)context;
+    ctx->statusCode = kiSCSILogoutInvalidStatusCode;
+    
+    // For session logout, ensure that disk unmount was successful...
+    if(!ctx->errorCode && !ctx->portal && result != kiSCSIDAOperationSuccess)
+        ctx->errorCode = EBUSY;
+    
+    if(ctx->errorCode) {
+        iSCSIDLogoutFinish(ctx);
+        return;
     }
+    
+    ctx->sessionId = iSCSISessionGetSessionIdForTarget(sessionManager,iSCSITargetGetIQN(target));
+    
+    if(ctx->portal)
+        ctx->connectionId = iSCSISessionGetConnectionIdForPortal(sessionManager,ctx->sessionId,ctx->portal);
+    
+    // The logout PDUs are exchanged on a worker thread, so that the main
+    // run loop (and other clients) are not held up by the target; the
+    // client's response is already deferred, so the request doesn't defer it
+    if(iSCSIDClientRequestQueue(NULL,&iSCSIDLogoutRun,&iSCSIDLogoutRequestComplete,ctx)) {
+        iSCSIDClientRequest request = { .context = ctx };
+        iSCSIDLogoutRun(&request);
+        iSCSIDLogoutFinish(ctx);
+    }
+}
 
-    iSCSIPortalRef portal = NULL;
-
-    if(portalData) {
-        portal = iSCSIPortalCreateWithData(portalData);
-        CFRelease(portalData);
+/*! Called once the volumes of the targets of several logouts have been
+ *  unmounted; completes each of the logouts. */
+void iSCSIDLogoutUnmountComplete(CFArrayRef targets,
+                                 const enum iSCSIDAOperationResult * results,
+                                 void * context)
+{
+    CFArrayRef contexts = context;
+    CFIndex count = CFArrayGetCount(contexts);
+    
+    for(CFIndex idx = 0; idx < count; idx++)
+    {
+        iSCSIDLogoutContext * ctx = (iSCSIDLogoutContext*)CFArrayGetValueAtIndex(contexts,idx);
+        iSCSIDLogoutComplete(ctx->target,results[idx],ctx);
     }
     
-    AuthorizationRef authorization = NULL;
+    CFRelease(contexts);
+}
+
+/*! Unmounts the volumes of the targets of the specified logouts (as
+ *  collected by iSCSIDLogoutStart) in a single operation, then completes
+ *  the logouts.  Takes ownership of the array. */
+void iSCSIDLogoutUnmountStart(CFMutableArrayRef unmounts)
+{
+    CFIndex count = CFArrayGetCount(unmounts);
     
-    // If authorization data is valid, create authorization object
-    if(authorizationData) {
-        AuthorizationExternalForm authorizationExtForm;
-        
-        CFDataGetBytes(authorizationData,
-                       CFRangeMake(0,kAuthorizationExternalFormLength),
-                       (UInt8 *)&authorizationExtForm.bytes);
-        
-        AuthorizationCreateFromExternalForm(&authorizationExtForm,&authorization);
-        CFRelease(authorizationData);
+    if(count == 0) {
+        CFRelease(unmounts);
+        return;
     }
     
-    // If authorization object is valid, get the necessary rights
-    if(authorization) {
-        if(iSCSIAuthRightsAcquire(authorization,kiSCSIAuthLoginRight) != errAuthorizationSuccess)
-            errorCode = EAUTH;
-        
-        AuthorizationFree(authorization,kAuthorizationFlagDefaults);
+    CFMutableArrayRef targets = CFArrayCreateMutable(kCFAllocatorDefault,count,&kCFTypeArrayCallBacks);
+    
+    for(CFIndex idx = 0; idx < count; idx++)
+    {
+        iSCSIDLogoutContext * ctx = (iSCSIDLogoutContext*)CFArrayGetValueAtIndex(unmounts,idx);
+        CFArrayAppendValue(targets,ctx->target);
     }
-    else
-        errorCode = EINVAL;
+    
+    DASessionRef diskSession = DASessionCreate(kCFAllocatorDefault);
+    DASessionScheduleWithRunLoop(diskSession,CFRunLoopGetMain(),kCFRunLoopDefaultMode);
+    
+    iSCSIDAUnmountForTargets(diskSession,kDADiskUnmountOptionWhole,targets,kiSCSIDUnmountTimeout,
+                             &iSCSIDLogoutUnmountComplete,unmounts);
+    
+    CFRelease(diskSession);
+    CFRelease(targets);
+}
 
+/*! Starts a logout of the specified target, or of the connection to the
+ *  specified portal.  The response to the client is sent (or the result is
+ *  recorded in the batch, if one is specified) once the logout completes.
+ *  Takes ownership of the target and portal.  Must be called from the main
+ *  thread while processing a request.
+ *  @param errorCode an error that has already occurred (the logout is not
+ *  performed and the error is reported).
+ *  @param unmounts session logouts that require volumes to be unmounted
+ *  are added to this array; they proceed once iSCSIDLogoutUnmountStart()
+ *  is called with it. */
+void iSCSIDLogoutStart(iSCSITargetRef target,
+                       iSCSIPortalRef portal,
+                       errno_t errorCode,
+                       iSCSIDClientBatch * batch,
+                       CFIndex batchIndex,
+                       CFMutableArrayRef unmounts)
+{
     // See if there exists an active session for this target
-    SessionIdentifier sessionId = iSCSISessionGetSessionIdForTarget(sessionManager,iSCSITargetGetIQN(target));
+    SessionIdentifier sessionId = kiSCSIInvalidSessionId;
+    
+    if(target) {
+        iSCSIDReloginCancel(iSCSITargetGetIQN(target));
+        sessionId = iSCSISessionGetSessionIdForTarget(sessionManager,iSCSITargetGetIQN(target));
+    }
 
     if(!errorCode && sessionId == kiSCSIInvalidSessionId)
     {
@@ -778,29 +2814,145 @@ errno_t iSCSIDLogout(int fd,iSCSIDMsgLogoutCmd * cmd)
         }
     }
     
+    // Don't log out while a login to the target is queued or running (e.g.,
+    // adding a connection to the session); the client can try again later
+    if(!errorCode && iSCSIDLoginIsScheduledForTarget(iSCSITargetGetIQN(target)))
+        errorCode = EBUSY;
+    
+    // Keep logins away from this target until the logout has completed
+    if(!errorCode) {
+        if(!loginActiveTargets)
+            loginActiveTargets = CFSetCreateMutable(kCFAllocatorDefault,0,&kCFTypeSetCallBacks);
+        
+        CFSetAddValue(loginActiveTargets,iSCSITargetGetIQN(target));
+    }
+    
     // Unmount volumes if portal not specified (session logout)
     // or if portal is specified and is only connection...
     iSCSIDLogoutContext * context;
     context = (iSCSIDLogoutContext*)malloc(sizeof(iSCSIDLogoutContext));
-    context->fd = fd;
+    context->client = batch ? NULL : iSCSIDClientDeferResponse();
+    context->target = target;
     context->portal = NULL;
     context->errorCode = errorCode;
-    context->diskSession = NULL;
+    context->fenced = !errorCode;
+    context->batch = batch;
+    context->batchIndex = batchIndex;
     
     // Unmount and session logout
     if(!errorCode && (!portal || connectionCount == 1))
-    {
-        context->diskSession = DASessionCreate(kCFAllocatorDefault);
-
-        DASessionScheduleWithRunLoop(context->diskSession,CFRunLoopGetMain(),kCFRunLoopDefaultMode);
-        iSCSIDAUnmountForTarget(context->diskSession,kDADiskUnmountOptionWhole,target,&iSCSIDLogoutComplete,context);
-    }
+        CFArrayAppendValue(unmounts,context);
     // Portal logout only (or no logout and just a response to client if error)
     else {
         context->portal = portal;
         iSCSIDLogoutComplete(target,kiSCSIDAOperationSuccess,context);
     }
+}
+
+errno_t iSCSIDLogout(int fd,iSCSIDMsgLogoutCmd * cmd)
+{
+    CFDataRef targetData = NULL, portalData = NULL, authorizationData = NULL;
+    iSCSIDaemonRecvMsg(fd,0,&authorizationData,cmd->authLength,&targetData,cmd->targetLength,&portalData,cmd->portalLength,NULL);
+    errno_t errorCode = 0;
+
+    iSCSITargetRef target = NULL;
+
+    if(targetData) {
+        target = iSCSITargetCreateWithData(targetData);
+        CFRelease(targetData);
+    }
+
+    iSCSIPortalRef portal = NULL;
+
+    if(portalData) {
+        portal = iSCSIPortalCreateWithData(portalData);
+        CFRelease(portalData);
+    }
+    
+    AuthorizationRef authorization = NULL;
+    
+    // If authorization data is valid, create authorization object
+    if(authorizationData) {
+        AuthorizationExternalForm authorizationExtForm;
+        
+        CFDataGetBytes(authorizationData,
+                       CFRangeMake(0,kAuthorizationExternalFormLength),
+                       (UInt8 *)&authorizationExtForm.bytes);
+        
+        AuthorizationCreateFromExternalForm(&authorizationExtForm,&authorization);
+        CFRelease(authorizationData);
+    }
+    
+    // If authorization object is valid, get the necessary rights
+    if(authorization) {
+        if(iSCSIAuthRightsAcquire(authorization,kiSCSIAuthLoginRight) != errAuthorizationSuccess)
+            errorCode = EAUTH;
+        
+        AuthorizationFree(authorization,kAuthorizationFlagDefaults);
+    }
+    else
+        errorCode = EINVAL;
+
+    if(!errorCode && !target)
+        errorCode = EINVAL;
+    
+    CFMutableArrayRef unmounts = CFArrayCreateMutable(kCFAllocatorDefault,0,NULL);
+    iSCSIDLogoutStart(target,portal,errorCode,NULL,0,unmounts);
+    iSCSIDLogoutUnmountStart(unmounts);
+    return 0;
+}
 
+/*! Logs out of several targets.  The logouts (including unmounting the
+ *  volumes of each target) proceed concurrently; a single response with the
+ *  result for each target is sent once they have all completed. */
+errno_t iSCSIDLogoutTargets(int fd,iSCSIDMsgLogoutTargetsCmd * cmd)
+{
+    CFDataRef targetsData = NULL, authorizationData = NULL;
+    iSCSIDaemonRecvMsg(fd,0,&authorizationData,cmd->authLength,&targetsData,cmd->targetsLength,NULL);
+    
+    errno_t errorCode = iSCSIDAcquireRightWithData(authorizationData,kiSCSIAuthLoginRight);
+    CFArrayRef targets = NULL;
+    
+    if(authorizationData)
+        CFRelease(authorizationData);
+    
+    if(targetsData) {
+        targets = iSCSITargetCreateArrayWithData(targetsData);
+        CFRelease(targetsData);
+    }
+    
+    CFIndex targetCount = targets ? CFArrayGetCount(targets) : 0;
+    iSCSIDClientBatch * batch = NULL;
+    
+    if(!errorCode && !targets)
+        errorCode = EINVAL;
+    
+    if(!errorCode && !(batch = iSCSIDClientBatchCreate(kiSCSIDLogoutTargets,targetCount)))
+        errorCode = ENOMEM;
+    
+    if(errorCode) {
+        if(targets)
+            CFRelease(targets);
+        
+        iSCSIDMsgLogoutTargetsRsp rsp = iSCSIDMsgLogoutTargetsRspInit;
+        rsp.errorCode = errorCode;
+        
+        if(send(fd,&rsp,sizeof(rsp),0) != sizeof(rsp))
+            return EAGAIN;
+        
+        return 0;
+    }
+    
+    // The logout takes ownership of the target; the volumes of all targets
+    // are unmounted at once
+    CFMutableArrayRef unmounts = CFArrayCreateMutable(kCFAllocatorDefault,targetCount,NULL);
+    
+    for(CFIndex idx = 0; idx < targetCount; idx++)
+        iSCSIDLogoutStart(CFRetain(CFArrayGetValueAtIndex(targets,idx)),NULL,0,batch,idx,unmounts);
+    
+    iSCSIDLogoutUnmountStart(unmounts);
+    CFRelease(targets);
+    iSCSIDClientBatchStarted(batch);
     return 0;
 }
 
@@ -823,9 +2975,7 @@ errno_t iSCSIDCreateArrayOfActiveTargets(int fd,iSCSIDMsgCreateArrayOfActiveTarg
     }
 
     // Serialize and send array
-    CFDataRef data = CFPropertyListCreateData(kCFAllocatorDefault,
-                                              (CFPropertyListRef) activeTargets,
-                                              kCFPropertyListBinaryFormat_v1_0,0,NULL);
+    CFDataRef data = iSCSITargetCreateDataForArray(activeTargets);
     CFRelease(activeTargets);
 
     // Send response header
@@ -864,9 +3014,7 @@ errno_t iSCSIDCreateArrayofActivePortalsForTarget(int fd,
     }
 
     // Serialize and send array
-    CFDataRef data = CFPropertyListCreateData(kCFAllocatorDefault,
-                                              (CFPropertyListRef) activeTargets,
-                                              kCFPropertyListBinaryFormat_v1_0,0,NULL);
+    CFDataRef data = iSCSITargetCreateDataForArray(activeTargets);
     CFRelease(activeTargets);
 
     // Send response header
@@ -950,6 +3098,42 @@ errno_t iSCSIDIsPortalActive(int fd,iSCSIDMsgIsPortalActiveCmd *cmd)
     return 0;
 }
 
+/*! An authentication method query requested by a client. */
+typedef struct iSCSIDAuthQuery {
+    iSCSITargetRef target;
+    iSCSIPortalRef portal;
+    enum iSCSIAuthMethods authMethod;
+    enum iSCSILoginStatusCode statusCode;
+    errno_t errorCode;
+} iSCSIDAuthQuery;
+
+/*! Queries the target for its authentication method; runs on a worker thread. */
+void iSCSIDAuthQueryRun(iSCSIDClientRequest * request)
+{
+    iSCSIDAuthQuery * query = request->context;
+    query->errorCode = iSCSIQueryTargetForAuthMethod(sessionManager,query->portal,
+                                                     iSCSITargetGetIQN(query->target),
+                                                     &query->authMethod,&query->statusCode);
+}
+
+/*! Responds to the client with the result of the query; runs on the main thread. */
+void iSCSIDAuthQueryComplete(iSCSIDClientRequest * request)
+{
+    iSCSIDAuthQuery * query = request->context;
+    
+    // Compose a response to send back to the client
+    iSCSIDMsgQueryTargetForAuthMethodRsp rsp = iSCSIDMsgQueryTargetForAuthMethodRspInit;
+    rsp.errorCode = query->errorCode;
+    rsp.statusCode = query->statusCode;
+    rsp.authMethod = query->authMethod;
+    
+    send(request->client->fd,&rsp,sizeof(rsp),0);
+    
+    iSCSITargetRelease(query->target);
+    iSCSIPortalRelease(query->portal);
+    free(query);
+}
+
 errno_t iSCSIDQueryTargetForAuthMethod(int fd,iSCSIDMsgQueryTargetForAuthMethodCmd * cmd)
 {
     CFDataRef targetData = NULL, portalData = NULL;
@@ -969,16 +3153,40 @@ errno_t iSCSIDQueryTargetForAuthMethod(int fd,iSCSIDMsgQueryTargetForAuthMethodC
         CFRelease(portalData);
     }
 
-    enum iSCSIAuthMethods authMethod = kiSCSIAuthMethodInvalid;
-    enum iSCSILoginStatusCode statusCode = kiSCSILoginInvalidStatusCode;
-
-    errno_t error = iSCSIQueryTargetForAuthMethod(sessionManager,portal,iSCSITargetGetIQN(target),&authMethod,&statusCode);
+    errno_t error = 0;
+    
+    // The query requires a login exchange with the target; perform it on a
+    // worker thread, which responds to the client
+    iSCSIDAuthQuery * query = NULL;
+    
+    if(!target || !portal)
+        error = EINVAL;
+    else if(!(query = malloc(sizeof(iSCSIDAuthQuery))))
+        error = ENOMEM;
+    else {
+        query->target = target;
+        query->portal = portal;
+        query->authMethod = kiSCSIAuthMethodInvalid;
+        query->statusCode = kiSCSILoginInvalidStatusCode;
+        query->errorCode = 0;
+        
+        if(!(error = iSCSIDClientRequestDispatch(&iSCSIDAuthQueryRun,&iSCSIDAuthQueryComplete,query)))
+            return 0;
+        
+        free(query);
+    }
+    
+    if(target)
+        iSCSITargetRelease(target);
+    
+    if(portal)
+        iSCSIPortalRelease(portal);
 
     // Compose a response to send back to the client
     iSCSIDMsgQueryTargetForAuthMethodRsp rsp = iSCSIDMsgQueryTargetForAuthMethodRspInit;
     rsp.errorCode = error;
-    rsp.statusCode = statusCode;
-    rsp.authMethod = authMethod;
+    rsp.statusCode = kiSCSILoginInvalidStatusCode;
+    rsp.authMethod = kiSCSIAuthMethodInvalid;
 
     if(send(fd,&rsp,sizeof(rsp),0) != sizeof(rsp))
         return EAGAIN;
@@ -1077,24 +3285,159 @@ errno_t iSCSIDCreateCFPropertiesForConnection(int fd,
             rsp.dataLength = (UInt32)CFDataGetLength(data);
             CFRelease(properties);
         }
-        else
-            rsp.dataLength = 0;
+        else
+            rsp.dataLength = 0;
+        
+        error = iSCSIDaemonSendMsg(fd,(iSCSIDMsgGeneric*)&rsp,data,NULL);
+        
+        if(data)
+            CFRelease(data);
+    }
+    
+    if(target)
+        iSCSITargetRelease(target);
+    
+    if(portal)
+        iSCSIPortalRelease(portal);
+
+    return error;
+}
+
+
+/*! Sends the properties of all sessions and their connections in a single
+ *  response.  The response contains a dictionary keyed by target name; the
+ *  value for each target is a dictionary of session properties (see
+ *  iSCSISessionCopyCFPropertiesForTarget()), which also contains a
+ *  dictionary of connection properties keyed by portal address (see
+ *  iSCSISessionCopyCFPropertiesForPortal()) under kRFC3720_Key_Connections. */
+errno_t iSCSIDCreateCFPropertiesForAllSessions(int fd,
+                                               iSCSIDMsgCreateCFPropertiesForAllSessionsCmd * cmd)
+{
+    CFArrayRef sessionIds = iSCSISessionCopyArrayOfSessionIds(sessionManager);
+    CFIndex sessionCount = sessionIds ? CFArrayGetCount(sessionIds) : 0;
+    
+    CFMutableDictionaryRef sessions = CFDictionaryCreateMutable(kCFAllocatorDefault,sessionCount,
+                                                                &kCFTypeDictionaryKeyCallBacks,
+                                                                &kCFTypeDictionaryValueCallBacks);
+    
+    for(CFIndex idx = 0; idx < sessionCount; idx++)
+    {
+        SessionIdentifier sessionId = (SessionIdentifier)CFArrayGetValueAtIndex(sessionIds,idx);
+        iSCSITargetRef target = iSCSISessionCopyTargetForId(sessionManager,sessionId);
+        
+        if(!target)
+            continue;
+        
+        CFDictionaryRef properties = iSCSISessionCopyCFPropertiesForTarget(sessionManager,target);
+        
+        if(!properties) {
+            iSCSITargetRelease(target);
+            continue;
+        }
+        
+        CFMutableDictionaryRef sessionProperties = CFDictionaryCreateMutableCopy(kCFAllocatorDefault,0,properties);
+        CFMutableDictionaryRef connections = CFDictionaryCreateMutable(kCFAllocatorDefault,0,
+                                                                       &kCFTypeDictionaryKeyCallBacks,
+                                                                       &kCFTypeDictionaryValueCallBacks);
+        CFRelease(properties);
+        
+        CFArrayRef connectionIds = iSCSISessionCopyArrayOfConnectionIds(sessionManager,sessionId);
+        CFIndex connectionCount = connectionIds ? CFArrayGetCount(connectionIds) : 0;
+        
+        for(CFIndex connectionIdx = 0; connectionIdx < connectionCount; connectionIdx++)
+        {
+            ConnectionIdentifier connectionId = (ConnectionIdentifier)CFArrayGetValueAtIndex(connectionIds,connectionIdx);
+            iSCSIPortalRef portal = iSCSISessionCopyPortalForConnectionId(sessionManager,sessionId,connectionId);
+            
+            if(!portal)
+                continue;
+            
+            if((properties = iSCSISessionCopyCFPropertiesForPortal(sessionManager,target,portal))) {
+                CFDictionarySetValue(connections,iSCSIPortalGetAddress(portal),properties);
+                CFRelease(properties);
+            }
+            
+            iSCSIPortalRelease(portal);
+        }
         
-        error = iSCSIDaemonSendMsg(fd,(iSCSIDMsgGeneric*)&rsp,data,NULL);
+        CFDictionarySetValue(sessionProperties,kRFC3720_Key_Connections,connections);
+        CFDictionarySetValue(sessions,iSCSITargetGetIQN(target),sessionProperties);
         
-        if(data)
-            CFRelease(data);
+        CFRelease(connections);
+        CFRelease(sessionProperties);
+        
+        if(connectionIds)
+            CFRelease(connectionIds);
+        
+        iSCSITargetRelease(target);
     }
     
-    if(target)
-        iSCSITargetRelease(target);
+    if(sessionIds)
+        CFRelease(sessionIds);
+    
+    CFDataRef data = CFPropertyListCreateData(kCFAllocatorDefault,
+                                              (CFPropertyListRef)sessions,
+                                              kCFPropertyListBinaryFormat_v1_0,0,NULL);
+    CFRelease(sessions);
+    
+    // Send back response
+    iSCSIDMsgCreateCFPropertiesForAllSessionsRsp rsp = iSCSIDMsgCreateCFPropertiesForAllSessionsRspInit;
+    
+    if(data)
+        rsp.dataLength = (UInt32)CFDataGetLength(data);
+    else
+        rsp.dataLength = 0;
+    
+    errno_t error = iSCSIDaemonSendMsg(fd,(iSCSIDMsgGeneric*)&rsp,data,NULL);
+    
+    if(data)
+        CFRelease(data);
     
-    if(portal)
-        iSCSIPortalRelease(portal);
-
     return error;
 }
 
+/*! Sends the state of the login scheduler: the login history of each
+ *  portal and the pending relogins (see
+ *  iSCSIDaemonCreateCFPropertiesForLoginScheduler()). */
+errno_t iSCSIDCreateCFPropertiesForLoginScheduler(int fd,
+                                                  iSCSIDMsgCreateCFPropertiesForLoginSchedulerCmd * cmd)
+{
+    CFMutableDictionaryRef scheduler = CFDictionaryCreateMutable(kCFAllocatorDefault,0,
+                                                                 &kCFTypeDictionaryKeyCallBacks,
+                                                                 &kCFTypeDictionaryValueCallBacks);
+    CFDictionaryRef portals = iSCSIDPortalHealthCreateCFProperties();
+    CFDictionaryRef targets = iSCSIDReloginCreateCFProperties();
+    
+    if(portals) {
+        CFDictionarySetValue(scheduler,kiSCSIDLoginSchedulerPortalsKey,portals);
+        CFRelease(portals);
+    }
+    
+    if(targets) {
+        CFDictionarySetValue(scheduler,kiSCSIDLoginSchedulerReloginsKey,targets);
+        CFRelease(targets);
+    }
+    
+    CFDataRef data = CFPropertyListCreateData(kCFAllocatorDefault,
+                                              (CFPropertyListRef)scheduler,
+                                              kCFPropertyListBinaryFormat_v1_0,0,NULL);
+    CFRelease(scheduler);
+    
+    // Send back response
+    iSCSIDMsgCreateCFPropertiesForLoginSchedulerRsp rsp = iSCSIDMsgCreateCFPropertiesForLoginSchedulerRspInit;
+    
+    if(data)
+        rsp.dataLength = (UInt32)CFDataGetLength(data);
+    else
+        rsp.dataLength = 0;
+    
+    errno_t error = iSCSIDaemonSendMsg(fd,(iSCSIDMsgGeneric*)&rsp,data,NULL);
+    
+    if(data)
+        CFRelease(data);
+    
+    return error;
+}
 
 errno_t iSCSIDAddTargetForSendTargets(iSCSIPreferencesRef preferences,
                                       CFStringRef targetIQN,
@@ -1132,12 +3475,20 @@ errno_t iSCSIDAddTargetForSendTargets(iSCSIPreferencesRef preferences,
     return 0;
 }
 
+/*! Thread entry point for a discovery pass.
+ *  @param context the discovery portals to query, copied from the
+ *  preferences on the main thread (released by this function). */
 void * iSCSIDRunDiscovery(void * context)
 {
+    CFArrayRef portals = context;
+    
     if(discoveryRecords != NULL)
         CFRelease(discoveryRecords);
 
-    discoveryRecords = iSCSIDiscoveryCreateRecordsWithSendTargets(sessionManager,preferences);
+    discoveryRecords = iSCSIDiscoveryCreateRecordsWithSendTargets(sessionManager,portals);
+    
+    if(portals)
+        CFRelease(portals);
 
     
     // Clear mutex created when discovery was launched
@@ -1150,7 +3501,8 @@ void * iSCSIDRunDiscovery(void * context)
 void iSCSIDProcessDiscoveryData(void * info)
 {
     // Process discovery results if any
-    if(discoveryRecords) {
+    // (deferred until a client that holds the preferences lock releases it)
+    if(discoveryRecords && !preferencesLockOwner) {
         
         pthread_mutex_lock(&preferencesMutex);
         iSCSIDUpdatePreferencesFromAppValues();
@@ -1160,13 +3512,19 @@ void iSCSIDProcessDiscoveryData(void * info)
         const void * values[count];
         CFDictionaryGetKeysAndValues(discoveryRecords,keys,values);
         
+        // Only write the preferences if discovery added, changed or removed targets
+        Boolean preferencesChanged = false;
+        
         for(CFIndex i = 0; i < count; i++)
-            iSCSIDiscoveryUpdatePreferencesWithDiscoveredTargets(sessionManager,preferences,keys[i],values[i]);
+            iSCSIDiscoveryUpdatePreferencesWithDiscoveredTargets(sessionManager,preferences,keys[i],values[i],
+                                                                 &preferencesChanged);
         
-        iSCSIPreferencesSynchronzeAppValues(preferences);
+        if(preferencesChanged)
+            iSCSIDPreferencesDidChange();
         pthread_mutex_unlock(&preferencesMutex);
         
         CFRelease(discoveryRecords);
+        discoveryRecords = NULL;
     }
 }
 
@@ -1179,15 +3537,26 @@ void iSCSIDLaunchDiscoveryThread(CFRunLoopTimerRef timer,void * context)
     pthread_t thread;
     errno_t error = 0;
     
-    if(pthread_mutex_trylock(&discoveryMutex))
+    // The mutex is held for the duration of a discovery pass
+    if(pthread_mutex_trylock(&discoveryMutex) == 0)
     {
         error = pthread_attr_init(&attribute);
         assert(!error);
         error = pthread_attr_setdetachstate(&attribute,PTHREAD_CREATE_DETACHED);
         assert(!error);
         
-        error = pthread_create(&thread,&attribute,&iSCSIDRunDiscovery,NULL);
+        // The preferences are only accessed on the main thread; the
+        // discovery thread is handed a copy of the discovery portals
+        CFArrayRef portals = iSCSIDiscoveryCreateArrayOfPortalsForSendTargets(preferences);
+        
+        error = pthread_create(&thread,&attribute,&iSCSIDRunDiscovery,(void*)portals);
         pthread_attr_destroy(&attribute);
+        
+        if(error) {
+            if(portals)
+                CFRelease(portals);
+            pthread_mutex_unlock(&discoveryMutex);
+        }
     }
     else {
         asl_log(NULL,NULL,ASL_LEVEL_CRIT,"discovery is taking longer than the specified"
@@ -1276,9 +3645,23 @@ errno_t iSCSIDPreferencesIOLockAndSync(int fd,iSCSIDMsgPreferencesIOLockAndSyncC
     else
         error = EINVAL;
     
-    // If we have the necessary rights, lock
+    // If we have the necessary rights, lock (and write back pending changes
+    // so that the client sees them).  If another client holds the lock, the
+    // response is sent once this client has been granted the lock.
     if(!error) {
+        if(preferencesLockOwner) {
+            iSCSIDClient * client = iSCSIDClientDeferResponse();
+            iSCSIDClient * * link = &preferencesLockWaiters;
+            
+            while(*link)
+                link = &(*link)->nextLockWaiter;
+            *link = client;
+            
+            return 0;
+        }
+        
         pthread_mutex_lock(&preferencesMutex);
+        iSCSIDPreferencesLockGrant(currentClient);
     }
     
     // Compose a response to send back to the client
@@ -1294,8 +3677,9 @@ errno_t iSCSIDPreferencesIOLockAndSync(int fd,iSCSIDMsgPreferencesIOLockAndSyncC
 errno_t iSCSIDPreferencesIOUnlockAndSync(int fd,iSCSIDMsgPreferencesIOUnlockAndSyncCmd * cmd)
 {
     // Verify that the client is authorized for the operation
-    CFDataRef preferencesData = NULL;
-    errno_t error = iSCSIDaemonRecvMsg(fd,0,&preferencesData,cmd->preferencesLength,NULL);
+    CFDataRef preferencesData = NULL, deltaData = NULL;
+    errno_t error = iSCSIDaemonRecvMsg(fd,0,&deltaData,cmd->deltaLength,
+                                       &preferencesData,cmd->preferencesLength,NULL);
     
     iSCSIPreferencesRef preferencesToSync = NULL;
     
@@ -1304,18 +3688,47 @@ errno_t iSCSIDPreferencesIOUnlockAndSync(int fd,iSCSIDMsgPreferencesIOUnlockAndS
         CFRelease(preferencesData);
     }
     
-    // If no errors and the daemon was previously locked out for sync
-    if(!error && preferencesToSync && pthread_mutex_trylock(&preferencesMutex))
+    // If this client holds the lock, sync (unless there was an error) and unlock
+    if(preferencesLockOwner == currentClient)
     {
-        iSCSIPreferencesSynchronzeAppValues(preferencesToSync);
-        iSCSIPreferencesUpdateWithAppValues(preferences);
+        // Only changes were sent; apply them to our copy and write that back
+        if(!error && deltaData)
+        {
+            iSCSIDUpdatePreferencesFromAppValues();
+            
+            if(iSCSIPreferencesApplyDeltaData(preferences,deltaData)) {
+                iSCSIPreferencesSynchronzeAppValues(preferences);
+                preferencesDirty = false;
+            }
+            else
+                error = EINVAL;
+            
+            // Consume the notification for this write
+            int changed;
+            if(preferencesNotifyToken != NOTIFY_TOKEN_INVALID)
+                notify_check(preferencesNotifyToken,&changed);
+        }
+        else if(!error && preferencesToSync)
+        {
+            iSCSIPreferencesSynchronzeAppValues(preferencesToSync);
+            iSCSIPreferencesUpdateWithAppValues(preferences);
+            preferencesDirty = false;
+            
+            // The preferences were just read; consume the notification for this write
+            int changed;
+            if(preferencesNotifyToken != NOTIFY_TOKEN_INVALID)
+                notify_check(preferencesNotifyToken,&changed);
+        }
+        
+        iSCSIDPreferencesLockRelease();
     }
     
-    pthread_mutex_unlock(&preferencesMutex);
-    
     if(preferencesToSync)
         iSCSIPreferencesRelease(preferencesToSync);
     
+    if(deltaData)
+        CFRelease(deltaData);
+    
     // Compose a response to send back to the client
     iSCSIDMsgPreferencesIOUnlockAndSyncRsp rsp = iSCSIDMsgPreferencesIOUnlockAndSyncRspInit;
     rsp.errorCode = error;
@@ -1445,106 +3858,32 @@ errno_t iSCSIDRemoveSharedSecret(int fd,iSCSIDMsgRemoveSharedSecretCmd *cmd)
     return 0;
 }
 
-/*! Callback function used to process a queued login once
- *  the network becomes available. */
-void iSCSIDProcessQueuedLogin(SCNetworkReachabilityRef reachabilityTarget,
-                              SCNetworkReachabilityFlags flags,
-                              void * info)
-{
-    struct iSCSIDQueueLoginForTargetPortal * loginRef = info;
-    
-    iSCSIMutableTargetRef target = iSCSITargetCreateMutableCopy(loginRef->target);
-    iSCSIPortalRef portal = loginRef->portal;
-    
-    enum iSCSILoginStatusCode statusCode;
-    iSCSIDLoginWithPortal(target,portal,&statusCode);
-    
-    iSCSITargetRelease(target);
-    iSCSITargetRelease(loginRef->target);
-    iSCSIPortalRelease(portal);
-    
-    free(loginRef);
-}
-
-/*! Helper function used by auto-login, sleep-mode and persistent
- *  functions to login to the specified target using the specified
- *  portal when the network becomes available. */
-void iSCSIDQueueLogin(iSCSITargetRef target,iSCSIPortalRef portal)
+void iSCSIDSessionTimeoutHandler(iSCSITargetRef target,CFArrayRef portals)
 {
-    if(!target || !portal)
+    if(!target || !portals)
         return;
     
-    iSCSITargetRetain(target);
-    iSCSIPortalRetain(portal);
-        
-    SCNetworkReachabilityRef reachabilityTarget;
-    SCNetworkReachabilityContext reachabilityContext;
-    
-    struct iSCSIDQueueLoginForTargetPortal * loginRef = malloc(sizeof(struct iSCSIDQueueLoginForTargetPortal));
-    loginRef->target = target;
-    loginRef->portal = portal;
-    
-    reachabilityContext.info = loginRef;
-    reachabilityContext.copyDescription = 0;
-    reachabilityContext.retain = 0;
-    reachabilityContext.release = 0;
-    
-    char portalAddressBuffer[NI_MAXHOST];
-    
-    if(!CFStringGetCString(iSCSIPortalGetAddress(portal),portalAddressBuffer,NI_MAXHOST,kCFStringEncodingASCII))
-        return;
+    Boolean persistent = iSCSIPreferencesGetPersistenceForTarget(preferences,iSCSITargetGetIQN(target));
+    CFIndex portalCount = CFArrayGetCount(portals);
     
-    // If a specific host interface was specified, create with pair...
-    if(CFStringCompare(iSCSIPortalGetHostInterface(portal),kiSCSIDefaultHostInterface,0) == kCFCompareEqualTo)
-        reachabilityTarget = SCNetworkReachabilityCreateWithName(kCFAllocatorDefault,portalAddressBuffer);
-    else {
-
-        struct sockaddr_storage remoteAddress, localAddress;
-        iSCSIUtilsGetAddressForPortal(portal,&remoteAddress,&localAddress);
+    for(CFIndex portalIdx = 0; portalIdx < portalCount; portalIdx++)
+    {
+        iSCSIPortalRef portal = CFArrayGetValueAtIndex(portals,portalIdx);
         
-        reachabilityTarget = SCNetworkReachabilityCreateWithAddressPair(kCFAllocatorDefault,
-                                                                        (const struct sockaddr *)&localAddress,
-                                                                        (const struct sockaddr *)&remoteAddress);
-    }
-    
-    // If the target is reachable just login; otherwise queue the login ...
-    SCNetworkReachabilityFlags reachabilityFlags;
-    SCNetworkReachabilityGetFlags(reachabilityTarget,&reachabilityFlags);
-    
-    if(reachabilityFlags & kSCNetworkReachabilityFlagsReachable) {
-        enum iSCSILoginStatusCode statusCode;
-        iSCSIMutableTargetRef mutableTarget = iSCSITargetCreateMutableCopy(target);
-        iSCSITargetRelease(target);
-        iSCSIDLoginWithPortal(mutableTarget,portal,&statusCode);
+        // Post message to system log
+        asl_log(NULL,NULL,ASL_LEVEL_ERR,"TCP timeout for %s over portal %s.",
+                CFStringGetCStringPtr(iSCSITargetGetIQN(target),kCFStringEncodingASCII),
+                CFStringGetCStringPtr(iSCSIPortalGetAddress(portal),kCFStringEncodingASCII));
         
-        iSCSITargetRelease(mutableTarget);
-        iSCSIPortalRelease(portal);
-        CFRelease(reachabilityTarget);
-        free(loginRef);
-    
-    }
-    else {
-        SCNetworkReachabilitySetCallback(reachabilityTarget,iSCSIDProcessQueuedLogin,&reachabilityContext);
-        SCNetworkReachabilityScheduleWithRunLoop(reachabilityTarget,CFRunLoopGetMain(),kCFRunLoopDefaultMode);
+        iSCSIDPortalHealthRecordTimeout(portal);
+        
+        // If this was a persistance target, schedule another login once the
+        // network is available (the logins over all portals are collapsed)
+        if(persistent)
+            iSCSIDReloginSchedule(target,portal);
     }
 }
 
-void iSCSIDSessionTimeoutHandler(iSCSITargetRef target,iSCSIPortalRef portal)
-{
-    if(!target || !portal)
-        return;
-    
-    // Post message to system log
-    asl_log(NULL,NULL,ASL_LEVEL_ERR,"TCP timeout for %s over portal %s.",
-            CFStringGetCStringPtr(iSCSITargetGetIQN(target),kCFStringEncodingASCII),
-            CFStringGetCStringPtr(iSCSIPortalGetAddress(portal),kCFStringEncodingASCII));
-    
-    // If this was a persistance target, queue another login when the network is
-    // available
-    if(iSCSIPreferencesGetPersistenceForTarget(preferences,iSCSITargetGetIQN(target)))
-        iSCSIDQueueLogin(target,portal);
-}
-
 /*! Automatically logs in to targets that were specified for auto-login.
  *  Used during startup of the daemon to log in to either static 
  *  dynamic targets for which the auto-login option is enabled. */
@@ -1560,6 +3899,23 @@ void iSCSIDAutoLogin()
     
     CFIndex targetsCount = CFArrayGetCount(targets);
     
+    // Logins are scheduled asynchronously; order boot-critical targets first
+    // so that they claim the first login slots
+    CFMutableArrayRef orderedTargets = CFArrayCreateMutable(kCFAllocatorDefault,targetsCount,&kCFTypeArrayCallBacks);
+    
+    for(CFIndex idx = 0; idx < targetsCount; idx++)
+    {
+        CFStringRef targetIQN = CFArrayGetValueAtIndex(targets,idx);
+        
+        if(iSCSIPreferencesGetBootCriticalForTarget(preferences,targetIQN))
+            CFArrayInsertValueAtIndex(orderedTargets,0,targetIQN);
+        else
+            CFArrayAppendValue(orderedTargets,targetIQN);
+    }
+    
+    CFRelease(targets);
+    targets = orderedTargets;
+    
     for(CFIndex idx = 0; idx < targetsCount; idx++)
     {
         CFStringRef targetIQN = CFArrayGetValueAtIndex(targets,idx);
@@ -1573,12 +3929,14 @@ void iSCSIDAutoLogin()
             
             CFArrayRef portals = NULL;
             
-            if(!(portals = iSCSIPreferencesCreateArrayOfPortalsForTarget(preferences,targetIQN)))
+            if(!(portals = iSCSIDCreateArrayOfPortalsForTargetByHealth(targetIQN)))
                 continue;
             
             CFIndex portalsCount = CFArrayGetCount(portals);
             
-            // Queue a login operation for a each portal; mind the interface is one is required
+            // Queue a login operation for a each portal; mind the interface is one is required.
+            // Logins to a target run in the order queued, so the healthiest
+            // portal is used for the leading login
             for(CFIndex portalIdx = 0; portalIdx < portalsCount; portalIdx++)
             {
                 CFStringRef portalAddress = CFArrayGetValueAtIndex(portals,portalIdx);
@@ -1598,6 +3956,10 @@ void iSCSIDAutoLogin()
     CFRelease(targets);
 }
 
+/*! Restores the sessions that were active before the system went to sleep.
+ *  Logins are queued so that targets are restored in parallel once their
+ *  portals are reachable; sessions that were kept while the system slept
+ *  are reconnected using the parameters negotiated before. */
 void iSCSIDRestoreFromSystemSleep()
 {
     // Do nothing if targets were not active before sleeping
@@ -1619,13 +3981,12 @@ void iSCSIDRestoreFromSystemSleep()
         
         for(CFIndex portalIdx = 0; portalIdx < portalCount; portalIdx++)
         {
-            enum iSCSILoginStatusCode statusCode;
-            iSCSIPortalRef portal = CFArrayGetValueAtIndex(portalArray,portalIdx);
+            iSCSIPortalRef portal = (iSCSIPortalRef)CFArrayGetValueAtIndex(portalArray,portalIdx);
             
             iSCSIMutableTargetRef target = iSCSITargetCreateMutable();
             iSCSITargetSetIQN(target,targetIQN);
             
-            iSCSIDLoginWithPortal(target,portal,&statusCode);
+            iSCSIDQueueLogin(target,portal);
             iSCSITargetRelease(target);
         }
     }
@@ -1634,18 +3995,76 @@ void iSCSIDRestoreFromSystemSleep()
     activeTargets = NULL;
 }
 
-/*! Called to logout of target after volumes for the target are unmounted. */
-void iSCSIDPrepareForSystemSleepComplete(iSCSITargetRef target,
-                                         enum iSCSIDAOperationResult result,
-                                         void * context)
+/*! Context for a session suspended or logged out before the system sleeps. */
+typedef struct iSCSIDSleepSessionContext {
+    SessionIdentifier sessionId;
+    Boolean retain;
+    pthread_t thread;
+    Boolean threadCreated;
+} iSCSIDSleepSessionContext;
+
+/*! Thread entry point used to suspend or logout a session before the
+ *  system sleeps. */
+void * iSCSIDSleepSessionWorker(void * context)
 {
-    SessionIdentifier sessionId = (SessionIdentifier)context;
+    iSCSIDSleepSessionContext * ctx = context;
     enum iSCSILogoutStatusCode statusCode;
-    iSCSISessionLogout(sessionManager,sessionId,&statusCode);
+    
+    if(!ctx->retain)
+        iSCSISessionLogout(sessionManager,ctx->sessionId,&statusCode);
+    else if(iSCSISessionSuspend(sessionManager,ctx->sessionId))
+        asl_log(NULL,NULL,ASL_LEVEL_WARNING,"could not suspend session %d before sleep.",ctx->sessionId);
+    
+    return NULL;
+}
+
+/*! Suspends or logs out the specified sessions before the system sleeps.
+ *  All sessions are processed concurrently (each logout waits on the target
+ *  independently); returns once all of them are done. */
+void iSCSIDSleepSessions(const SessionIdentifier * sessionIds,CFIndex sessionCount,Boolean retain)
+{
+    iSCSIDSleepSessionContext contexts[sessionCount];
+    
+    for(CFIndex idx = 0; idx < sessionCount; idx++)
+    {
+        contexts[idx].sessionId = sessionIds[idx];
+        contexts[idx].retain = retain;
+        contexts[idx].threadCreated = (pthread_create(&contexts[idx].thread,NULL,iSCSIDSleepSessionWorker,&contexts[idx]) == 0);
+        
+        if(!contexts[idx].threadCreated)
+            iSCSIDSleepSessionWorker(&contexts[idx]);
+    }
+    
+    for(CFIndex idx = 0; idx < sessionCount; idx++)
+        if(contexts[idx].threadCreated)
+            pthread_join(contexts[idx].thread,NULL);
+}
+
+/*! Called to logout of targets after volumes for the targets are unmounted. */
+void iSCSIDPrepareForSystemSleepComplete(CFArrayRef targets,
+                                         const enum iSCSIDAOperationResult * results,
+                                         void * context)
+{
+    CFIndex targetCount = CFArrayGetCount(targets);
+    SessionIdentifier sessionIds[targetCount];
+    CFIndex sessionCount = 0;
+    
+    for(CFIndex idx = 0; idx < targetCount; idx++)
+    {
+        iSCSITargetRef target = (iSCSITargetRef)CFArrayGetValueAtIndex(targets,idx);
+        SessionIdentifier sessionId = iSCSISessionGetSessionIdForTarget(sessionManager,iSCSITargetGetIQN(target));
+        
+        if(sessionId != kiSCSIInvalidSessionId)
+            sessionIds[sessionCount++] = sessionId;
+    }
+    
+    iSCSIDSleepSessions(sessionIds,sessionCount,false);
 }
 
 /*! Saves a dictionary of active targets and portals that
- *  is used to restore active sessions upon wakeup. */
+ *  is used to restore active sessions upon wakeup.  Depending on the
+ *  initiator preferences, sessions are either suspended (volumes remain
+ *  mounted) or volumes are unmounted and sessions are logged out. */
 void iSCSIDPrepareForSystemSleep()
 {
     CFArrayRef sessionIds = iSCSISessionCopyArrayOfSessionIds(sessionManager);
@@ -1654,9 +4073,11 @@ void iSCSIDPrepareForSystemSleep()
         return;
     
     CFIndex sessionCount = CFArrayGetCount(sessionIds);
+    Boolean retainSessions = iSCSIPreferencesGetInitiatorRetainSessionsDuringSleep(preferences);
     
-    // Create disk arbitration session to force unmount of all volumes
-    DASessionRef diskSession = DASessionCreate(kCFAllocatorDefault);
+    SessionIdentifier retainedSessionIds[sessionCount];
+    CFIndex retainedCount = 0;
+    CFMutableArrayRef targets = CFArrayCreateMutable(kCFAllocatorDefault,sessionCount,&kCFTypeArrayCallBacks);
     
     // Clear stale list if one is present
     if(activeTargets) {
@@ -1691,12 +4112,36 @@ void iSCSIDPrepareForSystemSleep()
         
         // Add array of active portals for target...
         CFDictionarySetValue(activeTargets,targetIQN,portals);
-
+        CFRelease(portals);
+        CFRelease(connectionIds);
+        
+        if(retainSessions)
+            retainedSessionIds[retainedCount++] = sessionId;
+        else
+            CFArrayAppendValue(targets,target);
+        
+        iSCSITargetRelease(target);
+    }
+    
+    CFRelease(sessionIds);
+    
+    // Flush file system buffers so that no writes are outstanding while
+    // connections are closed, and suspend all sessions
+    if(retainSessions) {
+        sync();
+        iSCSIDSleepSessions(retainedSessionIds,retainedCount,true);
+    }
+    // Force unmount of the volumes of all targets at once, then logout
+    else {
+        DASessionRef diskSession = DASessionCreate(kCFAllocatorDefault);
         DASessionScheduleWithRunLoop(diskSession,CFRunLoopGetMain(),kCFRunLoopDefaultMode);
-        iSCSIDAUnmountForTarget(diskSession,kDADiskUnmountOptionWhole,target,&iSCSIDPrepareForSystemSleepComplete,(void*)sessionId);
+        
+        iSCSIDAUnmountForTargets(diskSession,kDADiskUnmountOptionWhole,targets,
+                                 kiSCSIDUnmountTimeout,&iSCSIDPrepareForSystemSleepComplete,NULL);
+        CFRelease(diskSession);
     }
     
-    CFRetain(diskSession);
+    CFRelease(targets);
 }
 
 
@@ -1715,9 +4160,15 @@ void iSCSIDHandlePowerEvent(void * refCon,
     {
         // The system will go to sleep (we have no control)
         case kIOMessageSystemWillSleep:
+            if(!pthread_mutex_trylock(&preferencesMutex)) {
+                iSCSIDFlushPreferences();
+                pthread_mutex_unlock(&preferencesMutex);
+            }
             iSCSIDPrepareForSystemSleep();
             break;
         case kIOMessageSystemWillPowerOn:
+            // The network may have changed while the system was asleep
+            iSCSIUtilsFlushAddressCache();
             iSCSIDRestoreFromSystemSleep();
             break;
     };
@@ -1753,105 +4204,144 @@ void iSCSIDDeregisterForPowerEvents()
     IONotificationPortDestroy(powerNotifyPortRef);
 }
 
-void iSCSIDProcessIncomingRequest(void * info)
+/*! Processes a request from a client.  Called by the main runloop when data
+ *  is available on the client's socket.  Requests from different clients
+ *  are interleaved; operations that take a long time (e.g., logins) are
+ *  handed to worker threads so that they don't hold up other clients. */
+void iSCSIDProcessIncomingRequest(CFSocketRef socket,
+                                  CFSocketCallBackType callbackType,
+                                  CFDataRef address,
+                                  const void * data,
+                                  void * info)
 {
-    struct iSCSIDIncomingRequestInfo * reqInfo = (struct iSCSIDIncomingRequestInfo*)info;
+    iSCSIDClient * client = (iSCSIDClient*)info;
     iSCSIDMsgCmd cmd;
     
-    int fd = reqInfo->fd;
+    int fd = client->fd;
     
-    if(fd != 0 && recv(fd,&cmd,sizeof(cmd),MSG_WAITALL) == sizeof(cmd)) {
-        errno_t error = 0;
-        
-        switch(cmd.funcCode)
-        {
-            case kiSCSIDLogin:
-                error = iSCSIDLogin(fd,(iSCSIDMsgLoginCmd*)&cmd); break;
-            case kiSCSIDLogout:
-                error = iSCSIDLogout(fd,(iSCSIDMsgLogoutCmd*)&cmd); break;
-            case kiSCSIDCreateArrayOfActiveTargets:
-                error = iSCSIDCreateArrayOfActiveTargets(fd,(iSCSIDMsgCreateArrayOfActiveTargetsCmd*)&cmd); break;
-            case kiSCSIDCreateArrayOfActivePortalsForTarget:
-                error = iSCSIDCreateArrayofActivePortalsForTarget(fd,(iSCSIDMsgCreateArrayOfActivePortalsForTargetCmd*)&cmd); break;
-            case kiSCSIDIsTargetActive:
-                error = iSCSIDIsTargetActive(fd,(iSCSIDMsgIsTargetActiveCmd*)&cmd); break;
-            case kiSCSIDIsPortalActive:
-                error = iSCSIDIsPortalActive(fd,(iSCSIDMsgIsPortalActiveCmd*)&cmd); break;
-            case kiSCSIDQueryTargetForAuthMethod:
-                error = iSCSIDQueryTargetForAuthMethod(fd,(iSCSIDMsgQueryTargetForAuthMethodCmd*)&cmd); break;
-            case kiSCSIDCreateCFPropertiesForSession:
-                error = iSCSIDCreateCFPropertiesForSession(fd,(iSCSIDMsgCreateCFPropertiesForSessionCmd*)&cmd); break;
-            case kiSCSIDCreateCFPropertiesForConnection:
-                error = iSCSIDCreateCFPropertiesForConnection(fd,(iSCSIDMsgCreateCFPropertiesForConnectionCmd*)&cmd); break;
-            case kiSCSIDUpdateDiscovery:
-                error = iSCSIDUpdateDiscovery(fd,(iSCSIDMsgUpdateDiscoveryCmd*)&cmd); break;
-            case kiSCSIDPreferencesIOLockAndSync:
-                error = iSCSIDPreferencesIOLockAndSync(fd,(iSCSIDMsgPreferencesIOLockAndSyncCmd*)&cmd); break;
-            case kiSCSIDPreferencesIOUnlockAndSync:
-                error = iSCSIDPreferencesIOUnlockAndSync(fd,(iSCSIDMsgPreferencesIOUnlockAndSyncCmd*)&cmd); break;
-            case kiSCSIDSetSharedSecret:
-                error = iSCSIDSetSharedSecret(fd,(iSCSIDMsgSetSharedSecretCmd*)&cmd); break;
-            case kiSCSIDRemoveSharedSecret:
-                error = iSCSIDRemoveSharedSecret(fd,(iSCSIDMsgRemoveSharedSecretCmd*)&cmd); break;
-            default:
-                CFSocketInvalidate(reqInfo->socket);
-                reqInfo->fd = 0;
-                pthread_mutex_unlock(&preferencesMutex);
-        };
-        
-        if(error)
-            asl_log(NULL,NULL,ASL_LEVEL_ERR,"error code %d while processing user request",error);
+    // Client disconnected (or sent an incomplete request)
+    if(recv(fd,&cmd,sizeof(cmd),MSG_WAITALL) != sizeof(cmd)) {
+        iSCSIDClientClose(client);
+        return;
     }
     
-    // If a request came in while we were processing, queue it up...
-    if(reqInfo->fd && recv(fd,&cmd,sizeof(cmd),MSG_PEEK) > 0) {
-            CFRunLoopSourceSignal(reqInfo->socketSourceRead);
+    errno_t error = 0;
+    currentClient = client;
+    
+    switch(cmd.funcCode)
+    {
+        case kiSCSIDLogin:
+            error = iSCSIDLogin(fd,(iSCSIDMsgLoginCmd*)&cmd); break;
+        case kiSCSIDLogout:
+            error = iSCSIDLogout(fd,(iSCSIDMsgLogoutCmd*)&cmd); break;
+        case kiSCSIDCreateArrayOfActiveTargets:
+            error = iSCSIDCreateArrayOfActiveTargets(fd,(iSCSIDMsgCreateArrayOfActiveTargetsCmd*)&cmd); break;
+        case kiSCSIDCreateArrayOfActivePortalsForTarget:
+            error = iSCSIDCreateArrayofActivePortalsForTarget(fd,(iSCSIDMsgCreateArrayOfActivePortalsForTargetCmd*)&cmd); break;
+        case kiSCSIDIsTargetActive:
+            error = iSCSIDIsTargetActive(fd,(iSCSIDMsgIsTargetActiveCmd*)&cmd); break;
+        case kiSCSIDIsPortalActive:
+            error = iSCSIDIsPortalActive(fd,(iSCSIDMsgIsPortalActiveCmd*)&cmd); break;
+        case kiSCSIDQueryTargetForAuthMethod:
+            error = iSCSIDQueryTargetForAuthMethod(fd,(iSCSIDMsgQueryTargetForAuthMethodCmd*)&cmd); break;
+        case kiSCSIDCreateCFPropertiesForSession:
+            error = iSCSIDCreateCFPropertiesForSession(fd,(iSCSIDMsgCreateCFPropertiesForSessionCmd*)&cmd); break;
+        case kiSCSIDCreateCFPropertiesForConnection:
+            error = iSCSIDCreateCFPropertiesForConnection(fd,(iSCSIDMsgCreateCFPropertiesForConnectionCmd*)&cmd); break;
+        case kiSCSIDUpdateDiscovery:
+            error = iSCSIDUpdateDiscovery(fd,(iSCSIDMsgUpdateDiscoveryCmd*)&cmd); break;
+        case kiSCSIDPreferencesIOLockAndSync:
+            error = iSCSIDPreferencesIOLockAndSync(fd,(iSCSIDMsgPreferencesIOLockAndSyncCmd*)&cmd); break;
+        case kiSCSIDPreferencesIOUnlockAndSync:
+            error = iSCSIDPreferencesIOUnlockAndSync(fd,(iSCSIDMsgPreferencesIOUnlockAndSyncCmd*)&cmd); break;
+        case kiSCSIDSetSharedSecret:
+            error = iSCSIDSetSharedSecret(fd,(iSCSIDMsgSetSharedSecretCmd*)&cmd); break;
+        case kiSCSIDRemoveSharedSecret:
+            error = iSCSIDRemoveSharedSecret(fd,(iSCSIDMsgRemoveSharedSecretCmd*)&cmd); break;
+        case kiSCSIDLoginTargets:
+            error = iSCSIDLoginTargets(fd,(iSCSIDMsgLoginTargetsCmd*)&cmd); break;
+        case kiSCSIDLogoutTargets:
+            error = iSCSIDLogoutTargets(fd,(iSCSIDMsgLogoutTargetsCmd*)&cmd); break;
+        case kiSCSIDCreateCFPropertiesForAllSessions:
+            error = iSCSIDCreateCFPropertiesForAllSessions(fd,(iSCSIDMsgCreateCFPropertiesForAllSessionsCmd*)&cmd); break;
+        case kiSCSIDCreateCFPropertiesForLoginScheduler:
+            error = iSCSIDCreateCFPropertiesForLoginScheduler(fd,(iSCSIDMsgCreateCFPropertiesForLoginSchedulerCmd*)&cmd); break;
+        default:
+            client->closed = true;
+    };
+    
+    currentClient = NULL;
+    
+    if(error)
+        asl_log(NULL,NULL,ASL_LEVEL_ERR,"error code %d while processing user request",error);
+    
+    // Read the next request, unless the response to this one is pending
+    if(client->pendingResponses == 0) {
+        if(client->closed)
+            iSCSIDClientRelease(client);
+        else
+            CFSocketEnableCallBacks(client->socket,kCFSocketReadCallBack);
     }
 }
 
-/*! Handle an incoming connection from a client. Once a connection is
- *  established, main runloop calls this function. This function processes
- *  all incoming commands until a shutdown request is received, at which point
- *  this function terminates and returns control to the run loop. For this
- *  reason, no other commands (e.g., timers) can be executed until the 
- *  incoming request is processed. */
+/*! Handle an incoming connection from a client.  Each client is served by
+ *  its own socket runloop source, so any number of clients may be connected
+ *  at once. */
 void iSCSIDAcceptConnection(CFSocketRef socket,
                             CFSocketCallBackType callbackType,
                             CFDataRef address,
                             const void * data,
                             void * info)
 {
-    struct iSCSIDIncomingRequestInfo * reqInfo = (struct iSCSIDIncomingRequestInfo*)info;
-
+    if(callbackType != kCFSocketAcceptCallBack)
+        return;
+    
     // Get file descriptor associated with the connection
-    if(callbackType == kCFSocketAcceptCallBack) {
-        if(reqInfo->fd != 0) {
-            close(reqInfo->fd);
-        }
-        
-        reqInfo->fd = *(CFSocketNativeHandle*)data;
-        
-        // Set timeouts for send() and recv()
-        struct timeval tv;
-        memset(&tv,0,sizeof(tv));
-        tv.tv_usec = kiSCSIDaemonTimeoutMilliSec*1000;
-        
-        setsockopt(reqInfo->fd,SOL_SOCKET,SO_SNDTIMEO,&tv,sizeof(tv));
-        setsockopt(reqInfo->fd,SOL_SOCKET,SO_RCVTIMEO,&tv,sizeof(tv));
+    int fd = *(CFSocketNativeHandle*)data;
+    
+    // Set timeouts for send() and recv()
+    struct timeval tv;
+    memset(&tv,0,sizeof(tv));
+    tv.tv_usec = kiSCSIDaemonTimeoutMilliSec*1000;
+    
+    setsockopt(fd,SOL_SOCKET,SO_SNDTIMEO,&tv,sizeof(tv));
+    setsockopt(fd,SOL_SOCKET,SO_RCVTIMEO,&tv,sizeof(tv));
+    
+    // Report a closed connection as an error rather than raising SIGPIPE
+    int noSigPipe = 1;
+    setsockopt(fd,SOL_SOCKET,SO_NOSIGPIPE,&noSigPipe,sizeof(noSigPipe));
+    
+    iSCSIDClient * client = malloc(sizeof(iSCSIDClient));
+    
+    if(!client) {
+        close(fd);
+        return;
     }
     
-    iSCSIDProcessIncomingRequest(info);
-}
-
-void sig_pipe_handler(int signal)
-{
-    if(!reqInfo)
+    bzero(client,sizeof(iSCSIDClient));
+    client->fd = fd;
+    
+    CFSocketContext clientContext;
+    bzero(&clientContext,sizeof(clientContext));
+    clientContext.info = (void*)client;
+    
+    client->socket = CFSocketCreateWithNative(kCFAllocatorDefault,fd,
+                                              kCFSocketReadCallBack,
+                                              iSCSIDProcessIncomingRequest,
+                                              &clientContext);
+    if(!client->socket) {
+        close(fd);
+        free(client);
         return;
-
-    // Cleanup since pipe was broken
-    CFSocketInvalidate(reqInfo->socket);
-    reqInfo->fd = 0;
-    pthread_mutex_unlock(&preferencesMutex);
+    }
+    
+    // Requests are read one at a time; the read callback is re-enabled once
+    // the response to the current request has been sent
+    CFSocketSetSocketFlags(client->socket,
+                           CFSocketGetSocketFlags(client->socket) & ~kCFSocketAutomaticallyReenableReadCallBack);
+    
+    client->socketSource = CFSocketCreateRunLoopSource(kCFAllocatorDefault,client->socket,0);
+    CFRunLoopAddSource(CFRunLoopGetMain(),client->socketSource,kCFRunLoopDefaultMode);
 }
 
 /*! iSCSI daemon entry point. */
@@ -1935,37 +4425,22 @@ int main(void)
         goto ERROR_PWR_MGMT_FAIL;
     }
     
-    // Context for processing incoming requests. Holds references to CFSocket and
-    // associated structures (e.g., runloop sources)
-    reqInfo = malloc(sizeof(struct iSCSIDIncomingRequestInfo));
-    
     // Create a socket with a callback to accept incoming connections
-    CFSocketContext sockContext;
-    bzero(&sockContext,sizeof(sockContext));
-    sockContext.info = (void*)reqInfo;
-
     CFSocketRef socket = CFSocketCreateWithNative(kCFAllocatorDefault,
                                                   launch_data_get_fd(listen_socket),
                                                   kCFSocketAcceptCallBack,
-                                                  iSCSIDAcceptConnection,&sockContext);
+                                                  iSCSIDAcceptConnection,NULL);
     
     // Runloop source for CFSocket callback (iSCSIDAcceptConnection)
     CFRunLoopSourceRef sockSourceAccept = CFSocketCreateRunLoopSource(kCFAllocatorDefault,socket,0);
     CFRunLoopAddSource(CFRunLoopGetMain(),sockSourceAccept,kCFRunLoopDefaultMode);
     
-    // Runloop source signaled by daemon to queue processing of incoming data
-    CFRunLoopSourceRef sockSourceRead;
-    CFRunLoopSourceContext readContext;
-    bzero(&readContext,sizeof(readContext));
-    readContext.info = (void*)reqInfo;
-    readContext.perform = iSCSIDProcessIncomingRequest;
-    sockSourceRead = CFRunLoopSourceCreate(kCFAllocatorDefault,1,&readContext);
-    CFRunLoopAddSource(CFRunLoopGetMain(),sockSourceRead,kCFRunLoopDefaultMode);
-    
-    // Setup context
-    reqInfo->socket = socket;
-    reqInfo->socketSourceRead = sockSourceRead;
-    reqInfo->fd = 0;
+    // Runloop source signaled by workers when a client request has been processed
+    CFRunLoopSourceContext clientRequestContext;
+    bzero(&clientRequestContext,sizeof(clientRequestContext));
+    clientRequestContext.perform = iSCSIDProcessCompletedClientRequests;
+    clientRequestSource = CFRunLoopSourceCreate(kCFAllocatorDefault,1,&clientRequestContext);
+    CFRunLoopAddSource(CFRunLoopGetMain(),clientRequestSource,kCFRunLoopDefaultMode);
     
     // Runloop source signal by deamoen when discovery data is ready to be processed
     CFRunLoopSourceContext discoveryContext;
@@ -1975,10 +4450,17 @@ int main(void)
     discoverySource = CFRunLoopSourceCreate(kCFAllocatorDefault,1,&discoveryContext);
     CFRunLoopAddSource(CFRunLoopGetMain(),discoverySource,kCFRunLoopDefaultMode);
 
+    // Runloop source signaled by login workers when a login has completed
+    CFRunLoopSourceContext loginContext;
+    bzero(&loginContext,sizeof(loginContext));
+    loginContext.perform = iSCSIDProcessCompletedLogins;
+    loginSource = CFRunLoopSourceCreate(kCFAllocatorDefault,1,&loginContext);
+    CFRunLoopAddSource(CFRunLoopGetMain(),loginSource,kCFRunLoopDefaultMode);
+
     asl_log(NULL,NULL,ASL_LEVEL_INFO,"daemon started");
 
     // Ignore SIGPIPE (generated when the client closes the connection)
-    signal(SIGPIPE,sig_pipe_handler);
+    signal(SIGPIPE,SIG_IGN);
     
     // Setup authorization rights if none exist
     AuthorizationRef authorization;
@@ -1994,6 +4476,12 @@ int main(void)
     
     CFRunLoopRun();
     
+    // Write back pending changes to the preferences
+    iSCSIDFlushPreferences();
+    
+    if(preferencesNotifyToken != NOTIFY_TOKEN_INVALID)
+        notify_cancel(preferencesNotifyToken);
+    
     iSCSISessionManagerUnscheduleWithRunloop(sessionManager,CFRunLoopGetMain(),kCFRunLoopDefaultMode);
     iSCSISessionManagerRelease(sessionManager);
     sessionManager = NULL;
@@ -2001,8 +4489,7 @@ int main(void)
     // Deregister for power
     iSCSIDDeregisterForPowerEvents();
     
-    // Free all CF objects and reqInfo structure...
-    free(reqInfo);
+    // Free all CF objects...
     launch_data_free(reg_response);
     asl_close(log);
     return 0;
@@ -28,6 +28,10 @@
 
 #include "iSCSIDiscovery.h"
 
+#include <pthread.h>
+#include <stdarg.h>
+#include <sys/time.h>
+
 errno_t iSCSIDiscoveryAddTargetForSendTargets(iSCSIPreferencesRef preferences,
                                               CFStringRef targetIQN,
                                               iSCSIDiscoveryRecRef discoveryRec,
@@ -64,30 +68,164 @@ errno_t iSCSIDiscoveryAddTargetForSendTargets(iSCSIPreferencesRef preferences,
     return 0;
 }
 
+/*! Content hashes of the targets found by the most recent discovery of each
+ *  discovery portal.  Keys are discovery portal names and values are
+ *  dictionaries that map target names to hashes (CFNumber).  This is only
+ *  accessed while processing discovery results on the main thread. */
+static CFMutableDictionaryRef discoveryTargetHashes = NULL;
+
+/*! Mixes the bits of a hash value (the finalizer of SplitMix64).
+ *  @param hash the value to mix.
+ *  @return the mixed value. */
+static UInt64 iSCSIDiscoveryHashMix(UInt64 hash)
+{
+    hash ^= hash >> 30;
+    hash *= 0xbf58476d1ce4e5b9ULL;
+    hash ^= hash >> 27;
+    hash *= 0x94d049bb133111ebULL;
+    hash ^= hash >> 31;
+    return hash;
+}
+
+/*! Creates a hash of the portal groups and portals of a discovered target.
+ *  The hash does not depend on the order in which portal groups and portals
+ *  were reported by the target.
+ *  @param discoveryRec the discovery record.
+ *  @param targetIQN the name of the target.
+ *  @return the content hash of the target (a CFNumber). */
+static CFNumberRef iSCSIDiscoveryCreateTargetHash(iSCSIDiscoveryRecRef discoveryRec,
+                                                  CFStringRef targetIQN)
+{
+    UInt64 hash = iSCSIDiscoveryHashMix(CFHash(targetIQN));
+    
+    CFArrayRef portalGroups = iSCSIDiscoveryRecCreateArrayOfPortalGroupTags(discoveryRec,targetIQN);
+    CFIndex portalGroupCount = portalGroups ? CFArrayGetCount(portalGroups) : 0;
+    
+    for(CFIndex portalGroupIdx = 0; portalGroupIdx < portalGroupCount; portalGroupIdx++)
+    {
+        CFStringRef portalGroupTag = CFArrayGetValueAtIndex(portalGroups,portalGroupIdx);
+        CFArrayRef portals = iSCSIDiscoveryRecGetPortals(discoveryRec,targetIQN,portalGroupTag);
+        CFIndex portalsCount = portals ? CFArrayGetCount(portals) : 0;
+        
+        UInt64 portalGroupHash = iSCSIDiscoveryHashMix(CFHash(portalGroupTag));
+        
+        for(CFIndex portalIdx = 0; portalIdx < portalsCount; portalIdx++)
+        {
+            iSCSIPortalRef portal = CFArrayGetValueAtIndex(portals,portalIdx);
+            
+            if(!portal)
+                continue;
+            
+            UInt64 portalHash = iSCSIDiscoveryHashMix(CFHash(iSCSIPortalGetAddress(portal)));
+            portalGroupHash += iSCSIDiscoveryHashMix(portalHash ^ CFHash(iSCSIPortalGetPort(portal)));
+        }
+        
+        hash += iSCSIDiscoveryHashMix(portalGroupHash);
+    }
+    
+    if(portalGroups)
+        CFRelease(portalGroups);
+    
+    SInt64 value = (SInt64)hash;
+    return CFNumberCreate(kCFAllocatorDefault,kCFNumberSInt64Type,&value);
+}
+
+/*! Forgets the discovery results of portals that are no longer configured
+ *  for SendTargets discovery, so that results are not kept for removed
+ *  portals (and a portal that is added again is reconciled in full).
+ *  @param preferences an iSCSI preferences object. */
+void iSCSIDiscoveryPruneTargetHashes(iSCSIPreferencesRef preferences)
+{
+    if(!discoveryTargetHashes || !preferences)
+        return;
+    
+    CFIndex count = CFDictionaryGetCount(discoveryTargetHashes);
+    
+    if(count == 0)
+        return;
+    
+    CFArrayRef portals = iSCSIPreferencesCreateArrayOfPortalsForSendTargetsDiscovery(preferences);
+    CFIndex portalCount = portals ? CFArrayGetCount(portals) : 0;
+    
+    const void * keys[count];
+    CFDictionaryGetKeysAndValues(discoveryTargetHashes,keys,NULL);
+    
+    for(CFIndex idx = 0; idx < count; idx++)
+        if(!portals || !CFArrayContainsValue(portals,CFRangeMake(0,portalCount),keys[idx]))
+            CFDictionaryRemoveValue(discoveryTargetHashes,keys[idx]);
+    
+    if(portals)
+        CFRelease(portals);
+}
+
 /*! Updates an iSCSI preference sobject with information about targets as
- *  contained in the provided discovery record.
+ *  contained in the provided discovery record.  Discovery results are
+ *  compared with those of the previous discovery of the same portal, and
+ *  only targets that were added or changed (or that are missing from the
+ *  preferences) are written to the preferences.
  *  @param preferences an iSCSI preferences object.
  *  @param discoveryPortal the portal (address) that was used to perform discovery.
  *  @param discoveryRec the discovery record resulting from the discovery operation.
+ *  @param preferencesChanged set to true if the preferences were modified
+ *  (unchanged otherwise).
  *  @return an error code indicating the result of the operation. */
 errno_t iSCSIDiscoveryUpdatePreferencesWithDiscoveredTargets(iSCSISessionManagerRef managerRef,
                                                              iSCSIPreferencesRef preferences,
                                                              CFStringRef discoveryPortal,
-                                                             iSCSIDiscoveryRecRef discoveryRec)
+                                                             iSCSIDiscoveryRecRef discoveryRec,
+                                                             Boolean * preferencesChanged)
 {
+    if(!preferences || !discoveryPortal || !discoveryRec || !preferencesChanged)
+        return EINVAL;
+    
     CFArrayRef targets = iSCSIDiscoveryRecCreateArrayOfTargets(discoveryRec);
     
     if(!targets)
         return EINVAL;
     
     CFIndex targetCount = CFArrayGetCount(targets);
-
-    CFMutableDictionaryRef discTargets = CFDictionaryCreateMutable(
-        kCFAllocatorDefault,0,&kCFTypeDictionaryKeyCallBacks,0);
+    
+    if(!discoveryTargetHashes)
+        discoveryTargetHashes = CFDictionaryCreateMutable(kCFAllocatorDefault,0,
+                                                          &kCFTypeDictionaryKeyCallBacks,
+                                                          &kCFTypeDictionaryValueCallBacks);
+    
+    // Hash the discovered targets and compare against the previous results
+    CFDictionaryRef previousHashes = CFDictionaryGetValue(discoveryTargetHashes,discoveryPortal);
+    CFMutableDictionaryRef targetHashes = CFDictionaryCreateMutable(
+        kCFAllocatorDefault,targetCount,&kCFTypeDictionaryKeyCallBacks,&kCFTypeDictionaryValueCallBacks);
+    
+    for(CFIndex targetIdx = 0; targetIdx < targetCount; targetIdx++)
+    {
+        CFStringRef targetIQN = CFArrayGetValueAtIndex(targets,targetIdx);
+        CFNumberRef targetHash = iSCSIDiscoveryCreateTargetHash(discoveryRec,targetIQN);
+        CFDictionarySetValue(targetHashes,targetIQN,targetHash);
+        CFRelease(targetHash);
+    }
+    
+    // Nothing to do if the results haven't changed and the targets are still
+    // in the preferences (they may have been removed by another application)
+    Boolean unchanged = previousHashes && CFEqual(previousHashes,targetHashes);
+    
+    for(CFIndex targetIdx = 0; unchanged && targetIdx < targetCount; targetIdx++)
+        unchanged = iSCSIPreferencesContainsTarget(preferences,CFArrayGetValueAtIndex(targets,targetIdx));
+    
+    if(unchanged) {
+        CFRelease(targetHashes);
+        CFRelease(targets);
+        return 0;
+    }
 
     for(CFIndex targetIdx = 0; targetIdx < targetCount; targetIdx++)
     {
         CFStringRef targetIQN = CFArrayGetValueAtIndex(targets,targetIdx);
+        
+        // Skip targets that are unchanged since the previous discovery
+        CFNumberRef previousHash = previousHashes ? CFDictionaryGetValue(previousHashes,targetIQN) : NULL;
+        
+        if(previousHash && CFEqual(previousHash,CFDictionaryGetValue(targetHashes,targetIQN)) &&
+           iSCSIPreferencesContainsTarget(preferences,targetIQN))
+            continue;
 
         // Target exists with static (or other configuration).  In
         // this case we do nothing, log a message and move on.
@@ -111,6 +249,8 @@ errno_t iSCSIDiscoveryUpdatePreferencesWithDiscoveredTargets(iSCSISessionManager
         // configuration (add or update as necessary)
         else {
             iSCSIDiscoveryAddTargetForSendTargets(preferences,targetIQN,discoveryRec,discoveryPortal);
+            *preferencesChanged = true;
+            
             CFStringRef statusString = CFStringCreateWithFormat(
                 kCFAllocatorDefault,0,
                 CFSTR("discovered target %@ over discovery portal %@."),
@@ -124,17 +264,12 @@ errno_t iSCSIDiscoveryUpdatePreferencesWithDiscoveredTargets(iSCSISessionManager
             
             CFRelease(statusString);
         }
-
-        // As we process each target we'll add it to a temporary dictionary
-        // for cross-checking against targets that exist in our database
-        // which have been removed.
-        CFDictionaryAddValue(discTargets,targetIQN,0);
     }
 
     // Are there any targets that must be removed?  Cross-check existing
-    // list against the list we just built...
+    // list against the targets we just discovered...
     CFArrayRef existingTargets = iSCSIPreferencesCreateArrayOfDynamicTargetsForSendTargets(preferences,discoveryPortal);
-    targetCount = CFArrayGetCount(existingTargets);
+    targetCount = existingTargets ? CFArrayGetCount(existingTargets) : 0;
 
     for(CFIndex targetIdx = 0; targetIdx < targetCount; targetIdx++)
     {
@@ -142,7 +277,7 @@ errno_t iSCSIDiscoveryUpdatePreferencesWithDiscoveredTargets(iSCSISessionManager
 
         // If we have a target that was not discovered, then we need to remove
         // it from our property list...
-        if(!CFDictionaryContainsKey(discTargets,targetIQN)) {
+        if(!CFDictionaryContainsKey(targetHashes,targetIQN)) {
 
             // If the target is logged in, logout of the target and remove it
             SessionIdentifier sessionId = iSCSISessionGetSessionIdForTarget(managerRef,targetIQN);
@@ -151,106 +286,337 @@ errno_t iSCSIDiscoveryUpdatePreferencesWithDiscoveredTargets(iSCSISessionManager
                 iSCSISessionLogout(managerRef,sessionId,&statusCode);
 
             iSCSIPreferencesRemoveTarget(preferences,targetIQN);
+            *preferencesChanged = true;
         }
     }
+    
+    // Remember these results for the next discovery of this portal
+    CFDictionarySetValue(discoveryTargetHashes,discoveryPortal,targetHashes);
 
     CFRelease(targets);
-    CFRelease(discTargets);
-    CFRelease(existingTargets);
+    CFRelease(targetHashes);
+    
+    if(existingTargets)
+        CFRelease(existingTargets);
     
     return 0;
 }
 
-/*! Scans all iSCSI discovery portals found in iSCSI preferences
- *  for targets (SendTargets). Returns a dictionary of key-value pairs
- *  with discovery record objects as values and discovery portal names
- *  as keys.
+/*! Maximum number of discovery portals that are queried concurrently.
+ *  Workers that were abandoned count until they exit. */
+static const unsigned int kiSCSIDiscoveryMaxWorkers = 8;
+
+/*! Protects the discovery passes and their workers, including workers that
+ *  were abandoned by an earlier pass. */
+static pthread_mutex_t discoveryWorkersMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*! Signaled whenever a worker completes or exits. */
+static pthread_cond_t discoveryWorkersCond = PTHREAD_COND_INITIALIZER;
+
+/*! Number of worker threads that have not exited, including workers that
+ *  were abandoned. */
+static unsigned int discoveryRunningWorkers = 0;
+
+/*! Time allowed for SendTargets discovery of a single portal (seconds).  A
+ *  portal that doesn't respond in time is skipped for the current pass. */
+static const time_t kiSCSIDiscoveryPortalTimeoutSec = 30;
+
+/*! State shared by the workers of a single discovery pass.  The state is
+ *  reference counted since a worker that misses its deadline is abandoned
+ *  and may finish after the pass has completed. */
+typedef struct iSCSIDiscoveryPass {
+    
+    /*! Number of references held by the pass and its workers. */
+    unsigned int refCount;
+    
+    /*! Session manager used to query portals. */
+    iSCSISessionManagerRef managerRef;
+    
+    /*! Discovery records, keyed by discovery portal, merged as they arrive. */
+    CFMutableDictionaryRef discoveryRecords;
+    
+    /*! Number of workers that have neither completed nor been abandoned. */
+    unsigned int activeWorkers;
+    
+    /*! Workers, one for each discovery portal. */
+    struct iSCSIDiscoveryWorker * workers;
+    
+} iSCSIDiscoveryPass;
+
+/*! State of a worker that queries a single discovery portal. */
+typedef struct iSCSIDiscoveryWorker {
+    
+    /*! The discovery pass this worker belongs to. */
+    iSCSIDiscoveryPass * pass;
+    
+    /*! Name of the discovery portal (address). */
+    CFStringRef discoveryPortal;
+    
+    /*! The discovery portal to query. */
+    iSCSIPortalRef portal;
+    
+    /*! Time by which the worker must complete. */
+    struct timespec deadline;
+    
+    /*! Set once the worker has completed or has been abandoned. */
+    bool done;
+    
+    /*! Set if the worker missed its deadline; its results are discarded. */
+    bool abandoned;
+    
+} iSCSIDiscoveryWorker;
+
+/*! Logs a formatted message.
+ *  @param level the ASL log level.
+ *  @param format the format string, followed by its arguments. */
+static void iSCSIDiscoveryLog(int level,CFStringRef format,...)
+{
+    va_list arguments;
+    va_start(arguments,format);
+    CFStringRef string = CFStringCreateWithFormatAndArguments(kCFAllocatorDefault,0,format,arguments);
+    va_end(arguments);
+    
+    CFIndex stringLength = CFStringGetMaximumSizeForEncoding(CFStringGetLength(string),kCFStringEncodingASCII) + sizeof('\0');
+    char stringBuffer[stringLength];
+    CFStringGetCString(string,stringBuffer,stringLength,kCFStringEncodingASCII);
+    
+    asl_log(NULL, NULL, level, "%s", stringBuffer);
+    
+    CFRelease(string);
+}
+
+/*! Releases a reference to a discovery pass; the pass is freed once the
+ *  last reference is released.  Must be called with discoveryWorkersMutex
+ *  held, which is released by this function. */
+static void iSCSIDiscoveryPassRelease(iSCSIDiscoveryPass * pass)
+{
+    bool last = (--pass->refCount == 0);
+    pthread_mutex_unlock(&discoveryWorkersMutex);
+    
+    if(!last)
+        return;
+    
+    CFRelease(pass->discoveryRecords);
+    CFAllocatorDeallocate(kCFAllocatorDefault,pass->workers);
+    CFAllocatorDeallocate(kCFAllocatorDefault,pass);
+}
+
+/*! Thread entry point for a worker.  Queries a discovery portal using
+ *  SendTargets and merges the resulting discovery record into the pass.
+ *  @param context the iSCSIDiscoveryWorker to run.
+ *  @return NULL. */
+static void * iSCSIDiscoveryRunWorker(void * context)
+{
+    iSCSIDiscoveryWorker * worker = (iSCSIDiscoveryWorker *)context;
+    iSCSIDiscoveryPass * pass = worker->pass;
+    
+    enum iSCSILoginStatusCode statusCode = kiSCSILoginInvalidStatusCode;
+    iSCSIMutableDiscoveryRecRef discoveryRec = NULL;
+
+    iSCSIAuthRef auth = iSCSIAuthCreateNone();
+    errno_t error = iSCSIQueryPortalForTargets(pass->managerRef,worker->portal,auth,&discoveryRec,&statusCode);
+    iSCSIAuthRelease(auth);
+    
+    pthread_mutex_lock(&discoveryWorkersMutex);
+    
+    // If there was an error, log it and move on to the next portal
+    if(worker->abandoned)
+        iSCSIDiscoveryLog(ASL_LEVEL_INFO,CFSTR("SendTargets discovery of %@ completed after "
+                                               "its deadline; results discarded."),worker->discoveryPortal);
+    else if(error)
+        iSCSIDiscoveryLog(ASL_LEVEL_ERR,CFSTR("system error (code %d) occurred during SendTargets "
+                                              "discovery of %@."),error,worker->discoveryPortal);
+    else if(statusCode != kiSCSILoginSuccess)
+        iSCSIDiscoveryLog(ASL_LEVEL_ERR,CFSTR("login failed with (code %d) during SendTargets "
+                                              "discovery of %@."),statusCode,worker->discoveryPortal);
+    // Queue discovery record so that it can be processed later
+    else if(discoveryRec)
+        CFDictionarySetValue(pass->discoveryRecords,worker->discoveryPortal,discoveryRec);
+    
+    if(!worker->abandoned) {
+        worker->done = true;
+        pass->activeWorkers--;
+    }
+    
+    // A worker that was abandoned frees a slot for the current pass
+    discoveryRunningWorkers--;
+    pthread_cond_broadcast(&discoveryWorkersCond);
+    
+    if(discoveryRec)
+        iSCSIDiscoveryRecRelease(discoveryRec);
+    
+    iSCSIPortalRelease(worker->portal);
+    CFRelease(worker->discoveryPortal);
+    
+    // The worker itself is freed along with the pass
+    iSCSIDiscoveryPassRelease(pass);
+    return NULL;
+}
+
+/*! Creates an array of the iSCSI discovery portals found in iSCSI
+ *  preferences, for use by iSCSIDiscoveryCreateRecordsWithSendTargets().
  *  @param preferences an iSCSI preferences object.
- *  @return a dictionary key-value pairs of dicovery portal names (addresses)
- *  and the discovery records associated with the result of SendTargets
- *  discovery of those portals. */
-CFDictionaryRef iSCSIDiscoveryCreateRecordsWithSendTargets(iSCSISessionManagerRef managerRef,
-                                                           iSCSIPreferencesRef preferences)
+ *  @return an array of portals, or NULL if no discovery portals are defined. */
+CFArrayRef iSCSIDiscoveryCreateArrayOfPortalsForSendTargets(iSCSIPreferencesRef preferences)
 {
     if(!preferences)
         return NULL;
     
-    CFArrayRef portals = iSCSIPreferencesCreateArrayOfPortalsForSendTargetsDiscovery(preferences);
+    CFArrayRef discoveryPortals = iSCSIPreferencesCreateArrayOfPortalsForSendTargetsDiscovery(preferences);
+    
+    if(!discoveryPortals)
+        return NULL;
+    
+    CFIndex portalCount = CFArrayGetCount(discoveryPortals);
+    CFMutableArrayRef portals = CFArrayCreateMutable(kCFAllocatorDefault,portalCount,&kiSCSITypeArrayCallbacks);
+    
+    for(CFIndex idx = 0; idx < portalCount; idx++)
+    {
+        CFStringRef discoveryPortal = CFArrayGetValueAtIndex(discoveryPortals,idx);
+        iSCSIPortalRef portal = iSCSIPreferencesCopySendTargetsDiscoveryPortal(preferences,discoveryPortal);
+        
+        if(portal) {
+            CFArrayAppendValue(portals,portal);
+            iSCSIPortalRelease(portal);
+        }
+    }
     
+    CFRelease(discoveryPortals);
+    return portals;
+}
+
+/*! Scans the specified iSCSI discovery portals for targets (SendTargets).
+ *  Returns a dictionary of key-value pairs with discovery record objects as
+ *  values and discovery portal names as keys.
+ *  @param portals the discovery portals, as created by
+ *  iSCSIDiscoveryCreateArrayOfPortalsForSendTargets().
+ *  @return a dictionary key-value pairs of dicovery portal names (addresses)
+ *  and the discovery records associated with the result of SendTargets
+ *  discovery of those portals. */
+CFDictionaryRef iSCSIDiscoveryCreateRecordsWithSendTargets(iSCSISessionManagerRef managerRef,
+                                                           CFArrayRef portals)
+{
     // Quit if no discovery portals are defined
     if(!portals)
         return NULL;
     
     CFIndex portalCount = CFArrayGetCount(portals);
 
-    CFStringRef discoveryPortal = NULL;
-    iSCSIPortalRef portal = NULL;
-
-    CFMutableDictionaryRef discoveryRecords = CFDictionaryCreateMutable(kCFAllocatorDefault,0,
-                                                                        &kiSCSITypeDictionaryKeyCallbacks,
-                                                                        &kiSCSITypeDictionaryValueCallbacks);
+    iSCSIDiscoveryPass * pass = CFAllocatorAllocate(kCFAllocatorDefault,sizeof(iSCSIDiscoveryPass),0);
+    memset(pass,0,sizeof(iSCSIDiscoveryPass));
+    
+    pass->refCount = 1;
+    pass->managerRef = managerRef;
+    pass->discoveryRecords = CFDictionaryCreateMutable(kCFAllocatorDefault,0,
+                                                       &kiSCSITypeDictionaryKeyCallbacks,
+                                                       &kiSCSITypeDictionaryValueCallbacks);
+    
+    pass->workers = CFAllocatorAllocate(kCFAllocatorDefault,sizeof(iSCSIDiscoveryWorker)*(portalCount+1),0);
+    memset(pass->workers,0,sizeof(iSCSIDiscoveryWorker)*(portalCount+1));
 
-    for(CFIndex idx = 0; idx < portalCount; idx++)
+    pthread_attr_t attribute;
+    pthread_attr_init(&attribute);
+    pthread_attr_setdetachstate(&attribute,PTHREAD_CREATE_DETACHED);
+    
+    pthread_mutex_lock(&discoveryWorkersMutex);
+    
+    CFIndex nextIdx = 0;
+    
+    while(true)
     {
-        discoveryPortal = CFArrayGetValueAtIndex(portals,idx);
-        
-        if(!discoveryPortal)
-            continue;
-        
-        portal = iSCSIPreferencesCopySendTargetsDiscoveryPortal(preferences,discoveryPortal);
-        
-        if(!portal)
-            continue;
-        
-        enum iSCSILoginStatusCode statusCode;
-        iSCSIMutableDiscoveryRecRef discoveryRec;
-
-        // If there was an error, log it and move on to the next portal
-        errno_t error = 0;
-        iSCSIAuthRef auth = iSCSIAuthCreateNone();
-        if((error = iSCSIQueryPortalForTargets(managerRef,portal,auth,&discoveryRec,&statusCode)))
+        // Start workers for the remaining portals as slots become available
+        while(nextIdx < portalCount && discoveryRunningWorkers < kiSCSIDiscoveryMaxWorkers)
         {
-            CFStringRef errorString = CFStringCreateWithFormat(
-                kCFAllocatorDefault,0,
-                CFSTR("system error (code %d) occurred during SendTargets discovery of %@."),
-                error,discoveryPortal);
-
-            CFIndex errorStringLength = CFStringGetMaximumSizeForEncoding(CFStringGetLength(errorString),kCFStringEncodingASCII) + sizeof('\0');
-            char errorStringBuffer[errorStringLength];
-            CFStringGetCString(errorString,errorStringBuffer,errorStringLength,kCFStringEncodingASCII);
+            iSCSIDiscoveryWorker * worker = &pass->workers[nextIdx];
+            iSCSIPortalRef portal = CFArrayGetValueAtIndex(portals,nextIdx);
+            nextIdx++;
+            
+            worker->done = true;
+            
+            if(!portal)
+                continue;
+            
+            CFStringRef discoveryPortal = iSCSIPortalGetAddress(portal);
+            worker->portal = portal;
+            iSCSIPortalRetain(portal);
+            
+            struct timeval now;
+            gettimeofday(&now,NULL);
             
-            asl_log(NULL, NULL, ASL_LEVEL_ERR, "%s", errorStringBuffer);
+            worker->pass = pass;
+            worker->discoveryPortal = CFStringCreateCopy(kCFAllocatorDefault,discoveryPortal);
+            worker->deadline.tv_sec = now.tv_sec + kiSCSIDiscoveryPortalTimeoutSec;
+            worker->deadline.tv_nsec = now.tv_usec * 1000;
+            worker->done = false;
             
-            CFRelease(errorString);
+            pthread_t thread;
+            errno_t error = pthread_create(&thread,&attribute,&iSCSIDiscoveryRunWorker,worker);
+            
+            if(error) {
+                iSCSIDiscoveryLog(ASL_LEVEL_ERR,CFSTR("system error (code %d) occurred starting "
+                                                      "SendTargets discovery of %@."),error,discoveryPortal);
+                iSCSIPortalRelease(worker->portal);
+                CFRelease(worker->discoveryPortal);
+                worker->done = true;
+                continue;
+            }
+            
+            pass->refCount++;
+            pass->activeWorkers++;
+            discoveryRunningWorkers++;
         }
-        else if(statusCode != kiSCSILoginSuccess) {
-            CFStringRef errorString = CFStringCreateWithFormat(
-                kCFAllocatorDefault,0,
-                CFSTR("login failed with (code %d) during SendTargets discovery of %@."),
-                statusCode,discoveryPortal);
+        
+        if(pass->activeWorkers == 0 && nextIdx == portalCount)
+            break;
+        
+        // Wait for a worker to complete or for the earliest deadline to pass
+        struct timespec * deadline = NULL;
+        
+        for(CFIndex idx = 0; idx < nextIdx; idx++) {
+            iSCSIDiscoveryWorker * worker = &pass->workers[idx];
             
-            CFIndex errorStringLength = CFStringGetMaximumSizeForEncoding(CFStringGetLength(errorString),kCFStringEncodingASCII) + sizeof('\0');
-            char errorStringBuffer[errorStringLength];
-            CFStringGetCString(errorString,errorStringBuffer,errorStringLength,kCFStringEncodingASCII);
-
-            asl_log(NULL, NULL, ASL_LEVEL_ERR, "%s", errorStringBuffer);
+            if(worker->done)
+                continue;
             
-            CFRelease(errorString);
+            if(!deadline || worker->deadline.tv_sec < deadline->tv_sec ||
+               (worker->deadline.tv_sec == deadline->tv_sec && worker->deadline.tv_nsec < deadline->tv_nsec))
+                deadline = &worker->deadline;
         }
-        else {
-            // Queue discovery record so that it can be processed later
-            if(discoveryRec) {
-                CFDictionarySetValue(discoveryRecords,discoveryPortal,discoveryRec);
-                iSCSIDiscoveryRecRelease(discoveryRec);
-            }
+        
+        if(!deadline) {
+            pthread_cond_wait(&discoveryWorkersCond,&discoveryWorkersMutex);
+            continue;
         }
         
-        iSCSIAuthRelease(auth);
-        iSCSIPortalRelease(portal);
+        if(pthread_cond_timedwait(&discoveryWorkersCond,&discoveryWorkersMutex,deadline) != ETIMEDOUT)
+            continue;
+        
+        // Abandon workers that have missed their deadline; the portal is
+        // skipped for this pass (its targets are neither added nor removed)
+        struct timeval now;
+        gettimeofday(&now,NULL);
+        
+        for(CFIndex idx = 0; idx < nextIdx; idx++) {
+            iSCSIDiscoveryWorker * worker = &pass->workers[idx];
+            
+            if(worker->done || worker->deadline.tv_sec > now.tv_sec ||
+               (worker->deadline.tv_sec == now.tv_sec && worker->deadline.tv_nsec > now.tv_usec * 1000))
+                continue;
+            
+            iSCSIDiscoveryLog(ASL_LEVEL_ERR,CFSTR("SendTargets discovery of %@ timed out."),
+                              worker->discoveryPortal);
+            
+            worker->abandoned = true;
+            worker->done = true;
+            pass->activeWorkers--;
+        }
     }
     
-    // Release the array of discovery portals
-    CFRelease(portals);
+    pthread_attr_destroy(&attribute);
+    
+    // Workers that were abandoned no longer modify the records
+    CFDictionaryRef discoveryRecords = CFDictionaryCreateCopy(kCFAllocatorDefault,pass->discoveryRecords);
+    iSCSIDiscoveryPassRelease(pass);
     
     return discoveryRecords;
 }
@@ -37,26 +37,46 @@
 #include "iSCSIPreferences.h"
 
 
-/*! Scans all iSCSI discovery portals found in iSCSI preferences
- *  for targets (SendTargets). Returns a dictionary of key-value pairs
- *  with discovery record objects as values and discovery portal names
- *  as keys.
+/*! Creates an array of the iSCSI discovery portals found in iSCSI
+ *  preferences, for use by iSCSIDiscoveryCreateRecordsWithSendTargets().
+ *  The preferences are only read by this function, so that discovery can
+ *  run on another thread while the preferences change.
  *  @param preferences an iSCSI preferences object.
+ *  @return an array of portals, or NULL if no discovery portals are defined. */
+CFArrayRef iSCSIDiscoveryCreateArrayOfPortalsForSendTargets(iSCSIPreferencesRef preferences);
+
+/*! Scans the specified iSCSI discovery portals for targets (SendTargets).
+ *  Returns a dictionary of key-value pairs with discovery record objects as
+ *  values and discovery portal names as keys.
+ *  @param portals the discovery portals, as created by
+ *  iSCSIDiscoveryCreateArrayOfPortalsForSendTargets().
  *  @return a dictionary key-value pairs of dicovery portal names (addresses)
  *  and the discovery records associated with the result of SendTargets
  *  discovery of those portals. */
 CFDictionaryRef iSCSIDiscoveryCreateRecordsWithSendTargets(iSCSISessionManagerRef managerRef,
-                                                           iSCSIPreferencesRef preferences);
+                                                           CFArrayRef portals);
 
 /*! Updates an iSCSI preference sobject with information about targets as
- *  contained in the provided discovery record.
+ *  contained in the provided discovery record.  Discovery results are
+ *  compared with those of the previous discovery of the same portal, and
+ *  only targets that were added or changed (or that are missing from the
+ *  preferences) are written to the preferences.
  *  @param preferences an iSCSI preferences object.
  *  @param discoveryPortal the portal (address) that was used to perform discovery.
  *  @param discoveryRec the discovery record resulting from the discovery operation.
+ *  @param preferencesChanged set to true if the preferences were modified
+ *  (unchanged otherwise).
  *  @return an error code indicating the result of the operation. */
 errno_t iSCSIDiscoveryUpdatePreferencesWithDiscoveredTargets(iSCSISessionManagerRef managerRef,
                                                              iSCSIPreferencesRef preferences,
                                                              CFStringRef discoveryPortal,
-                                                             iSCSIDiscoveryRecRef discoveryRec);
+                                                             iSCSIDiscoveryRecRef discoveryRec,
+                                                             Boolean * preferencesChanged);
+
+/*! Forgets the discovery results of portals that are no longer configured
+ *  for SendTargets discovery.  Invoked when the preferences are reloaded,
+ *  since discovery portals are removed by other applications.
+ *  @param preferences an iSCSI preferences object. */
+void iSCSIDiscoveryPruneTargetHashes(iSCSIPreferencesRef preferences);
 
 #endif /* defined(__ISCSI_DISCOVERY_H__) */
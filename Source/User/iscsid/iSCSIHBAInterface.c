@@ -28,6 +28,8 @@
 
 #include "iSCSIHBAInterface.h"
 #include "iSCSIHBATypes.h"
+#include "iSCSIHBANotificationRing.h"
+#include "iSCSIPDUValidation.h"
 #include "iSCSIPDUUser.h"
 
 #include <IOKit/IOKitLib.h>
@@ -50,6 +52,10 @@ struct __iSCSIHBAInterface {
     /*! Mach port used to receive notifications. */
     CFMachPortRef  notificationPort;
     
+    /*! Ring of notifications mapped from the kernel, or NULL if the ring
+     *  could not be mapped (notifications are then sent as messages). */
+    iSCSIHBANotificationRing * notificationRing;
+    
     /*! Callback that will handle kernel notifications. */
     iSCSIHBANotificationCallBack callback;
     
@@ -57,6 +63,33 @@ struct __iSCSIHBAInterface {
     struct __iSCSIHBANotificationContext notifyContext;
 };
 
+/*! Passes a notification to the callback of an interface.  Asynchronous
+ *  messages carry the event and LUN in the notification parameters and are
+ *  unpacked into an iSCSIHBANotificationAsyncMessage. */
+static void iSCSIHBAInterfaceDeliverNotification(iSCSIHBAInterfaceRef interface,
+                                                 iSCSIHBANotificationMessage * notificationMsg)
+{
+    // Process notification type and return if invalid
+    enum iSCSIHBANotificationTypes type = (enum iSCSIHBANotificationTypes)notificationMsg->notificationType;
+    
+    if(type >= kiSCSIHBANotificationRingUpdated || !interface->callback)
+        return;
+    
+    if(type == kiSCSIHBANotificationAsyncMessage) {
+        iSCSIHBANotificationAsyncMessage asyncMsg;
+        asyncMsg.notificationType = notificationMsg->notificationType;
+        asyncMsg.asyncEvent = notificationMsg->parameter1;
+        asyncMsg.LUN = notificationMsg->parameter2;
+        asyncMsg.sessionId = notificationMsg->sessionId;
+        asyncMsg.connectionId = notificationMsg->connectionId;
+        
+        interface->callback(interface,type,(iSCSIHBANotificationMessage *)&asyncMsg,
+                            interface->notifyContext.info);
+    }
+    else
+        interface->callback(interface,type,notificationMsg,interface->notifyContext.info);
+}
+
 /*! Handles messages sent from the HBA. This is an internal handler that is called first
  *  to adhere to the required Mach callback prototype. The info parameter contains 
  *  information about an iSCSIHBAInterface instance (which includes user-defined data). */
@@ -66,17 +99,38 @@ static void iSCSIHBANotificationHandler(CFMachPortRef port,void * msg,CFIndex si
     iSCSIHBANotificationMessage * notificationMsg;
     if(!(notificationMsg = msg))
         return;
-
-    // Process notification type and return if invalid
-    enum iSCSIHBANotificationTypes type = (enum iSCSIHBANotificationTypes)notificationMsg->notificationType;
     
-    if(type == kiSCSIHBANotificationInvalid)
-        return;
-    
-    // Call the callback function with the message type and body
     iSCSIHBAInterfaceRef interface = (iSCSIHBAInterfaceRef)info;
-    if(interface->callback)
-        interface->callback(interface,type,msg,interface->notifyContext.info);
+    
+    // Drain the notification ring on every message: entries queued before
+    // a notification that was sent as a message must be handled first, and
+    // any message may stand in for a signal that was not delivered
+    if(interface->notificationRing) {
+        iSCSIHBANotificationRingEntry entry;
+        iSCSIHBANotificationMessage ringMsg;
+        memset(&ringMsg,0,sizeof(ringMsg));
+        
+        while(iSCSIHBANotificationRingPop(interface->notificationRing,&entry)) {
+            ringMsg.notificationType = entry.notificationType;
+            ringMsg.parameter1 = entry.parameter1;
+            ringMsg.parameter2 = entry.parameter2;
+            ringMsg.sessionId = entry.sessionId;
+            ringMsg.connectionId = entry.connectionId;
+            
+            iSCSIHBAInterfaceDeliverNotification(interface,&ringMsg);
+        }
+    }
+    
+    // The kernel queues notifications in the ring again once every message
+    // that bypassed it has been acknowledged; entries it queues from then on
+    // are only seen after this message is handled (the callback may release
+    // the interface, so acknowledge the message first)
+    if(interface->notificationRing &&
+       notificationMsg->header.msgh_id == kiSCSIHBANotificationBypassMessageId)
+        iSCSIHBANotificationRingBypassReceived(interface->notificationRing);
+    
+    if(notificationMsg->notificationType != kiSCSIHBANotificationRingUpdated)
+        iSCSIHBAInterfaceDeliverNotification(interface,notificationMsg);
 }
 
 /*! Schedules execution of various tasks, including handling of kernel notifications
@@ -151,6 +205,24 @@ iSCSIHBAInterfaceRef iSCSIHBAInterfaceCreate(CFAllocatorRef allocator,iSCSIHBANo
         result = IOConnectSetNotificationPort(connect,0,CFMachPortGetPort(notificationPort),0);
     }
     
+    // Map the notification ring; notifications are sent as messages if
+    // this fails (e.g., with an older kernel extension)
+    interface->notificationRing = NULL;
+    
+    if(result == kIOReturnSuccess) {
+        mach_vm_address_t ringAddress = 0;
+        mach_vm_size_t ringSize = 0;
+        
+        if(IOConnectMapMemory64(connect,kiSCSIHBAMemoryNotificationRing,mach_task_self(),
+                                &ringAddress,&ringSize,kIOMapAnywhere) == kIOReturnSuccess)
+        {
+            if(ringSize >= sizeof(iSCSIHBANotificationRing))
+                interface->notificationRing = (iSCSIHBANotificationRing *)ringAddress;
+            else
+                IOConnectUnmapMemory64(connect,kiSCSIHBAMemoryNotificationRing,mach_task_self(),ringAddress);
+        }
+    }
+    
     if(result == kIOReturnSuccess) {
         interface->allocator = allocator;
         interface->service = service;
@@ -193,6 +265,11 @@ void iSCSIHBAInterfaceRelease(iSCSIHBAInterfaceRef interface)
     // Close connection to the driver
     IOConnectCallScalarMethod(interface->connect,kiSCSICloseInitiator,0,0,0,0);
     
+    // Unmap the notification ring
+    if(interface->notificationRing)
+        IOConnectUnmapMemory64(interface->connect,kiSCSIHBAMemoryNotificationRing,mach_task_self(),
+                               (mach_vm_address_t)interface->notificationRing);
+    
 	// Clean up (now that we have a connection we no longer need the object)
     IOServiceClose(interface->connect);
     
@@ -516,6 +593,37 @@ IOReturn iSCSIHBAInterfaceReleaseConnection(iSCSIHBAInterfaceRef interface,
     return IOConnectCallScalarMethod(interface->connect,kiSCSIReleaseConnection,inputs,inputCnt,0,0);
 }
 
+/*! Helper function that checks the header of a PDU received by the kernel
+ *  against the data segment returned with it.
+ *  @param bhs the basic header segment that was received.
+ *  @param capacity the size of the buffer that was supplied for the data.
+ *  @param length the length of the data segment that was returned.
+ *  @return kIOReturnSuccess if the PDU is consistent. */
+static IOReturn iSCSIHBAInterfaceValidatePDU(const iSCSIPDUTargetBHS * bhs,size_t capacity,size_t length)
+{
+    iSCSIPDUFrame frame;
+    
+    if(capacity > UINT32_MAX)
+        capacity = UINT32_MAX;
+    
+    if(!iSCSIPDUFrameDecode(bhs,(uint32_t)capacity,&frame) || frame.dataSegmentLength != length)
+        return kIOReturnIOError;
+    
+    return kIOReturnSuccess;
+}
+
+/*! Helper function that packs a basic header segment into scalar inputs
+ *  following the session and connection identifiers. */
+static void iSCSIHBAInterfacePackBHS(UInt64 * inputs,
+                                     SessionIdentifier sessionId,
+                                     ConnectionIdentifier connectionId,
+                                     iSCSIPDUInitiatorBHS * bhs)
+{
+    inputs[0] = sessionId;
+    inputs[1] = connectionId;
+    memcpy(&inputs[2],bhs,kiSCSIPDUBasicHeaderSegmentSize);
+}
+
 /*! Sends data over a kernel socket associated with iSCSI.
  *  @param interface an instance of an iSCSIHBAInterface.
  *  @param sessionId the qualifier part of the ISID (see RFC3720).
@@ -535,20 +643,14 @@ IOReturn iSCSIHBAInterfaceSend(iSCSIHBAInterfaceRef interface,
     if(!interface || sessionId == kiSCSIInvalidSessionId || connectionId == kiSCSIInvalidConnectionId || !bhs || (!data && length > 0))
         return kIOReturnBadArgument;
     
-    // Setup input scalar array
-    const UInt32 inputCnt = 2;
-    const UInt64 inputs[] = {sessionId, connectionId};
-    
-    // Call kernel method to send (buffer) bhs and then data
-    kern_return_t result;
-    result = IOConnectCallStructMethod(interface->connect,kiSCSISendBHS,bhs,
-                                       sizeof(iSCSIPDUInitiatorBHS),NULL,NULL);
-    
-    if(result != kIOReturnSuccess)
-        return result;
+    // Setup input scalar array (session, connection and header)
+    const UInt32 inputCnt = 2 + kiSCSIHBABHSScalarCount;
+    UInt64 inputs[inputCnt];
+    iSCSIHBAInterfacePackBHS(inputs,sessionId,connectionId,bhs);
     
-    return IOConnectCallMethod(interface->connect,kiSCSISendData,inputs,inputCnt,
-                                               data,length,NULL,NULL,NULL,NULL);
+    // Call kernel method to send header and data
+    return IOConnectCallMethod(interface->connect,kiSCSISendPDU,inputs,inputCnt,
+                               data,length,NULL,NULL,NULL,NULL);
 }
 
 /*! Receives data over a kernel socket associated with iSCSI.
@@ -556,55 +658,90 @@ IOReturn iSCSIHBAInterfaceSend(iSCSIHBAInterfaceRef interface,
  *  @param sessionId the qualifier part of the ISID (see RFC3720).
  *  @param connectionId the connection associated with the session.
  *  @param bhs the basic header segment received over the connection.
- *  @param data the data segment of the PDU received over the connection.
- *  @param length the length of the data block received.
+ *  @param data a buffer to hold the data segment of the PDU.
+ *  @param length the size of the buffer; on return the length of the
+ *  data segment received.
  *  @return error code indicating result of operation. */
 IOReturn iSCSIHBAInterfaceReceive(iSCSIHBAInterfaceRef interface,
                                   SessionIdentifier sessionId,
                                   ConnectionIdentifier connectionId,
                                   iSCSIPDUTargetBHS * bhs,
-                                  void ** data,
+                                  void * data,
                                   size_t * length)
 {
     // Check parameters
-    if(!interface || sessionId == kiSCSIInvalidSessionId || connectionId == kiSCSIInvalidConnectionId || !bhs)
+    if(!interface || sessionId == kiSCSIInvalidSessionId || connectionId == kiSCSIInvalidConnectionId || !bhs || !length || (!data && *length > 0))
         return kIOReturnBadArgument;
     
     // Setup input scalar array
     const UInt32 inputCnt = 2;
     UInt64 inputs[] = {sessionId,connectionId};
     
-    size_t bhsLength = sizeof(iSCSIPDUTargetBHS);
+    UInt32 outputCnt = kiSCSIHBABHSScalarCount;
+    UInt64 outputs[kiSCSIHBABHSScalarCount];
+    size_t capacity = *length;
 
-    // Call kernel method to determine how much data there is to receive
-    // The inputs are the sesssion qualifier and connection ID
-    // The output is the size of the buffer we need to allocate to hold the data
+    // Call kernel method to receive header and data; the header is returned
+    // in the scalar outputs and the data segment in the caller's buffer
     kern_return_t result;
-    result = IOConnectCallMethod(interface->connect,kiSCSIRecvBHS,inputs,inputCnt,NULL,0,
-                                 NULL,NULL,bhs,&bhsLength);
+    result = IOConnectCallMethod(interface->connect,kiSCSIRecvPDU,inputs,inputCnt,NULL,0,
+                                 outputs,&outputCnt,data,length);
     
-    if(result != kIOReturnSuccess)
-        return result;
+    if(result == kIOReturnSuccess) {
+        memcpy(bhs,outputs,kiSCSIPDUBasicHeaderSegmentSize);
+        result = iSCSIHBAInterfaceValidatePDU(bhs,capacity,*length);
+    }
     
-    // Determine how much data to allocate for the data buffer
-    *length = iSCSIPDUGetDataSegmentLength((iSCSIPDUCommonBHS *)bhs);
+    return result;
+}
+
+/*! Sends a PDU and receives the response PDU (e.g., a login or text
+ *  request and response) over a kernel socket associated with iSCSI.
+ *  @param interface an instance of an iSCSIHBAInterface.
+ *  @param sessionId the qualifier part of the ISID (see RFC3720).
+ *  @param connectionId the connection associated with the session.
+ *  @param bhs the basic header segment to send over the connection.
+ *  @param data the data segment of the PDU to send over the connection.
+ *  @param length the length of the data block to send over the connection.
+ *  @param rspBHS the basic header segment received over the connection.
+ *  @param rspData a buffer to hold the data segment of the response.
+ *  @param rspLength the size of the response buffer; on return the length
+ *  of the data segment received.
+ *  @return error code indicating result of operation. */
+IOReturn iSCSIHBAInterfaceExchange(iSCSIHBAInterfaceRef interface,
+                                   SessionIdentifier sessionId,
+                                   ConnectionIdentifier connectionId,
+                                   iSCSIPDUInitiatorBHS * bhs,
+                                   void * data,
+                                   size_t length,
+                                   iSCSIPDUTargetBHS * rspBHS,
+                                   void * rspData,
+                                   size_t * rspLength)
+{
+    // Check parameters
+    if(!interface || sessionId == kiSCSIInvalidSessionId || connectionId == kiSCSIInvalidConnectionId || !bhs || (!data && length > 0))
+        return kIOReturnBadArgument;
     
-    // If no data, were done at this point
-    if(*length == 0)
-        return 0;
+    if(!rspBHS || !rspLength || (!rspData && *rspLength > 0))
+        return kIOReturnBadArgument;
     
-    *data = iSCSIPDUDataCreate(*length);
-        
-    if(*data == NULL)
-        return kIOReturnIOError;
+    // Setup input scalar array (session, connection and header)
+    const UInt32 inputCnt = 2 + kiSCSIHBABHSScalarCount;
+    UInt64 inputs[inputCnt];
+    iSCSIHBAInterfacePackBHS(inputs,sessionId,connectionId,bhs);
     
-    // Call kernel method to get data from a receive buffer
-    result = IOConnectCallMethod(interface->connect,kiSCSIRecvData,inputs,inputCnt,NULL,0,
-                                 NULL,NULL,*data,length);
-
-    // If we failed, free the temporary buffer and quit with error
-    if(result != kIOReturnSuccess)
-        iSCSIPDUDataRelease(data);
+    UInt32 outputCnt = kiSCSIHBABHSScalarCount;
+    UInt64 outputs[kiSCSIHBABHSScalarCount];
+    size_t capacity = *rspLength;
+    
+    kern_return_t result;
+    result = IOConnectCallMethod(interface->connect,kiSCSIExchangePDU,inputs,inputCnt,data,length,
+                                 outputs,&outputCnt,rspData,rspLength);
+    
+    if(result == kIOReturnSuccess) {
+        memcpy(rspBHS,outputs,kiSCSIPDUBasicHeaderSegmentSize);
+        result = iSCSIHBAInterfaceValidatePDU(rspBHS,capacity,*rspLength);
+    }
     
     return result;
 }
@@ -1066,3 +1203,91 @@ CFStringRef iSCSIHBAInterfaceCreateHostInterfaceForConnectionId(iSCSIHBAInterfac
     
     return CFStringCreateWithCString(kCFAllocatorDefault,hostInterface,kCFStringEncodingASCII);
 }
+
+/*! Creates a data object containing the PDU trace of a connection.  The data
+ *  is an array of iSCSIHBAPDUTraceRecord structures, oldest record first.
+ *  @param interface an instance of an iSCSIHBAInterface.
+ *  @param sessionId session identifier.
+ *  @param connectionId connection identifier.
+ *  @param totalRecords the total number of records traced over the lifetime
+ *  of the connection (used to detect records that were overwritten).  This
+ *  parameter is optional and may be NULL.
+ *  @return a data object containing trace records, or NULL if the session
+ *  or connection was invalid. */
+CFDataRef iSCSIHBAInterfaceCreatePDUTrace(iSCSIHBAInterfaceRef interface,
+                                          SessionIdentifier sessionId,
+                                          ConnectionIdentifier connectionId,
+                                          UInt32 * totalRecords)
+{
+    if(!interface || sessionId == kiSCSIInvalidSessionId || connectionId == kiSCSIInvalidConnectionId)
+        return NULL;
+    
+    const UInt32 inputCnt = 2;
+    UInt64 input[] = {sessionId,connectionId};
+    
+    const UInt32 expOutputCnt = 2;
+    UInt64 output[expOutputCnt];
+    UInt32 outputCnt = expOutputCnt;
+    
+    size_t traceSize = sizeof(iSCSIHBAPDUTraceRecord)*kiSCSIHBAPDUTraceRecordCount;
+    CFMutableDataRef trace = CFDataCreateMutable(interface->allocator,traceSize);
+    CFDataSetLength(trace,traceSize);
+    
+    kern_return_t result = IOConnectCallMethod(interface->connect,kiSCSIGetPDUTrace,
+                                               input,inputCnt,0,0,output,&outputCnt,
+                                               CFDataGetMutableBytePtr(trace),&traceSize);
+    
+    if(result != kIOReturnSuccess || outputCnt != expOutputCnt) {
+        CFRelease(trace);
+        return NULL;
+    }
+    
+    CFDataSetLength(trace,(CFIndex)(output[0]*sizeof(iSCSIHBAPDUTraceRecord)));
+    
+    if(totalRecords)
+        *totalRecords = (UInt32)output[1];
+    
+    return trace;
+}
+
+/*! Creates a data object containing snapshots of the parameters and counters
+ *  of one or all sessions.  The data is an array of iSCSIHBASessionSnapshot
+ *  structures, in order of session identifier.
+ *  @param interface an instance of an iSCSIHBAInterface.
+ *  @param sessionId session identifier, or kiSCSIInvalidSessionId to get
+ *  snapshots of all sessions.
+ *  @return a data object containing session snapshots, or NULL if the
+ *  session was invalid or the kernel extension uses a different snapshot
+ *  layout. */
+CFDataRef iSCSIHBAInterfaceCreateSessionSnapshots(iSCSIHBAInterfaceRef interface,
+                                                  SessionIdentifier sessionId)
+{
+    if(!interface)
+        return NULL;
+    
+    const UInt32 inputCnt = 1;
+    UInt64 input[] = {sessionId};
+    
+    const UInt32 expOutputCnt = 2;
+    UInt64 output[2];
+    UInt32 outputCnt = expOutputCnt;
+    
+    size_t count = (sessionId == kiSCSIInvalidSessionId) ? kiSCSIMaxSessions : 1;
+    size_t snapshotsSize = sizeof(iSCSIHBASessionSnapshot)*count;
+    CFMutableDataRef snapshots = CFDataCreateMutable(interface->allocator,snapshotsSize);
+    CFDataSetLength(snapshots,snapshotsSize);
+    
+    kern_return_t result = IOConnectCallMethod(interface->connect,kiSCSIGetSessionSnapshots,
+                                               input,inputCnt,0,0,output,&outputCnt,
+                                               CFDataGetMutableBytePtr(snapshots),&snapshotsSize);
+    
+    if(result != kIOReturnSuccess || outputCnt != expOutputCnt ||
+       output[0] != kiSCSIHBASnapshotVersion || output[1] > count)
+    {
+        CFRelease(snapshots);
+        return NULL;
+    }
+    
+    CFDataSetLength(snapshots,(CFIndex)(output[1]*sizeof(iSCSIHBASessionSnapshot)));
+    return snapshots;
+}
@@ -32,6 +32,7 @@
 #include "iSCSIHBATypes.h"
 #include "iSCSITypesShared.h"
 #include "iSCSIPDUShared.h"
+#include "iSCSIRFC3720Defaults.h"
 #include <sys/socket.h>
 #include <sys/errno.h>
 #include <netinet/in.h>
@@ -44,6 +45,11 @@
 
 typedef struct __iSCSIHBAInterface * iSCSIHBAInterfaceRef;
 
+/*! Size of a buffer large enough to hold the data segment of any PDU
+ *  received with iSCSIHBAInterfaceReceive().  This is the
+ *  MaxRecvDataSegmentLength declared by the initiator during login. */
+#define kiSCSIHBAInterfaceMaxRecvDataLength kRFC3720_MaxRecvDataSegmentLength
+
 /*! Notification context that is used when creating a new HBA
  *  instance. This struct is used to pass user-defined data
  *  when the iSCSIHBANotification callback functions are called. */
@@ -209,24 +215,49 @@ IOReturn iSCSIHBAInterfaceSend(iSCSIHBAInterfaceRef interface,
                                void * data,
                                size_t length);
 
-/*! Receives data over a kernel socket associated with iSCSI.  Function will
- *  receive the ENTIRE data segment of a PDU at once, and return the length
- *  of the buffer in length. This length includes any padding required to
- *  achieve 4-byte alignement required of PDUs.
+/*! Receives a PDU over a kernel socket associated with iSCSI.  The header
+ *  and the ENTIRE data segment of the PDU are received with a single call
+ *  into the kernel.  The data segment is placed in the caller's buffer,
+ *  which should be large enough to hold the largest data segment the
+ *  initiator declared it can receive (kiSCSIHBAInterfaceMaxRecvDataLength).
  *  @param interface an instance of an iSCSIHBAInterface.
  *  @param sessionId the qualifier part of the ISID (see RFC3720).
  *  @param connectionId the connection associated with the session.
  *  @param bhs the basic header segment received over the connection.
- *  @param data the data segment of the PDU received over the connection.
- *  @param length the length of the data block received.
+ *  @param data a buffer to hold the data segment of the PDU.
+ *  @param length the size of the buffer; on return the length of the
+ *  data segment received (excluding padding).
  *  @return error code indicating result of operation. */
 IOReturn iSCSIHBAInterfaceReceive(iSCSIHBAInterfaceRef interface,
                                   SessionIdentifier sessionId,
                                   ConnectionIdentifier connectionId,
                                   iSCSIPDUTargetBHS * bhs,
-                                  void * * data,
+                                  void * data,
                                   size_t * length);
 
+/*! Sends a PDU and receives the response PDU (e.g., a login or text
+ *  request and response) with a single call into the kernel.
+ *  @param interface an instance of an iSCSIHBAInterface.
+ *  @param sessionId the qualifier part of the ISID (see RFC3720).
+ *  @param connectionId the connection associated with the session.
+ *  @param bhs the basic header segment to send over the connection.
+ *  @param data the data segment of the PDU to send over the connection.
+ *  @param length the length of the data block to send over the connection.
+ *  @param rspBHS the basic header segment received over the connection.
+ *  @param rspData a buffer to hold the data segment of the response.
+ *  @param rspLength the size of the response buffer; on return the length
+ *  of the data segment received (excluding padding).
+ *  @return error code indicating result of operation. */
+IOReturn iSCSIHBAInterfaceExchange(iSCSIHBAInterfaceRef interface,
+                                   SessionIdentifier sessionId,
+                                   ConnectionIdentifier connectionId,
+                                   iSCSIPDUInitiatorBHS * bhs,
+                                   void * data,
+                                   size_t length,
+                                   iSCSIPDUTargetBHS * rspBHS,
+                                   void * rspData,
+                                   size_t * rspLength);
+
 /*! Sets parameter associated with a particular connection.
  *  @param interface an instance of an iSCSIHBAInterface.
  *  @param sessionId the qualifier part of the ISID (see RFC3720).
@@ -386,5 +417,32 @@ CFStringRef iSCSIHBAInterfaceCreateHostInterfaceForConnectionId(iSCSIHBAInterfac
                                                                 SessionIdentifier sessionId,
                                                                 ConnectionIdentifier connectionId);
 
+/*! Creates a data object containing the PDU trace of a connection.  The data
+ *  is an array of iSCSIHBAPDUTraceRecord structures, oldest record first.
+ *  @param interface an instance of an iSCSIHBAInterface.
+ *  @param sessionId session identifier.
+ *  @param connectionId connection identifier.
+ *  @param totalRecords the total number of records traced over the lifetime
+ *  of the connection (used to detect records that were overwritten).  This
+ *  parameter is optional and may be NULL.
+ *  @return a data object containing trace records, or NULL if the session
+ *  or connection was invalid. */
+CFDataRef iSCSIHBAInterfaceCreatePDUTrace(iSCSIHBAInterfaceRef interface,
+                                          SessionIdentifier sessionId,
+                                          ConnectionIdentifier connectionId,
+                                          UInt32 * totalRecords);
+
+/*! Creates a data object containing snapshots of the parameters and counters
+ *  of one or all sessions.  The data is an array of iSCSIHBASessionSnapshot
+ *  structures, in order of session identifier.
+ *  @param interface an instance of an iSCSIHBAInterface.
+ *  @param sessionId session identifier, or kiSCSIInvalidSessionId to get
+ *  snapshots of all sessions.
+ *  @return a data object containing session snapshots, or NULL if the
+ *  session was invalid or the kernel extension uses a different snapshot
+ *  layout. */
+CFDataRef iSCSIHBAInterfaceCreateSessionSnapshots(iSCSIHBAInterfaceRef interface,
+                                                  SessionIdentifier sessionId);
+
 
 #endif /* defined(__ISCSI_HBA_INTERFACE_H__) */
@@ -0,0 +1,228 @@
+/*
+ * Copyright (c) 2016, Nareg Sinenian
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __ISCSI_PDU_TEXT_H__
+#define __ISCSI_PDU_TEXT_H__
+
+// Scanning of key=value pairs in the data segment of login and text PDUs.
+// This header depends only on the C library so that the scanner can be
+// built and benchmarked on any platform; CoreFoundation objects are created
+// by the callers, and only for the pairs they consume.
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*! A span of bytes within a PDU data segment (not null-terminated). */
+typedef struct iSCSIPDUTextSpan {
+    
+    /*! First byte of the span. */
+    const uint8_t * bytes;
+    
+    /*! Number of bytes in the span. */
+    size_t length;
+    
+} iSCSIPDUTextSpan;
+
+/*! Gets the next key=value pair from a data segment.  Pairs are terminated by
+ *  a null character, and only the first '=' separates the key from the value
+ *  (values such as base64-encoded CHAP parameters may contain '=').  Tokens
+ *  without an '=' (e.g., padding) are skipped, as is a trailing pair that
+ *  is not null-terminated.  The returned spans point into the data segment.
+ *  @param data the data segment.
+ *  @param length the length of the data segment.
+ *  @param offset the offset at which to start scanning (start with zero);
+ *  this is advanced past the returned pair.
+ *  @param key the key of the pair (returned).
+ *  @param value the value of the pair (returned).
+ *  @return a non-zero value if a pair was found, or zero if there are no
+ *  more pairs in the data segment. */
+static inline int iSCSIPDUTextGetNextPair(const void * data,
+                                          size_t length,
+                                          size_t * offset,
+                                          iSCSIPDUTextSpan * key,
+                                          iSCSIPDUTextSpan * value)
+{
+    const uint8_t * bytes = (const uint8_t *)data;
+    
+    while(*offset < length)
+    {
+        const uint8_t * token = bytes + *offset;
+        
+        // memchr() is vectorized by the C library on all supported platforms
+        const uint8_t * end = (const uint8_t *)memchr(token,0,length - *offset);
+        
+        if(!end) {
+            *offset = length;
+            break;
+        }
+        
+        *offset = (size_t)(end - bytes) + 1;
+        
+        const uint8_t * equal = (const uint8_t *)memchr(token,'=',(size_t)(end - token));
+        
+        if(equal) {
+            key->bytes = token;
+            key->length = (size_t)(equal - token);
+            value->bytes = equal + 1;
+            value->length = (size_t)(end - equal - 1);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*! Compares a span to a null-terminated string.
+ *  @param span the span to compare.
+ *  @param string the string to compare against.
+ *  @return a non-zero value if the span and the string are equal. */
+static inline int iSCSIPDUTextSpanEqualsString(const iSCSIPDUTextSpan * span,const char * string)
+{
+    size_t stringLength = strlen(string);
+    return span->length == stringLength && memcmp(span->bytes,string,stringLength) == 0;
+}
+
+/*! Finds the first (or last) occurrence of a character in a span.
+ *  @param span the span to search.
+ *  @param character the character to find.
+ *  @param backwards a non-zero value to find the last occurrence.
+ *  @return the offset of the character within the span, or the length of
+ *  the span if the character was not found. */
+static inline size_t iSCSIPDUTextSpanFind(const iSCSIPDUTextSpan * span,uint8_t character,int backwards)
+{
+    if(!backwards) {
+        const uint8_t * found = (const uint8_t *)memchr(span->bytes,character,span->length);
+        return found ? (size_t)(found - span->bytes) : span->length;
+    }
+    
+    for(size_t idx = span->length; idx > 0; idx--)
+        if(span->bytes[idx-1] == character)
+            return idx - 1;
+    
+    return span->length;
+}
+
+/*! Maximum length of a key=value pair (including the null terminator) that
+ *  may be carried from one data segment to the next.  Longer pairs that
+ *  span data segments are discarded. */
+#define kiSCSIPDUTextStreamMaxCarryLength 8192
+
+/*! State used to scan a sequence of data segments (e.g., text responses with
+ *  the continue bit set) where a key=value pair may span data segments. */
+typedef struct iSCSIPDUTextStream {
+    
+    /*! Unterminated pair carried over from the previous data segment. */
+    uint8_t carry[kiSCSIPDUTextStreamMaxCarryLength];
+    
+    /*! Number of bytes in the carry buffer. */
+    size_t carryLength;
+    
+    /*! Set if the pair being carried did not fit and is being skipped. */
+    int discard;
+    
+} iSCSIPDUTextStream;
+
+/*! Function invoked for each key=value pair found in a stream. */
+typedef void (*iSCSIPDUTextStreamCallback)(void * context,
+                                           const iSCSIPDUTextSpan * key,
+                                           const iSCSIPDUTextSpan * value);
+
+/*! Initializes a stream before the first data segment is scanned.
+ *  @param stream the stream to initialize. */
+static inline void iSCSIPDUTextStreamInit(iSCSIPDUTextStream * stream)
+{
+    stream->carryLength = 0;
+    stream->discard = 0;
+}
+
+/*! Scans the next data segment of a stream.  Complete pairs are passed to the
+ *  callback as spans over the data segment (or over the carry buffer, for a
+ *  pair that spans data segments), and an unterminated pair at the end of
+ *  the data segment is carried over to the next call.
+ *  @param stream the stream.
+ *  @param data the data segment.
+ *  @param length the length of the data segment.
+ *  @param context a user-defined value passed to the callback.
+ *  @param callback the function to invoke for each pair. */
+static inline void iSCSIPDUTextStreamScan(iSCSIPDUTextStream * stream,
+                                          const void * data,
+                                          size_t length,
+                                          void * context,
+                                          iSCSIPDUTextStreamCallback callback)
+{
+    const uint8_t * bytes = (const uint8_t *)data;
+    iSCSIPDUTextSpan key, value;
+    size_t offset = 0;
+    
+    // Complete the pair carried over from the previous data segment
+    if(stream->carryLength > 0 || stream->discard)
+    {
+        const uint8_t * end = (const uint8_t *)memchr(bytes,0,length);
+        size_t partLength = end ? (size_t)(end - bytes) + 1 : length;
+        
+        if(!stream->discard && stream->carryLength + partLength <= sizeof(stream->carry)) {
+            memcpy(stream->carry + stream->carryLength,bytes,partLength);
+            stream->carryLength += partLength;
+        }
+        else {
+            stream->carryLength = 0;
+            stream->discard = 1;
+        }
+        
+        if(!end)
+            return;
+        
+        size_t carryOffset = 0;
+        if(!stream->discard &&
+           iSCSIPDUTextGetNextPair(stream->carry,stream->carryLength,&carryOffset,&key,&value))
+            callback(context,&key,&value);
+        
+        stream->carryLength = 0;
+        stream->discard = 0;
+        offset = partLength;
+    }
+    
+    // Scan the pairs that are terminated within this data segment in place
+    size_t terminatedLength = length;
+    while(terminatedLength > offset && bytes[terminatedLength-1] != 0)
+        terminatedLength--;
+    
+    while(iSCSIPDUTextGetNextPair(bytes,terminatedLength,&offset,&key,&value))
+        callback(context,&key,&value);
+    
+    // Carry over the unterminated remainder
+    size_t remainder = length - terminatedLength;
+    
+    if(remainder > sizeof(stream->carry))
+        stream->discard = 1;
+    else if(remainder > 0) {
+        memcpy(stream->carry,bytes + terminatedLength,remainder);
+        stream->carryLength = remainder;
+    }
+}
+
+#endif /* defined(__ISCSI_PDU_TEXT_H__) */
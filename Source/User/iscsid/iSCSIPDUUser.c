@@ -107,63 +107,27 @@ void iSCSIPDUDataParseCommon(void * data,size_t length,
     if(!data || length == 0 || !callback)
         return;
     
-    // Parse the text response
-    UInt8 * currentByte = data;
+    iSCSIPDUTextSpan key, value;
+    size_t offset = 0;
     
-    UInt8 * lastByte = currentByte + length;
-    UInt8 * tokenStartByte = currentByte;
-    
-    CFStringRef keyString = NULL, valString = NULL;
-    
-    bool equalFound = false;
-    
-    // Search through bytes and look for key=value pairs.  Convert key and
-    // value strings to CFStrings and add to a dictionary
-    while(currentByte <= lastByte)
+    // Convert key and value spans to CFStrings and pass them to the callback
+    while(iSCSIPDUTextGetNextPair(data,length,&offset,&key,&value))
     {
-        if(*currentByte == '=')
-        {
-            keyString = CFStringCreateWithBytes(kCFAllocatorDefault,
-                                                tokenStartByte,
-                                                currentByte-tokenStartByte,
-                                                kCFStringEncodingUTF8,false);
-            // Advance the starting point to skip the '='
-            tokenStartByte = currentByte + 1;
-            
-            // We've crossed from key to value
-            equalFound = true;
-        }
-        // Second boolean expression is required for the case of null-padded
-        // datasegments (per RFC3720 PDUs are padded up to the nearest word)
-        else if(*currentByte == 0 && equalFound)
-        {
-            valString = CFStringCreateWithBytes(kCFAllocatorDefault,
-                                                tokenStartByte,
-                                                currentByte-tokenStartByte,
-                                                kCFStringEncodingUTF8,false);
-            // Advance the starting point to skip the '='
-            tokenStartByte = currentByte + 1;
+        CFStringRef keyString = CFStringCreateWithBytes(kCFAllocatorDefault,
+                                                        key.bytes,key.length,
+                                                        kCFStringEncodingUTF8,false);
+        CFStringRef valString = CFStringCreateWithBytes(kCFAllocatorDefault,
+                                                        value.bytes,value.length,
+                                                        kCFStringEncodingUTF8,false);
+        
+        // Skip pairs that are not valid UTF-8
+        if(keyString && valString)
             (*callback)(keyContainer,keyString,valContainer,valString);
-
+        
+        if(keyString)
             CFRelease(keyString);
+        if(valString)
             CFRelease(valString);
-            keyString = valString = NULL;
-            
-            // Reset for next key-value pair (this allows extra 0's for padding
-            // if the string should contain any)
-            equalFound = false;
-        }
-        currentByte++;
-    }
-
-    if(keyString) {
-        CFRelease(keyString);
-        keyString = NULL;
-    }
-    
-    if(valString) {
-        CFRelease(valString);
-        valString = NULL;
     }
 }
 
@@ -201,10 +165,10 @@ void iSCSIPDUDataParseToArraysCallback(void * keyContainer,CFStringRef keyString
  *  @param values an array of corresponding values for each key. */
 void iSCSIPDUDataParseToArrays(void * data,size_t length,CFMutableArrayRef keys,CFMutableArrayRef values)
 {
-    if(!data || length == 0 || !values)
+    if(!data || length == 0 || !keys || !values)
         return;
     
-    iSCSIPDUDataParseCommon(data,length,keys,values,&iSCSIPDUDataParseToDictCallback);
+    iSCSIPDUDataParseCommon(data,length,keys,values,&iSCSIPDUDataParseToArraysCallback);
 }
 
 
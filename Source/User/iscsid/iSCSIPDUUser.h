@@ -30,6 +30,7 @@
 #define __ISCSI_PDU_USER_H__
 
 #include "iSCSIPDUShared.h"
+#include "iSCSIPDUText.h"
 #include <CoreFoundation/CoreFoundation.h>
 
 
@@ -298,7 +299,9 @@ void iSCSIPDUDataParseToDict(void * data,size_t length,CFMutableDictionaryRef te
 void iSCSIPDUDataParseToArrays(void * data,size_t length,CFMutableArrayRef keys,CFMutableArrayRef values);
 
 
-/*! Parses key-value pairs using a user-specified function.
+/*! Parses key-value pairs using a user-specified function.  Callers that
+ *  only consume some of the keys should scan the data segment with
+ *  iSCSIPDUTextGetNextPair() instead, which does not create any objects.
  *  @param data the data segmetn (from a PDU) to parse.
  *  @param length the length of the data segment.
  *  @param keyContainer the container to use for storing key strings (optional).
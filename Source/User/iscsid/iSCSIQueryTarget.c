@@ -52,25 +52,18 @@ errno_t iSCSISessionLoginSingleQuery(struct iSCSILoginQueryContext * context,
     size_t length = 0;
     iSCSIPDUDataCreateFromDict(textCmd,&data,&length);
 
-    errno_t error = iSCSIHBAInterfaceSend(context->interface,context->sessionId,context->connectionId,
-                                          (iSCSIPDUInitiatorBHS *)&cmd,data,length);
-    iSCSIPDUDataRelease(&data);
-    
-    if(error) {
-        return error;
-    }
-    
     // Get response from iSCSI portal, continue until response is complete
     iSCSIPDULoginRspBHS rsp;
+    UInt8 rspData[kiSCSIHBAInterfaceMaxRecvDataLength];
+    size_t rspLength = sizeof(rspData);
     
-    do {
-        if((error = iSCSIHBAInterfaceReceive(context->interface,context->sessionId,context->connectionId,
-                                             (iSCSIPDUTargetBHS *)&rsp,&data,&length)))
-        {
-            iSCSIPDUDataRelease(&data);
-            return error;
-        }
-        
+    // Send the request and receive the first response in one exchange
+    errno_t error = iSCSIHBAInterfaceExchange(context->interface,context->sessionId,context->connectionId,
+                                              (iSCSIPDUInitiatorBHS *)&cmd,data,length,
+                                              (iSCSIPDUTargetBHS *)&rsp,rspData,&rspLength);
+    iSCSIPDUDataRelease(&data);
+    
+    while(!error) {
         if(rsp.opCode == kiSCSIPDUOpCodeLoginRsp)
         {
             // Per RFC3720, the status and detail together make up the code
@@ -80,7 +73,7 @@ errno_t iSCSISessionLoginSingleQuery(struct iSCSILoginQueryContext * context,
             if(*statusCode != kiSCSILoginSuccess)
                 break;
             
-            iSCSIPDUDataParseToDict(data,length,textRsp);
+            iSCSIPDUDataParseToDict(rspData,rspLength,textRsp);
             
             // Save & return the TSIH if this is the leading login
             if(context->targetSessionId == 0 && context->nextStage == kiSCSIPDUFullFeaturePhase) {
@@ -99,10 +92,15 @@ errno_t iSCSISessionLoginSingleQuery(struct iSCSILoginQueryContext * context,
             error = EOPNOTSUPP;
             break;
         }
+        
+        if(!(rsp.loginStage & kiSCSIPDUTextReqContinueFlag))
+            break;
+        
+        rspLength = sizeof(rspData);
+        error = iSCSIHBAInterfaceReceive(context->interface,context->sessionId,context->connectionId,
+                                         (iSCSIPDUTargetBHS *)&rsp,rspData,&rspLength);
     }
-    while(rsp.loginStage & kiSCSIPDUTextReqContinueFlag);
     
-    iSCSIPDUDataRelease(&data);
     return error;
 }
 
@@ -191,29 +189,20 @@ errno_t iSCSISessionTextQuery(SessionIdentifier sessionId,
     size_t length;
     iSCSIPDUDataCreateFromDict(textCmd,&data,&length);
     
-    errno_t error = iSCSIHBAInterfaceSend(0,sessionId,
-                                    connectionId,
-                                    (iSCSIPDUInitiatorBHS *)&cmd,
-                                    data,length);
-    iSCSIPDUDataRelease(&data);
-    
-    if(error) {
-        return error;
-    }
-    
     // Get response from iSCSI portal, continue until response is complete
     iSCSIPDUTextRspBHS rsp;
+    UInt8 rspData[kiSCSIHBAInterfaceMaxRecvDataLength];
+    size_t rspLength = sizeof(rspData);
     
-    do {
-        if((error = iSCSIHBAInterfaceReceive(0,sessionId,connectionId,
-                                    (iSCSIPDUTargetBHS *)&rsp,&data,&length)))
-        {
-            iSCSIPDUDataRelease(&data);
-            return error;
-        }
-        
+    // Send the request and receive the first response in one exchange
+    errno_t error = iSCSIHBAInterfaceExchange(0,sessionId,connectionId,
+                                              (iSCSIPDUInitiatorBHS *)&cmd,data,length,
+                                              (iSCSIPDUTargetBHS *)&rsp,rspData,&rspLength);
+    iSCSIPDUDataRelease(&data);
+    
+    while(!error) {
         if(rsp.opCode == kiSCSIPDUOpCodeTextRsp)
-            iSCSIPDUDataParseToDict(data,length,textRsp);
+            iSCSIPDUDataParseToDict(rspData,rspLength,textRsp);
         
         // For this case some other kind of PDU or invalid data was received
         else if(rsp.opCode == kiSCSIPDUOpCodeReject)
@@ -221,9 +210,14 @@ errno_t iSCSISessionTextQuery(SessionIdentifier sessionId,
             error = EIO;
             break;
         }
+        
+        if(!(rsp.textReqStageBits & kiSCSIPDUTextReqContinueFlag))
+            break;
+        
+        rspLength = sizeof(rspData);
+        error = iSCSIHBAInterfaceReceive(0,sessionId,connectionId,
+                                         (iSCSIPDUTargetBHS *)&rsp,rspData,&rspLength);
     }
-    while(rsp.textReqStageBits & kiSCSIPDUTextReqContinueFlag);
     
-    iSCSIPDUDataRelease(&data);
     return error;
 }
\ No newline at end of file
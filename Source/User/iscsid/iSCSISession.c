@@ -39,6 +39,14 @@
  *  to produce the data section of text and login PDUs. */
 const unsigned int kiSCSISessionMaxTextKeyValuePairs = 100;
 
+/*! Key of the negotiated parameters for session-wide keys (see
+ *  iSCSINegotiateCacheResult()). */
+static CFStringRef kiSCSINegotiatedSessionKeys = CFSTR("Session");
+
+/*! Key of the negotiated parameters for connection-wide keys (see
+ *  iSCSINegotiateCacheResult()). */
+static CFStringRef kiSCSINegotiatedConnectionKeys = CFSTR("Connection");
+
 /*! Helper function used during session negotiation.  Returns true if BOTH
  *  the command and the response strings are "Yes" */
 Boolean iSCSILVGetEqual(CFStringRef cmdStr,CFStringRef rspStr)
@@ -122,13 +130,14 @@ void iSCSINegotiateBuildSWDictNormal(iSCSISessionConfigRef sessCfg,
     CFStringRef value;
     
     // If the maximum number of connections was specified in the target,
-    // use it.  Else default to RFC3720 value
+    // use it.  Else offer as many connections as the initiator supports
+    // (the target may negotiate this down).  Never offer more than that.
     UInt32 maxConnections = iSCSISessionConfigGetMaxConnections(sessCfg);
     
-    if(maxConnections == 0)
-        value = CFStringCreateWithFormat(kCFAllocatorDefault,NULL,CFSTR("%u"),kRFC3720_MaxConnections);
-    else
-        value = CFStringCreateWithFormat(kCFAllocatorDefault,NULL,CFSTR("%u"),maxConnections);
+    if(maxConnections == 0 || maxConnections > kiSCSIMaxConnectionsPerSession)
+        maxConnections = kiSCSIMaxConnectionsPerSession;
+    
+    value = CFStringCreateWithFormat(kCFAllocatorDefault,NULL,CFSTR("%u"),maxConnections);
     
     CFDictionaryAddValue(sessCmd,kRFC3720_Key_MaxConnections,value);
     CFRelease(value);
@@ -485,6 +494,67 @@ errno_t iSCSINegotiateParseCWDict(iSCSISessionManagerRef managerRef,
     return 0;
 }
 
+/*! Helper function used by iSCSINegotiateSession to remember the values
+ *  agreed upon with the target.  For each key that was offered the value
+ *  returned by the target is recorded (the outcome of the negotiation),
+ *  except for declarative keys whose value is set by the initiator.  Session
+ *  and connection keys are stored separately, since only the latter are
+ *  negotiated when a connection is added to an existing session.
+ *  @param managerRef the session manager.
+ *  @param target the target of the session.
+ *  @param connCfg the connection configuration used for the login.
+ *  @param sessCmd the key-value pairs sent to the target.
+ *  @param sessRsp the key-value pairs received from the target. */
+void iSCSINegotiateCacheResult(iSCSISessionManagerRef managerRef,
+                               iSCSITargetRef target,
+                               iSCSIConnectionConfigRef connCfg,
+                               CFDictionaryRef sessCmd,
+                               CFDictionaryRef sessRsp)
+{
+    CFMutableDictionaryRef connKeys = CFDictionaryCreateMutable(kCFAllocatorDefault,0,
+                                                                &kCFTypeDictionaryKeyCallBacks,
+                                                                &kCFTypeDictionaryValueCallBacks);
+    CFMutableDictionaryRef sessKeys = CFDictionaryCreateMutable(kCFAllocatorDefault,0,
+                                                                &kCFTypeDictionaryKeyCallBacks,
+                                                                &kCFTypeDictionaryValueCallBacks);
+    
+    // The connection keys are those produced for the connection configuration
+    iSCSINegotiateBuildCWDict(connCfg,connKeys);
+    
+    CFIndex count = CFDictionaryGetCount(sessCmd);
+    const void * keys[count], * values[count];
+    CFDictionaryGetKeysAndValues(sessCmd,keys,values);
+    
+    for(CFIndex idx = 0; idx < count; idx++)
+    {
+        CFStringRef key = keys[idx];
+        CFStringRef value = values[idx];
+        CFStringRef targetRsp = NULL;
+        
+        if(CFStringCompare(key,kRFC3720_Key_MaxRecvDataSegmentLength,0) != kCFCompareEqualTo &&
+           CFDictionaryGetValueIfPresent(sessRsp,key,(const void **)&targetRsp))
+            value = targetRsp;
+        
+        if(CFDictionaryContainsKey(connKeys,key))
+            CFDictionarySetValue(connKeys,key,value);
+        else
+            CFDictionarySetValue(sessKeys,key,value);
+    }
+    
+    const void * resultKeys[] = { kiSCSINegotiatedSessionKeys, kiSCSINegotiatedConnectionKeys };
+    const void * resultValues[] = { sessKeys, connKeys };
+    
+    CFDictionaryRef result = CFDictionaryCreate(kCFAllocatorDefault,resultKeys,resultValues,2,
+                                                &kCFTypeDictionaryKeyCallBacks,
+                                                &kCFTypeDictionaryValueCallBacks);
+    
+    iSCSISessionManagerSetNegotiatedParameters(managerRef,iSCSITargetGetIQN(target),result);
+    
+    CFRelease(result);
+    CFRelease(sessKeys);
+    CFRelease(connKeys);
+}
+
 errno_t iSCSINegotiateSession(iSCSISessionManagerRef managerRef,
                               iSCSIMutableTargetRef target,
                               SessionIdentifier sessionId,
@@ -552,6 +622,11 @@ errno_t iSCSINegotiateSession(iSCSISessionManagerRef managerRef,
     
         if(!error)
             error = iSCSINegotiateParseCWDict(managerRef,sessionId,connectionId,sessCmd,sessRsp);
+        
+        // Remember the outcome so that a lost connection can be restored
+        // with a single exchange (see iSCSISessionReconnect)
+        if(!error && !discoverySession)
+            iSCSINegotiateCacheResult(managerRef,target,connCfg,sessCmd,sessRsp);
     }
     
     // If no error and the target returned an alias save it...
@@ -646,16 +721,14 @@ errno_t iSCSISessionLogoutCommon(iSCSISessionManagerRef managerRef,
     iSCSIPDULogoutReqBHS cmd = iSCSIPDULogoutReqBHSInit;
     cmd.reasonCode = logoutReason | kISCSIPDULogoutReasonCodeFlag;
     
-    if((error = iSCSIHBAInterfaceSend(hbaInterface,sessionId,connectionId,(iSCSIPDUInitiatorBHS *)&cmd,NULL,0)))
-        return error;
-    
     // Get response from iSCSI portal
     iSCSIPDULogoutRspBHS rsp;
-    void * data = NULL;
-    size_t length = 0;
+    UInt8 data[kiSCSIHBAInterfaceMaxRecvDataLength];
+    size_t length = sizeof(data);
     
-    // Receive response PDU...
-    if((error = iSCSIHBAInterfaceReceive(hbaInterface,sessionId,connectionId,(iSCSIPDUTargetBHS *)&rsp,&data,&length)))
+    // Send request and receive response PDU...
+    if((error = iSCSIHBAInterfaceExchange(hbaInterface,sessionId,connectionId,(iSCSIPDUInitiatorBHS *)&cmd,NULL,0,
+                                          (iSCSIPDUTargetBHS *)&rsp,data,&length)))
         return error;
     
     if(rsp.opCode == kiSCSIPDUOpCodeLogoutRsp)
@@ -665,7 +738,6 @@ errno_t iSCSISessionLogoutCommon(iSCSISessionManagerRef managerRef,
     else if(rsp.opCode == kiSCSIPDUOpCodeReject)
         error = EINVAL;
     
-    iSCSIPDUDataRelease(data);
     return error;
 }
 
@@ -698,7 +770,7 @@ errno_t iSCSISessionAddConnection(iSCSISessionManagerRef managerRef,
     // Resolve information about the target
     struct sockaddr_storage ssTarget, ssHost;
     
-    if((error = iSCSIUtilsGetAddressForPortal(portal,&ssTarget,&ssHost)))
+    if((error = iSCSIUtilsSelectAddressForPortal(portal,&ssTarget,&ssHost)))
         return error;
     
     // If both target and host were resolved, grab a connection
@@ -796,7 +868,7 @@ errno_t iSCSISessionLogin(iSCSISessionManagerRef managerRef,
     // Resolve the target address
     struct sockaddr_storage ssTarget, ssHost;
     
-    if((error = iSCSIUtilsGetAddressForPortal(portal,&ssTarget,&ssHost)))
+    if((error = iSCSIUtilsSelectAddressForPortal(portal,&ssTarget,&ssHost)))
         return error;
 
     // Create a new session in the kernel.  This allocates session and
@@ -832,6 +904,302 @@ errno_t iSCSISessionLogin(iSCSISessionManagerRef managerRef,
     return error;
 }
 
+/*! Helper function.  Makes a single attempt to restore a connection of a
+ *  session using the parameters negotiated previously (see
+ *  iSCSISessionReconnect()).
+ *  @param targetSessionId the TSIH to present to the target, or zero to
+ *  reinstate the session (the target then discards its previous state). */
+static errno_t iSCSISessionReconnectAttempt(iSCSISessionManagerRef managerRef,
+                                            iSCSIMutableTargetRef target,
+                                            SessionIdentifier sessionId,
+                                            iSCSIPortalRef portal,
+                                            iSCSIAuthRef initiatorAuth,
+                                            iSCSIAuthRef targetAuth,
+                                            CFDictionaryRef negotiated,
+                                            TargetSessionIdentifier targetSessionId,
+                                            ConnectionIdentifier * connectionId,
+                                            enum iSCSILoginStatusCode * statusCode)
+{
+    iSCSIHBAInterfaceRef hbaInterface = iSCSISessionManagerGetHBAInterface(managerRef);
+    errno_t error = 0;
+    
+    // Resolve information about the target
+    struct sockaddr_storage ssTarget, ssHost;
+    
+    if((error = iSCSIUtilsSelectAddressForPortal(portal,&ssTarget,&ssHost)))
+        return error;
+    
+    error = iSCSIHBAInterfaceCreateConnection(hbaInterface,sessionId,
+                                              iSCSIPortalGetAddress(portal),
+                                              iSCSIPortalGetPort(portal),
+                                              iSCSIPortalGetHostInterface(portal),
+                                              &ssTarget,
+                                              &ssHost,connectionId);
+    
+    if(error || *connectionId == kiSCSIInvalidConnectionId)
+        return EAGAIN;
+    
+    // The security negotiation (if any) picks up the TSIH from the kernel
+    iSCSIHBAInterfaceSetSessionParameter(hbaInterface,sessionId,kiSCSIHBASOTargetSessionId,
+                                         &targetSessionId,sizeof(targetSessionId));
+    
+    CFMutableDictionaryRef textCmd = CFDictionaryCreateMutable(
+                                            kCFAllocatorDefault,
+                                            kiSCSISessionMaxTextKeyValuePairs,
+                                            &kCFTypeDictionaryKeyCallBacks,
+                                            &kCFTypeDictionaryValueCallBacks);
+    
+    CFMutableDictionaryRef textRsp = CFDictionaryCreateMutable(
+                                            kCFAllocatorDefault,
+                                            kiSCSISessionMaxTextKeyValuePairs,
+                                            &kCFTypeDictionaryKeyCallBacks,
+                                            &kCFTypeDictionaryValueCallBacks);
+    
+    struct iSCSILoginQueryContext context;
+    context.interface    = hbaInterface;
+    context.sessionId    = sessionId;
+    context.connectionId = *connectionId;
+    context.currentStage = kiSCSIPDULoginOperationalNegotiation;
+    context.nextStage    = kiSCSIPDUFullFeaturePhase;
+    context.targetSessionId = targetSessionId;
+    
+    // Without authentication the security stage is skipped altogether: the
+    // login starts in the operational stage and the keys that would have
+    // been sent during the security stage accompany the operational keys
+    Boolean skipSecurity = (iSCSIAuthGetMethod(initiatorAuth) == kiSCSIAuthMethodNone &&
+                            iSCSIAuthGetMethod(targetAuth) == kiSCSIAuthMethodNone);
+    
+    if(skipSecurity) {
+        iSCSIAuthNegotiateBuildDict(target,initiatorAuth,targetAuth,textCmd);
+        CFDictionaryRemoveValue(textCmd,kRFC3720_Key_AuthMethod);
+    }
+    else {
+        error = iSCSIAuthNegotiate(managerRef,target,initiatorAuth,targetAuth,
+                                   sessionId,*connectionId,statusCode);
+    }
+    
+    // Propose exactly the values agreed upon previously.  Session-wide keys
+    // are only negotiated if the session is reinstated
+    CFDictionaryRef connKeys = CFDictionaryGetValue(negotiated,kiSCSINegotiatedConnectionKeys);
+    CFDictionaryRef sessKeys = CFDictionaryGetValue(negotiated,kiSCSINegotiatedSessionKeys);
+    
+    CFIndex count = CFDictionaryGetCount(connKeys);
+    const void * keys[kiSCSISessionMaxTextKeyValuePairs], * values[kiSCSISessionMaxTextKeyValuePairs];
+    
+    CFDictionaryGetKeysAndValues(connKeys,keys,values);
+    for(CFIndex idx = 0; idx < count; idx++)
+        CFDictionarySetValue(textCmd,keys[idx],values[idx]);
+    
+    if(targetSessionId == 0) {
+        count = CFDictionaryGetCount(sessKeys);
+        CFDictionaryGetKeysAndValues(sessKeys,keys,values);
+        for(CFIndex idx = 0; idx < count; idx++)
+            CFDictionarySetValue(textCmd,keys[idx],values[idx]);
+    }
+    
+    enum iSCSIPDURejectCode rejectCode;
+    
+    if(!error && (skipSecurity || *statusCode == kiSCSILoginSuccess))
+        error = iSCSISessionLoginQuery(&context,statusCode,&rejectCode,textCmd,textRsp);
+    
+    // The first login response of the connection carries the status sequence
+    // number and the portal group tag, which must match that of the session
+    if(!error && *statusCode == kiSCSILoginSuccess && skipSecurity)
+    {
+        UInt32 expStatSN = context.statSN + 1;
+        iSCSIHBAInterfaceSetConnectionParameter(hbaInterface,sessionId,*connectionId,kiSCSIHBACOInitialExpStatSN,
+                                                &expStatSN,sizeof(expStatSN));
+        
+        CFStringRef targetPortalGroupRsp = NULL;
+        TargetPortalGroupTag targetPortalGroupTag = 0;
+        iSCSIHBAInterfaceGetSessionParameter(hbaInterface,sessionId,kiSCSIHBASOTargetPortalGroupTag,
+                                             &targetPortalGroupTag,sizeof(TargetPortalGroupTag));
+        
+        if(!CFDictionaryGetValueIfPresent(textRsp,kRFC3720_Key_TargetPortalGroupTag,(const void **)&targetPortalGroupRsp) ||
+           targetPortalGroupTag != CFStringGetIntValue(targetPortalGroupRsp))
+            error = EAUTH;
+    }
+    
+    // Store the outcome of the negotiation with the kernel
+    if(!error && *statusCode == kiSCSILoginSuccess)
+    {
+        if(targetSessionId == 0) {
+            iSCSIHBAInterfaceSetSessionParameter(hbaInterface,sessionId,kiSCSIHBASOTargetSessionId,
+                                                 &context.targetSessionId,sizeof(context.targetSessionId));
+            
+            error = iSCSINegotiateParseSWDictCommon(managerRef,sessionId,textCmd,textRsp);
+            
+            if(!error)
+                error = iSCSINegotiateParseSWDictNormal(managerRef,sessionId,textCmd,textRsp);
+        }
+        
+        if(!error)
+            error = iSCSINegotiateParseCWDict(managerRef,sessionId,*connectionId,textCmd,textRsp);
+    }
+    
+    if(!error && *statusCode == kiSCSILoginSuccess)
+        iSCSIHBAInterfaceActivateConnection(hbaInterface,sessionId,*connectionId);
+    else {
+        iSCSIHBAInterfaceReleaseConnection(hbaInterface,sessionId,*connectionId);
+        *connectionId = kiSCSIInvalidConnectionId;
+    }
+    
+    CFRelease(textCmd);
+    CFRelease(textRsp);
+    return error;
+}
+
+/*! Restores the connection of a session that has lost all of its
+ *  connections (e.g., after a network timeout), using the parameters that
+ *  were negotiated when the session was created.  Instead of a full login
+ *  the initiator proposes exactly those values in a single operational
+ *  exchange, which the target can accept as-is.  When no authentication is
+ *  used the security stage is skipped as well, so that the connection is
+ *  restored in a single round trip.  If the session negotiated an error
+ *  recovery level above zero the target may still hold the session, and the
+ *  connection is added to it by presenting the session's TSIH; otherwise
+ *  (or if the target no longer knows the session) the session is reinstated.
+ *  @param managerRef a session manager instance.
+ *  @param sessionId the session to reconnect.
+ *  @param portal specifies the portal to use for the connection.
+ *  @param initiatorAuth specifies the initiator authentication parameters.
+ *  @param targetAuth specifies the target authentication parameters.
+ *  @param connectionId the new connection identifier.
+ *  @param statusCode iSCSI response code indicating operation status.
+ *  @return an error code indicating whether the operation was successful;
+ *  ENOENT if no negotiated parameters are known for the session and EBUSY
+ *  if the session still has connections (a regular login is required). */
+errno_t iSCSISessionReconnect(iSCSISessionManagerRef managerRef,
+                              SessionIdentifier sessionId,
+                              iSCSIPortalRef portal,
+                              iSCSIAuthRef initiatorAuth,
+                              iSCSIAuthRef targetAuth,
+                              ConnectionIdentifier * connectionId,
+                              enum iSCSILoginStatusCode * statusCode)
+{
+    if(!portal || sessionId == kiSCSIInvalidSessionId || !connectionId || !statusCode ||
+       !initiatorAuth || !targetAuth)
+        return EINVAL;
+    
+    iSCSIHBAInterfaceRef hbaInterface = iSCSISessionManagerGetHBAInterface(managerRef);
+    *connectionId = kiSCSIInvalidConnectionId;
+    
+    CFArrayRef connections = iSCSISessionCopyArrayOfConnectionIds(managerRef,sessionId);
+    CFIndex connectionCount = connections ? CFArrayGetCount(connections) : 0;
+    
+    if(connections)
+        CFRelease(connections);
+    
+    if(connectionCount > 0)
+        return EBUSY;
+    
+    iSCSITargetRef targetTemp = iSCSISessionCopyTargetForId(managerRef,sessionId);
+    
+    if(!targetTemp)
+        return EINVAL;
+    
+    CFDictionaryRef negotiated = iSCSISessionManagerCopyNegotiatedParameters(managerRef,iSCSITargetGetIQN(targetTemp));
+    iSCSIMutableTargetRef target = iSCSITargetCreateMutableCopy(targetTemp);
+    iSCSITargetRelease(targetTemp);
+    
+    if(!negotiated) {
+        iSCSITargetRelease(target);
+        return ENOENT;
+    }
+    
+    TargetSessionIdentifier targetSessionId = 0;
+    UInt8 errorRecoveryLevel = 0;
+    
+    iSCSIHBAInterfaceGetSessionParameter(hbaInterface,sessionId,kiSCSIHBASOTargetSessionId,
+                                         &targetSessionId,sizeof(targetSessionId));
+    iSCSIHBAInterfaceGetSessionParameter(hbaInterface,sessionId,kiSCSIHBASOErrorRecoveryLevel,
+                                         &errorRecoveryLevel,sizeof(errorRecoveryLevel));
+    
+    // At error recovery level zero the target discards the session along
+    // with its last connection
+    if(errorRecoveryLevel == kiSCSIErrorRecoverySession)
+        targetSessionId = 0;
+    
+    errno_t error = iSCSISessionReconnectAttempt(managerRef,target,sessionId,portal,
+                                                 initiatorAuth,targetAuth,negotiated,
+                                                 targetSessionId,connectionId,statusCode);
+    
+    // The target may have discarded the session in the meantime
+    if(!error && targetSessionId != 0 && *statusCode == kiSCSILoginSessionDoesntExist)
+        error = iSCSISessionReconnectAttempt(managerRef,target,sessionId,portal,
+                                             initiatorAuth,targetAuth,negotiated,
+                                             0,connectionId,statusCode);
+    
+    // A suspended session is back to normal; losing its last connection
+    // un-mounts the target again
+    if(!error && *statusCode == kiSCSILoginSuccess) {
+        bool retainTarget = false;
+        iSCSIHBAInterfaceSetSessionParameter(hbaInterface,sessionId,kiSCSIHBASORetainTarget,
+                                             &retainTarget,sizeof(retainTarget));
+    }
+    
+    CFRelease(negotiated);
+    iSCSITargetRelease(target);
+    return error;
+}
+
+/*! Suspends an iSCSI session (e.g., before the system sleeps).  All of the
+ *  connections of the session are logged out and released, but the session
+ *  itself and its SCSI target are kept so that mounted volumes remain
+ *  available.  The session is later restored with iSCSISessionReconnect.
+ *  @param managerRef a session manager instance.
+ *  @param sessionId the session to suspend.
+ *  @return an error code indicating whether the operation was successful. */
+errno_t iSCSISessionSuspend(iSCSISessionManagerRef managerRef,
+                            SessionIdentifier sessionId)
+{
+    if(sessionId == kiSCSIInvalidSessionId)
+        return EINVAL;
+    
+    iSCSIHBAInterfaceRef hbaInterface = iSCSISessionManagerGetHBAInterface(managerRef);
+    CFArrayRef connections = NULL;
+    
+    if(!(connections = iSCSISessionCopyArrayOfConnectionIds(managerRef,sessionId)))
+        return EINVAL;
+    
+    // Keep the target once the last connection is gone (this fails if the
+    // kernel extension doesn't support it, in which case nothing is changed)
+    bool retainTarget = true;
+    errno_t error = 0;
+    
+    if(iSCSIHBAInterfaceSetSessionParameter(hbaInterface,sessionId,kiSCSIHBASORetainTarget,
+                                            &retainTarget,sizeof(retainTarget)))
+        error = ENOTSUP;
+    
+    // With connection recovery the target keeps the tasks of the connection
+    // for reassignment; otherwise they are terminated with the connection
+    UInt8 errorRecoveryLevel = 0;
+    iSCSIHBAInterfaceGetSessionParameter(hbaInterface,sessionId,kiSCSIHBASOErrorRecoveryLevel,
+                                         &errorRecoveryLevel,sizeof(errorRecoveryLevel));
+    
+    enum iSCSIPDULogoutReasons logoutReason = kISCSIPDULogoutCloseConnection;
+    
+    if(errorRecoveryLevel == kiSCSIErrorRecoveryConnection)
+        logoutReason = kISCSIPDULogoutRemoveConnectionForRecovery;
+    
+    CFIndex connectionCount = CFArrayGetCount(connections);
+    
+    for(CFIndex idx = 0; !error && idx < connectionCount; idx++)
+    {
+        ConnectionIdentifier connectionId = (ConnectionIdentifier)CFArrayGetValueAtIndex(connections,idx);
+        enum iSCSILogoutStatusCode statusCode;
+        
+        // The connection is released even if the target doesn't respond
+        if(!iSCSIHBAInterfaceDeactivateConnection(hbaInterface,sessionId,connectionId))
+            iSCSISessionLogoutCommon(managerRef,sessionId,connectionId,logoutReason,&statusCode);
+        
+        iSCSIHBAInterfaceReleaseConnection(hbaInterface,sessionId,connectionId);
+    }
+    
+    CFRelease(connections);
+    return error;
+}
+
 /*! Closes the iSCSI session by deactivating and removing all connections. Any
  *  pending or current data transfers are aborted. This function may be called 
  *  on a session with one or more connections that are either inactive or 
@@ -858,62 +1226,151 @@ errno_t iSCSISessionLogout(iSCSISessionManagerRef managerRef,
     if(!(error = iSCSIHBAInterfaceGetConnection(hbaInterface,sessionId,&connectionId)))
         error = iSCSISessionLogoutCommon(managerRef,sessionId,connectionId,kiSCSIPDULogoutCloseSession,statusCode);
 
+    // The next login to the target negotiates from scratch
+    iSCSITargetRef target = iSCSISessionCopyTargetForId(managerRef,sessionId);
+    
     // Release all of the connections in the kernel by releasing the session
     iSCSIHBAInterfaceReleaseSession(hbaInterface,sessionId);
     
+    if(target) {
+        iSCSISessionManagerSetNegotiatedParameters(managerRef,iSCSITargetGetIQN(target),NULL);
+        iSCSITargetRelease(target);
+    }
+    
     return error;
 }
 
-/*! Callback function used by iSCSIQueryPortalForTargets to parse discovery
- *  data into an iSCSIDiscoveryRec object. */
-void iSCSIPDUDataParseToDiscoveryRecCallback(void * keyContainer,CFStringRef key,
-                                             void * valContainer,CFStringRef val)
+/*! Creates a string from a span of a PDU data segment.
+ *  @param span the span.
+ *  @return a new string, or NULL if the span is not valid UTF-8. */
+static CFStringRef iSCSISessionCreateStringWithSpan(const iSCSIPDUTextSpan * span)
+{
+    return CFStringCreateWithBytes(kCFAllocatorDefault,span->bytes,span->length,
+                                   kCFStringEncodingUTF8,false);
+}
+
+/*! Compares a span of a PDU data segment to a key name.
+ *  @param span the span.
+ *  @param key the key name (e.g., kRFC3720_Key_TargetName).
+ *  @return true if the span is equal to the key name. */
+static Boolean iSCSISessionSpanEqualsKey(const iSCSIPDUTextSpan * span,CFStringRef key)
+{
+    // Key names are ASCII, so a constant string normally provides its bytes
+    // directly; otherwise copy them (key names are short)
+    const char * keyBytes = CFStringGetCStringPtr(key,kCFStringEncodingUTF8);
+    
+    if(keyBytes)
+        return iSCSIPDUTextSpanEqualsString(span,keyBytes);
+    
+    UInt8 buffer[64];
+    CFIndex keyLength = 0;
+    CFIndex length = CFStringGetLength(key);
+    
+    if(CFStringGetBytes(key,CFRangeMake(0,length),kCFStringEncodingUTF8,0,false,
+                        buffer,sizeof(buffer),&keyLength) != length)
+        return false;
+    
+    return span->length == (size_t)keyLength && memcmp(span->bytes,buffer,span->length) == 0;
+}
+
+/*! State used to parse SendTargets text responses into a discovery record.
+ *  This is owned by the caller so that queries may run concurrently and span
+ *  multiple text responses. */
+typedef struct iSCSISessionDiscoveryParser {
+    
+    /*! Scanner state (carries pairs that span text responses). */
+    iSCSIPDUTextStream stream;
+    
+    /*! Name of the target whose portals are being parsed. */
+    CFStringRef targetIQN;
+    
+    /*! Discovery record that targets and portals are added to. */
+    iSCSIMutableDiscoveryRecRef discoveryRec;
+    
+} iSCSISessionDiscoveryParser;
+
+/*! Adds a key=value pair of a SendTargets text response to a discovery
+ *  record.  Only the keys used by discovery are converted to strings.
+ *  @param context the discovery parser.
+ *  @param key the key of the pair.
+ *  @param value the value of the pair. */
+static void iSCSISessionParseDiscoveryPair(void * context,
+                                           const iSCSIPDUTextSpan * key,
+                                           const iSCSIPDUTextSpan * value)
 {
-    static CFStringRef targetIQN = NULL;
+    iSCSISessionDiscoveryParser * parser = (iSCSISessionDiscoveryParser *)context;
+    CFStringRef * targetIQN = &parser->targetIQN;
+    iSCSIMutableDiscoveryRecRef discoveryRec = parser->discoveryRec;
     
     // If the discovery data has a "TargetName = xxx" field, we're starting
     // a record for a new target
-    if(CFStringCompare(key,kRFC3720_Key_TargetName,0) == kCFCompareEqualTo)
+    if(iSCSISessionSpanEqualsKey(key,kRFC3720_Key_TargetName))
     {
-        targetIQN = CFStringCreateCopy(kCFAllocatorDefault,val);
-        iSCSIMutableDiscoveryRecRef discoveryRec = (iSCSIMutableDiscoveryRecRef)(valContainer);
-        iSCSIDiscoveryRecAddTarget(discoveryRec,targetIQN);
+        CFStringRef name = iSCSISessionCreateStringWithSpan(value);
+        
+        if(!name)
+            return;
+        
+        if(*targetIQN)
+            CFRelease(*targetIQN);
+        
+        *targetIQN = name;
+        iSCSIDiscoveryRecAddTarget(discoveryRec,*targetIQN);
     }
     // Otherwise we're dealing with a portal entry. Per RFC3720, this is
     // of the form "TargetAddress = <address>:<port>,<portalGroupTag>
-    else if(CFStringCompare(key,kRFC3720_Key_TargetAddress,0) == kCFCompareEqualTo)
+    else if(iSCSISessionSpanEqualsKey(key,kRFC3720_Key_TargetAddress) && *targetIQN)
     {
-        // Split the value string to extract the portal group tag
-        CFArrayRef targetAddress = CFStringCreateArrayBySeparatingStrings(kCFAllocatorDefault,val,CFSTR(","));
-        CFStringRef addressAndPort = CFArrayGetValueAtIndex(targetAddress,0);
-        CFStringRef portalGroupTag = CFArrayGetValueAtIndex(targetAddress,1);
+        // Split the value to extract the portal group tag; skip malformed
+        // entries that don't have one
+        size_t separator = iSCSIPDUTextSpanFind(value,',',false);
         
-        // Split the address and port, construct an iSCSIPortal object (do the
-        // search for a ":" backwards since IPv6 addresses use ":" as
-        // separators and the address can be IPv4/IPv6 or a domain name.
-        CFRange sepRange = CFStringFind(addressAndPort,CFSTR(":"),kCFCompareBackwards);
-        CFRange addressRange = CFRangeMake(0,sepRange.location);
-        CFRange portRange = CFRangeMake(sepRange.location+1,CFStringGetLength(addressAndPort)-(sepRange.location+1));
+        if(separator == value->length)
+            return;
         
-        CFStringRef address = CFStringCreateWithSubstring(kCFAllocatorDefault,addressAndPort,addressRange);
-        CFStringRef port = CFStringCreateWithSubstring(kCFAllocatorDefault,addressAndPort,portRange);
+        iSCSIPDUTextSpan addressAndPort = { value->bytes, separator };
+        iSCSIPDUTextSpan portalGroupTagSpan = { value->bytes + separator + 1, value->length - separator - 1 };
         
-        iSCSIMutablePortalRef portal = iSCSIPortalCreateMutable();
-        iSCSIPortalSetAddress(portal,address);
-        iSCSIPortalSetPort(portal,port);
-        iSCSIPortalSetHostInterface(portal,kiSCSIDefaultHostInterface);
-    
-        iSCSIMutableDiscoveryRecRef discoveryRec = (iSCSIMutableDiscoveryRecRef)(valContainer);
-        iSCSIDiscoveryRecAddPortal(discoveryRec,targetIQN,portalGroupTag,portal);
+        // Split the address and port (do the search for a ":" backwards
+        // since IPv6 addresses use ":" as separators and the address can
+        // be IPv4/IPv6 or a domain name).  The port may be omitted.
+        iSCSIPDUTextSpan addressSpan = addressAndPort;
+        iSCSIPDUTextSpan portSpan = { NULL, 0 };
         
-        CFRelease(port);
-        CFRelease(address);
-        CFRelease(targetAddress);
-        if (targetIQN) {
-            CFRelease(targetIQN);
-            targetIQN = NULL;
+        separator = iSCSIPDUTextSpanFind(&addressAndPort,':',true);
+        size_t bracket = iSCSIPDUTextSpanFind(&addressAndPort,']',true);
+        
+        // A ":" inside a bracketed IPv6 address doesn't separate the port
+        if(separator < addressAndPort.length &&
+           (bracket == addressAndPort.length || bracket < separator))
+        {
+            addressSpan.length = separator;
+            portSpan.bytes = addressAndPort.bytes + separator + 1;
+            portSpan.length = addressAndPort.length - separator - 1;
         }
-        iSCSIPortalRelease(portal);
+        
+        CFStringRef address = iSCSISessionCreateStringWithSpan(&addressSpan);
+        CFStringRef port = portSpan.bytes ? iSCSISessionCreateStringWithSpan(&portSpan) :
+                                            CFRetain(kiSCSIDefaultPort);
+        CFStringRef portalGroupTag = iSCSISessionCreateStringWithSpan(&portalGroupTagSpan);
+        
+        if(address && port && portalGroupTag)
+        {
+            iSCSIMutablePortalRef portal = iSCSIPortalCreateMutable();
+            iSCSIPortalSetAddress(portal,address);
+            iSCSIPortalSetPort(portal,port);
+            iSCSIPortalSetHostInterface(portal,kiSCSIDefaultHostInterface);
+            
+            iSCSIDiscoveryRecAddPortal(discoveryRec,*targetIQN,portalGroupTag,portal);
+            iSCSIPortalRelease(portal);
+        }
+        
+        if(address)
+            CFRelease(address);
+        if(port)
+            CFRelease(port);
+        if(portalGroupTag)
+            CFRelease(portalGroupTag);
     }
 }
 
@@ -977,8 +1434,15 @@ errno_t iSCSIQueryPortalForTargets(iSCSISessionManagerRef managerRef,
     cmd.textReqStageFlags |= kiSCSIPDUTextReqFinalFlag;
     cmd.targetTransferTag = kiSCSIPDUTargetTransferTagReserved;
     
+    // Get response from iSCSI portal, continue until response is complete
+    iSCSIPDUTextRspBHS rsp;
+    UInt8 rspData[kiSCSIHBAInterfaceMaxRecvDataLength];
+    size_t rspLength = sizeof(rspData);
+    
+    // Send the request and receive the first response in one exchange
     iSCSIHBAInterfaceRef hbaInterface = iSCSISessionManagerGetHBAInterface(managerRef);
-    error = iSCSIHBAInterfaceSend(hbaInterface,sessionId,connectionId,(iSCSIPDUInitiatorBHS *)&cmd,data,length);
+    error = iSCSIHBAInterfaceExchange(hbaInterface,sessionId,connectionId,(iSCSIPDUInitiatorBHS *)&cmd,data,length,
+                                      (iSCSIPDUTargetBHS *)&rsp,rspData,&rspLength);
     
     iSCSIPDUDataRelease(&data);
     CFRelease(textCmd);
@@ -990,26 +1454,28 @@ errno_t iSCSIQueryPortalForTargets(iSCSISessionManagerRef managerRef,
         return error;
     }
     
-    // Get response from iSCSI portal, continue until response is complete
-    iSCSIPDUTextRspBHS rsp;
+    // Targets and portals are added to the record as each response arrives;
+    // pairs (and a target's portals) may span responses
+    iSCSISessionDiscoveryParser * parser = malloc(sizeof(iSCSISessionDiscoveryParser));
+    
+    if(!parser)
+    {
+        enum iSCSILogoutStatusCode statusCode;
+        iSCSISessionLogout(managerRef,sessionId,&statusCode);
+        return ENOMEM;
+    }
     
     *discoveryRec = iSCSIDiscoveryRecCreateMutable();
+    
+    iSCSIPDUTextStreamInit(&parser->stream);
+    parser->targetIQN = NULL;
+    parser->discoveryRec = *discoveryRec;
 
-    do {
-        if((error = iSCSIHBAInterfaceReceive(hbaInterface,sessionId,connectionId,(iSCSIPDUTargetBHS *)&rsp,&data,&length)))
-        {
-            iSCSIPDUDataRelease(&data);
-
-            enum iSCSILogoutStatusCode statusCode;
-            iSCSISessionLogout(managerRef,sessionId,&statusCode);
-
-            return error;
-        }
-     
+    while(true) {
         if(rsp.opCode == kiSCSIPDUOpCodeTextRsp)
         {
-            iSCSIPDUDataParseCommon(data,length,NULL,*discoveryRec,
-                                    &iSCSIPDUDataParseToDiscoveryRecCallback);
+            iSCSIPDUTextStreamScan(&parser->stream,rspData,rspLength,parser,
+                                   &iSCSISessionParseDiscoveryPair);
         }
         // For this case some other kind of PDU or invalid data was received
         else if(rsp.opCode == kiSCSIPDUOpCodeReject)
@@ -1017,10 +1483,37 @@ errno_t iSCSIQueryPortalForTargets(iSCSISessionManagerRef managerRef,
             error = EINVAL;
             break;
         }
+        
+        if(!(rsp.textReqStageBits & kiSCSIPDUTextReqContinueFlag))
+            break;
+        
+        // The target waits for an empty text request (carrying its target
+        // transfer tag) before sending the next part of the response
+        iSCSIPDUTextReqBHS continueCmd = iSCSIPDUTextReqBHSInit;
+        continueCmd.textReqStageFlags |= kiSCSIPDUTextReqFinalFlag;
+        continueCmd.initiatorTaskTag = rsp.initiatorTaskTag;
+        continueCmd.targetTransferTag = rsp.targetTransferTag;
+        
+        rspLength = sizeof(rspData);
+        
+        if((error = iSCSIHBAInterfaceExchange(hbaInterface,sessionId,connectionId,
+                                              (iSCSIPDUInitiatorBHS *)&continueCmd,NULL,0,
+                                              (iSCSIPDUTargetBHS *)&rsp,rspData,&rspLength)))
+        {
+            if(parser->targetIQN)
+                CFRelease(parser->targetIQN);
+            free(parser);
+
+            enum iSCSILogoutStatusCode statusCode;
+            iSCSISessionLogout(managerRef,sessionId,&statusCode);
+
+            return error;
+        }
     }
-    while(rsp.textReqStageBits & kiSCSIPDUTextReqContinueFlag);
-     
-    iSCSIPDUDataRelease(&data);
+    
+    if(parser->targetIQN)
+        CFRelease(parser->targetIQN);
+    free(parser);
     
     enum iSCSILogoutStatusCode logoutStatusCode;
     iSCSISessionLogout(managerRef,sessionId,&logoutStatusCode);
@@ -1080,7 +1573,7 @@ errno_t iSCSIQueryTargetForAuthMethod(iSCSISessionManagerRef managerRef,
     // Resolve information about the target
     struct sockaddr_storage ssTarget, ssHost;
     
-    if((error = iSCSIUtilsGetAddressForPortal(portal,&ssTarget,&ssHost)))
+    if((error = iSCSIUtilsSelectAddressForPortal(portal,&ssTarget,&ssHost)))
         return error;
     
     // Create a discovery session to the portal
@@ -1236,6 +1729,29 @@ iSCSIPortalRef iSCSISessionCopyPortalForConnectionId(iSCSISessionManagerRef mana
     return portal;
 }
 
+/*! Gets a snapshot of the parameters of a session and its connections.
+ *  @param hbaInterface the HBA interface.
+ *  @param sessionId the session identifier.
+ *  @param snapshot the snapshot (returned).
+ *  @return true if the snapshot was retrieved. */
+static Boolean iSCSISessionGetSnapshot(iSCSIHBAInterfaceRef hbaInterface,
+                                       SessionIdentifier sessionId,
+                                       iSCSIHBASessionSnapshot * snapshot)
+{
+    CFDataRef snapshots = iSCSIHBAInterfaceCreateSessionSnapshots(hbaInterface,sessionId);
+    
+    if(!snapshots)
+        return false;
+    
+    Boolean found = (CFDataGetLength(snapshots) >= (CFIndex)sizeof(iSCSIHBASessionSnapshot));
+    
+    if(found)
+        CFDataGetBytes(snapshots,CFRangeMake(0,sizeof(iSCSIHBASessionSnapshot)),(UInt8 *)snapshot);
+    
+    CFRelease(snapshots);
+    return found;
+}
+
 /*! Creates a dictionary of session parameters for the session associated with
  *  the specified target, if one exists.
  *  @param handle a handle to a daemon connection.
@@ -1256,64 +1772,44 @@ CFDictionaryRef iSCSISessionCopyCFPropertiesForTarget(iSCSISessionManagerRef man
     if(sessionId == kiSCSIInvalidSessionId)
         return NULL;
     
-    // Get session options from kernel
-    UInt32 paramVal32 = 0;
+    // Get session options from kernel (in a single call)
+    iSCSIHBASessionSnapshot snapshot;
+    if(!iSCSISessionGetSnapshot(hbaInterface,sessionId,&snapshot))
+        return NULL;
     
-    iSCSIHBAInterfaceGetSessionParameter(hbaInterface,sessionId,kiSCSIHBASOMaxConnections,&paramVal32,sizeof(paramVal32));
+    UInt32 paramVal32 = snapshot.maxConnections;
     CFNumberRef maxConnections = CFNumberCreate(kCFAllocatorDefault,kCFNumberIntType,&paramVal32);
 
-    iSCSIHBAInterfaceGetSessionParameter(hbaInterface,sessionId,kiSCSIHBASOMaxBurstLength,&paramVal32,sizeof(paramVal32));
+    paramVal32 = snapshot.maxBurstLength;
     CFNumberRef maxBurstLength = CFNumberCreate(kCFAllocatorDefault,kCFNumberIntType,&paramVal32);
 
-    iSCSIHBAInterfaceGetSessionParameter(hbaInterface,sessionId,kiSCSIHBASOFirstBurstLength,&paramVal32,sizeof(paramVal32));
+    paramVal32 = snapshot.firstBurstLength;
     CFNumberRef firstBurstLength = CFNumberCreate(kCFAllocatorDefault,kCFNumberIntType,&paramVal32);
 
-    iSCSIHBAInterfaceGetSessionParameter(hbaInterface,sessionId,kiSCSIHBASOMaxOutstandingR2T,&paramVal32,sizeof(paramVal32));
+    paramVal32 = snapshot.maxOutStandingR2T;
     CFNumberRef maxOutStandingR2T = CFNumberCreate(kCFAllocatorDefault,kCFNumberIntType,&paramVal32);
 
-    iSCSIHBAInterfaceGetSessionParameter(hbaInterface,sessionId,kiSCSIHBASODefaultTime2Retain,&paramVal32,sizeof(paramVal32));
+    paramVal32 = snapshot.defaultTime2Retain;
     CFNumberRef defaultTime2Retain = CFNumberCreate(kCFAllocatorDefault,kCFNumberIntType,&paramVal32);
     
-    iSCSIHBAInterfaceGetSessionParameter(hbaInterface,sessionId,kiSCSIHBASODefaultTime2Wait,&paramVal32,sizeof(paramVal32));
+    paramVal32 = snapshot.defaultTime2Wait;
     CFNumberRef defaultTime2Wait = CFNumberCreate(kCFAllocatorDefault,kCFNumberIntType,&paramVal32);
-    
 
-    TargetPortalGroupTag tpgt = 0;
-    iSCSIHBAInterfaceGetSessionParameter(hbaInterface,sessionId,kiSCSIHBASOTargetPortalGroupTag,&tpgt,sizeof(TargetPortalGroupTag));
+    TargetPortalGroupTag tpgt = snapshot.targetPortalGroupTag;
     CFNumberRef targetPortalGroupTag = CFNumberCreate(kCFAllocatorDefault,kCFNumberSInt16Type,&tpgt);
 
-    TargetSessionIdentifier tsih = 0;
-    iSCSIHBAInterfaceGetSessionParameter(hbaInterface,sessionId,kiSCSIHBASOTargetSessionId,&tsih,sizeof(TargetSessionIdentifier));
+    TargetSessionIdentifier tsih = snapshot.targetSessionId;
     CFNumberRef targetSessionId = CFNumberCreate(kCFAllocatorDefault,kCFNumberSInt16Type,&tsih);
 
-    UInt8 paramVal8 = 0;
-    iSCSIHBAInterfaceGetSessionParameter(hbaInterface,sessionId,kiSCSIHBASOErrorRecoveryLevel,&paramVal8,sizeof(paramVal8));
+    UInt8 paramVal8 = snapshot.errorRecoveryLevel;
     CFNumberRef errorRecoveryLevel = CFNumberCreate(kCFAllocatorDefault,kCFNumberSInt8Type,&paramVal8);
 
     CFNumberRef sessionIdentifier = CFNumberCreate(kCFAllocatorDefault,kCFNumberSInt16Type,&sessionId);
     
-    CFStringRef initialR2T = kRFC3720_Value_No;
-    CFStringRef immediateData = kRFC3720_Value_No;
-    CFStringRef dataPDUInOrder = kRFC3720_Value_No;
-    CFStringRef dataSequenceInOrder = kRFC3720_Value_No;
-
-    Boolean paramValBool = false;
-    
-    iSCSIHBAInterfaceGetSessionParameter(hbaInterface,sessionId,kiSCSIHBASOImmediateData,&paramValBool,sizeof(Boolean));
-    if(paramValBool)
-        immediateData = kRFC3720_Value_Yes;
-
-    iSCSIHBAInterfaceGetSessionParameter(hbaInterface,sessionId,kiSCSIHBASOInitialR2T,&paramValBool,sizeof(Boolean));
-    if(paramValBool)
-        initialR2T = kRFC3720_Value_Yes;
-
-    iSCSIHBAInterfaceGetSessionParameter(hbaInterface,sessionId,kiSCSIHBASODataPDUInOrder,&paramValBool,sizeof(Boolean));
-    if(paramValBool)
-        dataPDUInOrder = kRFC3720_Value_Yes;
-
-    iSCSIHBAInterfaceGetSessionParameter(hbaInterface,sessionId,kiSCSIHBASODataSequenceInOrder,&paramValBool,sizeof(Boolean));
-    if(paramValBool)
-        dataSequenceInOrder = kRFC3720_Value_Yes;
+    CFStringRef initialR2T = snapshot.initialR2T ? kRFC3720_Value_Yes : kRFC3720_Value_No;
+    CFStringRef immediateData = snapshot.immediateData ? kRFC3720_Value_Yes : kRFC3720_Value_No;
+    CFStringRef dataPDUInOrder = snapshot.dataPDUInOrder ? kRFC3720_Value_Yes : kRFC3720_Value_No;
+    CFStringRef dataSequenceInOrder = snapshot.dataSequenceInOrder ? kRFC3720_Value_Yes : kRFC3720_Value_No;
 
     const void * keys[] = {
         kRFC3720_Key_InitialR2T,
@@ -1353,6 +1849,10 @@ CFDictionaryRef iSCSISessionCopyCFPropertiesForTarget(iSCSISessionManagerRef man
                                     sizeof(keys)/sizeof(void*),
                                     &kCFTypeDictionaryKeyCallBacks,
                                     &kCFTypeDictionaryValueCallBacks);
+    
+    // The dictionary retains the numbers (the first four values are constants)
+    for(CFIndex idx = 4; idx < sizeof(values)/sizeof(void*); idx++)
+        CFRelease(values[idx]);
 
     return dictionary;
 }
@@ -1385,31 +1885,31 @@ CFDictionaryRef iSCSISessionCopyCFPropertiesForPortal(iSCSISessionManagerRef man
     if(connectionId == kiSCSIInvalidConnectionId)
         return NULL;
     
-    // Get connection options from kernel
-
-    UInt32 paramVal32 = 0;
-    iSCSIHBAInterfaceGetConnectionParameter(hbaInterface,sessionId,connectionId,kiSCSIHBACOMaxRecvDataSegmentLength,&paramVal32,sizeof(paramVal32));
-    CFNumberRef maxRecvDataSegmentLength = CFNumberCreate(kCFAllocatorDefault,kCFNumberIntType,&paramVal32);
+    // Get connection options from kernel (in a single call)
+    iSCSIHBASessionSnapshot snapshot;
+    if(!iSCSISessionGetSnapshot(hbaInterface,sessionId,&snapshot))
+        return NULL;
     
-    CFNumberRef connectionIdentifier = CFNumberCreate(kCFAllocatorDefault,kCFNumberIntType,&connectionId);
+    const iSCSIHBAConnectionSnapshot * connSnapshot = NULL;
     
+    for(UInt32 idx = 0; idx < snapshot.connectionCount && idx < kiSCSIMaxConnectionsPerSession; idx++)
+        if(snapshot.connections[idx].connectionId == connectionId)
+            connSnapshot = &snapshot.connections[idx];
+    
+    if(!connSnapshot)
+        return NULL;
 
-    enum iSCSIDigestTypes dataDigestType = kiSCSIDigestNone;
-    enum iSCSIDigestTypes headerDigestType = kiSCSIDigestNone;
-
-    Boolean paramValBool = false;
+    UInt32 paramVal32 = connSnapshot->maxRecvDataSegmentLength;
+    CFNumberRef maxRecvDataSegmentLength = CFNumberCreate(kCFAllocatorDefault,kCFNumberIntType,&paramVal32);
     
-    iSCSIHBAInterfaceGetConnectionParameter(hbaInterface,sessionId,connectionId,kiSCSIHBACOUseDataDigest,&paramValBool,sizeof(Boolean));
-    if(paramValBool)
-        dataDigestType = kiSCSIDigestCRC32C;
+    CFNumberRef connectionIdentifier = CFNumberCreate(kCFAllocatorDefault,kCFNumberIntType,&connectionId);
 
-    iSCSIHBAInterfaceGetConnectionParameter(hbaInterface,sessionId,connectionId,kiSCSIHBACOUseHeaderDigest,&paramValBool,sizeof(Boolean));
-    if(paramValBool)
-        dataDigestType = kiSCSIDigestCRC32C;
+    CFIndex dataDigestType = connSnapshot->useDataDigest ? kiSCSIDigestCRC32C : kiSCSIDigestNone;
+    CFIndex headerDigestType = connSnapshot->useHeaderDigest ? kiSCSIDigestCRC32C : kiSCSIDigestNone;
 
     CFNumberRef dataDigest = CFNumberCreate(kCFAllocatorDefault,
-                                            kCFNumberCFIndexType
-                                            ,&dataDigestType);
+                                            kCFNumberCFIndexType,
+                                            &dataDigestType);
 
     CFNumberRef headerDigest = CFNumberCreate(kCFAllocatorDefault,
                                               kCFNumberCFIndexType,
@@ -1432,6 +1932,10 @@ CFDictionaryRef iSCSISessionCopyCFPropertiesForPortal(iSCSISessionManagerRef man
                                     sizeof(keys)/sizeof(void*),
                                     &kCFTypeDictionaryKeyCallBacks,
                                     &kCFTypeDictionaryValueCallBacks);
+    
+    for(CFIndex idx = 0; idx < sizeof(values)/sizeof(void*); idx++)
+        CFRelease(values[idx]);
+    
     return dictionary;
 }
 
@@ -58,6 +58,45 @@ errno_t iSCSISessionLogin(iSCSISessionManagerRef managerRef,
                           ConnectionIdentifier * connectionId,
                           enum iSCSILoginStatusCode * statusCode);
 
+/*! Restores the connection of a session that has lost all of its
+ *  connections (e.g., after a network timeout), using the parameters that
+ *  were negotiated when the session was created.  Instead of a full login
+ *  the initiator proposes exactly those values in a single operational
+ *  exchange, which the target can accept as-is.  When no authentication is
+ *  used the security stage is skipped as well, so that the connection is
+ *  restored in a single round trip.  If the session negotiated an error
+ *  recovery level above zero the target may still hold the session, and the
+ *  connection is added to it by presenting the session's TSIH; otherwise
+ *  (or if the target no longer knows the session) the session is reinstated.
+ *  @param managerRef a session manager instance.
+ *  @param sessionId the session to reconnect.
+ *  @param portal specifies the portal to use for the connection.
+ *  @param initiatorAuth specifies the initiator authentication parameters.
+ *  @param targetAuth specifies the target authentication parameters.
+ *  @param connectionId the new connection identifier.
+ *  @param statusCode iSCSI response code indicating operation status.
+ *  @return an error code indicating whether the operation was successful;
+ *  ENOENT if no negotiated parameters are known for the session and EBUSY
+ *  if the session still has connections (a regular login is required). */
+errno_t iSCSISessionReconnect(iSCSISessionManagerRef managerRef,
+                              SessionIdentifier sessionId,
+                              iSCSIPortalRef portal,
+                              iSCSIAuthRef initiatorAuth,
+                              iSCSIAuthRef targetAuth,
+                              ConnectionIdentifier * connectionId,
+                              enum iSCSILoginStatusCode * statusCode);
+
+/*! Suspends an iSCSI session (e.g., before the system sleeps).  All of the
+ *  connections of the session are logged out and released, but the session
+ *  itself and its SCSI target are kept so that mounted volumes remain
+ *  available.  The session is later restored with iSCSISessionReconnect.
+ *  @param managerRef a session manager instance.
+ *  @param sessionId the session to suspend.
+ *  @return an error code indicating whether the operation was successful;
+ *  ENOTSUP if the kernel extension cannot keep the target. */
+errno_t iSCSISessionSuspend(iSCSISessionManagerRef managerRef,
+                            SessionIdentifier sessionId);
+
 /*! Closes the iSCSI connection and frees the session qualifier.
  *  @param managerRef a session manager instance.
  *  @param sessionId the session to free. */
@@ -31,6 +31,15 @@
 #include "iSCSISession.h"
 #include "iSCSIHBAInterface.h"
 
+#include <asl.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <mach/mach_time.h>
+#include <pthread.h>
+
 /*! Name of the initiator. */
 CFStringRef kiSCSIInitiatorIQN = CFSTR("iqn.2015-01.com.localhost");
 
@@ -45,30 +54,190 @@ struct __iSCSISessionManager
     CFStringRef initiatorName;
     CFStringRef initiatorAlias;
     
+    /*! Parameters last negotiated with each target, keyed by target name. */
+    CFMutableDictionaryRef negotiatedParameters;
+    
+    /*! Protects negotiatedParameters (logins run on worker threads). */
+    pthread_mutex_t negotiatedParametersMutex;
+    
+    /*! Target and portals (of the connections that timed out) of sessions
+     *  that timed out, indexed by session identifier.  Timeouts are
+     *  collected while a batch of notifications is processed so that the
+     *  callback runs once per session. */
+    iSCSITargetRef timeoutTargets[kiSCSIMaxSessions];
+    CFMutableArrayRef timeoutPortals[kiSCSIMaxSessions];
+    
+    /*! Runloop source used to report collected timeouts once the current
+     *  batch of notifications has been processed (NULL if not scheduled). */
+    CFRunLoopSourceRef timeoutSource;
+    
 };
 
+/*! Directory to which PDU traces of failed connections are written.  The
+ *  directory is owned by root and only accessible to root. */
+static const char * kiSCSIPDUTraceDirectory = "/var/db/iscsid";
+
+/*! Opens the PDU trace directory, creating it if required, and verifies
+ *  that it is a directory that only root can access.
+ *  @return a file descriptor for the directory, or -1 on failure. */
+static int iSCSISessionManagerOpenPDUTraceDirectory()
+{
+    if(mkdir(kiSCSIPDUTraceDirectory,S_IRWXU) && errno != EEXIST)
+        return -1;
+    
+    int dirfd = open(kiSCSIPDUTraceDirectory,O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    
+    if(dirfd < 0)
+        return -1;
+    
+    struct stat info;
+    
+    if(fstat(dirfd,&info) || !S_ISDIR(info.st_mode) ||
+       info.st_uid != geteuid() || (info.st_mode & (S_IRWXG | S_IRWXO))) {
+        asl_log(NULL,NULL,ASL_LEVEL_ERR,"%s is not a private directory, PDU trace not written",
+                kiSCSIPDUTraceDirectory);
+        close(dirfd);
+        return -1;
+    }
+    
+    return dirfd;
+}
+
+/*! Writes the PDU trace of a connection to a binary capture file so that the
+ *  PDU exchange leading up to a failure can be decoded and replayed offline.
+ *  The file contains an iSCSIHBAPDUTraceFileHeader followed by the raw
+ *  iSCSIHBAPDUTraceRecord array, oldest first.
+ *  @param managerRef the session manager.
+ *  @param sessionId the session identifier.
+ *  @param connectionId the connection identifier. */
+static void iSCSISessionManagerWritePDUTrace(iSCSISessionManagerRef managerRef,
+                                             SessionIdentifier sessionId,
+                                             ConnectionIdentifier connectionId)
+{
+    UInt32 totalRecords = 0;
+    CFDataRef trace = iSCSIHBAInterfaceCreatePDUTrace(managerRef->hbaInterface,sessionId,
+                                                      connectionId,&totalRecords);
+    if(!trace)
+        return;
+    
+    int dirfd = iSCSISessionManagerOpenPDUTraceDirectory();
+    
+    if(dirfd < 0) {
+        CFRelease(trace);
+        return;
+    }
+    
+    char name[NAME_MAX];
+    snprintf(name,sizeof(name),"iscsid-sid%u-cid%u.pdutrace",sessionId,connectionId);
+    
+    // Replace the trace of an earlier connection with the same identifiers
+    unlinkat(dirfd,name,0);
+    
+    int fd = openat(dirfd,name,O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW,S_IRUSR | S_IWUSR);
+    
+    if(fd >= 0) {
+        mach_timebase_info_data_t timebase;
+        mach_timebase_info(&timebase);
+        
+        CFIndex length = CFDataGetLength(trace);
+        
+        iSCSIHBAPDUTraceFileHeader header;
+        bzero(&header,sizeof(header));
+        header.magic = kiSCSIHBAPDUTraceFileMagic;
+        header.version = kiSCSIHBAPDUTraceFileVersion;
+        header.recordSize = sizeof(iSCSIHBAPDUTraceRecord);
+        header.timebaseNumer = timebase.numer;
+        header.timebaseDenom = timebase.denom;
+        header.recordCount = (UInt32)(length/sizeof(iSCSIHBAPDUTraceRecord));
+        header.totalRecords = totalRecords;
+        header.sessionId = sessionId;
+        header.connectionId = connectionId;
+        
+        if(write(fd,&header,sizeof(header)) == sizeof(header) &&
+           write(fd,CFDataGetBytePtr(trace),length) == length)
+            asl_log(NULL,NULL,ASL_LEVEL_NOTICE,"wrote %u of %u PDU trace records to %s/%s",
+                    header.recordCount,totalRecords,kiSCSIPDUTraceDirectory,name);
+        close(fd);
+    }
+    
+    close(dirfd);
+    CFRelease(trace);
+}
+
+/*! Runloop source callback; reports the timeouts collected while the last
+ *  batch of notifications was processed, once for each session. */
+static void iSCSISessionManagerReportTimeouts(void * info)
+{
+    iSCSISessionManagerRef managerRef = (iSCSISessionManagerRef)info;
+    
+    for(SessionIdentifier sessionId = 0; sessionId < kiSCSIMaxSessions; sessionId++)
+    {
+        iSCSITargetRef target = managerRef->timeoutTargets[sessionId];
+        CFMutableArrayRef portals = managerRef->timeoutPortals[sessionId];
+        
+        if(!target)
+            continue;
+        
+        managerRef->timeoutTargets[sessionId] = NULL;
+        managerRef->timeoutPortals[sessionId] = NULL;
+        
+        // Call user-defined callback function if one exists
+        if(managerRef->callbacks.timeoutCallback)
+            managerRef->callbacks.timeoutCallback(target,portals);
+        
+        iSCSITargetRelease(target);
+        if(portals)
+            CFRelease(portals);
+    }
+}
+
 /*! This function is called handle session or connection network timeouts.
  *  When a timeout occurs the kernel deactivates the session and connection.
  *  The session layer (this layer) must release the connection after propogating 
- *  the notification onto the user of the session manager. */
+ *  the notification onto the user of the session manager.  When several
+ *  connections of a session time out together (e.g., during a storage
+ *  failover) the user is notified once for the session. */
  void iSCSIHBANotificationTimeoutMessageHandler(iSCSISessionManagerRef managerRef,
                                                 iSCSIHBANotificationMessage * msg)
  {
+     if(msg->sessionId >= kiSCSIMaxSessions)
+         return;
+     
      // Retrieve the target name and portal address associated with
      // the timeout. Pass information along to pre-designated runloop
      // so that clients of this layer can act
      iSCSITargetRef target = iSCSISessionCopyTargetForId(managerRef,msg->sessionId);
      iSCSIPortalRef portal = iSCSISessionCopyPortalForConnectionId(managerRef,msg->sessionId,msg->connectionId);
      
+     // Preserve the PDU trace of the connection before it is released
+     iSCSISessionManagerWritePDUTrace(managerRef,msg->sessionId,msg->connectionId);
+     
      // Release the stale session/connection
      iSCSIHBAInterfaceReleaseConnection(managerRef->hbaInterface,msg->sessionId,msg->connectionId);
      
-     // Call user-defined callback function if one exists
-     if(managerRef->callbacks.timeoutCallback)
-         managerRef->callbacks.timeoutCallback(target,portal);
+     // Collect the portals of all connections of a session that time out
+     // in the same batch
+     if(target && !managerRef->timeoutTargets[msg->sessionId]) {
+         managerRef->timeoutTargets[msg->sessionId] = target;
+         managerRef->timeoutPortals[msg->sessionId] = CFArrayCreateMutable(managerRef->allocator,0,&kCFTypeArrayCallBacks);
+     }
+     else if(target)
+         iSCSITargetRelease(target);
+     
+     CFMutableArrayRef portals = managerRef->timeoutPortals[msg->sessionId];
+     
+     if(portal) {
+         if(portals && !CFArrayContainsValue(portals,CFRangeMake(0,CFArrayGetCount(portals)),portal))
+             CFArrayAppendValue(portals,portal);
+         iSCSIPortalRelease(portal);
+     }
      
-     iSCSITargetRelease(target);
-     iSCSIPortalRelease(portal);
+     // Report once the batch has been processed, or right away if the
+     // session manager is not scheduled on a runloop
+     if(managerRef->timeoutSource)
+         CFRunLoopSourceSignal(managerRef->timeoutSource);
+     else
+         iSCSISessionManagerReportTimeouts(managerRef);
  }
  
 /*! Called to handle asynchronous events that involve dropped sessions, connections, 
@@ -144,6 +313,13 @@ iSCSISessionManagerRef iSCSISessionManagerCreate(CFAllocatorRef allocator,
         managerRef->callbacks = callbacks;
         managerRef->initiatorName = kiSCSIInitiatorIQN;
         managerRef->initiatorAlias = kiSCSIInitiatorAlias;
+        managerRef->negotiatedParameters = CFDictionaryCreateMutable(allocator,0,
+                                                                     &kCFTypeDictionaryKeyCallBacks,
+                                                                     &kCFTypeDictionaryValueCallBacks);
+        pthread_mutex_init(&managerRef->negotiatedParametersMutex,NULL);
+        memset(managerRef->timeoutTargets,0,sizeof(managerRef->timeoutTargets));
+        memset(managerRef->timeoutPortals,0,sizeof(managerRef->timeoutPortals));
+        managerRef->timeoutSource = NULL;
     }
     else {
         CFAllocatorDeallocate(allocator,managerRef);
@@ -159,6 +335,21 @@ iSCSISessionManagerRef iSCSISessionManagerCreate(CFAllocatorRef allocator,
  *  @param managerRef an instance of an iSCSISessionManagerRef. */
 void iSCSISessionManagerRelease(iSCSISessionManagerRef managerRef)
 {
+    // Drop timeouts that were never reported
+    for(SessionIdentifier sessionId = 0; sessionId < kiSCSIMaxSessions; sessionId++) {
+        if(managerRef->timeoutTargets[sessionId])
+            iSCSITargetRelease(managerRef->timeoutTargets[sessionId]);
+        if(managerRef->timeoutPortals[sessionId])
+            CFRelease(managerRef->timeoutPortals[sessionId]);
+    }
+    
+    if(managerRef->timeoutSource) {
+        CFRunLoopSourceInvalidate(managerRef->timeoutSource);
+        CFRelease(managerRef->timeoutSource);
+    }
+    
+    CFRelease(managerRef->negotiatedParameters);
+    pthread_mutex_destroy(&managerRef->negotiatedParametersMutex);
     CFAllocatorDeallocate(managerRef->allocator,managerRef);
 }
 
@@ -174,6 +365,18 @@ void iSCSISessionManagerScheduleWithRunLoop(iSCSISessionManagerRef managerRef,
                                             CFStringRef runLoopMode)
 {
     iSCSIHBAInterfaceScheduleWithRunloop(managerRef->hbaInterface,runLoop,runLoopMode);
+    
+    if(!managerRef->timeoutSource) {
+        CFRunLoopSourceContext sourceContext;
+        bzero(&sourceContext,sizeof(sourceContext));
+        sourceContext.info = managerRef;
+        sourceContext.perform = iSCSISessionManagerReportTimeouts;
+        
+        managerRef->timeoutSource = CFRunLoopSourceCreate(managerRef->allocator,0,&sourceContext);
+    }
+    
+    if(managerRef->timeoutSource)
+        CFRunLoopAddSource(runLoop,managerRef->timeoutSource,runLoopMode);
 }
 
 /*! Unschedules execution of various tasks, including handling of session notifications
@@ -186,6 +389,9 @@ void iSCSISessionManagerUnscheduleWithRunloop(iSCSISessionManagerRef managerRef,
                                               CFStringRef runLoopMode)
 {
     iSCSIHBAInterfaceScheduleWithRunloop(managerRef->hbaInterface,runLoop,runLoopMode);
+    
+    if(managerRef->timeoutSource)
+        CFRunLoopRemoveSource(runLoop,managerRef->timeoutSource,runLoopMode);
 }
 
 /*! Returns a reference to the underlying HBA interface instance.
@@ -217,3 +423,42 @@ void iSCSISessionManagerSetInitiatorAlias(iSCSISessionManagerRef managerRef,
     CFRelease(managerRef->initiatorAlias);
     managerRef->initiatorAlias = CFStringCreateCopy(kCFAllocatorDefault,initiatorAlias);
 }
+
+/*! Stores the parameters negotiated for the session with a target so that
+ *  lost connections can be re-established quickly (see
+ *  iSCSISessionReconnect()).  Safe to call from any thread.
+ *  @param managerRef an instance of an iSCSISessionManagerRef.
+ *  @param targetIQN the name of the target.
+ *  @param parameters the negotiated parameters, or NULL to discard them. */
+void iSCSISessionManagerSetNegotiatedParameters(iSCSISessionManagerRef managerRef,
+                                                CFStringRef targetIQN,
+                                                CFDictionaryRef parameters)
+{
+    pthread_mutex_lock(&managerRef->negotiatedParametersMutex);
+    
+    if(parameters)
+        CFDictionarySetValue(managerRef->negotiatedParameters,targetIQN,parameters);
+    else
+        CFDictionaryRemoveValue(managerRef->negotiatedParameters,targetIQN);
+    
+    pthread_mutex_unlock(&managerRef->negotiatedParametersMutex);
+}
+
+/*! Copies the parameters that were last negotiated for the session with a
+ *  target.  Safe to call from any thread.
+ *  @param managerRef an instance of an iSCSISessionManagerRef.
+ *  @param targetIQN the name of the target.
+ *  @return the negotiated parameters, or NULL if none are known. */
+CFDictionaryRef iSCSISessionManagerCopyNegotiatedParameters(iSCSISessionManagerRef managerRef,
+                                                            CFStringRef targetIQN)
+{
+    pthread_mutex_lock(&managerRef->negotiatedParametersMutex);
+    
+    CFDictionaryRef parameters = CFDictionaryGetValue(managerRef->negotiatedParameters,targetIQN);
+    
+    if(parameters)
+        CFRetain(parameters);
+    
+    pthread_mutex_unlock(&managerRef->negotiatedParametersMutex);
+    return parameters;
+}
@@ -36,8 +36,10 @@
 /*! Opaque session manager reference. */
 typedef struct __iSCSISessionManager * iSCSISessionManagerRef;
 
-/*! Callback function called when a session or connection timeout occurs. */
-typedef void (*iSCSISessionTimeoutCallback)(iSCSITargetRef target,iSCSIPortalRef portal);
+/*! Callback function called when a session or connection timeout occurs.
+ *  The portals are those of the connections of the session that timed out
+ *  (one or more). */
+typedef void (*iSCSISessionTimeoutCallback)(iSCSITargetRef target,CFArrayRef portals);
     
 /*! Callback types used by the session manager. */
 typedef struct iSCSISessionManagerCallBacks
@@ -99,5 +101,23 @@ void iSCSISessionManagerSetInitiatorName(iSCSISessionManagerRef managerRef,
 void iSCSISessionManagerSetInitiatorAlias(iSCSISessionManagerRef managerRef,
                                           CFStringRef initiatorAlias);
 
+/*! Stores the parameters negotiated for the session with a target so that
+ *  lost connections can be re-established quickly (see
+ *  iSCSISessionReconnect()).  Safe to call from any thread.
+ *  @param managerRef an instance of an iSCSISessionManagerRef.
+ *  @param targetIQN the name of the target.
+ *  @param parameters the negotiated parameters, or NULL to discard them. */
+void iSCSISessionManagerSetNegotiatedParameters(iSCSISessionManagerRef managerRef,
+                                                CFStringRef targetIQN,
+                                                CFDictionaryRef parameters);
+
+/*! Copies the parameters that were last negotiated for the session with a
+ *  target.  Safe to call from any thread.
+ *  @param managerRef an instance of an iSCSISessionManagerRef.
+ *  @param targetIQN the name of the target.
+ *  @return the negotiated parameters, or NULL if none are known. */
+CFDictionaryRef iSCSISessionManagerCopyNegotiatedParameters(iSCSISessionManagerRef managerRef,
+                                                            CFStringRef targetIQN);
+
 
 #endif
@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2016, Nareg Sinenian
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Replays inputs through a fuzzing harness without libFuzzer, so that the
+// seed corpus (and any crashing inputs) can be run with any C compiler.
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+int LLVMFuzzerTestOneInput(const uint8_t * data,size_t size);
+
+int main(int argc,char * argv[])
+{
+    for(int argIdx = 1; argIdx < argc; argIdx++)
+    {
+        FILE * file = fopen(argv[argIdx],"rb");
+        
+        if(!file) {
+            fprintf(stderr,"%s: cannot open %s\n",argv[0],argv[argIdx]);
+            return EXIT_FAILURE;
+        }
+        
+        fseek(file,0,SEEK_END);
+        long size = ftell(file);
+        fseek(file,0,SEEK_SET);
+        
+        uint8_t * data = malloc(size > 0 ? (size_t)size : 1);
+        size_t length = data ? fread(data,1,(size_t)size,file) : 0;
+        fclose(file);
+        
+        if(!data || length != (size_t)size) {
+            fprintf(stderr,"%s: cannot read %s\n",argv[0],argv[argIdx]);
+            free(data);
+            return EXIT_FAILURE;
+        }
+        
+        LLVMFuzzerTestOneInput(data,length);
+        free(data);
+    }
+    return EXIT_SUCCESS;
+}
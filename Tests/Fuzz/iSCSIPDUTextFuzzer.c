@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) 2016, Nareg Sinenian
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Fuzzing harness for the receive side of login, text and Data-In PDUs.
+// The input is treated as the byte stream read from a connection: it is
+// split into PDUs using the checks shared with the kernel receive path
+// (iSCSIPDUValidation.h), and the data segments of login and text
+// responses are scanned for key=value pairs, both one segment at a time and
+// as a continued stream.  The data segments of Data-In PDUs are placed in
+// a task buffer of the expected transfer length, as the kernel does.
+//
+// Build with libFuzzer (clang -fsanitize=fuzzer) or AFL++ (afl-clang-fast
+// with its libFuzzer driver).  Linked with FuzzerMain.c instead, the harness
+// replays the files given on the command line (e.g., the seed corpus).
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "iSCSIPDUText.h"
+#include "iSCSIPDUValidation.h"
+
+/*! Data segment length the initiator declares (RFC3720 default). */
+#define kMaxRecvDataSegmentLength 8192
+
+/*! Transfer length assumed for Data-In PDUs. */
+#define kExpectedDataTransferLength 65536
+
+/*! PDU opcodes and flags used by the harness (see iSCSIPDUShared.h). */
+#define kOpCodeMask         0x3F
+#define kOpCodeLoginRsp     0x23
+#define kOpCodeTextRsp      0x24
+#define kOpCodeDataIn       0x25
+#define kContinueFlag       0x40
+#define kDataInFinalFlag    0x80
+#define kDataInStatusFlag   0x01
+
+/*! Bounds of the buffers that spans may legitimately point into. */
+typedef struct FuzzBounds {
+    const uint8_t * segment;
+    size_t segmentLength;
+    const iSCSIPDUTextStream * stream;
+    size_t pairs;
+} FuzzBounds;
+
+static int SpanWithin(const iSCSIPDUTextSpan * span,const uint8_t * bytes,size_t length)
+{
+    return span->bytes >= bytes && span->length <= length &&
+           (size_t)(span->bytes - bytes) <= length - span->length;
+}
+
+static void CheckPair(const FuzzBounds * bounds,
+                      const iSCSIPDUTextSpan * key,
+                      const iSCSIPDUTextSpan * value)
+{
+    // Spans point into the data segment or into the carry buffer
+    int inSegment = SpanWithin(key,bounds->segment,bounds->segmentLength) &&
+                    SpanWithin(value,bounds->segment,bounds->segmentLength);
+    int inCarry = bounds->stream &&
+                  SpanWithin(key,bounds->stream->carry,sizeof(bounds->stream->carry)) &&
+                  SpanWithin(value,bounds->stream->carry,sizeof(bounds->stream->carry));
+    
+    assert(inSegment || inCarry);
+    
+    // Keys never contain '=' and neither keys nor values contain a null
+    assert(!memchr(key->bytes,'=',key->length));
+    assert(!memchr(key->bytes,0,key->length));
+    assert(!memchr(value->bytes,0,value->length));
+    assert(value->bytes == key->bytes + key->length + 1);
+}
+
+static void StreamCallback(void * context,
+                           const iSCSIPDUTextSpan * key,
+                           const iSCSIPDUTextSpan * value)
+{
+    FuzzBounds * bounds = (FuzzBounds *)context;
+    CheckPair(bounds,key,value);
+    bounds->pairs++;
+}
+
+static void ScanSegment(const uint8_t * segment,size_t length)
+{
+    FuzzBounds bounds = { segment, length, NULL, 0 };
+    iSCSIPDUTextSpan key, value;
+    size_t offset = 0, previousOffset = 0;
+    
+    while(iSCSIPDUTextGetNextPair(segment,length,&offset,&key,&value)) {
+        CheckPair(&bounds,&key,&value);
+        assert(offset > previousOffset && offset <= length);
+        previousOffset = offset;
+    }
+    assert(offset == length);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t * data,size_t size)
+{
+    static iSCSIPDUTextStream stream;
+    size_t offset = 0;
+    
+    iSCSIPDUTextStreamInit(&stream);
+    
+    // Data-In segments are copied into a buffer of exactly the transfer
+    // length, so that a placement the checks let through is caught by the
+    // sanitizers rather than only by an assertion
+    uint8_t * taskBuffer = malloc(kExpectedDataTransferLength);
+    uint64_t realizedLength = 0;
+    assert(taskBuffer);
+    
+    // The input as a whole is also a valid (if unusual) data segment
+    ScanSegment(data,size);
+    
+    while(size - offset >= kiSCSIPDUValidationBHSSize)
+    {
+        const uint8_t * bhs = data + offset;
+        uint8_t opCode = bhs[0] & kOpCodeMask;
+        iSCSIPDUFrame frame;
+        
+        offset += kiSCSIPDUValidationBHSSize;
+        
+        // Oversized data segments and truncated PDUs drop the connection
+        if(!iSCSIPDUFrameDecode(bhs,kMaxRecvDataSegmentLength,&frame) ||
+           size - offset < (size_t)frame.ahsLength + frame.paddedDataSegmentLength)
+            break;
+        
+        assert(frame.dataSegmentLength <= kMaxRecvDataSegmentLength);
+        assert(frame.paddedDataSegmentLength - frame.dataSegmentLength < 4);
+        
+        offset += frame.ahsLength;
+        const uint8_t * segment = data + offset;
+        size_t dataSegmentLength = frame.dataSegmentLength;
+        offset += frame.paddedDataSegmentLength;
+        
+        if(opCode == kOpCodeLoginRsp || opCode == kOpCodeTextRsp)
+        {
+            ScanSegment(segment,dataSegmentLength);
+            
+            FuzzBounds bounds = { segment, dataSegmentLength, &stream, 0 };
+            iSCSIPDUTextStreamScan(&stream,segment,dataSegmentLength,&bounds,&StreamCallback);
+            assert(stream.carryLength <= sizeof(stream.carry));
+            
+            // The final response of a sequence ends the stream
+            if(!(bhs[1] & kContinueFlag))
+                iSCSIPDUTextStreamInit(&stream);
+        }
+        else if(opCode == kOpCodeDataIn && dataSegmentLength > 0)
+        {
+            uint32_t bufferOffset = ((uint32_t)bhs[40] << 24) | ((uint32_t)bhs[41] << 16) |
+                                    ((uint32_t)bhs[42] << 8)  | bhs[43];
+            
+            // Data outside of the transfer fails the task and drops the
+            // connection
+            if(!iSCSIPDUDataInIsWithinTransfer(bufferOffset,frame.dataSegmentLength,
+                                               kExpectedDataTransferLength))
+                break;
+            
+            memcpy(taskBuffer + bufferOffset,segment,dataSegmentLength);
+            
+            if(bufferOffset + dataSegmentLength > realizedLength)
+                realizedLength = bufferOffset + dataSegmentLength;
+            
+            assert(realizedLength <= kExpectedDataTransferLength);
+            
+            // A PDU with status completes the task; the next Data-In PDU
+            // belongs to another task
+            if((bhs[1] & kDataInFinalFlag) && (bhs[1] & kDataInStatusFlag))
+                realizedLength = 0;
+        }
+    }
+    
+    free(taskBuffer);
+    return 0;
+}
@@ -0,0 +1,324 @@
+/*
+ * Copyright (c) 2016, Nareg Sinenian
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Tests the notification ring shared by the kernel extension and iscsid.
+// The kernel's producer and the daemon's consumer are modeled by two
+// threads; mach messages are modeled by a queue that may lose signals.
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "iSCSIHBANotificationRing.h"
+
+static int failures = 0;
+
+#define CHECK(condition) do { \
+    if(!(condition)) { \
+        fprintf(stderr,"%s:%d: check failed: %s\n",__FILE__,__LINE__,#condition); \
+        failures++; \
+    } \
+} while(0)
+
+/*! Message types of the simulated message queue. */
+enum { kMessageSignal, kMessageBypass };
+
+/*! A message sent by the simulated producer. */
+typedef struct Message {
+    int type;
+    uint64_t sequence;
+} Message;
+
+/*! Simulated mach port: an unbounded FIFO of messages. */
+typedef struct MessageQueue {
+    pthread_mutex_t lock;
+    pthread_cond_t available;
+    Message * messages;
+    size_t head, tail, capacity;
+} MessageQueue;
+
+static void MessageQueueSend(MessageQueue * queue,Message message)
+{
+    pthread_mutex_lock(&queue->lock);
+    
+    if(queue->tail == queue->capacity) {
+        queue->capacity = queue->capacity ? queue->capacity*2 : 64;
+        queue->messages = realloc(queue->messages,queue->capacity*sizeof(Message));
+    }
+    queue->messages[queue->tail++] = message;
+    
+    pthread_cond_signal(&queue->available);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static int MessageQueueReceive(MessageQueue * queue,Message * message,int waitMs)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME,&deadline);
+    deadline.tv_nsec += (long)waitMs*1000000;
+    deadline.tv_sec += deadline.tv_nsec/1000000000;
+    deadline.tv_nsec %= 1000000000;
+    
+    pthread_mutex_lock(&queue->lock);
+    
+    while(queue->head == queue->tail)
+        if(pthread_cond_timedwait(&queue->available,&queue->lock,&deadline)) {
+            pthread_mutex_unlock(&queue->lock);
+            return 0;
+        }
+    
+    *message = queue->messages[queue->head++];
+    pthread_mutex_unlock(&queue->lock);
+    return 1;
+}
+
+/*! State shared by the simulated kernel and daemon. */
+typedef struct Simulation {
+    iSCSIHBANotificationRing ring;
+    iSCSIHBANotificationRingProducer producer;
+    pthread_mutex_t producerLock;
+    MessageQueue queue;
+    unsigned int lossRate;
+    unsigned int seed;
+    uint64_t received;
+    int outOfOrder;
+    int done;
+} Simulation;
+
+/*! Sends a message as the kernel does; signals are lost at random. */
+static int SimulationSend(Simulation * sim,int type,uint64_t sequence)
+{
+    if(type == kMessageSignal && sim->lossRate && rand_r(&sim->seed) % sim->lossRate == 0)
+        return 0;
+    
+    Message message = { type, sequence };
+    MessageQueueSend(&sim->queue,message);
+    return 1;
+}
+
+/*! Mirrors iSCSIHBAUserClient::sendNotification(). */
+static void SimulationProduce(Simulation * sim,uint64_t sequence)
+{
+    iSCSIHBANotificationRingEntry entry;
+    memset(&entry,0,sizeof(entry));
+    entry.parameter1 = sequence;
+    
+    pthread_mutex_lock(&sim->producerLock);
+    
+    enum iSCSIHBANotificationRingDelivery delivery =
+        iSCSIHBANotificationRingProduce(&sim->ring,&sim->producer,&entry);
+    
+    if(delivery == kiSCSIHBANotificationRingBypass)
+        iSCSIHBANotificationRingMessageSent(&sim->producer,delivery,
+                                            SimulationSend(sim,kMessageBypass,sequence));
+    else if(delivery == kiSCSIHBANotificationRingSignal)
+        iSCSIHBANotificationRingMessageSent(&sim->producer,delivery,
+                                            SimulationSend(sim,kMessageSignal,0));
+    
+    pthread_mutex_unlock(&sim->producerLock);
+}
+
+/*! Mirrors iSCSIHBAUserClient::flushNotifications(). */
+static void SimulationFlush(Simulation * sim)
+{
+    pthread_mutex_lock(&sim->producerLock);
+    
+    if(sim->producer.signalPending)
+        iSCSIHBANotificationRingMessageSent(&sim->producer,kiSCSIHBANotificationRingSignal,
+                                            SimulationSend(sim,kMessageSignal,0));
+    
+    pthread_mutex_unlock(&sim->producerLock);
+}
+
+static void SimulationDeliver(Simulation * sim,uint64_t sequence)
+{
+    if(sequence != sim->received)
+        sim->outOfOrder = 1;
+    __atomic_store_n(&sim->received,sim->received + 1,__ATOMIC_SEQ_CST);
+}
+
+/*! Mirrors iSCSIHBANotificationHandler() in iSCSIHBAInterface.c. */
+static void * SimulationConsumer(void * context)
+{
+    Simulation * sim = (Simulation *)context;
+    Message message;
+    
+    while(!__atomic_load_n(&sim->done,__ATOMIC_SEQ_CST))
+    {
+        if(!MessageQueueReceive(&sim->queue,&message,10))
+            continue;
+        
+        iSCSIHBANotificationRingEntry entry;
+        while(iSCSIHBANotificationRingPop(&sim->ring,&entry))
+            SimulationDeliver(sim,entry.parameter1);
+        
+        if(message.type == kMessageBypass) {
+            iSCSIHBANotificationRingBypassReceived(&sim->ring);
+            SimulationDeliver(sim,message.sequence);
+        }
+    }
+    return NULL;
+}
+
+/*! Runs the producer against a consumer thread and checks that every
+ *  notification is delivered once and in order. */
+static void TestConcurrentDelivery(uint64_t count,unsigned int lossRate,int burst)
+{
+    Simulation * sim = calloc(1,sizeof(Simulation));
+    pthread_t consumer;
+    
+    iSCSIHBANotificationRingInit(&sim->ring);
+    pthread_mutex_init(&sim->producerLock,NULL);
+    pthread_mutex_init(&sim->queue.lock,NULL);
+    pthread_cond_init(&sim->queue.available,NULL);
+    sim->lossRate = lossRate;
+    sim->seed = 1;
+    
+    pthread_create(&consumer,NULL,SimulationConsumer,sim);
+    
+    for(uint64_t sequence = 0; sequence < count; sequence++) {
+        SimulationProduce(sim,sequence);
+        
+        // Pause between bursts so that the consumer can catch up
+        if(burst && sequence % (uint64_t)burst == 0) {
+            struct timespec pause = { 0, 100000 };
+            nanosleep(&pause,NULL);
+        }
+    }
+    
+    // The periodic retry of lost signals guarantees eventual delivery
+    for(int attempt = 0; attempt < 1000 && __atomic_load_n(&sim->received,__ATOMIC_SEQ_CST) < count; attempt++) {
+        SimulationFlush(sim);
+        struct timespec pause = { 0, 1000000 };
+        nanosleep(&pause,NULL);
+    }
+    
+    __atomic_store_n(&sim->done,1,__ATOMIC_SEQ_CST);
+    pthread_join(consumer,NULL);
+    
+    CHECK(sim->received == count);
+    CHECK(!sim->outOfOrder);
+    
+    free(sim->queue.messages);
+    free(sim);
+}
+
+/*! Checks that signals are only requested when the consumer may have
+ *  stopped draining the ring. */
+static void TestSignal(void)
+{
+    static iSCSIHBANotificationRing ring;
+    iSCSIHBANotificationRingProducer producer = { 0, 0 };
+    iSCSIHBANotificationRingEntry entry, popped;
+    memset(&entry,0,sizeof(entry));
+    
+    iSCSIHBANotificationRingInit(&ring);
+    
+    CHECK(iSCSIHBANotificationRingProduce(&ring,&producer,&entry) == kiSCSIHBANotificationRingSignal);
+    CHECK(iSCSIHBANotificationRingProduce(&ring,&producer,&entry) == kiSCSIHBANotificationRingQueued);
+    CHECK(iSCSIHBANotificationRingPop(&ring,&popped));
+    CHECK(iSCSIHBANotificationRingPop(&ring,&popped));
+    CHECK(!iSCSIHBANotificationRingPop(&ring,&popped));
+    CHECK(iSCSIHBANotificationRingProduce(&ring,&producer,&entry) == kiSCSIHBANotificationRingSignal);
+    
+    // A signal that was not delivered is requested again
+    iSCSIHBANotificationRingMessageSent(&producer,kiSCSIHBANotificationRingSignal,0);
+    CHECK(iSCSIHBANotificationRingProduce(&ring,&producer,&entry) == kiSCSIHBANotificationRingSignal);
+    iSCSIHBANotificationRingMessageSent(&producer,kiSCSIHBANotificationRingSignal,1);
+    CHECK(iSCSIHBANotificationRingProduce(&ring,&producer,&entry) == kiSCSIHBANotificationRingQueued);
+}
+
+/*! Checks that notifications bypass a full ring until the consumer has
+ *  acknowledged every bypassing message. */
+static void TestBypass(void)
+{
+    static iSCSIHBANotificationRing ring;
+    iSCSIHBANotificationRingProducer producer = { 0, 0 };
+    iSCSIHBANotificationRingEntry entry, popped;
+    memset(&entry,0,sizeof(entry));
+    
+    iSCSIHBANotificationRingInit(&ring);
+    
+    for(int idx = 0; idx < kiSCSIHBANotificationRingEntryCount; idx++)
+        CHECK(iSCSIHBANotificationRingProduce(&ring,&producer,&entry) != kiSCSIHBANotificationRingBypass);
+    
+    CHECK(iSCSIHBANotificationRingProduce(&ring,&producer,&entry) == kiSCSIHBANotificationRingBypass);
+    iSCSIHBANotificationRingMessageSent(&producer,kiSCSIHBANotificationRingBypass,1);
+    
+    // Draining the ring is not enough; the bypassing message is outstanding
+    while(iSCSIHBANotificationRingPop(&ring,&popped));
+    CHECK(iSCSIHBANotificationRingProduce(&ring,&producer,&entry) == kiSCSIHBANotificationRingBypass);
+    iSCSIHBANotificationRingMessageSent(&producer,kiSCSIHBANotificationRingBypass,1);
+    
+    iSCSIHBANotificationRingBypassReceived(&ring);
+    CHECK(iSCSIHBANotificationRingProduce(&ring,&producer,&entry) == kiSCSIHBANotificationRingBypass);
+    
+    // A bypassing message that was not sent need not be acknowledged
+    iSCSIHBANotificationRingMessageSent(&producer,kiSCSIHBANotificationRingBypass,0);
+    iSCSIHBANotificationRingBypassReceived(&ring);
+    CHECK(iSCSIHBANotificationRingProduce(&ring,&producer,&entry) == kiSCSIHBANotificationRingSignal);
+}
+
+/*! Checks that indices written by a misbehaving consumer are tolerated. */
+static void TestCorruptIndices(void)
+{
+    static iSCSIHBANotificationRing ring;
+    iSCSIHBANotificationRingProducer producer = { 0, 0 };
+    iSCSIHBANotificationRingEntry entry;
+    memset(&entry,0,sizeof(entry));
+    
+    iSCSIHBANotificationRingInit(&ring);
+    ring.head = 0x80000000;
+    CHECK(iSCSIHBANotificationRingProduce(&ring,&producer,&entry) == kiSCSIHBANotificationRingBypass);
+    
+    ring.head = 0;
+    ring.bypassReceived = 12345;
+    CHECK(iSCSIHBANotificationRingProduce(&ring,&producer,&entry) == kiSCSIHBANotificationRingBypass);
+}
+
+int main(void)
+{
+    TestSignal();
+    TestBypass();
+    TestCorruptIndices();
+    
+    // Bursts larger than the ring exercise bypassing; lost signals exercise
+    // the periodic retry
+    TestConcurrentDelivery(100000,0,0);
+    TestConcurrentDelivery(100000,0,1000);
+    TestConcurrentDelivery(100000,4,0);
+    TestConcurrentDelivery(20000,2,50);
+    
+    if(failures)
+        fprintf(stderr,"iSCSIHBANotificationRingTest: %d check(s) failed\n",failures);
+    
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,265 @@
+/*
+ * Copyright (c) 2016, Nareg Sinenian
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Tests and benchmarks the scanner of key=value pairs in login and text PDU
+// data segments.  Run without arguments to test the scanner, or with
+// "-benchmark" to measure its throughput on a large SendTargets response.
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "iSCSIPDUText.h"
+
+static int failures = 0;
+
+#define CHECK(condition) do { \
+    if(!(condition)) { \
+        fprintf(stderr,"%s:%d: check failed: %s\n",__FILE__,__LINE__,#condition); \
+        failures++; \
+    } \
+} while(0)
+
+/*! Pairs collected from a data segment, formatted as "key=value;". */
+typedef struct Collector {
+    char text[4096];
+    size_t length;
+    size_t pairs;
+} Collector;
+
+static void CollectorAppend(Collector * collector,const iSCSIPDUTextSpan * span)
+{
+    if(collector->length + span->length < sizeof(collector->text)) {
+        memcpy(collector->text + collector->length,span->bytes,span->length);
+        collector->length += span->length;
+    }
+    collector->text[collector->length] = 0;
+}
+
+static void CollectorCallback(void * context,
+                              const iSCSIPDUTextSpan * key,
+                              const iSCSIPDUTextSpan * value)
+{
+    Collector * collector = (Collector *)context;
+    iSCSIPDUTextSpan equals = { (const uint8_t *)"=", 1 };
+    iSCSIPDUTextSpan separator = { (const uint8_t *)";", 1 };
+    
+    CollectorAppend(collector,key);
+    CollectorAppend(collector,&equals);
+    CollectorAppend(collector,value);
+    CollectorAppend(collector,&separator);
+    collector->pairs++;
+}
+
+/*! Scans a single data segment and returns the pairs found. */
+static const char * Scan(const void * data,size_t length,Collector * collector)
+{
+    iSCSIPDUTextSpan key, value;
+    size_t offset = 0;
+    
+    memset(collector,0,sizeof(*collector));
+    
+    while(iSCSIPDUTextGetNextPair(data,length,&offset,&key,&value))
+        CollectorCallback(collector,&key,&value);
+    
+    return collector->text;
+}
+
+static void TestGetNextPair(void)
+{
+    Collector collector;
+    
+    // Lengths include the null terminator of each pair
+    CHECK(strcmp(Scan("A=1\0B=2\0",8,&collector),"A=1;B=2;") == 0);
+    CHECK(strcmp(Scan("",0,&collector),"") == 0);
+    
+    // Only the first '=' separates the key from the value
+    CHECK(strcmp(Scan("CHAP_C=0xAB==\0",14,&collector),"CHAP_C=0xAB==;") == 0);
+    
+    // Empty values and keys are returned; tokens without '=' are skipped
+    CHECK(strcmp(Scan("A=\0=1\0junk\0B=2\0",15,&collector),"A=;=1;B=2;") == 0);
+    
+    // Padding and stray nulls are skipped
+    CHECK(strcmp(Scan("\0\0A=1\0\0\0",8,&collector),"A=1;") == 0);
+    
+    // A trailing pair that is not null-terminated is not returned
+    CHECK(strcmp(Scan("A=1\0B=2",7,&collector),"A=1;") == 0);
+    CHECK(collector.pairs == 1);
+}
+
+static void TestSpanFind(void)
+{
+    iSCSIPDUTextSpan span = { (const uint8_t *)"[fe80::1]:3260", 14 };
+    iSCSIPDUTextSpan empty = { (const uint8_t *)"", 0 };
+    
+    CHECK(iSCSIPDUTextSpanFind(&span,':',0) == 5);
+    CHECK(iSCSIPDUTextSpanFind(&span,':',1) == 9);
+    CHECK(iSCSIPDUTextSpanFind(&span,',',0) == span.length);
+    CHECK(iSCSIPDUTextSpanFind(&span,',',1) == span.length);
+    CHECK(iSCSIPDUTextSpanFind(&empty,':',1) == 0);
+    
+    iSCSIPDUTextSpan key = { (const uint8_t *)"TargetNameX", 10 };
+    CHECK(iSCSIPDUTextSpanEqualsString(&key,"TargetName"));
+    CHECK(!iSCSIPDUTextSpanEqualsString(&key,"TargetNam"));
+    CHECK(!iSCSIPDUTextSpanEqualsString(&key,"TargetNameX"));
+}
+
+/*! Scans a data segment split at every possible offset into two segments,
+ *  and checks that the same pairs are found as when scanning it whole. */
+static void TestStreamSplits(const char * data,size_t length,const char * expected)
+{
+    static iSCSIPDUTextStream stream;
+    
+    for(size_t split = 0; split <= length; split++)
+    {
+        Collector collector;
+        memset(&collector,0,sizeof(collector));
+        
+        iSCSIPDUTextStreamInit(&stream);
+        iSCSIPDUTextStreamScan(&stream,data,split,&collector,&CollectorCallback);
+        iSCSIPDUTextStreamScan(&stream,data + split,length - split,&collector,&CollectorCallback);
+        
+        CHECK(strcmp(collector.text,expected) == 0);
+        CHECK(stream.carryLength == 0);
+    }
+}
+
+static void TestStream(void)
+{
+    static const char response[] = "TargetName=iqn.2004-04.com.example:disk1\0"
+                                   "TargetAddress=[fe80::1]:3260,1\0"
+                                   "TargetAddress=10.0.0.1,2\0";
+    
+    TestStreamSplits(response,sizeof(response) - 1,
+                     "TargetName=iqn.2004-04.com.example:disk1;"
+                     "TargetAddress=[fe80::1]:3260,1;"
+                     "TargetAddress=10.0.0.1,2;");
+    
+    // A pair spanning three segments
+    static iSCSIPDUTextStream stream;
+    Collector collector;
+    memset(&collector,0,sizeof(collector));
+    
+    iSCSIPDUTextStreamInit(&stream);
+    iSCSIPDUTextStreamScan(&stream,"A=1\0Targ",8,&collector,&CollectorCallback);
+    iSCSIPDUTextStreamScan(&stream,"etName=i",8,&collector,&CollectorCallback);
+    iSCSIPDUTextStreamScan(&stream,"qn\0B=2\0",7,&collector,&CollectorCallback);
+    CHECK(strcmp(collector.text,"A=1;TargetName=iqn;B=2;") == 0);
+    
+    // A pair too long to carry is discarded, and scanning resumes after it
+    static uint8_t segment[kiSCSIPDUTextStreamMaxCarryLength + 16];
+    memset(segment,'x',sizeof(segment));
+    segment[0] = 'K';
+    segment[1] = '=';
+    memset(&collector,0,sizeof(collector));
+    
+    iSCSIPDUTextStreamInit(&stream);
+    iSCSIPDUTextStreamScan(&stream,segment,sizeof(segment),&collector,&CollectorCallback);
+    iSCSIPDUTextStreamScan(&stream,"tail\0C=3\0",9,&collector,&CollectorCallback);
+    CHECK(strcmp(collector.text,"C=3;") == 0);
+    CHECK(stream.carryLength == 0 && !stream.discard);
+}
+
+/*! Counts the pairs and value bytes of a stream (the benchmark callback). */
+static void CountCallback(void * context,
+                          const iSCSIPDUTextSpan * key,
+                          const iSCSIPDUTextSpan * value)
+{
+    size_t * count = (size_t *)context;
+    count[0]++;
+    count[1] += key->length + value->length;
+}
+
+static double Now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    return now.tv_sec + now.tv_nsec/1e9;
+}
+
+/*! Measures the throughput of the scanner on a SendTargets response for
+ *  many targets, split into data segments of the default maximum length. */
+static void Benchmark(void)
+{
+    const size_t targetCount = 20000, segmentLength = 8192, iterations = 50;
+    size_t capacity = targetCount*160, length = 0;
+    char * response = malloc(capacity);
+    
+    if(!response)
+        return;
+    
+    for(size_t targetIdx = 0; targetIdx < targetCount; targetIdx++)
+        length += (size_t)snprintf(response + length,capacity - length,
+                                   "TargetName=iqn.2004-04.com.example:storage.disk%zu%c"
+                                   "TargetAddress=192.168.%zu.%zu:3260,1%c"
+                                   "TargetAddress=[fe80::%zx]:3260,2%c",
+                                   targetIdx,0,targetIdx/256%256,targetIdx%256,0,targetIdx,0);
+    
+    static iSCSIPDUTextStream stream;
+    size_t count[2] = { 0, 0 };
+    double start = Now();
+    
+    for(size_t iteration = 0; iteration < iterations; iteration++)
+    {
+        iSCSIPDUTextStreamInit(&stream);
+        
+        for(size_t offset = 0; offset < length; offset += segmentLength) {
+            size_t remaining = length - offset;
+            iSCSIPDUTextStreamScan(&stream,response + offset,
+                                   remaining < segmentLength ? remaining : segmentLength,
+                                   count,&CountCallback);
+        }
+    }
+    
+    double elapsed = Now() - start;
+    
+    CHECK(count[0] == targetCount*3*iterations);
+    printf("Scanned %zu pairs (%.1f MB) in %.3f s: %.0f MB/s, %.1f million pairs/s\n",
+           count[0],length*iterations/1e6,elapsed,
+           length*iterations/1e6/elapsed,count[0]/1e6/elapsed);
+    
+    free(response);
+}
+
+int main(int argc,char * argv[])
+{
+    if(argc > 1 && strcmp(argv[1],"-benchmark") == 0)
+        Benchmark();
+    else {
+        TestGetNextPair();
+        TestSpanFind();
+        TestStream();
+    }
+    
+    if(failures)
+        fprintf(stderr,"iSCSIPDUTextTest: %d check(s) failed\n",failures);
+    
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}